@@ -141,11 +141,23 @@ public:
 	}
 
 	// ************************************************************************************
-	size_t encode_bases(char* dna_raw, size_t len, uint8_t* dna_packed)
+	// Length of the prefix of symbols that can be packed (ACGTN)
+	size_t packable_len(const char* dna_raw, size_t len) const
+	{
+		size_t i = 0;
+
+		while (i < len && base_to_code[static_cast<uint8_t>(dna_raw[i])] < 5)
+			++i;
+
+		return i;
+	}
+
+	// ************************************************************************************
+	// No terminator is stored, so the length must be known at decoding (packed size is (len + 2) / 3)
+	size_t encode_bases(const char* dna_raw, size_t len, uint8_t* dna_packed)
 	{
 		size_t packed_len = 0;
 		size_t i;
-		++len;						// terminating 0 is also compressed
 
 		for (i = 0; i + 2 < len; i += 3, ++packed_len)
 			dna_packed[packed_len] =
@@ -155,20 +167,34 @@ public:
 
 		if(i + 1 == len)
 			dna_packed[packed_len++] =
-				base_to_code[static_cast<uint8_t>(dna_raw[i])] * 36 +
-				base_to_code[0] * 6 +
-				base_to_code[0];
+				base_to_code[static_cast<uint8_t>(dna_raw[i])] * 36;
 		else if(i + 2 == len)
 			dna_packed[packed_len++] =
 				base_to_code[static_cast<uint8_t>(dna_raw[i])] * 36 +
-				base_to_code[static_cast<uint8_t>(dna_raw[i + 1])] * 6 +
-				base_to_code[0];
-/*		else
-			dna_packed[packed_len++] = base_to_code[0] * 36 + base_to_code[0] * 6 + base_to_code[0];*/
+				base_to_code[static_cast<uint8_t>(dna_raw[i + 1])] * 6;
 
 		return packed_len;
 	}
 
+	// ************************************************************************************
+	// Decodes exactly len bases (packed by encode_bases with explicit length)
+	void decode_bases(const uint8_t* dna_packed, size_t len, std::vector<uint8_t>& dna_raw)
+	{
+		dna_raw.resize(3 * ((len + 2) / 3));
+
+		uint8_t* p = dna_raw.data();
+
+		for (size_t i = 0; i < len; i += 3, ++dna_packed, p += 3)
+		{
+			auto& x = uint8_to_bases[*dna_packed];
+			p[0] = x[0];
+			p[1] = x[1];
+			p[2] = x[2];
+		}
+
+		dna_raw.resize(len);
+	}
+
 	// ************************************************************************************
 	void decode_bases(uint8_t* dna_packed, std::vector<uint8_t>& dna_raw)
 	{
@@ -0,0 +1,688 @@
+#include <iostream>
+#include <cstring>
+#include <cerrno>
+#include <algorithm>
+#include "async_reader.h"
+#include "params.h"
+
+#ifndef _WIN32
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+#define HAS_IO_URING
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+#endif
+
+// *********************************************************************************************
+// Minimal io_uring wrapper (raw syscalls, so liburing is not necessary)
+// Only a single thread submits and reaps, so the ring is not synchronised
+class CIoUring
+{
+#ifdef HAS_IO_URING
+	int ring_fd = -1;
+
+	void* sq_ptr = nullptr;
+	void* cq_ptr = nullptr;
+	size_t sq_map_size = 0;
+	size_t cq_map_size = 0;
+	io_uring_sqe* sqes = nullptr;
+	size_t sqes_map_size = 0;
+
+	unsigned* sq_tail = nullptr;
+	unsigned* sq_mask = nullptr;
+	unsigned* sq_array = nullptr;
+	unsigned* cq_head = nullptr;
+	unsigned* cq_tail = nullptr;
+	unsigned* cq_mask = nullptr;
+	io_uring_cqe* cqes = nullptr;
+
+	vector<iovec> iovecs;				// READV (Linux 5.1+) is used instead of READ (Linux 5.6+)
+
+	int enter(unsigned to_submit, unsigned min_complete, unsigned flags)
+	{
+		int r;
+		do
+			r = (int) syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete, flags, nullptr, 0);
+		while (r < 0 && errno == EINTR);
+
+		return r;
+	}
+#endif
+
+public:
+	CIoUring() = default;
+	CIoUring(const CIoUring&) = delete;
+	CIoUring& operator=(const CIoUring&) = delete;
+
+	// *********************************************************************************************
+	~CIoUring()
+	{
+#ifdef HAS_IO_URING
+		if (sqes)
+			munmap(sqes, sqes_map_size);
+		if (cq_ptr && cq_ptr != sq_ptr)
+			munmap(cq_ptr, cq_map_size);
+		if (sq_ptr)
+			munmap(sq_ptr, sq_map_size);
+		if (ring_fd >= 0)
+			::close(ring_fd);
+#endif
+	}
+
+	// *********************************************************************************************
+	// Fails if the kernel is too old or io_uring is blocked (e.g., by seccomp in containers)
+	bool Init(unsigned entries)
+	{
+#ifdef HAS_IO_URING
+		io_uring_params p;
+		memset(&p, 0, sizeof(p));
+
+		ring_fd = (int) syscall(__NR_io_uring_setup, entries, &p);
+		if (ring_fd < 0)
+			return false;
+
+		sq_map_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+		cq_map_size = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+
+		if (p.features & IORING_FEAT_SINGLE_MMAP)
+			sq_map_size = cq_map_size = max(sq_map_size, cq_map_size);
+
+		sq_ptr = mmap(nullptr, sq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+		if (sq_ptr == MAP_FAILED)
+		{
+			sq_ptr = nullptr;
+			return false;
+		}
+
+		if (p.features & IORING_FEAT_SINGLE_MMAP)
+			cq_ptr = sq_ptr;
+		else
+		{
+			cq_ptr = mmap(nullptr, cq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+			if (cq_ptr == MAP_FAILED)
+			{
+				cq_ptr = nullptr;
+				return false;
+			}
+		}
+
+		sqes_map_size = p.sq_entries * sizeof(io_uring_sqe);
+		void* ptr = mmap(nullptr, sqes_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+		if (ptr == MAP_FAILED)
+			return false;
+		sqes = (io_uring_sqe*) ptr;
+
+		sq_tail = (unsigned*) ((char*) sq_ptr + p.sq_off.tail);
+		sq_mask = (unsigned*) ((char*) sq_ptr + p.sq_off.ring_mask);
+		sq_array = (unsigned*) ((char*) sq_ptr + p.sq_off.array);
+		cq_head = (unsigned*) ((char*) cq_ptr + p.cq_off.head);
+		cq_tail = (unsigned*) ((char*) cq_ptr + p.cq_off.tail);
+		cq_mask = (unsigned*) ((char*) cq_ptr + p.cq_off.ring_mask);
+		cqes = (io_uring_cqe*) ((char*) cq_ptr + p.cq_off.cqes);
+
+		iovecs.resize(entries);
+
+		return true;
+#else
+		return false;
+#endif
+	}
+
+	// *********************************************************************************************
+	// At most 'entries' requests can be in flight, id must be smaller than 'entries'
+	bool Submit(int fd, uint64_t offset, char* dest, size_t size, int id)
+	{
+#ifdef HAS_IO_URING
+		iovecs[id].iov_base = dest;
+		iovecs[id].iov_len = size;
+
+		unsigned tail = *sq_tail;
+		unsigned idx = tail & *sq_mask;
+
+		io_uring_sqe* sqe = &sqes[idx];
+		memset(sqe, 0, sizeof(*sqe));
+		sqe->opcode = IORING_OP_READV;
+		sqe->fd = fd;
+		sqe->off = offset;
+		sqe->addr = (uint64_t) &iovecs[id];
+		sqe->len = 1;
+		sqe->user_data = (uint64_t) id;
+
+		sq_array[idx] = idx;
+		__atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+		return enter(1, 0, 0) == 1;
+#else
+		return false;
+#endif
+	}
+
+	// *********************************************************************************************
+	// Waits for any completion; result is the no. of bytes read or -errno
+	bool Wait(int& id, int64_t& result)
+	{
+#ifdef HAS_IO_URING
+		while (true)
+		{
+			unsigned head = *cq_head;
+
+			if (head != __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE))
+			{
+				io_uring_cqe* cqe = &cqes[head & *cq_mask];
+				id = (int) cqe->user_data;
+				result = cqe->res;
+				__atomic_store_n(cq_head, head + 1, __ATOMIC_RELEASE);
+
+				return true;
+			}
+
+			if (enter(0, 1, IORING_ENTER_GETEVENTS) < 0)
+				return false;
+		}
+#else
+		return false;
+#endif
+	}
+};
+
+// *********************************************************************************************
+//
+// *********************************************************************************************
+
+// *********************************************************************************************
+CAsyncFileReader::CAsyncFileReader(io_mode_t io_mode, bool use_direct, int no_buffers, size_t buffer_size) :
+	requested_mode(io_mode),
+	use_direct(use_direct),
+	no_buffers(max(no_buffers, 1))
+{
+	this->buffer_size = (max<size_t>(buffer_size, DIRECT_ALIGNMENT) + DIRECT_ALIGNMENT - 1) / DIRECT_ALIGNMENT * DIRECT_ALIGNMENT;
+}
+
+// *********************************************************************************************
+CAsyncFileReader::~CAsyncFileReader()
+{
+	close();
+	stop_io_threads();
+}
+
+// *********************************************************************************************
+void CAsyncFileReader::close()
+{
+	if (!is_open)
+		return;
+
+	drain();
+
+#ifdef _WIN32
+	fclose(in);
+	in = nullptr;
+#else
+	::close(fd);
+	fd = -1;
+#endif
+
+	for (auto& s : slots)
+		s.state = slot_state_t::empty;
+
+	is_open = false;
+	is_error = false;
+	is_direct = false;
+}
+
+// *********************************************************************************************
+// Buffers are allocated once (at the 1st opening in an asynchronous mode) and reused for next files
+void CAsyncFileReader::allocate_buffers()
+{
+	if (!slots.empty())
+		return;
+
+	raw_buffers.resize(no_buffers * buffer_size + DIRECT_ALIGNMENT);
+	char* base = raw_buffers.data() + (DIRECT_ALIGNMENT - (uintptr_t) raw_buffers.data() % DIRECT_ALIGNMENT) % DIRECT_ALIGNMENT;
+
+	slots.resize(no_buffers);
+	for (int i = 0; i < no_buffers; ++i)
+		slots[i].data = base + i * buffer_size;
+}
+
+// *********************************************************************************************
+void CAsyncFileReader::start_io_threads()
+{
+	if (!io_threads.empty())
+		return;
+
+	io_stop = false;
+	for (int i = 0; i < NO_IO_THREADS; ++i)
+		io_threads.emplace_back([&] { io_thread_fun(); });
+}
+
+// *********************************************************************************************
+void CAsyncFileReader::stop_io_threads()
+{
+	{
+		lock_guard<mutex> lck(mtx);
+		io_stop = true;
+	}
+	cv_task.notify_all();
+
+	for (auto& t : io_threads)
+		t.join();
+	io_threads.clear();
+}
+
+// *********************************************************************************************
+void CAsyncFileReader::io_thread_fun()
+{
+	unique_lock<mutex> lck(mtx);
+
+	while (true)
+	{
+		cv_task.wait(lck, [&] { return io_stop || !io_tasks.empty(); });
+
+		if (io_tasks.empty())
+			return;
+
+		int id = io_tasks.front();
+		io_tasks.pop_front();
+
+		uint64_t offset = slots[id].offset;
+		char* data = slots[id].data;
+		size_t requested = slots[id].requested;
+
+		lck.unlock();
+		int64_t result = read_at(offset, data, requested);
+		lck.lock();
+
+		complete(id, result);
+		cv_done.notify_all();
+	}
+}
+
+// *********************************************************************************************
+// Returns the no. of bytes read (smaller than size at the file end) or -1 on error
+int64_t CAsyncFileReader::read_at(uint64_t offset, char* dest, size_t size)
+{
+#ifdef _WIN32
+	lock_guard<mutex> lck(mtx_file);
+
+	if (_fseeki64(in, (int64_t) offset, SEEK_SET) != 0)
+		return -1;
+
+	size_t readed = fread(dest, 1, size, in);
+
+	return ferror(in) ? -1 : (int64_t) readed;
+#else
+	size_t done = 0;
+
+	while (done < size)
+	{
+		ssize_t r = pread(fd, dest + done, size - done, (off_t) (offset + done));
+
+		if (r < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		if (r == 0)
+			break;
+
+		done += (size_t) r;
+
+		if (is_direct && done % DIRECT_ALIGNMENT)
+			break;				// unaligned short read is possible only at the file end
+	}
+
+	return (int64_t) done;
+#endif
+}
+
+// *********************************************************************************************
+size_t CAsyncFileReader::read_sync(char* dest, size_t size)
+{
+	size_t to_read = (size_t) min<uint64_t>(size, end_offset - next_offset);
+	size_t done = 0;
+
+	while (done < to_read)
+	{
+#ifdef _WIN32
+		size_t r = fread(dest + done, 1, to_read - done, in);
+		if (r == 0)
+		{
+			if (ferror(in))
+				is_error = true;
+			break;
+		}
+#else
+		ssize_t r = ::read(fd, dest + done, to_read - done);
+		if (r < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			is_error = true;
+			break;
+		}
+		if (r == 0)
+			break;
+#endif
+		done += (size_t) r;
+	}
+
+	next_offset += done;
+	if (done < to_read)
+		end_offset = next_offset;
+
+	return done;
+}
+
+// *********************************************************************************************
+// Starts reading the next buffer-size range into the slot (or marks the slot as empty at the end of the range)
+void CAsyncFileReader::submit(int id)
+{
+	unique_lock<mutex> lck(mtx, defer_lock);
+	if (mode == io_mode_t::threads)
+		lck.lock();
+
+	auto& s = slots[id];
+
+	s.pos = 0;
+	s.size = 0;
+
+	if (next_offset >= end_offset)
+	{
+		s.state = slot_state_t::empty;
+		return;
+	}
+
+	s.offset = next_offset;
+	s.requested = (size_t) min<uint64_t>(buffer_size, end_offset - next_offset);
+	if (is_direct)
+		s.requested = (s.requested + DIRECT_ALIGNMENT - 1) / DIRECT_ALIGNMENT * DIRECT_ALIGNMENT;
+	s.state = slot_state_t::pending;
+
+	next_offset += buffer_size;
+
+	if (mode == io_mode_t::threads)
+	{
+		io_tasks.push_back(id);
+		cv_task.notify_one();
+	}
+#ifndef _WIN32
+	else if (!uring->Submit(fd, s.offset, s.data, s.requested, id))
+		s.state = slot_state_t::failed;
+#endif
+}
+
+// *********************************************************************************************
+// Short reads (possible, e.g., for network file systems) are completed synchronously
+void CAsyncFileReader::complete(int id, int64_t result)
+{
+	auto& s = slots[id];
+
+	if (result < 0)
+	{
+		s.state = slot_state_t::failed;
+		return;
+	}
+
+	s.size = (size_t) result;
+
+	if (s.size < s.requested && !(is_direct && s.size % DIRECT_ALIGNMENT))
+	{
+		int64_t rest = s.size ? read_at(s.offset + s.size, s.data + s.size, s.requested - s.size) : 0;
+		if (rest < 0)
+		{
+			s.state = slot_state_t::failed;
+			return;
+		}
+		s.size += (size_t) rest;
+	}
+
+	s.size = (size_t) min<uint64_t>(s.size, end_offset > s.offset ? end_offset - s.offset : 0);
+
+	if (s.size < s.requested)
+		end_offset = min(end_offset, s.offset + s.size);		// file is shorter than expected
+
+	s.state = slot_state_t::ready;
+}
+
+// *********************************************************************************************
+CAsyncFileReader::slot_state_t CAsyncFileReader::wait_slot(int id)
+{
+	auto& s = slots[id];
+
+	if (mode == io_mode_t::threads)
+	{
+		unique_lock<mutex> lck(mtx);
+		cv_done.wait(lck, [&] { return s.state != slot_state_t::pending; });
+
+		return s.state;
+	}
+
+#ifndef _WIN32
+	while (s.state == slot_state_t::pending)
+	{
+		int done_id;
+		int64_t result;
+
+		if (!uring->Wait(done_id, result))
+		{
+			s.state = slot_state_t::failed;
+			break;
+		}
+
+		complete(done_id, result);
+	}
+#endif
+
+	return s.state;
+}
+
+// *********************************************************************************************
+// The buffers cannot be reused (or freed) before the reads in flight complete
+void CAsyncFileReader::drain()
+{
+	if (mode == io_mode_t::sync)
+		return;
+
+	for (int i = 0; i < (int) slots.size(); ++i)
+		wait_slot(i);
+}
+
+// *********************************************************************************************
+// Opens the file, optionally limiting reading to the [offset_begin, offset_end) range
+bool CAsyncFileReader::Open(const string& file_name, uint64_t offset_begin, uint64_t offset_end)
+{
+	close();
+
+	mode = requested_mode == io_mode_t::automatic ? io_mode_t::uring : requested_mode;
+	uint64_t file_size;
+
+#ifdef _WIN32
+	if (mode == io_mode_t::uring)
+		mode = io_mode_t::threads;
+
+	in = fopen(file_name.c_str(), "rb");
+	if (!in)
+		return false;
+
+	setvbuf(in, nullptr, _IONBF, 0);
+
+	if (_fseeki64(in, 0, SEEK_END) != 0)
+	{
+		fclose(in);
+		in = nullptr;
+		return false;
+	}
+	file_size = (uint64_t) _ftelli64(in);
+#else
+	if (use_direct && mode != io_mode_t::sync)
+	{
+#ifdef O_DIRECT
+		fd = open(file_name.c_str(), O_RDONLY | O_DIRECT);
+		is_direct = fd >= 0;
+#endif
+	}
+
+	if (fd < 0)
+		fd = open(file_name.c_str(), O_RDONLY);			// also when O_DIRECT is not supported by the file system
+	if (fd < 0)
+		return false;
+
+	struct stat st;
+	if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode))
+		file_size = (uint64_t) st.st_size;
+	else
+	{
+		file_size = ~0ull;
+		mode = io_mode_t::sync;						// no positional reads for pipes
+		if (is_direct)
+		{
+			::close(fd);
+			fd = open(file_name.c_str(), O_RDONLY);
+			is_direct = false;
+			if (fd < 0)
+				return false;
+		}
+	}
+
+	if (mode == io_mode_t::uring && !uring)
+	{
+		uring = make_unique<CIoUring>();
+		if (!uring->Init((unsigned) no_buffers))
+		{
+			uring.reset();
+			requested_mode = io_mode_t::threads;	// no sense to try again for the next files
+		}
+	}
+
+	if (mode == io_mode_t::uring && !uring)
+		mode = io_mode_t::threads;
+#endif
+
+	is_open = true;
+	end_offset = min(offset_end, file_size);
+
+	if (mode == io_mode_t::sync)
+	{
+		next_offset = offset_begin;
+		if (offset_begin)
+		{
+#ifdef _WIN32
+			bool ok = _fseeki64(in, (int64_t) offset_begin, SEEK_SET) == 0;
+#else
+			bool ok = lseek(fd, (off_t) offset_begin, SEEK_SET) == (off_t) offset_begin;
+#endif
+			if (!ok)
+			{
+				close();
+				return false;
+			}
+		}
+
+		return true;
+	}
+
+	allocate_buffers();
+
+	if (mode == io_mode_t::threads)
+		start_io_threads();
+
+	uint64_t first_offset = is_direct ? offset_begin / DIRECT_ALIGNMENT * DIRECT_ALIGNMENT : offset_begin;
+
+	next_offset = first_offset;
+	head = 0;
+
+	for (int i = 0; i < no_buffers; ++i)
+		submit(i);
+
+	slots[0].pos = (size_t) (offset_begin - first_offset);
+
+	return true;
+}
+
+// *********************************************************************************************
+void CAsyncFileReader::Close()
+{
+	close();
+}
+
+// *********************************************************************************************
+size_t CAsyncFileReader::Read(char* dest, size_t size)
+{
+	if (!is_open)
+		return 0;
+
+	if (mode == io_mode_t::sync)
+		return read_sync(dest, size);
+
+	size_t copied = 0;
+
+	while (copied < size && !is_error)
+	{
+		auto state = wait_slot(head);
+
+		if (state == slot_state_t::empty)
+			break;
+		if (state == slot_state_t::failed)
+		{
+			is_error = true;
+			break;
+		}
+
+		auto& s = slots[head];
+
+		if (s.pos < s.size)
+		{
+			size_t n = min(size - copied, s.size - s.pos);
+			memcpy(dest + copied, s.data + s.pos, n);
+			copied += n;
+			s.pos += n;
+		}
+
+		if (s.pos >= s.size)
+		{
+			submit(head);
+			head = (head + 1) % no_buffers;
+		}
+	}
+
+	return copied;
+}
+
+// *********************************************************************************************
+bool CAsyncFileReader::Eof()
+{
+	if (!is_open || is_error)
+		return true;
+
+	if (mode == io_mode_t::sync)
+		return next_offset >= end_offset;
+
+	// Slots emptied by a short read at the file end are skipped
+	while (true)
+	{
+		auto state = wait_slot(head);
+
+		if (state == slot_state_t::failed)
+			is_error = true;
+		if (state != slot_state_t::ready || slots[head].pos < slots[head].size)
+			return state != slot_state_t::ready;
+
+		submit(head);
+		head = (head + 1) % no_buffers;
+	}
+}
+
+// *********************************************************************************************
+string CAsyncFileReader::Description() const
+{
+	return to_string(mode) + (is_direct ? ", O_DIRECT" : "");
+}
+
+// EOF
@@ -0,0 +1,106 @@
+#pragma once
+
+#include <cstdio>
+#include <cinttypes>
+#include <string>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include "../common/defs.h"
+#include "input_stream.h"
+
+using namespace std;
+
+class CIoUring;
+
+// *********************************************************************************************
+// Sequential reader of a file (or its range) keeping several read-ahead buffers in flight
+// - uring: reads are submitted to io_uring (Linux only), so no extra threads are necessary
+// - threads: reads are made by a small pool of I/O threads
+// - sync: reads are made on demand in the calling thread (also used for non-regular files)
+// With O_DIRECT the page cache is bypassed, so buffers and file offsets are aligned to DIRECT_ALIGNMENT
+class CAsyncFileReader : public CInputStream
+{
+	const size_t DIRECT_ALIGNMENT = 4096;
+	const int NO_IO_THREADS = 2;
+
+	enum class slot_state_t { empty, pending, ready, failed };
+
+	struct slot_t
+	{
+		char* data = nullptr;
+		uint64_t offset = 0;			// file position of data[0]
+		size_t requested = 0;			// no. of bytes to read
+		size_t size = 0;				// no. of bytes read
+		size_t pos = 0;					// no. of bytes consumed
+		slot_state_t state = slot_state_t::empty;
+	};
+
+	io_mode_t requested_mode;
+	io_mode_t mode = io_mode_t::sync;
+	bool use_direct;
+	bool is_direct = false;
+	int no_buffers;
+	size_t buffer_size;
+
+#ifdef _WIN32
+	FILE* in = nullptr;
+	mutex mtx_file;
+#else
+	int fd = -1;
+#endif
+	bool is_open = false;
+	bool is_error = false;
+
+	uint64_t next_offset = 0;			// position of the next read
+	uint64_t end_offset = 0;
+
+	vector<char> raw_buffers;
+	vector<slot_t> slots;
+	int head = 0;						// slot being consumed
+
+	unique_ptr<CIoUring> uring;
+
+	vector<thread> io_threads;
+	deque<int> io_tasks;
+	mutex mtx;
+	condition_variable cv_task;
+	condition_variable cv_done;
+	bool io_stop = false;
+
+	void close();
+	void allocate_buffers();
+	void start_io_threads();
+	void stop_io_threads();
+	void io_thread_fun();
+
+	int64_t read_at(uint64_t offset, char* dest, size_t size);
+	size_t read_sync(char* dest, size_t size);
+
+	void submit(int id);
+	void complete(int id, int64_t result);
+	slot_state_t wait_slot(int id);
+	void drain();
+
+public:
+	CAsyncFileReader(io_mode_t io_mode = io_mode_t::automatic, bool use_direct = false, int no_buffers = 4, size_t buffer_size = 8 << 20);
+	CAsyncFileReader(const CAsyncFileReader&) = delete;
+	CAsyncFileReader& operator=(const CAsyncFileReader&) = delete;
+	~CAsyncFileReader();
+
+	bool Open(const string& file_name, uint64_t offset_begin = 0, uint64_t offset_end = ~0ull);
+	void Close();
+
+	size_t Read(char* dest, size_t size) override;
+	bool Eof() override;
+	bool Error() const override { return is_error; }
+	string Description() const override;
+
+	io_mode_t Mode() const { return mode; }
+	bool IsDirect() const { return is_direct; }
+};
+
+// EOF
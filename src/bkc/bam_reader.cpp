@@ -0,0 +1,386 @@
+#include <iostream>
+#include <cstring>
+#include <algorithm>
+#include "bam_reader.h"
+
+// *********************************************************************************************
+CBamReader::CBamReader(int no_gz_threads, gz_backend_t gz_backend, io_mode_t io_mode, bool direct_io, int no_io_buffers) :
+	gz_in(no_gz_threads, gz_backend, io_mode, direct_io, no_io_buffers)
+{}
+
+// *********************************************************************************************
+void CBamReader::SetView(bam_view_t view, uint32_t cbc_len, uint32_t umi_len)
+{
+	this->view = view;
+	this->cbc_len = cbc_len;
+	this->umi_len = umi_len;
+}
+
+// *********************************************************************************************
+void CBamReader::close()
+{
+	if (is_open)
+	{
+		gz_in.Close();
+		is_open = false;
+	}
+
+	raw_pos = raw_size = 0;
+	raw_eof = false;
+	header_parsed = false;
+
+	text.clear();
+	text_pos = 0;
+
+	is_finished = false;
+	is_error = false;
+}
+
+// *********************************************************************************************
+bool CBamReader::Open(const string& file_name)
+{
+	close();
+
+	if (!gz_in.Open(file_name))
+		return false;
+
+	is_open = true;
+	raw.resize(RAW_BUFFER_SIZE);
+
+	return true;
+}
+
+// *********************************************************************************************
+void CBamReader::Close()
+{
+	close();
+}
+
+// *********************************************************************************************
+size_t CBamReader::Read(char* dest, size_t size)
+{
+	size_t copied = 0;
+
+	while (copied < size && !is_error)
+	{
+		if (text_pos == text.size())
+		{
+			if (is_finished)
+				break;
+
+			if (!decode_records())
+				is_error = true;
+
+			continue;
+		}
+
+		size_t n = min(size - copied, text.size() - text_pos);
+		memcpy(dest + copied, text.data() + text_pos, n);
+		copied += n;
+		text_pos += n;
+	}
+
+	return copied;
+}
+
+// *********************************************************************************************
+bool CBamReader::Eof()
+{
+	return is_error || (is_finished && text_pos == text.size());
+}
+
+// *********************************************************************************************
+// Makes sure that at least n bytes of decompressed data are available (returns false at the file end or on error)
+bool CBamReader::need(size_t n)
+{
+	if (raw_size - raw_pos >= n)
+		return true;
+
+	if (raw_pos)
+	{
+		memmove(raw.data(), raw.data() + raw_pos, raw_size - raw_pos);
+		raw_size -= raw_pos;
+		raw_pos = 0;
+	}
+
+	if (raw.size() < n)
+		raw.resize(max(n, 2 * raw.size()));
+
+	while (raw_size < n && !raw_eof)
+	{
+		size_t to_read = raw.size() - raw_size;
+		size_t readed = gz_in.Read((char*) raw.data() + raw_size, to_read);
+		raw_size += readed;
+
+		if (gz_in.Error())
+		{
+			is_error = true;
+			return false;
+		}
+
+		if (readed < to_read)
+			raw_eof = true;
+	}
+
+	return raw_size >= n;
+}
+
+// *********************************************************************************************
+// Skips the text header and the list of reference sequences
+bool CBamReader::parse_header()
+{
+	if (!need(8) || memcmp(raw.data() + raw_pos, "BAM\1", 4) != 0)
+	{
+		cerr << "Error: incorrect BAM file\n";
+		return false;
+	}
+
+	uint32_t l_text = load32(raw.data() + raw_pos + 4);
+	raw_pos += 8;
+
+	if (!need((size_t) l_text + 4))
+	{
+		cerr << "Error: unexpected end of BAM file\n";
+		return false;
+	}
+
+	raw_pos += l_text;
+	uint32_t n_ref = load32(raw.data() + raw_pos);
+	raw_pos += 4;
+
+	for (uint32_t i = 0; i < n_ref; ++i)
+	{
+		if (!need(4) || !need((size_t) load32(raw.data() + raw_pos) + 8))
+		{
+			cerr << "Error: unexpected end of BAM file\n";
+			return false;
+		}
+
+		raw_pos += (size_t) load32(raw.data() + raw_pos) + 8;
+	}
+
+	header_parsed = true;
+
+	return true;
+}
+
+// *********************************************************************************************
+// Converts the next records into FASTQ text
+bool CBamReader::decode_records()
+{
+	text.clear();
+	text_pos = 0;
+
+	if (!header_parsed && !parse_header())
+		return false;
+
+	while (text.size() < TEXT_BUFFER_SIZE)
+	{
+		if (!need(4))
+		{
+			if (is_error || raw_pos != raw_size)
+			{
+				cerr << "Error: unexpected end of BAM file\n";
+				return false;
+			}
+
+			is_finished = true;
+			break;
+		}
+
+		size_t block_size = load32(raw.data() + raw_pos);
+
+		if (block_size < RECORD_FIXED_SIZE || !need(4 + block_size))
+		{
+			cerr << "Error: corrupted or truncated BAM file\n";
+			return false;
+		}
+
+		if (!append_record(raw.data() + raw_pos + 4, block_size))
+		{
+			cerr << "Error: corrupted BAM record\n";
+			return false;
+		}
+
+		raw_pos += 4 + block_size;
+	}
+
+	return true;
+}
+
+// *********************************************************************************************
+bool CBamReader::append_record(const uint8_t* rec, size_t rec_size)
+{
+	uint32_t l_read_name = rec[8];
+	uint32_t n_cigar_op = load16(rec + 12);
+	uint16_t flag = load16(rec + 14);
+	int32_t l_seq = (int32_t) load32(rec + 16);
+
+	if (l_seq < 0 || l_read_name == 0)
+		return false;
+
+	const uint8_t* read_name = rec + RECORD_FIXED_SIZE;
+	const uint8_t* seq = read_name + l_read_name + 4 * (size_t) n_cigar_op;
+	const uint8_t* qual = seq + (l_seq + 1) / 2;
+	const uint8_t* tags = qual + l_seq;
+	const uint8_t* rec_end = rec + rec_size;
+
+	if (tags > rec_end)
+		return false;
+
+	if (flag & (FLAG_SECONDARY | FLAG_SUPPLEMENTARY))
+		return true;
+
+	if (view == bam_view_t::reads)
+	{
+		if (flag & FLAG_READ1)
+			return true;
+	}
+	else if (flag & FLAG_READ2)
+		return true;
+
+	text.push_back('@');
+	text.insert(text.end(), (const char*) read_name, (const char*) read_name + l_read_name - 1);
+	text.push_back('\n');
+
+	if (view == bam_view_t::reads || (flag & FLAG_READ1))
+	{
+		bool reverse = (flag & FLAG_REVERSE) != 0;
+
+		append_seq(seq, l_seq, reverse);
+		text.push_back('\n');
+		text.push_back('+');
+		text.push_back('\n');
+		append_qual(qual, l_seq, reverse);
+		text.push_back('\n');
+
+		return true;
+	}
+
+	// CBC and UMI from tags (corrected ones are preferred, 10x adds the GEM well suffix, e.g., -1, to CB)
+	if (find_string_tag(tags, rec_end, "CB", cbc))
+		cbc.resize(find(cbc.begin(), cbc.end(), '-') - cbc.begin());
+	else if (!find_string_tag(tags, rec_end, "CR", cbc))
+		cbc.assign(cbc_len, 'N');
+
+	if (!find_string_tag(tags, rec_end, "UB", umi) && !find_string_tag(tags, rec_end, "UR", umi))
+		umi.assign(umi_len, 'N');
+
+	if (!find_string_tag(tags, rec_end, "CY", cbc_qual) || cbc_qual.size() != cbc.size())
+		cbc_qual.assign(cbc.size(), 'I');
+	if (!find_string_tag(tags, rec_end, "UY", umi_qual) || umi_qual.size() != umi.size())
+		umi_qual.assign(umi.size(), 'I');
+
+	text.insert(text.end(), cbc.begin(), cbc.end());
+	text.insert(text.end(), umi.begin(), umi.end());
+	text.push_back('\n');
+	text.push_back('+');
+	text.push_back('\n');
+	text.insert(text.end(), cbc_qual.begin(), cbc_qual.end());
+	text.insert(text.end(), umi_qual.begin(), umi_qual.end());
+	text.push_back('\n');
+
+	return true;
+}
+
+// *********************************************************************************************
+// Sequences of reads aligned to the reverse strand are stored reverse-complemented
+void CBamReader::append_seq(const uint8_t* seq, int32_t len, bool reverse)
+{
+	static const char codes[] = "=ACMGRSVTWYHKDBN";
+	static const char rc_codes[] = "NTGNCNNNANNNNNNN";
+
+	size_t pos = text.size();
+	text.resize(pos + len);
+	char* p = text.data() + pos;
+
+	if (!reverse)
+		for (int32_t i = 0; i < len; ++i)
+			p[i] = codes[(seq[i / 2] >> (4 * (1 - i % 2))) & 0xf];
+	else
+		for (int32_t i = 0; i < len; ++i)
+			p[len - 1 - i] = rc_codes[(seq[i / 2] >> (4 * (1 - i % 2))) & 0xf];
+}
+
+// *********************************************************************************************
+// Missing qualities (0xff) are replaced by 'I'
+void CBamReader::append_qual(const uint8_t* qual, int32_t len, bool reverse)
+{
+	size_t pos = text.size();
+	text.resize(pos + len);
+	char* p = text.data() + pos;
+
+	if (len && qual[0] == 0xff)
+	{
+		fill_n(p, len, 'I');
+		return;
+	}
+
+	if (!reverse)
+		for (int32_t i = 0; i < len; ++i)
+			p[i] = (char) (qual[i] + 33);
+	else
+		for (int32_t i = 0; i < len; ++i)
+			p[len - 1 - i] = (char) (qual[i] + 33);
+}
+
+// *********************************************************************************************
+// Looks for the tag of type Z (string)
+bool CBamReader::find_string_tag(const uint8_t* tags, const uint8_t* tags_end, const char* tag, string& value)
+{
+	const uint8_t* p = tags;
+
+	while (p + 3 <= tags_end)
+	{
+		bool match = p[0] == tag[0] && p[1] == tag[1];
+		char type = (char) p[2];
+		p += 3;
+
+		size_t size;
+
+		switch (type)
+		{
+		case 'A': case 'c': case 'C':
+			size = 1;
+			break;
+		case 's': case 'S':
+			size = 2;
+			break;
+		case 'i': case 'I': case 'f':
+			size = 4;
+			break;
+		case 'Z': case 'H':
+		{
+			auto q = find(p, tags_end, 0);
+			if (q == tags_end)
+				return false;
+
+			if (match && type == 'Z')
+			{
+				value.assign((const char*) p, (const char*) q);
+				return true;
+			}
+
+			size = q - p + 1;
+			break;
+		}
+		case 'B':
+		{
+			if (p + 5 > tags_end)
+				return false;
+
+			size_t elem_size = (p[0] == 'c' || p[0] == 'C') ? 1 : (p[0] == 's' || p[0] == 'S') ? 2 : 4;
+			size = 5 + elem_size * load32(p + 1);
+			break;
+		}
+		default:
+			return false;
+		}
+
+		p += size;
+	}
+
+	return false;
+}
+
+// EOF
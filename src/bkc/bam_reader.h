@@ -0,0 +1,82 @@
+#pragma once
+
+#include <cinttypes>
+#include <string>
+#include <vector>
+#include "input_stream.h"
+#include "parallel_gz_reader.h"
+
+using namespace std;
+
+enum class bam_view_t { none, barcodes, reads };
+
+// *********************************************************************************************
+// Reader of BAM files producing FASTQ records, so the rest of the pipeline is the same as for FASTQ input
+// - barcodes view: CBC+UMI of each read, i.e., the sequence of the 1st read of a pair (unaligned BAM with R1 and R2 records)
+//   or CB+UB tags (CR+UR when the corrected ones are missing) of a single read
+// - reads view: biological reads (the 2nd read of a pair or single reads) in the original (sequencing) orientation
+// Secondary and supplementary alignments are skipped, so both views contain the same reads in the same order
+// BGZF blocks are decompressed in parallel by CParallelGzReader
+class CBamReader : public CInputStream
+{
+	const size_t RAW_BUFFER_SIZE = 16 << 20;
+	const size_t TEXT_BUFFER_SIZE = 16 << 20;
+	const size_t RECORD_FIXED_SIZE = 32;
+
+	const uint16_t FLAG_REVERSE = 0x10;
+	const uint16_t FLAG_READ1 = 0x40;
+	const uint16_t FLAG_READ2 = 0x80;
+	const uint16_t FLAG_SECONDARY = 0x100;
+	const uint16_t FLAG_SUPPLEMENTARY = 0x800;
+
+	CParallelGzReader gz_in;
+	bam_view_t view = bam_view_t::reads;
+	uint32_t cbc_len = 16;
+	uint32_t umi_len = 12;
+
+	vector<uint8_t> raw;
+	size_t raw_pos = 0;
+	size_t raw_size = 0;
+	bool raw_eof = false;
+	bool header_parsed = false;
+
+	vector<char> text;
+	size_t text_pos = 0;
+
+	string cbc, umi, cbc_qual, umi_qual;
+
+	bool is_open = false;
+	bool is_finished = false;
+	bool is_error = false;
+
+	void close();
+	bool need(size_t n);
+
+	bool parse_header();
+	bool decode_records();
+	bool append_record(const uint8_t* rec, size_t rec_size);
+
+	void append_seq(const uint8_t* seq, int32_t len, bool reverse);
+	void append_qual(const uint8_t* qual, int32_t len, bool reverse);
+
+
+	bool find_string_tag(const uint8_t* tags, const uint8_t* tags_end, const char* tag, string& value);
+
+	static uint16_t load16(const uint8_t* p) { return (uint16_t) (p[0] | (p[1] << 8)); }
+	static uint32_t load32(const uint8_t* p) { return (uint32_t) p[0] | ((uint32_t) p[1] << 8) | ((uint32_t) p[2] << 16) | ((uint32_t) p[3] << 24); }
+
+public:
+	CBamReader(int no_gz_threads, gz_backend_t gz_backend = gz_backend_t::automatic, io_mode_t io_mode = io_mode_t::automatic, bool direct_io = false, int no_io_buffers = 4);
+
+	void SetView(bam_view_t view, uint32_t cbc_len, uint32_t umi_len);
+
+	bool Open(const string& file_name);
+	void Close();
+
+	size_t Read(char* dest, size_t size) override;
+	bool Eof() override;
+	bool Error() const override { return is_error; }
+	string Description() const override { return "BAM, " + gz_in.Description(); }
+};
+
+// EOF
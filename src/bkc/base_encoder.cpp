@@ -0,0 +1,200 @@
+#include <cstddef>
+#include "base_encoder.h"
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define BASE_ENCODER_X64
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define BASE_TARGET_AVX2
+#else
+#define BASE_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+#endif
+
+// *********************************************************************************************
+// Moves bits of x to even positions (bit i goes to bit 2i)
+static inline uint64_t spread_bits(uint32_t x)
+{
+	uint64_t v = x;
+
+	v = (v | (v << 16)) & 0x0000FFFF0000FFFFull;
+	v = (v | (v << 8)) & 0x00FF00FF00FF00FFull;
+	v = (v | (v << 4)) & 0x0F0F0F0F0F0F0F0Full;
+	v = (v | (v << 2)) & 0x3333333333333333ull;
+	v = (v | (v << 1)) & 0x5555555555555555ull;
+
+	return v;
+}
+
+// *********************************************************************************************
+// Reverses the order of 2-bit groups, so the base at the lowest position becomes the most significant one
+static inline uint64_t reverse_2b(uint64_t x)
+{
+#ifdef _MSC_VER
+	x = _byteswap_uint64(x);
+#else
+	x = __builtin_bswap64(x);
+#endif
+	x = ((x >> 4) & 0x0F0F0F0F0F0F0F0Full) | ((x & 0x0F0F0F0F0F0F0F0Full) << 4);
+	x = ((x >> 2) & 0x3333333333333333ull) | ((x & 0x3333333333333333ull) << 2);
+
+	return x;
+}
+
+// *********************************************************************************************
+// lo and hi hold the lower and higher bits of codes of consecutive bases, valid marks ACGT symbols
+static inline uint64_t pack_codes(uint32_t lo, uint32_t hi, uint32_t valid, uint32_t len)
+{
+	uint32_t len_mask = len >= 32 ? ~0u : (1u << len) - 1;
+
+	if ((valid & len_mask) != len_mask)
+		return ~0ull;
+
+	if (!len)
+		return 0;
+
+	uint64_t x = spread_bits(lo & len_mask) | (spread_bits(hi & len_mask) << 1);
+
+	return reverse_2b(x) >> (64 - 2 * len);
+}
+
+// *********************************************************************************************
+// ((c >> 1) ^ (c >> 2)) & 3 maps A, C, G, T (ASCII) to 0, 1, 2, 3
+static uint64_t encode_scalar(const char* p, uint32_t len)
+{
+	uint64_t code = 0;
+
+	for (uint32_t i = 0; i < len; ++i)
+	{
+		char c = p[i];
+
+		if (c != 'A' && c != 'C' && c != 'G' && c != 'T')
+			return ~0ull;
+
+		code = (code << 2) + (((c >> 1) ^ (c >> 2)) & 3);
+	}
+
+	return code;
+}
+
+#ifdef BASE_ENCODER_X64
+// *********************************************************************************************
+static inline void codes_sse2(__m128i v, uint32_t& lo, uint32_t& hi, uint32_t& valid)
+{
+	__m128i is_valid = _mm_or_si128(
+		_mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('A')), _mm_cmpeq_epi8(v, _mm_set1_epi8('C'))),
+		_mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('G')), _mm_cmpeq_epi8(v, _mm_set1_epi8('T'))));
+
+	// Only the 2 lowest bits of each byte are used, so 16-bit shifts are enough
+	__m128i c = _mm_xor_si128(_mm_srli_epi16(v, 1), _mm_srli_epi16(v, 2));
+
+	lo = (uint32_t) _mm_movemask_epi8(_mm_slli_epi16(c, 7));
+	hi = (uint32_t) _mm_movemask_epi8(_mm_slli_epi16(c, 6));
+	valid = (uint32_t) _mm_movemask_epi8(is_valid);
+}
+
+// *********************************************************************************************
+static uint64_t encode_sse2(const char* p, uint32_t len)
+{
+	uint32_t lo0, hi0, valid0, lo1, hi1, valid1;
+
+	codes_sse2(_mm_loadu_si128((const __m128i*) p), lo0, hi0, valid0);
+	codes_sse2(_mm_loadu_si128((const __m128i*) (p + 16)), lo1, hi1, valid1);
+
+	return pack_codes(lo0 | (lo1 << 16), hi0 | (hi1 << 16), valid0 | (valid1 << 16), len);
+}
+
+// *********************************************************************************************
+BASE_TARGET_AVX2 static uint64_t encode_avx2(const char* p, uint32_t len)
+{
+	__m256i v = _mm256_loadu_si256((const __m256i*) p);
+
+	__m256i is_valid = _mm256_or_si256(
+		_mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('A')), _mm256_cmpeq_epi8(v, _mm256_set1_epi8('C'))),
+		_mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('G')), _mm256_cmpeq_epi8(v, _mm256_set1_epi8('T'))));
+
+	__m256i c = _mm256_xor_si256(_mm256_srli_epi16(v, 1), _mm256_srli_epi16(v, 2));
+
+	uint32_t lo = (uint32_t) _mm256_movemask_epi8(_mm256_slli_epi16(c, 7));
+	uint32_t hi = (uint32_t) _mm256_movemask_epi8(_mm256_slli_epi16(c, 6));
+	uint32_t valid = (uint32_t) _mm256_movemask_epi8(is_valid);
+
+	return pack_codes(lo, hi, valid, len);
+}
+
+// *********************************************************************************************
+static bool cpu_has_avx2()
+{
+#ifdef _MSC_VER
+	int regs[4];
+
+	__cpuid(regs, 0);
+	if (regs[0] < 7)
+		return false;
+
+	// AVX and OS support for YMM registers
+	__cpuid(regs, 1);
+	if ((regs[2] & (1 << 27)) == 0 || (regs[2] & (1 << 28)) == 0 || (_xgetbv(0) & 6) != 6)
+		return false;
+
+	__cpuidex(regs, 7, 0);
+	return (regs[1] & (1 << 5)) != 0;
+#else
+	return __builtin_cpu_supports("avx2");
+#endif
+}
+#endif
+
+// *********************************************************************************************
+base_kernel_t CBaseEncoder::select_kernel()
+{
+#ifdef BASE_ENCODER_X64
+	return cpu_has_avx2() ? base_kernel_t::avx2 : base_kernel_t::sse2;
+#else
+	return base_kernel_t::scalar;
+#endif
+}
+
+// *********************************************************************************************
+base_kernel_t CBaseEncoder::Kernel()
+{
+	static const base_kernel_t kernel = select_kernel();
+
+	return kernel;
+}
+
+// *********************************************************************************************
+const char* CBaseEncoder::KernelName()
+{
+	switch (Kernel())
+	{
+	case base_kernel_t::avx2:
+		return "AVX2";
+	case base_kernel_t::sse2:
+		return "SSE2";
+	default:
+		return "scalar";
+	}
+}
+
+// *********************************************************************************************
+uint64_t CBaseEncoder::Encode(const char* p, uint32_t len, const char* p_end)
+{
+	if (p_end - p >= (ptrdiff_t) MAX_LEN)
+		switch (Kernel())
+		{
+#ifdef BASE_ENCODER_X64
+		case base_kernel_t::avx2:
+			return encode_avx2(p, len);
+		case base_kernel_t::sse2:
+			return encode_sse2(p, len);
+#endif
+		default:
+			break;
+		}
+
+	return encode_scalar(p, len);
+}
+
+// EOF
@@ -0,0 +1,28 @@
+#pragma once
+
+#include <cinttypes>
+
+using namespace std;
+
+enum class base_kernel_t { scalar, sse2, avx2 };
+
+// *********************************************************************************************
+// 2-bit encoding of short sequences (e.g., CBC+UMI) in the same way as BaseCoding4::encode_bases_2b,
+// i.e., A=0, C=1, G=2, T=3 with the 1st base at the most significant position and ~0ull if any base is not ACGT
+// The kernel (AVX2, SSE2 or scalar) is selected at runtime according to the CPU features
+class CBaseEncoder
+{
+	static base_kernel_t select_kernel();
+
+public:
+	static const uint32_t MAX_LEN = 32;
+
+	static base_kernel_t Kernel();
+	static const char* KernelName();
+
+	// Encodes len (at most MAX_LEN) bases starting at p; data up to p_end can be read
+	// (SIMD kernels load MAX_LEN bytes, so shorter tails are encoded by the scalar code)
+	static uint64_t Encode(const char* p, uint32_t len, const char* p_end);
+};
+
+// EOF
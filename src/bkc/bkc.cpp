@@ -2,7 +2,6 @@
 #include <iostream>
 #include <fstream>
 #include <cstdint>
-#include <regex>
 //#include "../common/version.h"
 #include "kmer_counter.h"
 
@@ -13,8 +12,8 @@ CParams params;
 
 void usage();
 bool parse_args(int argc, char** argv);
-bool load_predefined_cbc_visium();
-bool load_predefined_cbc_plain();
+bool load_predefined_cbc();
+bool convert_predefined_cbc();
 
 // *********************************************************************************************
 bool parse_args(int argc, char** argv)
@@ -87,6 +86,46 @@ bool parse_args(int argc, char** argv)
 				return false;
 			}
 		}
+		else if (argv[i] == "--n_file_parts"s && i + 1 < argc)
+		{
+			if (!params.no_file_parts.set(atoi(argv[++i])))
+			{
+				cerr << "Incorrect value for n_file_parts: " << argv[i] << endl;
+				return false;
+			}
+		}
+		else if (argv[i] == "--io_memory"s && i + 1 < argc)
+		{
+			if (!params.io_memory.set(atoi(argv[++i])))
+			{
+				cerr << "Incorrect value for io_memory: " << argv[i] << endl;
+				return false;
+			}
+		}
+		else if (argv[i] == "--max_ram"s && i + 1 < argc)
+		{
+			if (!params.max_ram.set(atoi(argv[++i])))
+			{
+				cerr << "Incorrect value for max_ram: " << argv[i] << endl;
+				return false;
+			}
+		}
+		else if (argv[i] == "--n_io_buffers"s && i + 1 < argc)
+		{
+			if (!params.no_io_buffers.set(atoi(argv[++i])))
+			{
+				cerr << "Incorrect value for n_io_buffers: " << argv[i] << endl;
+				return false;
+			}
+		}
+		else if (argv[i] == "--n_gz_threads"s && i + 1 < argc)
+		{
+			if (!params.no_gz_threads.set(atoi(argv[++i])))
+			{
+				cerr << "Incorrect value for n_gz_threads: " << argv[i] << endl;
+				return false;
+			}
+		}
 		else if (argv[i] == "--zstd_level"s && i + 1 < argc)
 		{
 			if (!params.zstd_level.set(atoi(argv[++i])))
@@ -119,6 +158,14 @@ bool parse_args(int argc, char** argv)
 				return false;
 			}
 		}
+		else if (argv[i] == "--early_whitelist_sample"s && i + 1 < argc)
+		{
+			if (!params.early_whitelist_sample.set(atoi(argv[++i])))
+			{
+				cerr << "Incorrect value for early_whitelist_sample: " << argv[i] << endl;
+				return false;
+			}
+		}
 		else if (argv[i] == "--max_count"s && i + 1 < argc)
 		{
 			if (!params.max_count.set(atoi(argv[++i])))
@@ -147,6 +194,18 @@ bool parse_args(int argc, char** argv)
 			params.apply_filter_illumina_adapters = true;
 		else if (argv[i] == "--apply_cbc_correction"s)
 			params.apply_cbc_correction = true;
+		else if (argv[i] == "--quality_aware_cbc_correction"s)
+			params.quality_aware_cbc_correction = true;
+		else if (argv[i] == "--umi_dedup"s && i + 1 < argc)
+		{
+			++i;
+			params.umi_dedup = umi_dedup_from_string(argv[i]);
+			if (params.umi_dedup == umi_dedup_t::unknown)
+			{
+				cerr << "Wrong value for umi_dedup: " << argv[i] << endl;
+				return false;
+			}
+		}
 		else if (argv[i] == "--log_name"s && i + 1 < argc)
 		{
 			params.export_cbc_logs = true;
@@ -154,6 +213,12 @@ bool parse_args(int argc, char** argv)
 		}
 		else if (argv[i] == "--filtered_input_path"s && i + 1 < argc)
 			params.filtered_input_path = argv[++i];
+		else if (argv[i] == "--no_gz_index"s)
+			params.use_gz_index = false;
+		else if (argv[i] == "--gz_index_path"s && i + 1 < argc)
+			params.gz_index_path = argv[++i];
+		else if (argv[i] == "--spool_path"s && i + 1 < argc)
+			params.spool_path = argv[++i];
 		else if (argv[i] == "--export_filtered_input_mode"s && i + 1 < argc)
 		{
 			++i;
@@ -173,6 +238,10 @@ bool parse_args(int argc, char** argv)
 		}
 		else if (argv[i] == "--allow_strange_cbc_umi_reads"s)
 			params.allow_strange_cbc_umi_reads = true;
+		else if (argv[i] == "--no_mmap"s)
+			params.use_mmap = false;
+		else if (argv[i] == "--direct_io"s)
+			params.direct_io = true;
 		else if (argv[i] == "--input_name"s && i + 1 < argc)
 			input_name = argv[++i];
 		else if (argv[i] == "--technology"s && i + 1 < argc)
@@ -198,6 +267,31 @@ bool parse_args(int argc, char** argv)
 				return false;
 			}
 		}
+		else if (argv[i] == "--gz_backend"s && i + 1 < argc)
+		{
+			++i;
+			params.gz_backend = gz_backend_from_string(argv[i]);
+			if (params.gz_backend == gz_backend_t::unknown)
+			{
+				cerr << "Wrong value for gz_backend: " << argv[i] << endl;
+				return false;
+			}
+			if (!is_gz_backend_available(params.gz_backend))
+			{
+				cerr << "Backend " << argv[i] << " is not available in this build\n";
+				return false;
+			}
+		}
+		else if (argv[i] == "--io_mode"s && i + 1 < argc)
+		{
+			++i;
+			params.io_mode = io_mode_from_string(argv[i]);
+			if (params.io_mode == io_mode_t::unknown)
+			{
+				cerr << "Wrong value for io_mode: " << argv[i] << endl;
+				return false;
+			}
+		}
 		else if (argv[i] == "--output_format"s && i + 1 < argc)
 		{
 			++i;
@@ -220,6 +314,12 @@ bool parse_args(int argc, char** argv)
 		}
 		else if (argv[i] == "--predefined_cbc"s && i + 1 < argc)
 			params.predefined_cbc_fn = argv[++i];
+		else if (argv[i] == "--convert_predefined_cbc"s && i + 1 < argc)
+			params.converted_cbc_fn = argv[++i];
+		else if (argv[i] == "--save_cbc_state"s && i + 1 < argc)
+			params.save_cbc_state_fn = argv[++i];
+		else if (argv[i] == "--load_cbc_state"s && i + 1 < argc)
+			params.load_cbc_state_fn = argv[++i];
 		else
 		{
 			cerr << "Unknown parameter: " << argv[i] << endl;
@@ -227,6 +327,18 @@ bool parse_args(int argc, char** argv)
 		}
 	}
 
+	// Only conversion of the predefined CBCs, so no input is necessary
+	if (!params.converted_cbc_fn.empty())
+	{
+		if (params.predefined_cbc_fn.empty())
+		{
+			cerr << "No predefined CBCs to convert\n";
+			return false;
+		}
+
+		return true;
+	}
+
 	if (input_name.empty())
 	{
 		cerr << "No input name provided\n";
@@ -242,26 +354,31 @@ bool parse_args(int argc, char** argv)
 	ifstream ifs(input_name);
 	string s1, s2, s;
 
+	// "-" stands for the standard input
+	auto input_path = [](const string& name) { return name == "-" ? "/dev/stdin"s : name; };
+
 	while (ifs >> s)
 	{
 		auto p = find(s.begin(), s.end(), ',');
+		if (p == s.end() && params.input_format == input_format_t::bam)
+		{
+			// Both CBC+UMI and reads are in the same BAM file
+			params.cbc_file_names.emplace_back(s);
+			params.read_file_names.emplace_back(s);
+			continue;
+		}
 		if (p == s.end())
 		{
 			cerr << "Wrong line in input name file: " << s << endl;
 			return false;
 		}
 
-		params.cbc_file_names.emplace_back(s.begin(), p);
-		params.read_file_names.emplace_back(p+1, s.end());
+		params.cbc_file_names.emplace_back(input_path(string(s.begin(), p)));
+		params.read_file_names.emplace_back(input_path(string(p+1, s.end())));
 	}
 
-	if (!params.predefined_cbc_fn.empty())
-	{
-		if (params.technology == technology_t::visium)
-			load_predefined_cbc_visium();
-		else if (params.technology == technology_t::ten_x)
-			load_predefined_cbc_plain();
-	}
+	if (!params.predefined_cbc_fn.empty() && !load_predefined_cbc())
+		return false;
 
 	return true;
 }
@@ -285,13 +402,30 @@ void usage()
 		<< "    --canonical - turn on canonical k-mers (default: false); works only in single mode" << endl
 		<< "    --verbose <int> - verbosity level " << params.verbosity_level.str() << endl
 		<< "Options - input:\n"
-		<< "    --input_format <fasta|fastq> - input format (default: fastq)\n"
-		<< "    --input_name <file_name> - file name with list of pairs (comma separated) of barcoded files; 1st contains CBC+UMI\n"
+		<< "    --input_format <fasta|fastq|bam> - input format (default: fastq)\n"
+		<< "    --input_name <file_name> - file name with list of pairs (comma separated) of barcoded files; 1st contains CBC+UMI (for BAM input: list of BAM files); files can be pipes or FIFOs, - stands for stdin\n"
 		<< "    --technology <10x|visium> - sequencing technology (default: " << technology_str(params.technology) << ")\n"
 		<< "    --soft_cbc_umi_len_limit <int> - tolerance of CBC+UMI len " << params.soft_cbc_umi_len_limit.str() << endl
 		<< "    --cbc_filtering_thr <int> - CBC filtering threshold (0 is for auto) " << params.cbc_filtering_thr.str() << endl
+		<< "    --early_whitelist_sample <int> - no. of reads (in millions) from the beginning of CBC files used to estimate the CBC whitelist, so the 1st pass keeps only the candidate CBCs (0 means off; only with auto CBC filtering) " << params.early_whitelist_sample.str() << endl
+		<< "    --n_file_parts <int> - no. of parts each uncompressed input file is split into for parallel parsing (0 means auto) " << params.no_file_parts.str() << endl
+		<< "    --n_gz_threads <int> - no. of threads decompressing each gzipped or zstd-compressed input file; single-member gzip files are split at guessed deflate block starts (0 means auto) " << params.no_gz_threads.str() << endl
+		<< "    --gz_backend <auto|zlib|igzip|libdeflate> - gzip decompression backend; auto selects the fastest one by a short benchmark (default: " << to_string(params.gz_backend) << ")\n"
+		<< "    --no_mmap - read uncompressed input files with fread instead of mapping them into memory (default: " << !params.use_mmap << ")\n"
+		<< "    --io_mode <auto|uring|threads|sync> - how input files are read ahead; auto uses io_uring if available and I/O threads otherwise (default: " << to_string(params.io_mode) << ")\n"
+		<< "    --n_io_buffers <int> - no. of read-ahead buffers (8 MB each) in flight per input file " << params.no_io_buffers.str() << endl
+		<< "    --io_memory <int> - memory (in MB) for blocks of input data passed from reading to parsing threads (0 means auto) " << params.io_memory.str() << endl
+		<< "    --direct_io - read input files with O_DIRECT, bypassing the page cache (turns off memory mapping) (default: " << params.direct_io << ")\n"
+		<< "    --no_gz_index - do not build and use random-access indexes of single-member gzipped input files (default: " << !params.use_gz_index << ")\n"
+		<< "    --gz_index_path <string> - directory of random-access indexes of gzipped input files (default: next to the input files)\n"
+		<< "    --spool_path <string> - path to spools of streamed (pipe, FIFO, stdin) inputs read in the 2nd pass and of spilled CBC/UMI tuples (default: " << params.spool_path << ")\n"
+		<< "    --max_ram <int> - memory (in GB) for CBC/UMI tuples of the 1st pass; above it sorted runs of tuples are spilled to disk (0 means no limit; CBC statistics and ids of retained reads are not covered) " << params.max_ram.str() << endl
 		<< "    --allow_strange_cbc_umi_reads - use to prevent the application from crashing when the CBC+UMI read length is outside the acceptable range (either shorter than CBC+UMI or longer than CBC+UMI+soft_cbc_umi_len_limit) (default: " << params.allow_strange_cbc_umi_reads << ")\n"
 		<< "    --apply_cbc_correction - apply CBC correction (default: " << params.apply_cbc_correction << ")\n"
+		<< "    --save_cbc_state <file_name> - store the results of the 1st pass (CBC filtering, correction and UMI deduplication) in file_name\n"
+		<< "    --load_cbc_state <file_name> - skip the 1st pass and load its results from file_name (made by --save_cbc_state for the same CBC files)\n"
+		<< "    --umi_dedup <exact|directional> - reads of a CBC are collapsed if their UMIs are the same (exact) or form a network of 1-mismatch UMIs as in UMI-tools (directional) (default: " << to_string(params.umi_dedup) << ")\n"
+		<< "    --quality_aware_cbc_correction - use base qualities to correct CBCs with many trusted 1-mismatch neighbours (requires --apply_cbc_correction) (default: " << params.quality_aware_cbc_correction << ")\n"
 		<< "Options - output:\n"
 		<< "    --output_format <bkc|splash> (default: " << to_string(params.output_format) << ")\n"
 		<< "    --output_name <file_name> - output file name (default: " << params.out_file_name << ")\n"
@@ -304,6 +438,7 @@ void usage()
 		<< "    --zstd_level <int> - internal compression level " << params.zstd_level.str() << endl
 		<< "Options - filtering:\n"
 		<< "    --predefined_cbc <file_name> - path to file with predefined CBCs (default: " << params.predefined_cbc_fn << ")\n"
+		<< "    --convert_predefined_cbc <file_name> - convert predefined CBCs to the binary form, store them in file_name and exit\n"
 		<< "    --poly_ACGT_len <int> - all leaders containing polyACGT of this length will be filtered out (0 means no filtering) " << params.poly_ACGT_len.str() << endl
 		<< "    --artifacts <file_name> - path to artifacts, each leader containing artifact will be filtered out\n"
 		<< "    --apply_filter_illumina_adapters - if used leaders containing Illumina adapters will be filtered out\n"					
@@ -313,43 +448,28 @@ void usage()
 }
 
 // *********************************************************************************************
-bool load_predefined_cbc_visium()
+bool load_predefined_cbc()
 {
-	ifstream ifs(params.predefined_cbc_fn);
-
-	params.predefined_cbc.clear();
+	auto whitelist = make_shared<CCbcWhitelist>();
 
-	regex re("([ACGT]+)-(.+),([0-9]+),[0-9]+,[0-9]+,[0-9]+,[0-9]+");
-	smatch sm;
-
-	string s;
-
-	while (ifs >> s)
-	{
-		if (!regex_match(s, sm, re))
-		{
-			cerr << "Unknown trusted CBC description: " << s << endl;
-			return false;
-		}
+	if (!whitelist->Load(params.predefined_cbc_fn, params.technology, params.cbc_len.get()))
+		return false;
 
-		if (stoi(sm[3]) == 1)
-			params.predefined_cbc.emplace_back(sm[1]);
-	}
+	params.predefined_cbc = whitelist;
 
 	return true;
 }
 
 // *********************************************************************************************
-bool load_predefined_cbc_plain()
+bool convert_predefined_cbc()
 {
-	ifstream ifs(params.predefined_cbc_fn);
-
-	params.predefined_cbc.clear();
+	if (!load_predefined_cbc())
+		return false;
 
-	string s;
+	if (!params.predefined_cbc->Save(params.converted_cbc_fn))
+		return false;
 
-	while (ifs >> s)
-		params.predefined_cbc.emplace_back(s);
+	cerr << "Predefined CBCs (" << params.predefined_cbc->Size() << ") stored in " << params.converted_cbc_fn << endl;
 
 	return true;
 }
@@ -363,11 +483,15 @@ int main(int argc, char **argv)
 		return 1;
 	}
 
+	if (!params.converted_cbc_fn.empty())
+		return convert_predefined_cbc() ? 0 : 1;
+
 	CBarcodedCounter barcoded_counter;
 
 	barcoded_counter.SetParams(params);
 
-	barcoded_counter.ProcessCBC();
+	if (!barcoded_counter.ProcessCBC())
+		return 1;
 
 	if (((uint32_t)params.export_filtered_input) & (uint32_t)export_filtered_input_t::first)
 		barcoded_counter.ProcessExportFilteredCBCReads();
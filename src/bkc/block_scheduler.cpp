@@ -0,0 +1,132 @@
+#include "block_scheduler.h"
+
+// *********************************************************************************************
+CBlockScheduler::CBlockScheduler(int no_lanes, size_t lane_capacity, bool allow_stealing) :
+	lanes(no_lanes),
+	completed(no_lanes, false),
+	no_active_lanes(no_lanes),
+	lane_capacity(max<size_t>(lane_capacity, 1)),
+	allow_stealing(allow_stealing)
+{}
+
+// *********************************************************************************************
+void CBlockScheduler::Push(int lane_id, input_block_t&& block)
+{
+	unique_lock<mutex> lck(mtx);
+
+	cv_push.wait(lck, [&] {return lanes[lane_id].size() < lane_capacity; });
+
+	lanes[lane_id].emplace_back(move(block));
+
+	// Any parser can take the block when stealing is allowed
+	if (allow_stealing)
+		cv_pop.notify_one();
+	else
+		cv_pop.notify_all();
+}
+
+// *********************************************************************************************
+void CBlockScheduler::MarkCompleted(int lane_id)
+{
+	lock_guard<mutex> lck(mtx);
+
+	if (!completed[lane_id])
+	{
+		completed[lane_id] = true;
+		--no_active_lanes;
+	}
+
+	cv_pop.notify_all();
+}
+
+// *********************************************************************************************
+// Returns the lane to take a block from (-1 if there is no block available for the parser)
+int CBlockScheduler::find_lane(int lane_id) const
+{
+	if (!lanes[lane_id].empty() || !allow_stealing)
+		return lanes[lane_id].empty() ? -1 : lane_id;
+
+	int best = -1;
+
+	for (int i = 0; i < (int) lanes.size(); ++i)
+		if (!lanes[i].empty() && (best < 0 || lanes[i].size() > lanes[best].size()))
+			best = i;
+
+	return best;
+}
+
+// *********************************************************************************************
+bool CBlockScheduler::Pop(int lane_id, input_block_t& block)
+{
+	unique_lock<mutex> lck(mtx);
+	int src_id = -1;
+
+	cv_pop.wait(lck, [&] {
+		src_id = find_lane(lane_id);
+		return src_id >= 0 || (allow_stealing ? no_active_lanes == 0 : (bool) completed[lane_id]);
+		});
+
+	if (src_id < 0)
+		return false;
+
+	block = move(lanes[src_id].front());
+	lanes[src_id].pop_front();
+
+	if (src_id != lane_id)
+		++no_stolen_blocks;
+
+	cv_push.notify_all();
+
+	return true;
+}
+
+// *********************************************************************************************
+uint64_t CBlockScheduler::NoStolenBlocks()
+{
+	lock_guard<mutex> lck(mtx);
+
+	return no_stolen_blocks;
+}
+
+// *********************************************************************************************
+//
+// *********************************************************************************************
+
+// *********************************************************************************************
+void CReadIdSequencer::Reset(const vector<file_part_t>& file_parts)
+{
+	lock_guard<mutex> lck(mtx);
+
+	parts.clear();
+	parts.reserve(file_parts.size());
+
+	for (const auto& part : file_parts)
+		parts.emplace_back(part_state_t{ 0, part.first_read_id, part.first_valid_read_id });
+}
+
+// *********************************************************************************************
+void CReadIdSequencer::Acquire(int part_id, uint64_t block_no, uint64_t& read_id, uint64_t& valid_read_id)
+{
+	unique_lock<mutex> lck(mtx);
+
+	cv.wait(lck, [&] {return parts[part_id].next_block_no == block_no; });
+
+	read_id = parts[part_id].read_id;
+	valid_read_id = parts[part_id].valid_read_id;
+}
+
+// *********************************************************************************************
+void CReadIdSequencer::Release(int part_id, uint64_t no_reads, uint64_t no_valid_reads)
+{
+	lock_guard<mutex> lck(mtx);
+
+	auto& part = parts[part_id];
+
+	++part.next_block_no;
+	part.read_id += no_reads;
+	part.valid_read_id += no_valid_reads;
+
+	cv.notify_all();
+}
+
+// EOF
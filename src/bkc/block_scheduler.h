@@ -0,0 +1,68 @@
+#pragma once
+
+#include <cinttypes>
+#include <vector>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include "fq_reader.h"
+
+using namespace std;
+
+// *********************************************************************************************
+// Blocks of all reading threads available to all parsing threads (a lane per reading thread)
+// A parser takes blocks from its own lane and, when it is empty, steals the oldest block of the longest lane,
+// so a large or slow input does not leave the remaining parsers idle
+// Blocks of a lane are always taken in the order they were pushed
+class CBlockScheduler
+{
+	mutex mtx;
+	condition_variable cv_push;
+	condition_variable cv_pop;
+
+	vector<deque<input_block_t>> lanes;
+	vector<bool> completed;
+	int no_active_lanes;
+	size_t lane_capacity;
+	bool allow_stealing;
+	uint64_t no_stolen_blocks = 0;
+
+	int find_lane(int lane_id) const;
+
+public:
+	CBlockScheduler(int no_lanes, size_t lane_capacity, bool allow_stealing);
+
+	void Push(int lane_id, input_block_t&& block);
+	void MarkCompleted(int lane_id);
+	bool Pop(int lane_id, input_block_t& block);		// false when there are no more blocks for the parser
+
+	bool AllowStealing() const { return allow_stealing; }
+	uint64_t NoStolenBlocks();
+};
+
+// *********************************************************************************************
+// Assigns read ids to blocks of file parts when they are processed by many parsers
+// Blocks are numbered within parts by reading threads and a parser waits only until the preceding block
+// of the part has been counted, so the read numbering is the same as in a sequential pass
+class CReadIdSequencer
+{
+	struct part_state_t
+	{
+		uint64_t next_block_no;
+		uint64_t read_id;
+		uint64_t valid_read_id;
+	};
+
+	mutex mtx;
+	condition_variable cv;
+	vector<part_state_t> parts;
+
+public:
+	void Reset(const vector<file_part_t>& file_parts);
+
+	// Acquire gives the ids of the 1st read of the block, Release must follow with the no. of reads (and valid reads) in the block
+	void Acquire(int part_id, uint64_t block_no, uint64_t& read_id, uint64_t& valid_read_id);
+	void Release(int part_id, uint64_t no_reads, uint64_t no_valid_reads);
+};
+
+// EOF
@@ -0,0 +1,71 @@
+#include <algorithm>
+#include <thread>
+#include "cbc_correction.h"
+
+// *********************************************************************************************
+// Both arrays are sorted at once (any no. of threads larger than 1 is enough)
+void CCbcCorrectionIndex::Build(const vector<pair<uint64_t, cbc_t>>& trusted, uint32_t _cbc_len, int no_threads)
+{
+	Clear();
+
+	cbc_len = _cbc_len;
+	suffix_bits = 2 * (cbc_len / 2);
+	prefix_bits = 2 * cbc_len - suffix_bits;
+	suffix_mask = (1ull << suffix_bits) - 1;
+
+	by_prefix.reserve(trusted.size());
+	by_suffix.reserve(trusted.size());
+
+	for (const auto& x : trusted)
+	{
+		by_prefix.emplace_back(x.second);
+		by_suffix.emplace_back(swap_halves(x.second));
+	}
+
+	if (no_threads > 1)
+	{
+		thread t([&] {sort(by_suffix.begin(), by_suffix.end()); });
+		sort(by_prefix.begin(), by_prefix.end());
+		t.join();
+	}
+	else
+	{
+		sort(by_prefix.begin(), by_prefix.end());
+		sort(by_suffix.begin(), by_suffix.end());
+	}
+}
+
+// *********************************************************************************************
+void CCbcCorrectionIndex::Clear()
+{
+	vector<cbc_t>().swap(by_prefix);
+	vector<cbc_t>().swap(by_suffix);
+}
+
+// *********************************************************************************************
+// Items of arr sharing the bits above low_bits with the query are compared with it
+void CCbcCorrectionIndex::scan(const vector<cbc_t>& arr, cbc_t query, uint32_t low_bits, vector<cbc_t>& neighbours)
+{
+	cbc_t first = (query >> low_bits) << low_bits;
+	cbc_t last = first + ((1ull << low_bits) - 1);
+
+	for (auto p = lower_bound(arr.begin(), arr.end(), first); p != arr.end() && *p <= last; ++p)
+		if (is_neighbour(*p, query))
+			neighbours.emplace_back(*p);
+}
+
+// *********************************************************************************************
+// Each neighbour differs from the query in a single half, so it is found in exactly one of the arrays
+void CCbcCorrectionIndex::FindNeighbours(cbc_t cbc, vector<cbc_t>& neighbours) const
+{
+	scan(by_prefix, cbc, suffix_bits, neighbours);
+
+	size_t no_found = neighbours.size();
+
+	scan(by_suffix, swap_halves(cbc), prefix_bits, neighbours);
+
+	for (size_t i = no_found; i < neighbours.size(); ++i)
+		neighbours[i] = unswap_halves(neighbours[i]);
+}
+
+// EOF
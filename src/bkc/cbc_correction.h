@@ -0,0 +1,61 @@
+#pragma once
+
+#include <cinttypes>
+#include <vector>
+#include <utility>
+#include "../common/defs.h"
+
+using namespace std;
+
+// *********************************************************************************************
+// Index of trusted CBCs for finding their neighbours at Hamming distance 1
+// A neighbour of a CBC differs from it in a single base, so it shares either the prefix or the suffix half with it.
+// Trusted CBCs are sorted twice: as they are (so by the prefix half) and with swapped halves (so by the suffix half).
+// A query is a binary search and a short scan in each array, so the index takes 2 words per trusted CBC
+// (instead of 4 * cbc_len hash map entries) and can be queried by many threads at once
+class CCbcCorrectionIndex
+{
+	uint32_t cbc_len = 0;
+	uint32_t suffix_bits = 0;
+	uint32_t prefix_bits = 0;
+	cbc_t suffix_mask = 0;
+
+	vector<cbc_t> by_prefix;
+	vector<cbc_t> by_suffix;			// CBCs with swapped halves
+
+	cbc_t swap_halves(cbc_t x) const { return ((x & suffix_mask) << prefix_bits) | (x >> suffix_bits); }
+	cbc_t unswap_halves(cbc_t x) const { return ((x & ((1ull << prefix_bits) - 1)) << suffix_bits) | (x >> prefix_bits); }
+
+	static bool is_neighbour(cbc_t x, cbc_t y)
+	{
+		cbc_t diff = x ^ y;
+		diff = (diff | (diff >> 1)) & 0x5555555555555555ull;
+
+		return diff && !(diff & (diff - 1));
+	}
+
+	static void scan(const vector<cbc_t>& arr, cbc_t query, uint32_t low_bits, vector<cbc_t>& neighbours);
+
+public:
+	void Build(const vector<pair<uint64_t, cbc_t>>& trusted, uint32_t _cbc_len, int no_threads);
+	void Clear();
+
+	// Trusted CBCs at Hamming distance 1 from cbc (appended to neighbours)
+	void FindNeighbours(cbc_t cbc, vector<cbc_t>& neighbours) const;
+
+	// Position (in the read) of the only base in which neighbours differ
+	uint32_t MismatchPos(cbc_t x, cbc_t y) const
+	{
+		cbc_t diff = x ^ y;
+		uint32_t i = 0;
+
+		while (!(diff & (3ull << (2 * i))))
+			++i;
+
+		return cbc_len - 1 - i;
+	}
+
+	size_t Size() const { return (by_prefix.size() + by_suffix.size()) * sizeof(cbc_t); }
+};
+
+// EOF
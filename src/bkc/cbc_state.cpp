@@ -0,0 +1,200 @@
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include "cbc_state.h"
+
+const char CCbcState::MAGIC[8] = { 'B', 'K', 'C', 'S', 'T', 'A', 'T', 0 };
+
+// *********************************************************************************************
+bool CCbcState::Save(const string& file_name, uint32_t cbc_len, uint32_t umi_len, const vector<string>& cbc_file_names,
+	const vector<CRankBitVector>& valid_reads, const vector<pair<cbc_t, const vector<uint64_t>*>>& cbc_read_ids,
+	const vector<correction_t>& cbc_corrections)
+{
+	string names;
+	for (const auto& x : cbc_file_names)
+		names += x + "\n";
+
+	header_t header{};
+	memcpy(header.magic, MAGIC, sizeof(MAGIC));
+	header.version = VERSION;
+	header.cbc_len = cbc_len;
+	header.umi_len = umi_len;
+	header.no_files = (uint32_t) valid_reads.size();
+	header.no_cbcs = cbc_read_ids.size();
+	header.no_corrections = cbc_corrections.size();
+	header.names_len = names.size();
+
+	for (const auto& x : cbc_read_ids)
+		header.no_read_ids += x.second->size();
+
+	ofstream ofs(file_name, ios::binary);
+
+	auto write = [&](const void* data, uint64_t size) {
+		ofs.write((const char*) data, (streamsize) size);
+	};
+
+	write(&header, sizeof(header));
+
+	for (const auto& x : valid_reads)
+	{
+		file_desc_t desc{ x.Size(), x.NoSet() };
+		write(&desc, sizeof(desc));
+	}
+
+	for (const auto& x : cbc_read_ids)
+	{
+		cbc_desc_t desc{ x.first, x.second->size() };
+		write(&desc, sizeof(desc));
+	}
+
+	write(cbc_corrections.data(), cbc_corrections.size() * sizeof(correction_t));
+
+	for (const auto& x : cbc_read_ids)
+		write(x.second->data(), x.second->size() * sizeof(uint64_t));
+
+	for (const auto& x : valid_reads)
+		write(x.Words(), bit_vector_words(x.Size()) * sizeof(uint64_t));
+
+	names.resize(names_words(names.size()) * 8, 0);
+	write(names.data(), names.size());
+
+	if (!ofs)
+	{
+		cerr << "Error: Cannot write CBC state file: " << file_name << endl;
+		return false;
+	}
+
+	return true;
+}
+
+// *********************************************************************************************
+bool CCbcState::Load(const string& file_name)
+{
+	if (mapped.Open(file_name))
+		return attach((const uint64_t*) mapped.Data(), mapped.Size() / sizeof(uint64_t), file_name);
+
+	// Files cannot be mapped under Windows
+	ifstream ifs(file_name, ios::binary | ios::ate);
+	if (!ifs)
+	{
+		cerr << "Error: Cannot open CBC state file: " << file_name << endl;
+		return false;
+	}
+
+	uint64_t size = (uint64_t) ifs.tellg();
+	ifs.seekg(0);
+
+	owned.resize(size / sizeof(uint64_t));
+	ifs.read((char*) owned.data(), owned.size() * sizeof(uint64_t));
+
+	return attach(owned.data(), owned.size(), file_name);
+}
+
+// *********************************************************************************************
+bool CCbcState::attach(const uint64_t* data, uint64_t no_words, const string& file_name)
+{
+	uint64_t header_words = sizeof(header_t) / sizeof(uint64_t);
+
+	if (no_words < header_words || memcmp(data, MAGIC, sizeof(MAGIC)) != 0)
+	{
+		cerr << "Error: " << file_name << " is not a CBC state file" << endl;
+		return false;
+	}
+
+	memcpy(&header, data, sizeof(header));
+
+	if (header.version != VERSION)
+	{
+		cerr << "Error: Unsupported version of CBC state file: " << file_name << endl;
+		return false;
+	}
+
+	const uint64_t* p = data + header_words;
+	const uint64_t* end = data + no_words;
+
+	bool ok = true;
+
+	// Sizes are checked before the views are taken, so a truncated file is reported instead of read out of bounds
+	// (counts come from the file, so they are compared with the remaining words before multiplying)
+	auto take = [&](uint64_t count, uint64_t item_words) {
+		const uint64_t* q = p;
+
+		if (!ok || (uint64_t) (end - p) / item_words < count)
+			ok = false;
+		else
+			p += count * item_words;
+
+		return q;
+	};
+
+	files = (const file_desc_t*) take(header.no_files, sizeof(file_desc_t) / sizeof(uint64_t));
+	if (!ok)
+	{
+		cerr << "Error: Corrupted CBC state file: " << file_name << endl;
+		return false;
+	}
+
+	uint64_t no_bit_words = 0;
+	file_offsets.resize(header.no_files);
+
+	for (uint32_t i = 0; i < header.no_files; ++i)
+	{
+		file_offsets[i] = no_bit_words;
+		uint64_t words = bit_vector_words(files[i].no_reads);
+
+		if (words > no_words - no_bit_words)
+		{
+			cerr << "Error: Corrupted CBC state file: " << file_name << endl;
+			return false;
+		}
+
+		no_bit_words += words;
+	}
+
+	cbcs = (const cbc_desc_t*) take(header.no_cbcs, sizeof(cbc_desc_t) / sizeof(uint64_t));
+	corrections = (const correction_t*) take(header.no_corrections, sizeof(correction_t) / sizeof(uint64_t));
+	read_ids = take(header.no_read_ids, 1);
+	bit_words = take(no_bit_words, 1);
+	const char* names = (const char*) take(names_words(header.names_len), 1);
+
+	if (!ok || p != end)
+	{
+		cerr << "Error: Corrupted CBC state file: " << file_name << endl;
+		return false;
+	}
+
+	uint64_t no_read_ids = 0;
+	cbc_offsets.resize(header.no_cbcs);
+
+	for (uint64_t i = 0; i < header.no_cbcs; ++i)
+	{
+		cbc_offsets[i] = no_read_ids;
+
+		if (cbcs[i].no_read_ids > header.no_read_ids - no_read_ids)
+			break;
+
+		no_read_ids += cbcs[i].no_read_ids;
+	}
+
+	if (no_read_ids != header.no_read_ids)
+	{
+		cerr << "Error: Corrupted CBC state file: " << file_name << endl;
+		return false;
+	}
+
+	file_names.clear();
+
+	for (uint64_t i = 0; i < header.names_len; )
+	{
+		uint64_t j = i;
+		while (j < header.names_len && names[j] != '\n')
+			++j;
+
+		file_names.emplace_back(names + i, names + j);
+		i = j + 1;
+	}
+
+	return true;
+}
+
+// EOF
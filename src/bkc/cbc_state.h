@@ -0,0 +1,104 @@
+#pragma once
+
+#include <cinttypes>
+#include <string>
+#include <vector>
+#include "../common/defs.h"
+#include "fq_reader.h"
+#include "rank_bit_vector.h"
+
+using namespace std;
+
+// *********************************************************************************************
+// Results of the 1st pass necessary in the following ones, so the 1st pass can be skipped in later runs for the same sample:
+// reads retained for each CBC (ids after relabelling), bit vectors of valid reads of each file and corrections of CBCs
+// The binary form is a sequence of 64-bit words (header, descriptors of files, CBCs and corrections, read ids, bit vectors
+// and names of CBC files), which is mapped into memory, so the counter copies the data straight from the views.
+class CCbcState
+{
+	static const char MAGIC[8];
+	static const uint32_t VERSION = 1;
+
+	struct header_t
+	{
+		char magic[8];
+		uint32_t version;
+		uint32_t cbc_len;
+		uint32_t umi_len;
+		uint32_t no_files;
+		uint64_t no_cbcs;
+		uint64_t no_read_ids;
+		uint64_t no_corrections;
+		uint64_t names_len;				// in bytes (names are separated by '\n')
+	};
+
+public:
+	struct file_desc_t
+	{
+		uint64_t no_reads;				// size of the bit vector
+		uint64_t no_valid_reads;
+	};
+
+	struct cbc_desc_t
+	{
+		cbc_t cbc;
+		uint64_t no_read_ids;
+	};
+
+	struct correction_t
+	{
+		cbc_t from;
+		cbc_t to;
+	};
+
+private:
+	header_t header{};
+
+	// Views into the mapped file (or owned memory)
+	const file_desc_t* files = nullptr;
+	const cbc_desc_t* cbcs = nullptr;
+	const correction_t* corrections = nullptr;
+	const uint64_t* read_ids = nullptr;
+	const uint64_t* bit_words = nullptr;
+	vector<uint64_t> cbc_offsets;			// of read ids of CBCs
+	vector<uint64_t> file_offsets;			// of words of bit vectors
+	vector<string> file_names;
+
+	CMappedFile mapped;
+	vector<uint64_t> owned;
+
+	bool attach(const uint64_t* data, uint64_t no_words, const string& file_name);
+	static uint64_t bit_vector_words(uint64_t no_reads) { return no_reads / 64 + 1; }
+	static uint64_t names_words(uint64_t names_len) { return names_len / 8 + (names_len % 8 != 0); }
+
+public:
+	CCbcState() = default;
+	CCbcState(const CCbcState&) = delete;
+	CCbcState& operator=(const CCbcState&) = delete;
+
+	// CBCs are given as (CBC, read ids) pairs, valid_reads must have their ranks built
+	static bool Save(const string& file_name, uint32_t cbc_len, uint32_t umi_len, const vector<string>& cbc_file_names,
+		const vector<CRankBitVector>& valid_reads, const vector<pair<cbc_t, const vector<uint64_t>*>>& cbc_read_ids,
+		const vector<correction_t>& cbc_corrections);
+
+	bool Load(const string& file_name);
+
+	uint32_t CbcLen() const { return header.cbc_len; }
+	uint32_t UmiLen() const { return header.umi_len; }
+
+	uint32_t NoFiles() const { return header.no_files; }
+	const vector<string>& FileNames() const { return file_names; }
+	const file_desc_t& File(size_t i) const { return files[i]; }
+	const uint64_t* BitVectorWords(size_t i) const { return bit_words + file_offsets[i]; }
+
+	uint64_t NoCbcs() const { return header.no_cbcs; }
+	const cbc_desc_t& Cbc(size_t i) const { return cbcs[i]; }
+	const uint64_t* CbcReadIds(size_t i) const { return read_ids + cbc_offsets[i]; }
+
+	uint64_t NoCorrections() const { return header.no_corrections; }
+	const correction_t& Correction(size_t i) const { return corrections[i]; }
+
+	bool IsMapped() const { return mapped.Data() != nullptr; }
+};
+
+// EOF
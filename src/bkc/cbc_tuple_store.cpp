@@ -0,0 +1,541 @@
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <thread>
+#include <iostream>
+#include "cbc_tuple_store.h"
+
+// *********************************************************************************************
+static int fseek_64(FILE* f, uint64_t pos)
+{
+#ifdef _WIN32
+	return _fseeki64(f, (int64_t) pos, SEEK_SET);
+#else
+	return fseek(f, (long) pos, SEEK_SET);
+#endif
+}
+
+// *********************************************************************************************
+// In-place MSD radix sort (American flag sort) by 8-bit digits (no_bits lowest bits are not sorted yet)
+// digit(x, pos, len) gives len bits of x starting at pos, ranges of at most small_range items are sorted by std::sort
+template<typename T, typename DIGIT>
+static void msd_radix_sort(T* first, T* last, uint32_t no_bits, size_t small_range, DIGIT digit)
+{
+	if (no_bits == 0 || last - first <= (ptrdiff_t) small_range)
+	{
+		sort(first, last);
+		return;
+	}
+
+	uint32_t digit_bits = min(no_bits, 8u);
+	uint32_t shift = no_bits - digit_bits;
+	size_t no_digits = 1ull << digit_bits;
+
+	array<size_t, 257> starts{};
+
+	for (auto p = first; p != last; ++p)
+		++starts[digit(*p, shift, digit_bits) + 1];
+
+	for (size_t i = 1; i <= no_digits; ++i)
+		starts[i] += starts[i - 1];
+
+	array<size_t, 256> heads;
+	copy_n(starts.begin(), heads.size(), heads.begin());
+
+	for (size_t d = 0; d < no_digits; ++d)
+		while (heads[d] < starts[d + 1])
+		{
+			size_t t = digit(first[heads[d]], shift, digit_bits);
+
+			if (t == d)
+				++heads[d];
+			else
+				swap(first[heads[d]], first[heads[t]++]);
+		}
+
+	for (size_t d = 0; d < no_digits; ++d)
+		if (starts[d + 1] - starts[d] > 1)
+			msd_radix_sort(first + starts[d], first + starts[d + 1], shift, small_range, digit);
+}
+
+// *********************************************************************************************
+// Read numbers get 32 bits (as in encode_read_id) if possible, so they are narrower only for (very) many input files
+bool CTupleLayout::Set(uint32_t cbc_suffix_len, uint32_t umi_len, uint32_t no_files)
+{
+	cbc_bits = 2 * cbc_suffix_len;
+	umi_bits = 2 * umi_len;
+
+	file_bits = 0;
+	while ((1ull << file_bits) < no_files)
+		++file_bits;
+
+	uint32_t used_bits = cbc_bits + umi_bits + file_bits;
+
+	if (used_bits + MIN_READ_NO_BITS > MAX_BITS)
+		return false;
+
+	read_no_bits = min(32u, MAX_BITS - used_bits);
+
+	uint32_t cbc_pos = read_no_bits + file_bits + umi_bits;
+
+	hi_umi_read_mask = cbc_pos > 64 ? (uint32_t) ((1ull << (cbc_pos - 64)) - 1) : 0;
+	low_umi_read_mask = cbc_pos >= 64 ? ~0ull : (1ull << cbc_pos) - 1;
+
+	return true;
+}
+
+// *********************************************************************************************
+//
+// *********************************************************************************************
+
+// *********************************************************************************************
+void CTupleMerger::Reset(const vector<cbc_group_t>& groups, uint64_t umi_from, uint64_t umi_to)
+{
+	no_leaves = 1;
+	while (no_leaves < (int) groups.size())
+		no_leaves *= 2;
+
+	heads.assign(no_leaves, nullptr);
+	ends.assign(no_leaves, nullptr);
+	losers.assign(no_leaves, -1);
+
+	for (size_t i = 0; i < groups.size(); ++i)
+	{
+		heads[i] = partition_point(groups[i].first, groups[i].last, [&](const packed_tuple_t& x) {return layout.Umi(x) < umi_from; });
+		ends[i] = partition_point(heads[i], groups[i].last, [&](const packed_tuple_t& x) {return layout.Umi(x) < umi_to; });
+	}
+
+	winner = play(1);
+}
+
+// *********************************************************************************************
+// Returns the winner of the subtree (losers are stored in its internal nodes)
+int CTupleMerger::play(int node)
+{
+	if (node >= no_leaves)
+		return node - no_leaves;
+
+	int left = play(2 * node);
+	int right = play(2 * node + 1);
+
+	if (less(right, left))
+	{
+		losers[node] = left;
+		return right;
+	}
+
+	losers[node] = right;
+	return left;
+}
+
+// *********************************************************************************************
+//
+// *********************************************************************************************
+
+// *********************************************************************************************
+CCbcTupleBuckets::CCbcTupleBuckets(const CTupleLayout& layout, uint32_t cbc_len) :
+	layout(layout),
+	shift(2 * cbc_len - CCbcTupleStore::NoPrefixBits(cbc_len)),
+	suffix_mask((1ull << shift) - 1),
+	buckets(1ull << CCbcTupleStore::NoPrefixBits(cbc_len)),
+	rest_buckets(1ull << CCbcTupleStore::NoPrefixBits(cbc_len))
+{}
+
+// *********************************************************************************************
+//
+// *********************************************************************************************
+
+// *********************************************************************************************
+bool CCbcTupleStore::Reset(uint32_t _cbc_len, uint32_t umi_len, uint32_t no_files)
+{
+	Clear();
+
+	cbc_len = _cbc_len;
+	rest_counts.resize(1ull << NoPrefixBits(cbc_len));
+
+	return layout.Set(cbc_len - NoPrefixBits(cbc_len) / 2, umi_len, no_files);
+}
+
+// *********************************************************************************************
+void CCbcTupleStore::Add(CCbcTupleBuckets&& local_buckets)
+{
+	lock_guard<mutex> lck(mtx);
+
+	thread_buckets.emplace_back(move(local_buckets));
+}
+
+// *********************************************************************************************
+void CCbcTupleStore::Clear()
+{
+	thread_buckets.clear();
+	thread_buckets.shrink_to_fit();
+	buckets.clear();
+	buckets.shrink_to_fit();
+	groups.clear();
+	groups.shrink_to_fit();
+
+	for (auto& run : runs)
+		remove(run.file_name.c_str());
+	runs.clear();
+	no_run_files = 0;
+	spilled_bucket_sizes.clear();
+	unordered_map<cbc_t, uint64_t>().swap(spilled_stats);
+	ReleaseRestCounts();
+
+	no_tuples = 0;
+	no_groups = 0;
+}
+
+// *********************************************************************************************
+// Packed tuples are sorted by their no_bits lowest bits
+void CCbcTupleStore::radix_sort(packed_tuple_t* first, packed_tuple_t* last, uint32_t no_bits)
+{
+	msd_radix_sort(first, last, no_bits, SMALL_RANGE, [&](const packed_tuple_t& x, uint32_t pos, uint32_t len) {
+		return layout.Bits(x, pos, len);
+		});
+}
+
+// *********************************************************************************************
+// Moves the tuples of the bucket from all threads into a single vector
+void CCbcTupleStore::gather_bucket(size_t bucket_id)
+{
+	size_t size = 0;
+
+	for (auto& tb : thread_buckets)
+		size += tb.buckets[bucket_id].size();
+
+	auto& bucket = buckets[bucket_id];
+	bucket.reserve(size);
+
+	for (auto& tb : thread_buckets)
+	{
+		auto& src = tb.buckets[bucket_id];
+
+		bucket.insert(bucket.end(), src.begin(), src.end());
+		vector<packed_tuple_t>().swap(src);
+	}
+}
+
+// *********************************************************************************************
+// Suffixes of CBCs of the bucket are sorted and counted (counts are appended in the order of CBCs), the suffixes are released
+void CCbcTupleStore::count_rest(size_t bucket_id, vector<cbc_t>& cbc_suffixes, vector<pair<cbc_t, uint64_t>>& counts)
+{
+	uint32_t suffix_bits = 2 * cbc_len - NoPrefixBits(cbc_len);
+
+	msd_radix_sort(cbc_suffixes.data(), cbc_suffixes.data() + cbc_suffixes.size(), suffix_bits, SMALL_RANGE, [](cbc_t x, uint32_t pos, uint32_t len) {
+		return (x >> pos) & ((1ull << len) - 1);
+		});
+
+	for (size_t i = 0; i < cbc_suffixes.size(); )
+	{
+		size_t j = i + 1;
+
+		while (j < cbc_suffixes.size() && cbc_suffixes[j] == cbc_suffixes[i])
+			++j;
+
+		counts.emplace_back(((cbc_t) bucket_id << suffix_bits) + cbc_suffixes[i], j - i);
+		i = j;
+	}
+
+	vector<cbc_t>().swap(cbc_suffixes);
+}
+
+// *********************************************************************************************
+// Both vectors are sorted by CBC, counts of the same CBCs are summed
+void CCbcTupleStore::merge_rest(vector<pair<cbc_t, uint64_t>>& dest, const vector<pair<cbc_t, uint64_t>>& src)
+{
+	if (src.empty())
+		return;
+
+	vector<pair<cbc_t, uint64_t>> merged;
+	merged.reserve(dest.size() + src.size());
+
+	auto p = dest.begin();
+	auto q = src.begin();
+
+	while (p != dest.end() || q != src.end())
+		if (q == src.end() || (p != dest.end() && p->first < q->first))
+			merged.emplace_back(*p++);
+		else if (p == dest.end() || q->first < p->first)
+			merged.emplace_back(*q++);
+		else
+		{
+			merged.emplace_back(p->first, p->second + q->second);
+			++p;
+			++q;
+		}
+
+	dest.swap(merged);
+}
+
+// *********************************************************************************************
+uint64_t CCbcTupleStore::NoRestCbcs() const
+{
+	uint64_t r = 0;
+
+	for (const auto& x : rest_counts)
+		r += x.size();
+
+	return r;
+}
+
+// *********************************************************************************************
+void CCbcTupleStore::ReleaseRestCounts()
+{
+	for (auto& x : rest_counts)
+		vector<pair<cbc_t, uint64_t>>().swap(x);
+}
+
+// *********************************************************************************************
+void CCbcTupleStore::find_groups(size_t bucket_id, const vector<packed_tuple_t>& bucket, vector<cbc_group_t>& bucket_groups)
+{
+	uint32_t suffix_bits = 2 * cbc_len - NoPrefixBits(cbc_len);
+
+	for (size_t i = 0; i < bucket.size(); )
+	{
+		cbc_t cbc_suffix = layout.CbcSuffix(bucket[i]);
+		size_t j = i + 1;
+
+		while (j < bucket.size() && layout.CbcSuffix(bucket[j]) == cbc_suffix)
+			++j;
+
+		bucket_groups.emplace_back(cbc_group_t{ ((cbc_t) bucket_id << suffix_bits) + cbc_suffix, bucket.data() + i, bucket.data() + j });
+		i = j;
+	}
+}
+
+// *********************************************************************************************
+// Buckets are processed independently, so they are distributed among threads
+void CCbcTupleStore::Finalize(int no_threads)
+{
+	if (IsSpilled())
+	{
+		finalize_spilled(no_threads);
+		return;
+	}
+
+	size_t no_buckets = 1ull << NoPrefixBits(cbc_len);
+
+	buckets.resize(no_buckets);
+	groups.resize(no_buckets);
+
+	atomic<size_t> bucket_id{ 0 };
+	vector<thread> threads;
+
+	threads.reserve(no_threads);
+
+	for (int i = 0; i < no_threads; ++i)
+		threads.emplace_back([&] {
+			while (true)
+			{
+				size_t id = bucket_id.fetch_add(1);
+				if (id >= no_buckets)
+					break;
+
+				gather_bucket(id);
+
+				vector<cbc_t> rest;
+				size_t no_rest = 0;
+				for (auto& tb : thread_buckets)
+					no_rest += tb.rest_buckets[id].size();
+				rest.reserve(no_rest);
+
+				for (auto& tb : thread_buckets)
+				{
+					rest.insert(rest.end(), tb.rest_buckets[id].begin(), tb.rest_buckets[id].end());
+					vector<cbc_t>().swap(tb.rest_buckets[id]);
+				}
+				count_rest(id, rest, rest_counts[id]);
+
+				auto& bucket = buckets[id];
+				radix_sort(bucket.data(), bucket.data() + bucket.size(), layout.KeyBits());
+
+				find_groups(id, bucket, groups[id]);
+				groups[id].shrink_to_fit();
+			}
+		});
+
+	for (auto& t : threads)
+		t.join();
+
+	thread_buckets.clear();
+
+	no_tuples = 0;
+	no_groups = 0;
+
+	for (size_t i = 0; i < no_buckets; ++i)
+	{
+		no_tuples += buckets[i].size();
+		no_groups += groups[i].size();
+	}
+}
+
+// *********************************************************************************************
+//
+// *********************************************************************************************
+
+// *********************************************************************************************
+void CCbcTupleStore::SetSpilling(const string& _spill_prefix, size_t _spill_budget)
+{
+	spill_prefix = _spill_prefix;
+	spill_budget = _spill_budget;
+}
+
+// *********************************************************************************************
+size_t CCbcTupleStore::NoRuns()
+{
+	lock_guard<mutex> lck(mtx);
+
+	return runs.size();
+}
+
+// *********************************************************************************************
+// Buckets are sorted and written one after another to a new run file, and tuples of each CBC are counted on the way
+// (so statistics of CBCs are known without reading the runs)
+void CCbcTupleStore::Spill(CCbcTupleBuckets& local_buckets, bool count_cbcs)
+{
+	size_t no_buckets = local_buckets.buckets.size();
+	uint32_t suffix_bits = 2 * cbc_len - NoPrefixBits(cbc_len);
+
+	spill_run_t run;
+	vector<pair<cbc_t, uint64_t>> cbc_counts;
+	vector<vector<pair<cbc_t, uint64_t>>> bucket_rest_counts(no_buckets);
+
+	{
+		lock_guard<mutex> lck(mtx);
+		run.file_name = spill_prefix + ".tuples_" + to_string(no_run_files++) + ".bin";
+	}
+
+	FILE* f = fopen(run.file_name.c_str(), "wb");
+	if (!f)
+	{
+		cerr << "Error: Cannot create file " + run.file_name + "\n";
+		exit(1);
+	}
+
+	setvbuf(f, nullptr, _IOFBF, 1 << 22);
+
+	run.offsets.assign(no_buckets + 1, 0);
+
+	for (size_t i = 0; i < no_buckets; ++i)
+	{
+		auto& bucket = local_buckets.buckets[i];
+
+		radix_sort(bucket.data(), bucket.data() + bucket.size(), layout.KeyBits());
+
+		if (count_cbcs)
+			for (size_t j = 0; j < bucket.size(); )
+			{
+				cbc_t cbc_suffix = layout.CbcSuffix(bucket[j]);
+				size_t k = j + 1;
+
+				while (k < bucket.size() && layout.CbcSuffix(bucket[k]) == cbc_suffix)
+					++k;
+
+				cbc_counts.emplace_back(((cbc_t) i << suffix_bits) + cbc_suffix, k - j);
+				j = k;
+			}
+
+		if (!bucket.empty() && fwrite(bucket.data(), sizeof(packed_tuple_t), bucket.size(), f) != bucket.size())
+		{
+			cerr << "Error: Cannot write to file " + run.file_name + "\n";
+			exit(1);
+		}
+
+		run.offsets[i + 1] = run.offsets[i] + bucket.size();
+		bucket.clear();
+
+		count_rest(i, local_buckets.rest_buckets[i], bucket_rest_counts[i]);
+	}
+
+	fclose(f);
+	local_buckets.no_tuples = 0;
+	local_buckets.no_rest = 0;
+
+	lock_guard<mutex> lck(mtx);
+
+	if (spilled_bucket_sizes.empty())
+		spilled_bucket_sizes.assign(no_buckets, 0);
+
+	for (size_t i = 0; i < no_buckets; ++i)
+		spilled_bucket_sizes[i] += run.offsets[i + 1] - run.offsets[i];
+
+	for (auto& x : cbc_counts)
+		spilled_stats[x.first] += x.second;
+
+	for (size_t i = 0; i < no_buckets; ++i)
+		merge_rest(rest_counts[i], bucket_rest_counts[i]);
+
+	runs.emplace_back(move(run));
+}
+
+// *********************************************************************************************
+// Tuples not spilled yet are spilled too, so all buckets are in the runs
+void CCbcTupleStore::finalize_spilled(int no_threads)
+{
+	atomic<size_t> tb_id{ 0 };
+	vector<thread> threads;
+
+	for (int i = 0; i < no_threads; ++i)
+		threads.emplace_back([&] {
+			while (true)
+			{
+				size_t id = tb_id.fetch_add(1);
+				if (id >= thread_buckets.size())
+					break;
+
+				if (!thread_buckets[id].Empty())
+					Spill(thread_buckets[id]);
+			}
+		});
+
+	for (auto& t : threads)
+		t.join();
+
+	thread_buckets.clear();
+
+	groups.clear();
+	groups.resize(1ull << NoPrefixBits(cbc_len));
+
+	no_tuples = 0;
+	for (auto x : spilled_bucket_sizes)
+		no_tuples += x;
+
+	no_groups = spilled_stats.size();
+}
+
+// *********************************************************************************************
+FILE* CCbcTupleStore::open_run(size_t run_id, size_t bucket_id, uint64_t& first, uint64_t& last)
+{
+	string file_name;
+	{
+		lock_guard<mutex> lck(mtx);
+		file_name = runs[run_id].file_name;
+		first = runs[run_id].offsets[bucket_id];
+		last = runs[run_id].offsets[bucket_id + 1];
+	}
+
+	FILE* f = fopen(file_name.c_str(), "rb");
+
+	if (!f || fseek_64(f, first * sizeof(packed_tuple_t)) != 0)
+	{
+		cerr << "Error: Cannot read file " + file_name + "\n";
+		exit(1);
+	}
+
+	return f;
+}
+
+// *********************************************************************************************
+void CCbcTupleStore::read_tuples(FILE* f, size_t count, vector<packed_tuple_t>& dest)
+{
+	dest.resize(count);
+
+	if (fread(dest.data(), sizeof(packed_tuple_t), count, f) != count)
+	{
+		cerr << "Error: Cannot read spilled tuples\n";
+		exit(1);
+	}
+}
+
+// EOF
@@ -0,0 +1,416 @@
+#pragma once
+
+#include <cinttypes>
+#include <cstdio>
+#include <vector>
+#include <string>
+#include <mutex>
+#include <map>
+#include <unordered_map>
+#include "../common/defs.h"
+
+using namespace std;
+
+// *********************************************************************************************
+// (CBC, UMI, read id) tuple collected in the 1st pass, packed into a 96-bit number (three 32-bit words, so 12 bytes)
+// Fields (from the most significant bits): CBC suffix (CBC prefix is the bucket id), UMI, file id, read no.
+// Widths of the fields are set at run time (see CTupleLayout), so comparison of packed tuples gives the order
+// of (CBC, UMI, file id, read no.)
+struct packed_tuple_t
+{
+	uint32_t hi;
+	uint32_t mid;
+	uint32_t lo;
+
+	uint64_t Low() const { return ((uint64_t) mid << 32) | lo; }
+
+	bool operator<(const packed_tuple_t& x) const
+	{
+		return hi != x.hi ? hi < x.hi : Low() < x.Low();
+	}
+};
+
+// *********************************************************************************************
+class CTupleLayout
+{
+	uint32_t read_no_bits = 0;
+	uint32_t file_bits = 0;
+	uint32_t umi_bits = 0;
+	uint32_t cbc_bits = 0;				// CBC suffix only
+	uint32_t hi_umi_read_mask = 0;		// bits below the CBC suffix
+	uint64_t low_umi_read_mask = 0;
+
+	static uint64_t get_bits(const packed_tuple_t& x, uint32_t pos, uint32_t len)
+	{
+		uint64_t mask = (1ull << len) - 1;
+
+		if (pos >= 64)
+			return ((uint64_t) x.hi >> (pos - 64)) & mask;
+		if (pos + len <= 64)
+			return (x.Low() >> pos) & mask;
+
+		return ((x.Low() >> pos) | ((uint64_t) x.hi << (64 - pos))) & mask;
+	}
+
+	static void put_bits(uint64_t& hi, uint64_t& low, uint64_t value, uint32_t pos)
+	{
+		if (pos >= 64)
+			hi |= value << (pos - 64);
+		else
+		{
+			low |= value << pos;
+			if (pos)
+				hi |= value >> (64 - pos);
+		}
+	}
+
+public:
+	static const uint32_t MAX_BITS = 96;
+	static const uint32_t MIN_READ_NO_BITS = 24;
+
+	bool Set(uint32_t cbc_suffix_len, uint32_t umi_len, uint32_t no_files);
+
+	uint32_t KeyBits() const { return cbc_bits + umi_bits + file_bits + read_no_bits; }
+	uint64_t MaxReadNo() const { return (1ull << read_no_bits) - 1; }
+	uint32_t UmiBits() const { return umi_bits; }
+
+	packed_tuple_t Pack(cbc_t cbc_suffix, uint64_t umi, uint64_t file_id, uint64_t read_no) const
+	{
+		uint64_t hi = 0;
+		uint64_t low = read_no;
+
+		put_bits(hi, low, file_id, read_no_bits);
+		put_bits(hi, low, umi, read_no_bits + file_bits);
+		put_bits(hi, low, cbc_suffix, read_no_bits + file_bits + umi_bits);
+
+		return packed_tuple_t{ (uint32_t) hi, (uint32_t) (low >> 32), (uint32_t) low };
+	}
+
+	// Digit of a radix sort, i.e., len bits starting at pos
+	uint64_t Bits(const packed_tuple_t& x, uint32_t pos, uint32_t len) const { return get_bits(x, pos, len); }
+
+	cbc_t CbcSuffix(const packed_tuple_t& x) const { return get_bits(x, read_no_bits + file_bits + umi_bits, cbc_bits); }
+	uint64_t Umi(const packed_tuple_t& x) const { return get_bits(x, read_no_bits + file_bits, umi_bits); }
+	uint64_t FileId(const packed_tuple_t& x) const { return get_bits(x, read_no_bits, file_bits); }
+	uint64_t ReadNo(const packed_tuple_t& x) const { return get_bits(x, 0, read_no_bits); }
+
+	// Order of (UMI, file id, read no.), i.e., CBC is ignored (tuples of different CBCs are merged after correction)
+	bool LessUmiRead(const packed_tuple_t& x, const packed_tuple_t& y) const
+	{
+		uint32_t x_hi = x.hi & hi_umi_read_mask;
+		uint32_t y_hi = y.hi & hi_umi_read_mask;
+
+		return x_hi != y_hi ? x_hi < y_hi : (x.Low() & low_umi_read_mask) < (y.Low() & low_umi_read_mask);
+	}
+};
+
+// *********************************************************************************************
+// Contiguous run of tuples of a single CBC (sorted by UMI and read id)
+struct cbc_group_t
+{
+	cbc_t cbc;
+	const packed_tuple_t* first;
+	const packed_tuple_t* last;
+
+	size_t size() const { return (size_t) (last - first); }
+};
+
+// *********************************************************************************************
+// Part of a bucket loaded at once in the external-memory mode: CBCs in [cbc_from, cbc_to) with UMIs in [umi_from, umi_to)
+// Only a single CBC (larger than the memory limit) is split into ranges of UMIs
+struct bucket_slice_t
+{
+	cbc_t cbc_from = 0;
+	cbc_t cbc_to = ~0ull;
+	uint64_t umi_from = 0;
+	uint64_t umi_to = ~0ull;
+	uint64_t size = 0;					// no. of tuples
+
+	bool IsPartOfCbc() const { return umi_from != 0 || umi_to != ~0ull; }
+	bool IsLastPartOfCbc() const { return umi_to == ~0ull; }
+};
+
+// *********************************************************************************************
+// k-way merge of groups (sorted by UMI and read id) with a loser tree, so a tuple costs log2(k) comparisons
+// Only tuples with UMIs in [umi_from, umi_to) are merged, so a large CBC can be processed in parts by many threads
+class CTupleMerger
+{
+	const CTupleLayout& layout;
+
+	vector<const packed_tuple_t*> heads;
+	vector<const packed_tuple_t*> ends;
+	vector<int> losers;						// internal nodes of the tree (no. of streams is padded to a power of 2)
+	int no_leaves = 0;
+	int winner = -1;
+
+	// Exhausted streams are larger than any other
+	bool less(int i, int j) const
+	{
+		if (heads[i] == ends[i])
+			return false;
+		if (heads[j] == ends[j])
+			return true;
+
+		return layout.LessUmiRead(*heads[i], *heads[j]);
+	}
+
+	int play(int node);
+
+public:
+	CTupleMerger(const CTupleLayout& layout) : layout(layout) {}
+
+	void Reset(const vector<cbc_group_t>& groups, uint64_t umi_from = 0, uint64_t umi_to = ~0ull);
+
+	// Next tuple in the order of (UMI, file id, read no.) or nullptr at the end
+	const packed_tuple_t* Pop()
+	{
+		if (winner < 0 || heads[winner] == ends[winner])
+			return nullptr;
+
+		const packed_tuple_t* x = heads[winner]++;
+		int w = winner;
+
+		for (int node = (w + no_leaves) / 2; node > 0; node /= 2)
+			if (less(losers[node], w))
+				swap(losers[node], w);
+
+		winner = w;
+
+		return x;
+	}
+};
+
+// *********************************************************************************************
+// Tuples appended by a single thread, partitioned by the CBC prefix
+class CCbcTupleBuckets
+{
+	friend class CCbcTupleStore;
+
+	CTupleLayout layout;
+	uint32_t shift;
+	cbc_t suffix_mask;
+	vector<vector<packed_tuple_t>> buckets;
+	vector<vector<cbc_t>> rest_buckets;			// suffixes of CBCs of reads without tuples
+	size_t no_tuples = 0;
+	size_t no_rest = 0;
+
+public:
+	CCbcTupleBuckets(const CTupleLayout& layout, uint32_t cbc_len);
+
+	void Add(cbc_t cbc, uint64_t umi, uint64_t file_id, uint64_t read_no)
+	{
+		buckets[cbc >> shift].emplace_back(layout.Pack(cbc & suffix_mask, umi, file_id, read_no));
+		++no_tuples;
+	}
+
+	// Read of a CBC that is only counted (no tuple is stored, e.g., outside the early whitelist)
+	void AddCbc(cbc_t cbc)
+	{
+		rest_buckets[cbc >> shift].emplace_back(cbc & suffix_mask);
+		++no_rest;
+	}
+
+	size_t Size() const { return no_tuples; }
+	bool Empty() const { return no_tuples == 0 && no_rest == 0; }
+
+	// Memory in tuples (a counted CBC takes 8 bytes, a tuple 12)
+	size_t Footprint() const { return no_tuples + no_rest * sizeof(cbc_t) / sizeof(packed_tuple_t); }
+};
+
+// *********************************************************************************************
+// Flat store of all tuples of the 1st pass, partitioned by the CBC prefix
+// Thread-local buckets are gathered and sorted in place (MSD radix sort of packed tuples) in parallel,
+// so tuples of each CBC are contiguous and no per-CBC containers are necessary
+// With a memory limit, thread-local buckets are sorted and spilled to run files instead (external-memory mode),
+// and a bucket is later loaded (from all runs) and sorted again when it is processed
+// CBCs of reads without tuples are sorted and run-length counted for each bucket (when finalized or spilled)
+class CCbcTupleStore
+{
+	static const size_t SMALL_RANGE = 64;		// sorted by std::sort
+	static const size_t SCAN_CHUNK = 1 << 16;	// tuples read at once from a run
+	static const uint32_t SLICE_UMI_BITS = 16;	// resolution of ranges of UMIs of slices
+
+	// Sorted buckets of a single spill, stored one after another
+	struct spill_run_t
+	{
+		string file_name;
+		vector<uint64_t> offsets;			// in tuples, no_buckets + 1 entries
+	};
+
+	uint32_t cbc_len = 0;
+	CTupleLayout layout;
+
+	mutex mtx;
+	vector<CCbcTupleBuckets> thread_buckets;			// not gathered yet
+	vector<vector<packed_tuple_t>> buckets;
+	vector<vector<cbc_group_t>> groups;
+	uint64_t no_tuples = 0;
+	uint64_t no_groups = 0;
+
+	string spill_prefix;
+	size_t spill_budget = 0;							// tuples of a thread, 0 - no spilling
+	vector<spill_run_t> runs;
+	size_t no_run_files = 0;
+	vector<uint64_t> spilled_bucket_sizes;
+	unordered_map<cbc_t, uint64_t> spilled_stats;		// no. of tuples of each CBC (counted when spilled)
+	vector<vector<pair<cbc_t, uint64_t>>> rest_counts;	// no. of reads of CBCs without tuples (sorted in each bucket)
+
+	void radix_sort(packed_tuple_t* first, packed_tuple_t* last, uint32_t no_bits);
+	void gather_bucket(size_t bucket_id);
+	void count_rest(size_t bucket_id, vector<cbc_t>& cbc_suffixes, vector<pair<cbc_t, uint64_t>>& counts);
+	void merge_rest(vector<pair<cbc_t, uint64_t>>& dest, const vector<pair<cbc_t, uint64_t>>& src);
+	void find_groups(size_t bucket_id, const vector<packed_tuple_t>& bucket, vector<cbc_group_t>& bucket_groups);
+	void finalize_spilled(int no_threads);
+	FILE* open_run(size_t run_id, size_t bucket_id, uint64_t& first, uint64_t& last);
+	void read_tuples(FILE* f, size_t count, vector<packed_tuple_t>& dest);
+
+public:
+	static uint32_t NoPrefixBits(uint32_t cbc_len) { return min(2 * cbc_len, 8u); }
+
+	bool Reset(uint32_t _cbc_len, uint32_t umi_len, uint32_t no_files);
+	void Add(CCbcTupleBuckets&& local_buckets);
+	void Finalize(int no_threads);
+	void Clear();
+	~CCbcTupleStore() { Clear(); }
+
+	const CTupleLayout& Layout() const { return layout; }
+	size_t NoBuckets() const { return groups.size(); }
+	const vector<cbc_group_t>& Groups(size_t bucket_id) const { return groups[bucket_id]; }
+	uint64_t NoTuples() const { return no_tuples; }
+	uint64_t NoGroups() const { return no_groups; }
+
+	// External-memory mode
+	void SetSpilling(const string& _spill_prefix, size_t _spill_budget);
+	bool ShouldSpill(const CCbcTupleBuckets& local_buckets) const { return spill_budget && local_buckets.Footprint() >= spill_budget; }
+	void Spill(CCbcTupleBuckets& local_buckets, bool count_cbcs = true);
+	bool IsSpilled() const { return !runs.empty(); }
+	size_t NoRuns();
+	uint64_t SpilledBucketSize(size_t bucket_id) const { return spilled_bucket_sizes[bucket_id]; }
+	const unordered_map<cbc_t, uint64_t>& SpilledStats() const { return spilled_stats; }
+	void ReleaseSpilledStats() { unordered_map<cbc_t, uint64_t>().swap(spilled_stats); }
+
+	// CBCs of reads without tuples with their no. of reads (after Finalize)
+	const vector<pair<cbc_t, uint64_t>>& RestCounts(size_t bucket_id) const { return rest_counts[bucket_id]; }
+	uint64_t NoRestCbcs() const;
+	void ReleaseRestCounts();
+
+	// Tuples of the bucket (from the first no_runs runs) in chunks, fun(cbc, tuple) is called for each of them
+	template<typename FUN> void ScanBucket(size_t bucket_id, size_t no_runs, FUN fun)
+	{
+		vector<packed_tuple_t> chunk;
+		uint32_t suffix_bits = 2 * cbc_len - NoPrefixBits(cbc_len);
+
+		for (size_t i = 0; i < no_runs; ++i)
+		{
+			uint64_t first, last;
+			FILE* f = open_run(i, bucket_id, first, last);
+
+			for (uint64_t j = first; j < last; j += SCAN_CHUNK)
+			{
+				read_tuples(f, (size_t) min<uint64_t>(SCAN_CHUNK, last - j), chunk);
+				for (const auto& x : chunk)
+					fun(((cbc_t) bucket_id << suffix_bits) + layout.CbcSuffix(x), x);
+			}
+
+			fclose(f);
+		}
+	}
+
+	// Splits the tuples of the bucket (of CBCs accepted by the filter) into slices of at most max_size tuples
+	// CBCs are packed into slices in their order, a larger CBC is split into ranges of UMIs (by a histogram of their highest bits),
+	// so only a single UMI range with more than max_size tuples can exceed the limit
+	template<typename FILTER> void PlanSlices(size_t bucket_id, FILTER filter, uint64_t max_size, vector<bucket_slice_t>& slices)
+	{
+		slices.clear();
+
+		map<cbc_t, uint64_t> cbc_sizes;
+
+		ScanBucket(bucket_id, NoRuns(), [&](cbc_t cbc, const packed_tuple_t& x) {
+			if (filter(cbc))
+				++cbc_sizes[cbc];
+			});
+
+		uint32_t hist_bits = min(layout.UmiBits(), SLICE_UMI_BITS);
+		uint32_t hist_shift = layout.UmiBits() - hist_bits;
+		unordered_map<cbc_t, vector<uint64_t>> umi_hists;
+
+		for (const auto& x : cbc_sizes)
+			if (x.second > max_size)
+				umi_hists[x.first].assign(1ull << hist_bits, 0);
+
+		if (!umi_hists.empty())
+			ScanBucket(bucket_id, NoRuns(), [&](cbc_t cbc, const packed_tuple_t& x) {
+				auto p = umi_hists.find(cbc);
+				if (p != umi_hists.end())
+					++p->second[layout.Umi(x) >> hist_shift];
+				});
+
+		bucket_slice_t slice;
+
+		auto close_slice = [&] {
+			if (slice.size)
+				slices.emplace_back(slice);
+			slice = bucket_slice_t();
+		};
+
+		for (const auto& x : cbc_sizes)
+		{
+			if (x.second <= max_size)
+			{
+				if (slice.size + x.second > max_size)
+					close_slice();
+				if (!slice.size)
+					slice.cbc_from = x.first;
+
+				slice.cbc_to = x.first + 1;
+				slice.size += x.second;
+				continue;
+			}
+
+			close_slice();
+
+			const auto& hist = umi_hists[x.first];
+
+			for (size_t i = 0; i < hist.size(); ++i)
+			{
+				if (slice.size && slice.size + hist[i] > max_size)
+				{
+					slice.umi_to = (uint64_t) i << hist_shift;
+					slices.emplace_back(slice);
+					slice.umi_from = slice.umi_to;
+					slice.size = 0;
+				}
+
+				slice.cbc_from = x.first;
+				slice.cbc_to = x.first + 1;
+				slice.size += hist[i];
+			}
+
+			slice.umi_to = ~0ull;
+			close_slice();
+		}
+
+		close_slice();
+	}
+
+	// Loads tuples of the slice of the bucket (of CBCs accepted by the filter) from all runs, sorts them and finds the groups
+	template<typename FILTER> void LoadSlice(size_t bucket_id, const bucket_slice_t& slice, FILTER filter, vector<packed_tuple_t>& bucket, vector<cbc_group_t>& bucket_groups)
+	{
+		bucket.clear();
+		bucket_groups.clear();
+
+		ScanBucket(bucket_id, NoRuns(), [&](cbc_t cbc, const packed_tuple_t& x) {
+			if (cbc >= slice.cbc_from && cbc < slice.cbc_to && filter(cbc))
+			{
+				uint64_t umi = layout.Umi(x);
+				if (umi >= slice.umi_from && umi < slice.umi_to)
+					bucket.emplace_back(x);
+			}
+			});
+
+		radix_sort(bucket.data(), bucket.data() + bucket.size(), layout.KeyBits());
+		find_groups(bucket_id, bucket, bucket_groups);
+	}
+};
+
+// EOF
@@ -0,0 +1,284 @@
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <filesystem>
+#include <iostream>
+#include "cbc_whitelist.h"
+
+#include <types/kmer.h>
+
+const char CCbcWhitelist::MAGIC[8] = { 'B', 'K', 'C', 'W', 'L', 'S', 'T', 0 };
+
+// *********************************************************************************************
+bool CCbcWhitelist::Load(const string& file_name, technology_t technology, uint32_t _cbc_len)
+{
+	cbc_len = _cbc_len;
+
+	// The file is opened once, as it can be a pipe or FIFO (e.g., a process substitution)
+	ifstream ifs(file_name, ios::binary);
+	if (!ifs)
+	{
+		cerr << "Error: Cannot open predefined CBC file: " << file_name << endl;
+		return false;
+	}
+
+	string data(sizeof(MAGIC), 0);
+	ifs.read(data.data(), data.size());
+	data.resize((size_t) ifs.gcount());
+
+	bool is_binary = data.size() == sizeof(MAGIC) && memcmp(data.data(), MAGIC, sizeof(MAGIC)) == 0;
+
+	// Only regular files are mapped
+	std::error_code ec;
+	if (is_binary && filesystem::is_regular_file(file_name, ec) && mapped.Open(file_name))
+	{
+		mapped.WillNeed(0, mapped.Size());		// probes are random
+		return attach((const uint64_t*) mapped.Data(), mapped.Size() / sizeof(uint64_t), file_name);
+	}
+
+	if (!read_rest(ifs, data))
+	{
+		cerr << "Error: Cannot read predefined CBC file: " << file_name << endl;
+		return false;
+	}
+
+	if (!is_binary)
+	{
+		vector<cbc_t> cbcs;
+
+		if (!parse_text(data, technology, cbcs))
+			return false;
+
+		build(cbcs);
+
+		return attach(owned.data(), owned.size(), file_name);
+	}
+
+	// Streamed binary whitelists and files that cannot be mapped (under Windows)
+	owned.resize(data.size() / sizeof(uint64_t));
+	memcpy(owned.data(), data.data(), owned.size() * sizeof(uint64_t));
+
+	return attach(owned.data(), owned.size(), file_name);
+}
+
+// *********************************************************************************************
+// Reads in chunks until the end of the stream, as the size of a pipe is not known in advance
+bool CCbcWhitelist::read_rest(istream& in, string& dest)
+{
+	vector<char> chunk(1 << 20);
+
+	while (in)
+	{
+		in.read(chunk.data(), chunk.size());
+		dest.append(chunk.data(), (size_t) in.gcount());
+	}
+
+	return !in.bad();
+}
+
+// *********************************************************************************************
+bool CCbcWhitelist::Save(const string& file_name) const
+{
+	ofstream ofs(file_name, ios::binary);
+
+	if (ofs)
+		ofs.write((const char*) image, image_words * sizeof(uint64_t));
+
+	if (!ofs)
+	{
+		cerr << "Error: Cannot write predefined CBC file: " << file_name << endl;
+		return false;
+	}
+
+	return true;
+}
+
+// *********************************************************************************************
+// Tokens are separated by white spaces (as for ifstream >>):
+// - plain: a CBC per token,
+// - Visium: tissue positions, i.e., <CBC>-<suffix>,<in_tissue>,<row>,<col>,<pixel_row>,<pixel_col> (only CBCs in tissue are taken)
+bool CCbcWhitelist::parse_text(const string& text, technology_t technology, vector<cbc_t>& cbcs)
+{
+	auto is_space = [](char c) { return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\v' || c == '\f'; };
+	auto is_number = [](const char* p, const char* q) { return p != q && all_of(p, q, [](char c) { return c >= '0' && c <= '9'; }); };
+
+	auto encode = [&](const char* p, const char* q, cbc_t& cbc) {
+		if ((uint32_t) (q - p) != cbc_len)
+			return false;
+
+		cbc = 0;
+		for (; p != q; ++p)
+		{
+			auto c = dna_code(*p);
+			if (c > 3)
+				return false;
+			cbc = (cbc << 2) + c;
+		}
+
+		return true;
+	};
+
+	const char* p = text.data();
+	const char* text_end = p + text.size();
+
+	while (true)
+	{
+		while (p != text_end && is_space(*p))
+			++p;
+		if (p == text_end)
+			break;
+
+		const char* token = p;
+		while (p != text_end && !is_space(*p))
+			++p;
+
+		cbc_t cbc;
+
+		if (technology != technology_t::visium)
+		{
+			if (!encode(token, p, cbc))
+			{
+				cerr << "Wrong predefined CBC: " << string(token, p) << endl;
+				return false;
+			}
+
+			cbcs.emplace_back(cbc);
+			continue;
+		}
+
+		// 5 numeric fields from the end, the 1st of them is the in_tissue flag
+		const char* fields[6];
+		const char* q = p;
+		int no_fields = 0;
+
+		for (; no_fields < 5; ++no_fields)
+		{
+			const char* r = q;
+			while (r != token && r[-1] != ',')
+				--r;
+			if (r == token || !is_number(r, q))
+				break;
+			fields[5 - no_fields] = r;
+			q = r - 1;
+		}
+
+		const char* dash = find(token, q, '-');
+
+		if (no_fields != 5 || dash == token || dash + 1 >= q || !encode(token, dash, cbc))
+		{
+			cerr << "Unknown trusted CBC description: " << string(token, p) << endl;
+			return false;
+		}
+
+		if (atoi(fields[1]) == 1)
+			cbcs.emplace_back(cbc);
+	}
+
+	return true;
+}
+
+// *********************************************************************************************
+// The representation is chosen by its size
+void CCbcWhitelist::build(vector<cbc_t>& cbcs)
+{
+	sort(cbcs.begin(), cbcs.end());
+	cbcs.erase(unique(cbcs.begin(), cbcs.end()), cbcs.end());
+
+	dir_bits = 0;
+	while (dir_bits < 2 * cbc_len && (CODES_PER_BUCKET << dir_bits) < cbcs.size())
+		++dir_bits;
+
+	uint64_t sorted_words = directory_words(dir_bits) + cbcs.size();
+	kind = bit_vector_words(cbc_len) <= sorted_words ? kind_t::bit_vector : kind_t::sorted_codes;
+
+	uint64_t header_words = sizeof(header_t) / sizeof(uint64_t);
+	owned.assign(header_words + (kind == kind_t::bit_vector ? bit_vector_words(cbc_len) : sorted_words), 0);
+
+	header_t header{};
+	memcpy(header.magic, MAGIC, sizeof(MAGIC));
+	header.version = VERSION;
+	header.cbc_len = cbc_len;
+	header.kind = (uint32_t) kind;
+	header.dir_bits = kind == kind_t::bit_vector ? 0 : dir_bits;
+	header.no_cbcs = cbcs.size();
+	memcpy(owned.data(), &header, sizeof(header));
+
+	uint64_t* payload = owned.data() + header_words;
+
+	if (kind == kind_t::bit_vector)
+	{
+		for (auto cbc : cbcs)
+			payload[cbc >> 6] |= 1ull << (cbc & 63);
+		return;
+	}
+
+	uint32_t* dir = (uint32_t*) payload;
+	uint32_t shift = 2 * cbc_len - dir_bits;
+	size_t j = 0;
+
+	for (uint64_t b = 0; b <= (1ull << dir_bits); ++b)
+	{
+		while (j < cbcs.size() && (cbcs[j] >> shift) < b)
+			++j;
+		dir[b] = (uint32_t) j;
+	}
+
+	copy(cbcs.begin(), cbcs.end(), (cbc_t*) (payload + directory_words(dir_bits)));
+}
+
+// *********************************************************************************************
+bool CCbcWhitelist::attach(const uint64_t* data, uint64_t no_words, const string& file_name)
+{
+	header_t header;
+	uint64_t header_words = sizeof(header_t) / sizeof(uint64_t);
+
+	if (no_words < header_words)
+	{
+		cerr << "Error: Corrupted predefined CBC file: " << file_name << endl;
+		return false;
+	}
+
+	memcpy(&header, data, sizeof(header));
+
+	if (header.version != VERSION)
+	{
+		cerr << "Error: Unsupported version of predefined CBC file: " << file_name << endl;
+		return false;
+	}
+
+	if (header.cbc_len != cbc_len)
+	{
+		cerr << "Error: Predefined CBCs in " << file_name << " are of length " << header.cbc_len << ", but cbc_len is " << cbc_len << endl;
+		return false;
+	}
+
+	kind = (kind_t) header.kind;
+	dir_bits = header.dir_bits;
+	dir_shift = 2 * cbc_len - dir_bits;
+	no_cbcs = header.no_cbcs;
+
+	const uint64_t* payload = data + header_words;
+	uint64_t expected_words = kind == kind_t::bit_vector ? bit_vector_words(cbc_len) : directory_words(dir_bits) + no_cbcs;
+
+	if (header.kind > (uint32_t) kind_t::sorted_codes || dir_bits > 2 * cbc_len || no_words != header_words + expected_words)
+	{
+		cerr << "Error: Corrupted predefined CBC file: " << file_name << endl;
+		return false;
+	}
+
+	image = data;
+	image_words = no_words;
+
+	if (kind == kind_t::bit_vector)
+		bits = payload;
+	else
+	{
+		directory = (const uint32_t*) payload;
+		codes = (const cbc_t*) (payload + directory_words(dir_bits));
+	}
+
+	return true;
+}
+
+// EOF
@@ -0,0 +1,89 @@
+#pragma once
+
+#include <cinttypes>
+#include <string>
+#include <istream>
+#include <vector>
+#include "../common/defs.h"
+#include "fq_reader.h"
+
+using namespace std;
+
+// *********************************************************************************************
+// Set of predefined CBCs (2-bit codes) that can be probed in O(1)
+// Short CBCs are kept in a bit vector of 4^cbc_len bits. Longer ones are kept as sorted codes
+// with a directory of bucket starts (by the top bits of the codes), so a probe scans a bucket of a few codes.
+// The binary form (see Save) is mapped into memory, so loading takes no time and the pages are shared by all runs.
+// Text whitelists (plain or Visium CSV) are parsed by hand and converted on the fly.
+class CCbcWhitelist
+{
+	static const char MAGIC[8];
+	static const uint32_t VERSION = 1;
+	static const uint64_t CODES_PER_BUCKET = 4;
+
+	enum class kind_t : uint32_t { bit_vector, sorted_codes };
+
+	struct header_t
+	{
+		char magic[8];
+		uint32_t version;
+		uint32_t cbc_len;
+		uint32_t kind;
+		uint32_t dir_bits;
+		uint64_t no_cbcs;
+		uint64_t reserved;
+	};
+
+	kind_t kind = kind_t::bit_vector;
+	uint32_t cbc_len = 0;
+	uint32_t dir_bits = 0;
+	uint32_t dir_shift = 0;
+	uint64_t no_cbcs = 0;
+
+	// Image of the binary form (mapped file or owned memory) and views into it
+	const uint64_t* image = nullptr;
+	uint64_t image_words = 0;
+	const uint64_t* bits = nullptr;
+	const uint32_t* directory = nullptr;		// 2^dir_bits + 1 bucket starts
+	const cbc_t* codes = nullptr;
+
+	CMappedFile mapped;
+	vector<uint64_t> owned;
+
+	bool parse_text(const string& text, technology_t technology, vector<cbc_t>& cbcs);
+	static bool read_rest(istream& in, string& dest);
+	void build(vector<cbc_t>& cbcs);
+	bool attach(const uint64_t* data, uint64_t no_words, const string& file_name);
+	static uint64_t bit_vector_words(uint32_t cbc_len) { return max<uint64_t>((1ull << (2 * cbc_len)) / 64, 1); }
+	static uint64_t directory_words(uint32_t dir_bits) { return ((1ull << dir_bits) + 2) / 2; }
+
+public:
+	CCbcWhitelist() = default;
+	CCbcWhitelist(const CCbcWhitelist&) = delete;
+	CCbcWhitelist& operator=(const CCbcWhitelist&) = delete;
+
+	// Binary whitelists are recognized by the magic number, other files are parsed according to the technology
+	bool Load(const string& file_name, technology_t technology, uint32_t _cbc_len);
+	bool Save(const string& file_name) const;
+
+	bool Contains(cbc_t cbc) const
+	{
+		if (kind == kind_t::bit_vector)
+			return (bits[cbc >> 6] >> (cbc & 63)) & 1;
+
+		uint64_t bucket = cbc >> dir_shift;
+
+		for (auto p = codes + directory[bucket]; p != codes + directory[bucket + 1]; ++p)
+			if (*p >= cbc)
+				return *p == cbc;
+
+		return false;
+	}
+
+	uint64_t Size() const { return no_cbcs; }
+	bool Empty() const { return no_cbcs == 0; }
+	uint32_t CbcLen() const { return cbc_len; }
+	bool IsMapped() const { return mapped.Data() != nullptr; }
+};
+
+// EOF
@@ -0,0 +1,45 @@
+#include <algorithm>
+#include "count_min_sketch.h"
+
+// *********************************************************************************************
+// Width is a power of 2 not smaller than half of the no. of items (within 64K..4M)
+CCountMinSketch::CCountMinSketch(uint64_t no_items)
+{
+	uint64_t width = 1ull << 16;
+
+	while (width < no_items / 2 && width < (1ull << 22))
+		width <<= 1;
+
+	width_mask = width - 1;
+	counters = make_unique<atomic<uint32_t>[]>(width * DEPTH);
+
+	for (uint64_t i = 0; i < width * DEPTH; ++i)
+		counters[i].store(0, memory_order_relaxed);
+}
+
+// *********************************************************************************************
+uint32_t CCountMinSketch::Add(uint64_t key)
+{
+	uint32_t estimate = ~0u;
+
+	for (int row = 0; row < DEPTH; ++row)
+	{
+		auto& counter = counters[row * (width_mask + 1) + (hash(key, row) & width_mask)];
+		estimate = min(estimate, counter.fetch_add(1, memory_order_relaxed) + 1);
+	}
+
+	return estimate;
+}
+
+// *********************************************************************************************
+uint32_t CCountMinSketch::Estimate(uint64_t key) const
+{
+	uint32_t estimate = ~0u;
+
+	for (int row = 0; row < DEPTH; ++row)
+		estimate = min(estimate, counters[row * (width_mask + 1) + (hash(key, row) & width_mask)].load(memory_order_relaxed));
+
+	return estimate;
+}
+
+// EOF
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <cinttypes>
+#include <vector>
+#include <atomic>
+#include <memory>
+
+using namespace std;
+
+// *********************************************************************************************
+// Count-min sketch of 64-bit keys (e.g., CBCs) that can be updated by many threads at once
+// Estimates are never below the true counts and exceed them by at most 2N/width with probability 1 - 2^-depth
+class CCountMinSketch
+{
+	static const int DEPTH = 4;
+
+	uint64_t width_mask;
+	unique_ptr<atomic<uint32_t>[]> counters;
+
+	static uint64_t hash(uint64_t x, int row)
+	{
+		x += 0x9e3779b97f4a7c15ull * (row + 1);
+		x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+		x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+
+		return x ^ (x >> 31);
+	}
+
+public:
+	CCountMinSketch(uint64_t no_items);
+
+	uint32_t Add(uint64_t key);				// returns the estimate after the update
+	uint32_t Estimate(uint64_t key) const;
+	size_t Size() const { return (size_t) (width_mask + 1) * DEPTH * sizeof(uint32_t); }
+};
+
+// EOF
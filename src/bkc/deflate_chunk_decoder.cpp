@@ -0,0 +1,593 @@
+#include <cstring>
+#include <algorithm>
+#include <climits>
+#include "deflate_chunk_decoder.h"
+
+static const uint16_t len_base[29] = { 3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+static const uint8_t len_extra[29] = { 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+static const uint16_t dist_base[30] = { 1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577 };
+static const uint8_t dist_extra[30] = { 0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+static const uint8_t code_length_order[19] = { 16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
+
+// *********************************************************************************************
+// 64 bits starting at the given bit offset (the caller guarantees that 8 bytes are available)
+static inline uint64_t peek_bits(const uint8_t* data, uint64_t bit_pos)
+{
+	uint64_t x;
+	memcpy(&x, data + bit_pos / 8, 8);
+
+	return x >> (bit_pos % 8);
+}
+
+// *********************************************************************************************
+static inline uint32_t reverse_bits(uint32_t code, int length)
+{
+	uint32_t r = 0;
+
+	for (int i = 0; i < length; ++i, code >>= 1)
+		r = (r << 1) | (code & 1);
+
+	return r;
+}
+
+// *********************************************************************************************
+// Incomplete codes are accepted only if made of a single code (as in zlib)
+bool CDeflateChunkDecoder::huffman_t::build(const uint8_t* lengths, int no_symbols, bool must_be_complete)
+{
+	memset(count, 0, sizeof(count));
+	memset(table, 0, sizeof(table));
+
+	for (int i = 0; i < no_symbols; ++i)
+		++count[lengths[i]];
+	count[0] = 0;
+
+	int max_length = 0;
+	int left = 1;
+
+	for (int len = 1; len < 16; ++len)
+	{
+		if (count[len])
+			max_length = len;
+
+		left = (left << 1) - count[len];
+		if (left < 0)
+			return false;		// Over-subscribed
+	}
+
+	if (max_length == 0)
+		return !must_be_complete;
+
+	if (left > 0 && (must_be_complete || max_length != 1))
+		return false;
+
+	uint16_t offsets[16];
+	offsets[1] = 0;
+	for (int len = 1; len < 15; ++len)
+		offsets[len + 1] = offsets[len] + count[len];
+
+	for (int i = 0; i < no_symbols; ++i)
+		if (lengths[i])
+			symbols[offsets[lengths[i]]++] = (uint16_t) i;
+
+	uint32_t code = 0;
+	int idx = 0;
+
+	for (int len = 1; len <= TABLE_BITS; ++len, code <<= 1)
+		for (int i = 0; i < count[len]; ++i, ++code)
+		{
+			uint16_t entry = (uint16_t) ((symbols[idx++] << 4) | len);
+
+			for (uint32_t j = reverse_bits(code, len); j < (1u << TABLE_BITS); j += 1u << len)
+				table[j] = entry;
+		}
+
+	return true;
+}
+
+// *********************************************************************************************
+// Bit-by-bit decoding of codes longer than TABLE_BITS (as in puff.c from zlib)
+int CDeflateChunkDecoder::huffman_t::decode_long(uint64_t bits, int& length) const
+{
+	int code = 0;
+	int first = 0;
+	int idx = 0;
+
+	for (int len = 1; len < 16; ++len)
+	{
+		code |= (int) (bits >> (len - 1)) & 1;
+
+		if (code - first < count[len])
+		{
+			length = len;
+			return symbols[idx + code - first];
+		}
+
+		idx += count[len];
+		first = (first + count[len]) << 1;
+		code <<= 1;
+	}
+
+	return -1;
+}
+
+// *********************************************************************************************
+void CDeflateChunkDecoder::bit_reader_t::init(const uint8_t* _data, size_t size, uint64_t bit_pos)
+{
+	data = _data;
+	end = _data + size;
+	next = _data + bit_pos / 8;
+	buf = 0;
+	cnt = 0;
+	padded = 0;
+
+	refill();
+	consume((int) (bit_pos % 8));
+}
+
+// *********************************************************************************************
+// Reading past the end gives zeros, so the decoder checks exhausted() instead of the available bits before each symbol
+void CDeflateChunkDecoder::bit_reader_t::refill()
+{
+	if (end - next >= 8)
+	{
+		uint64_t x;
+		memcpy(&x, next, 8);
+		buf |= x << cnt;
+		next += (63 - cnt) >> 3;
+		cnt |= 56;
+		return;
+	}
+
+	for (; cnt <= 56; cnt += 8)
+		if (next < end)
+			buf |= (uint64_t) *next++ << cnt;
+		else
+			++padded;
+}
+
+// *********************************************************************************************
+int CDeflateChunkDecoder::bit_reader_t::decode(const huffman_t& h)
+{
+	uint32_t entry = h.table[buf & ((1u << TABLE_BITS) - 1)];
+
+	if (entry)
+	{
+		consume(entry & 15);
+		return (int) (entry >> 4);
+	}
+
+	int length = 0;
+	int symbol = h.decode_long(buf, length);
+	if (symbol >= 0)
+		consume(length);
+
+	return symbol;
+}
+
+// *********************************************************************************************
+CDeflateChunkDecoder::~CDeflateChunkDecoder()
+{
+	if (strm_initialized)
+		inflateEnd(&strm);
+}
+
+// *********************************************************************************************
+// Quick test of a non-final dynamic block header: field ranges and the completeness of the code of code lengths
+bool CDeflateChunkDecoder::is_dynamic_header(const uint8_t* data, size_t size, uint64_t bit_pos)
+{
+	if (bit_pos + 17 + 64 + 8 > (uint64_t) size * 8)
+		return false;
+
+	uint64_t x = peek_bits(data, bit_pos);
+
+	if ((x & 7) != 4 || ((x >> 3) & 31) > 29 || ((x >> 8) & 31) > 29)
+		return false;
+
+	int hclen = (int) ((x >> 13) & 15) + 4;
+	uint64_t lengths = peek_bits(data, bit_pos + 17);
+	int kraft = 0;
+
+	for (int i = 0; i < hclen; ++i, lengths >>= 3)
+		if (lengths & 7)
+			kraft += 128 >> (lengths & 7);
+
+	return kraft == 128;
+}
+
+// *********************************************************************************************
+// Reads code lengths of a dynamic block (after the 3 bits of the block type) and builds its codes
+bool CDeflateChunkDecoder::read_dynamic_header()
+{
+	br.refill();
+
+	int hlit = (int) br.get(5) + 257;
+	int hdist = (int) br.get(5) + 1;
+	int hclen = (int) br.get(4) + 4;
+
+	if (hlit > 286 || hdist > 30)
+		return false;
+
+	uint8_t lengths[286 + 30] = {};
+
+	for (int i = 0; i < hclen; ++i)
+	{
+		br.refill();
+		lengths[code_length_order[i]] = (uint8_t) br.get(3);
+	}
+
+	if (!lit_code.build(lengths, 19, true))
+		return false;
+
+	int total = hlit + hdist;
+
+	for (int i = 0; i < total;)
+	{
+		br.refill();
+
+		int symbol = br.decode(lit_code);
+		if (symbol < 0)
+			return false;
+
+		if (symbol < 16)
+		{
+			lengths[i++] = (uint8_t) symbol;
+			continue;
+		}
+
+		uint8_t value = 0;
+		int repeat;
+
+		if (symbol == 16)
+		{
+			if (i == 0)
+				return false;
+			value = lengths[i - 1];
+			repeat = 3 + (int) br.get(2);
+		}
+		else if (symbol == 17)
+			repeat = 3 + (int) br.get(3);
+		else
+			repeat = 11 + (int) br.get(7);
+
+		if (i + repeat > total)
+			return false;
+
+		fill_n(lengths + i, repeat, value);
+		i += repeat;
+	}
+
+	if (br.exhausted() || lengths[256] == 0)
+		return false;
+
+	return lit_code.build(lengths, hlit, false) && dist_code.build(lengths + hlit, hdist, false);
+}
+
+// *********************************************************************************************
+void CDeflateChunkDecoder::set_fixed_codes()
+{
+	uint8_t lengths[288];
+
+	fill_n(lengths, 144, 8);
+	fill_n(lengths + 144, 112, 9);
+	fill_n(lengths + 256, 24, 7);
+	fill_n(lengths + 280, 8, 8);
+	lit_code.build(lengths, 288, true);
+
+	fill_n(lengths, 32, 5);
+	dist_code.build(lengths, 32, true);
+}
+
+// *********************************************************************************************
+// Decodes blocks from the current position of the bit reader until:
+// - the 1st block boundary at or after stop_bit (boundary)
+// - a block boundary after which the last WINDOW_SIZE symbols contain no markers (boundary before stop_bit, if stop_when_clean)
+// - the end of the final block (member_end) or of the input (input_end, the output is truncated to the last complete block)
+deflate_stop_t CDeflateChunkDecoder::decode_marked(uint64_t stop_bit, bool stop_when_clean, vector<uint16_t>& out, size_t& out_size, uint64_t& end_bit)
+{
+	uint64_t last_bit = br.position();
+	size_t last_size = out_size;
+	size_t marker_end = 0;			// position after the last marker
+	deflate_stop_t stop = deflate_stop_t::input_end;
+
+	auto reserve = [&] {
+		if (out.size() < out_size + MIN_FREE_OUT)
+			out.resize(max(out.size() * 2, out_size + MIN_FREE_OUT));
+	};
+
+	while (true)
+	{
+		br.refill();
+
+		uint32_t header = br.get(3);
+		bool is_final = header & 1;
+		uint32_t type = header >> 1;
+
+		if (type == 0)
+		{
+			br.consume(br.cnt % 8);
+			br.refill();
+
+			uint32_t len = br.get(16);
+			if (len != (~br.get(16) & 0xffff))
+			{
+				stop = deflate_stop_t::error;
+				break;
+			}
+
+			reserve();
+			if (out.size() < out_size + len)
+				out.resize(out_size + len);
+
+			for (uint32_t i = 0; i < len; ++i)
+			{
+				br.refill();
+				out[out_size++] = (uint16_t) br.get(8);
+			}
+		}
+		else if (type == 3)
+		{
+			stop = deflate_stop_t::error;
+			break;
+		}
+		else
+		{
+			if (type == 1)
+				set_fixed_codes();
+			else if (!read_dynamic_header())
+			{
+				stop = br.exhausted() ? deflate_stop_t::input_end : deflate_stop_t::error;
+				break;
+			}
+
+			reserve();
+			uint16_t* o = out.data();
+			bool is_valid = true;
+
+			while (true)
+			{
+				br.refill();
+				if (br.exhausted())
+					break;
+
+				if (out_size + 258 > out.size())
+				{
+					reserve();
+					o = out.data();
+				}
+
+				int symbol = br.decode(lit_code);
+
+				if (symbol < 256)
+				{
+					if (symbol < 0)
+					{
+						is_valid = false;
+						break;
+					}
+					o[out_size++] = (uint16_t) symbol;
+					continue;
+				}
+
+				if (symbol == 256)
+					break;
+
+				symbol -= 257;
+				if (symbol >= 29)
+				{
+					is_valid = false;
+					break;
+				}
+
+				uint32_t len = len_base[symbol] + br.get(len_extra[symbol]);
+
+				int dist_symbol = br.decode(dist_code);
+				if (dist_symbol < 0 || dist_symbol >= 30)
+				{
+					is_valid = false;
+					break;
+				}
+
+				uint32_t dist = dist_base[dist_symbol] + br.get(dist_extra[dist_symbol]);
+
+				if (dist <= out_size)
+				{
+					uint16_t* dest = o + out_size;
+					const uint16_t* src = dest - dist;
+					uint16_t any = 0;
+
+					for (uint32_t i = 0; i < len; ++i)
+					{
+						dest[i] = src[i];
+						any |= src[i];
+					}
+
+					out_size += len;
+					if (any >= MARKER)
+						marker_end = out_size;
+					continue;
+				}
+
+				// References before the chunk start are markers (positions in the unknown window)
+				for (uint32_t i = 0; i < len; ++i, ++out_size)
+				{
+					int64_t src = (int64_t) out_size - dist;
+					o[out_size] = src < 0 ? (uint16_t) (MARKER + WINDOW_SIZE + src) : o[src];
+				}
+
+				marker_end = out_size;
+			}
+
+			if (!is_valid)
+			{
+				stop = deflate_stop_t::error;
+				break;
+			}
+		}
+
+		if (br.exhausted())
+			break;
+
+		uint64_t pos = br.position();
+
+		if (is_final)
+		{
+			end_bit = (pos + 7) / 8 * 8;
+			return deflate_stop_t::member_end;
+		}
+
+		last_bit = pos;
+		last_size = out_size;
+
+		if (pos >= stop_bit || (stop_when_clean && out_size >= marker_end + WINDOW_SIZE))
+		{
+			end_bit = pos;
+			return deflate_stop_t::boundary;
+		}
+	}
+
+	out_size = last_size;
+	end_bit = last_bit;
+
+	return stop;
+}
+
+// *********************************************************************************************
+// Inflates blocks by zlib from a block boundary when the window is known
+bool CDeflateChunkDecoder::inflate_known(const uint8_t* data, size_t size, uint64_t bit_pos, const uint8_t* window, size_t window_size, uint64_t stop_bit, deflate_chunk_t& chunk)
+{
+	if (!strm_initialized)
+	{
+		memset(&strm, 0, sizeof(strm));
+		if (inflateInit2(&strm, -MAX_WBITS) != Z_OK)
+			return false;
+		strm_initialized = true;
+	}
+	else if (inflateReset(&strm) != Z_OK)
+		return false;
+
+	size_t byte_pos = (size_t) (bit_pos / 8);
+	int bits = (int) (bit_pos % 8);
+
+	if (bits && inflatePrime(&strm, 8 - bits, data[byte_pos++] >> bits) != Z_OK)
+		return false;
+
+	if (window_size && inflateSetDictionary(&strm, window, (uInt) window_size) != Z_OK)
+		return false;
+
+	strm.next_in = (Bytef*) data + byte_pos;
+	strm.avail_in = (uInt) (size - byte_pos);
+
+	uint64_t last_bit = bit_pos;
+	size_t last_size = chunk.out_size;
+
+	while (true)
+	{
+		if (chunk.out.size() < chunk.out_size + MIN_FREE_OUT)
+			chunk.out.resize(max(chunk.out.size() * 2, chunk.out_size + MIN_FREE_OUT));
+
+		strm.next_out = chunk.out.data() + chunk.out_size;
+		strm.avail_out = (uInt) min<size_t>(chunk.out.size() - chunk.out_size, UINT_MAX);
+
+		uInt avail_out = strm.avail_out;
+		int r = inflate(&strm, Z_BLOCK);
+		chunk.out_size += avail_out - strm.avail_out;
+
+		uint64_t consumed = (uint64_t) (strm.next_in - data);
+
+		if (r == Z_STREAM_END)
+		{
+			chunk.end_bit = consumed * 8;
+			chunk.stop = deflate_stop_t::member_end;
+			return true;
+		}
+
+		if (r != Z_OK && r != Z_BUF_ERROR)
+			return false;
+
+		if (strm.data_type & 128)
+		{
+			last_bit = consumed * 8 - (strm.data_type & 7);
+			last_size = chunk.out_size;
+
+			if (last_bit >= stop_bit)
+			{
+				chunk.end_bit = last_bit;
+				chunk.stop = deflate_stop_t::boundary;
+				return true;
+			}
+		}
+
+		if (strm.avail_in == 0)
+			break;
+	}
+
+	chunk.out_size = last_size;
+	chunk.end_bit = last_bit;
+	chunk.stop = deflate_stop_t::input_end;
+
+	return true;
+}
+
+// *********************************************************************************************
+bool CDeflateChunkDecoder::FindBlockStart(const uint8_t* data, size_t size, uint64_t from_bit, uint64_t to_bit, uint64_t& found_bit)
+{
+	for (uint64_t pos = from_bit; pos < to_bit; ++pos)
+	{
+		if (!is_dynamic_header(data, size, pos))
+			continue;
+
+		size_t scratch_size = 0;
+		uint64_t end_bit;
+
+		br.init(data, size, pos);
+
+		if (decode_marked(pos + 1, false, scratch, scratch_size, end_bit) == deflate_stop_t::boundary)
+		{
+			found_bit = pos;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+// *********************************************************************************************
+// Symbols are decoded with markers until the window becomes known, i.e., until the last 32 KB of the output contain no markers,
+// and then zlib (which is much faster) inflates the rest
+void CDeflateChunkDecoder::Decode(const uint8_t* data, size_t size, const vector<uint8_t>* window, uint64_t stop_bit, deflate_chunk_t& chunk)
+{
+	chunk.marked_size = 0;
+	chunk.out_size = 0;
+	chunk.end_bit = chunk.begin_bit;
+
+	if (window)
+	{
+		if (!inflate_known(data, size, chunk.begin_bit, window->data(), window->size(), stop_bit, chunk))
+			chunk.stop = deflate_stop_t::error;
+		return;
+	}
+
+	br.init(data, size, chunk.begin_bit);
+	chunk.stop = decode_marked(stop_bit, true, chunk.marked, chunk.marked_size, chunk.end_bit);
+
+	if (chunk.stop != deflate_stop_t::boundary || chunk.end_bit >= stop_bit)
+		return;
+
+	uint8_t known_window[WINDOW_SIZE];
+	const uint16_t* p = chunk.marked.data() + chunk.marked_size - WINDOW_SIZE;
+
+	for (uint32_t i = 0; i < WINDOW_SIZE; ++i)
+		known_window[i] = (uint8_t) p[i];
+
+	if (!inflate_known(data, size, chunk.end_bit, known_window, WINDOW_SIZE, stop_bit, chunk))
+		chunk.stop = deflate_stop_t::error;
+}
+
+// *********************************************************************************************
+void CDeflateChunkDecoder::Resolve(const uint16_t* marked, size_t size, const uint8_t* window, uint8_t* out)
+{
+	for (size_t i = 0; i < size; ++i)
+		out[i] = marked[i] < MARKER ? (uint8_t) marked[i] : window[marked[i] - MARKER];
+}
+
+// EOF
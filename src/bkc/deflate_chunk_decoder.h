@@ -0,0 +1,109 @@
+#pragma once
+
+#include <cinttypes>
+#include <vector>
+#include <zlib-ng/zlib.h>
+
+using namespace std;
+
+enum class deflate_stop_t { boundary, member_end, input_end, error };
+
+// *********************************************************************************************
+// Part of a deflate stream decoded from a block start
+// The output is made of two parts:
+// - marked: symbols decoded before the last 32 KB of the output became free of references to the unknown window
+//   (values < 256 are bytes, values >= MARKER are positions in the 32 KB window preceding the chunk)
+// - out: bytes decoded after that (by zlib, as the window is then known)
+struct deflate_chunk_t
+{
+	uint64_t begin_bit = 0;			// bit offsets in the input buffer
+	uint64_t end_bit = 0;			// position after the last complete block (byte-aligned after the final block)
+	deflate_stop_t stop = deflate_stop_t::error;
+
+	vector<uint16_t> marked;
+	size_t marked_size = 0;
+	vector<uint8_t> out;
+	size_t out_size = 0;
+
+	size_t Size() const { return marked_size + out_size; }
+};
+
+// *********************************************************************************************
+// Decoder of deflate chunks starting at block boundaries that are only guessed (as in pugz and rapidgzip):
+// - candidates of dynamic block starts are found by checking block headers at consecutive bit offsets
+//   and decoding the whole 1st block
+// - back-references to the data preceding the chunk are decoded as markers that are resolved
+//   when the window (the last 32 KB of the preceding chunk) is known
+// Decoding stops at the 1st block boundary at or after the given stop position,
+// so a guess is confirmed when the preceding chunk stops exactly at it
+class CDeflateChunkDecoder
+{
+public:
+	static const uint32_t WINDOW_SIZE = 32768;
+	static const uint16_t MARKER = 32768;
+
+private:
+	static const int TABLE_BITS = 10;
+	static const size_t MIN_FREE_OUT = 1 << 16;
+
+	// Canonical Huffman code with a lookup table of codes up to TABLE_BITS long (longer ones are decoded bit by bit)
+	struct huffman_t
+	{
+		uint16_t table[1 << TABLE_BITS];		// (symbol << 4) + code length, 0 for longer codes
+		uint16_t count[16];
+		uint16_t symbols[288];
+
+		bool build(const uint8_t* lengths, int no_symbols, bool must_be_complete);
+		int decode_long(uint64_t bits, int& length) const;
+	};
+
+	struct bit_reader_t
+	{
+		const uint8_t* data;
+		const uint8_t* end;
+		const uint8_t* next;
+		uint64_t buf;
+		int cnt;
+		size_t padded;
+
+		void init(const uint8_t* _data, size_t size, uint64_t bit_pos);
+		void refill();
+		uint64_t position() const { return (uint64_t) (next - data + padded) * 8 - cnt; }
+		bool exhausted() const { return padded && position() > (uint64_t) (end - data) * 8; }
+		uint32_t peek(int n) const { return (uint32_t) (buf & ((1ull << n) - 1)); }
+		void consume(int n) { buf >>= n; cnt -= n; }
+		uint32_t get(int n) { uint32_t x = peek(n); consume(n); return x; }
+		int decode(const huffman_t& h);
+	};
+
+	bit_reader_t br;
+	huffman_t lit_code;
+	huffman_t dist_code;
+	vector<uint16_t> scratch;
+
+	z_stream strm;
+	bool strm_initialized = false;
+
+	static bool is_dynamic_header(const uint8_t* data, size_t size, uint64_t bit_pos);
+	bool read_dynamic_header();
+	void set_fixed_codes();
+	deflate_stop_t decode_marked(uint64_t stop_bit, bool stop_when_clean, vector<uint16_t>& out, size_t& out_size, uint64_t& end_bit);
+	bool inflate_known(const uint8_t* data, size_t size, uint64_t bit_pos, const uint8_t* window, size_t window_size, uint64_t stop_bit, deflate_chunk_t& chunk);
+
+public:
+	CDeflateChunkDecoder() = default;
+	~CDeflateChunkDecoder();
+	CDeflateChunkDecoder(const CDeflateChunkDecoder&) = delete;
+	CDeflateChunkDecoder& operator=(const CDeflateChunkDecoder&) = delete;
+
+	// Looks for the 1st non-final dynamic block starting in [from_bit, to_bit)
+	bool FindBlockStart(const uint8_t* data, size_t size, uint64_t from_bit, uint64_t to_bit, uint64_t& found_bit);
+
+	// Decodes the chunk from chunk.begin_bit; the window is nullptr if unknown (and then the output can contain markers)
+	void Decode(const uint8_t* data, size_t size, const vector<uint8_t>* window, uint64_t stop_bit, deflate_chunk_t& chunk);
+
+	// Replaces markers with bytes of the window (WINDOW_SIZE bytes preceding the chunk)
+	static void Resolve(const uint16_t* marked, size_t size, const uint8_t* window, uint8_t* out);
+};
+
+// EOF
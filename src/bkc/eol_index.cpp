@@ -0,0 +1,207 @@
+#include <cstring>
+#include <bit>
+#include "eol_index.h"
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define EOL_INDEX_X64
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define EOL_TARGET_AVX2
+#else
+#define EOL_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+#endif
+
+// *********************************************************************************************
+// Positions of set bits of the mask (line ends in 64 bytes starting at base)
+static inline void append_eols(uint64_t mask, uint32_t base, vector<uint32_t>& eols)
+{
+	while (mask)
+	{
+		eols.emplace_back(base + (uint32_t) countr_zero(mask));
+		mask &= mask - 1;
+	}
+}
+
+// *********************************************************************************************
+static void find_scalar(const char* data, size_t size, size_t pos, vector<uint32_t>& eols)
+{
+	for (const char* p = data + pos, *p_end = data + size; (p = (const char*) memchr(p, '\n', p_end - p)) != nullptr; ++p)
+		eols.emplace_back((uint32_t) (p - data));
+}
+
+// *********************************************************************************************
+static uint64_t count_scalar(const char* data, size_t size, size_t pos)
+{
+	uint64_t cnt = 0;
+
+	for (const char* p = data + pos, *p_end = data + size; (p = (const char*) memchr(p, '\n', p_end - p)) != nullptr; ++p)
+		++cnt;
+
+	return cnt;
+}
+
+#ifdef EOL_INDEX_X64
+// *********************************************************************************************
+static inline uint64_t eol_mask_sse2(const char* p)
+{
+	const __m128i nl = _mm_set1_epi8('\n');
+
+	uint64_t m0 = (uint32_t) _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*) p), nl));
+	uint64_t m1 = (uint32_t) _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*) (p + 16)), nl));
+	uint64_t m2 = (uint32_t) _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*) (p + 32)), nl));
+	uint64_t m3 = (uint32_t) _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*) (p + 48)), nl));
+
+	return m0 | (m1 << 16) | (m2 << 32) | (m3 << 48);
+}
+
+// *********************************************************************************************
+EOL_TARGET_AVX2 static inline uint64_t eol_mask_avx2(const char* p)
+{
+	const __m256i nl = _mm256_set1_epi8('\n');
+
+	uint64_t m0 = (uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*) p), nl));
+	uint64_t m1 = (uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*) (p + 32)), nl));
+
+	return m0 | (m1 << 32);
+}
+
+// *********************************************************************************************
+static void find_sse2(const char* data, size_t size, vector<uint32_t>& eols)
+{
+	size_t pos = 0;
+
+	for (; pos + 64 <= size; pos += 64)
+		append_eols(eol_mask_sse2(data + pos), (uint32_t) pos, eols);
+
+	find_scalar(data, size, pos, eols);
+}
+
+// *********************************************************************************************
+EOL_TARGET_AVX2 static void find_avx2(const char* data, size_t size, vector<uint32_t>& eols)
+{
+	size_t pos = 0;
+
+	for (; pos + 64 <= size; pos += 64)
+		append_eols(eol_mask_avx2(data + pos), (uint32_t) pos, eols);
+
+	find_scalar(data, size, pos, eols);
+}
+
+// *********************************************************************************************
+static uint64_t count_sse2(const char* data, size_t size)
+{
+	uint64_t cnt = 0;
+	size_t pos = 0;
+
+	for (; pos + 64 <= size; pos += 64)
+		cnt += popcount(eol_mask_sse2(data + pos));
+
+	return cnt + count_scalar(data, size, pos);
+}
+
+// *********************************************************************************************
+EOL_TARGET_AVX2 static uint64_t count_avx2(const char* data, size_t size)
+{
+	uint64_t cnt = 0;
+	size_t pos = 0;
+
+	for (; pos + 64 <= size; pos += 64)
+		cnt += popcount(eol_mask_avx2(data + pos));
+
+	return cnt + count_scalar(data, size, pos);
+}
+
+// *********************************************************************************************
+static bool cpu_has_avx2()
+{
+#ifdef _MSC_VER
+	int regs[4];
+
+	__cpuid(regs, 0);
+	if (regs[0] < 7)
+		return false;
+
+	// AVX and OS support for YMM registers
+	__cpuid(regs, 1);
+	if ((regs[2] & (1 << 27)) == 0 || (regs[2] & (1 << 28)) == 0 || (_xgetbv(0) & 6) != 6)
+		return false;
+
+	__cpuidex(regs, 7, 0);
+	return (regs[1] & (1 << 5)) != 0;
+#else
+	return __builtin_cpu_supports("avx2");
+#endif
+}
+#endif
+
+// *********************************************************************************************
+eol_kernel_t CEolIndex::select_kernel()
+{
+#ifdef EOL_INDEX_X64
+	return cpu_has_avx2() ? eol_kernel_t::avx2 : eol_kernel_t::sse2;
+#else
+	return eol_kernel_t::scalar;
+#endif
+}
+
+// *********************************************************************************************
+eol_kernel_t CEolIndex::Kernel()
+{
+	static const eol_kernel_t kernel = select_kernel();
+
+	return kernel;
+}
+
+// *********************************************************************************************
+const char* CEolIndex::KernelName()
+{
+	switch (Kernel())
+	{
+	case eol_kernel_t::avx2:
+		return "AVX2";
+	case eol_kernel_t::sse2:
+		return "SSE2";
+	default:
+		return "scalar";
+	}
+}
+
+// *********************************************************************************************
+void CEolIndex::Find(const char* data, size_t size, vector<uint32_t>& eols)
+{
+	eols.clear();
+
+	switch (Kernel())
+	{
+#ifdef EOL_INDEX_X64
+	case eol_kernel_t::avx2:
+		find_avx2(data, size, eols);
+		break;
+	case eol_kernel_t::sse2:
+		find_sse2(data, size, eols);
+		break;
+#endif
+	default:
+		find_scalar(data, size, 0, eols);
+	}
+}
+
+// *********************************************************************************************
+uint64_t CEolIndex::Count(const char* data, size_t size)
+{
+	switch (Kernel())
+	{
+#ifdef EOL_INDEX_X64
+	case eol_kernel_t::avx2:
+		return count_avx2(data, size);
+	case eol_kernel_t::sse2:
+		return count_sse2(data, size);
+#endif
+	default:
+		return count_scalar(data, size, 0);
+	}
+}
+
+// EOF
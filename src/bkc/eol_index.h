@@ -0,0 +1,28 @@
+#pragma once
+
+#include <cinttypes>
+#include <vector>
+
+using namespace std;
+
+enum class eol_kernel_t { scalar, sse2, avx2 };
+
+// *********************************************************************************************
+// Scanning of blocks of FASTQ/FASTA data for line ends ('\n')
+// The kernel (AVX2, SSE2 or scalar) is selected at runtime according to the CPU features
+class CEolIndex
+{
+	static eol_kernel_t select_kernel();
+
+public:
+	static eol_kernel_t Kernel();
+	static const char* KernelName();
+
+	// Stores positions of all line ends in the block (eols is cleared first)
+	static void Find(const char* data, size_t size, vector<uint32_t>& eols);
+
+	// Counts line ends in the block
+	static uint64_t Count(const char* data, size_t size);
+};
+
+// EOF
@@ -1,53 +1,191 @@
 #include <iostream>
 #include <cstring>
+#include <filesystem>
+#include <thread>
+#include <atomic>
+#include <algorithm>
 #include "fq_reader.h"
 
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
 // *********************************************************************************************
-void CFastXReader::close()
+static int fseek_64(FILE* f, uint64_t pos)
 {
-	if (in)
-	{
-		fclose(in);
-		in = nullptr;
-	}
-	else if (gz_in)
+#ifdef _WIN32
+	return _fseeki64(f, (int64_t) pos, SEEK_SET);
+#else
+	return fseek(f, (long) pos, SEEK_SET);
+#endif
+}
+
+// *********************************************************************************************
+CMappedFile::~CMappedFile()
+{
+#ifndef _WIN32
+	if (data)
+		munmap(data, size);
+#endif
+}
+
+// *********************************************************************************************
+// Maps regular non-empty files only (not supported under Windows, so the caller falls back to fread)
+bool CMappedFile::Open(const string& file_name)
+{
+#ifdef _WIN32
+	return false;
+#else
+	int fd = open(file_name.c_str(), O_RDONLY);
+	if (fd < 0)
+		return false;
+
+	struct stat st;
+	if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0)
 	{
-		gzclose(gz_in);
-		gz_in = nullptr;
+		::close(fd);
+		return false;
 	}
 
+	void* p = mmap(nullptr, (size_t) st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	::close(fd);
+
+	if (p == MAP_FAILED)
+		return false;
+
+	data = (char*) p;
+	size = (uint64_t) st.st_size;
+
+	madvise(data, size, MADV_SEQUENTIAL);
+
+	return true;
+#endif
+}
+
+// *********************************************************************************************
+// Asks the kernel to read ahead the given range
+void CMappedFile::WillNeed(uint64_t offset, uint64_t length)
+{
+#ifndef _WIN32
+	if (!data || offset >= size)
+		return;
+
+	uint64_t page_size = (uint64_t) sysconf(_SC_PAGESIZE);
+	uint64_t begin = offset / page_size * page_size;
+	uint64_t end = min(size, offset + length);
+
+	madvise(data + begin, end - begin, MADV_WILLNEED);
+#endif
+}
+
+// *********************************************************************************************
+//
+// *********************************************************************************************
+
+// *********************************************************************************************
+void CFastXReader::close()
+{
+	if (in)
+		in->Close();
+	decoder.reset();
+	stream = nullptr;
+
+	mapping.reset();
+	map_pos = map_end = 0;
+
 	file_name.clear();
+	internal_buffer.clear();
+
+	gz_index.reset();
+	gz_index_out_pos = gz_index_read_id = 0;
+}
 
-	is_gzipped = false;
+// *********************************************************************************************
+bool CFastXReader::open_mapped(const string& _file_name)
+{
+	mapping = make_shared<CMappedFile>();
+
+	if (!mapping->Open(_file_name))
+	{
+		mapping.reset();
+		return false;
+	}
+
+	return true;
 }
 
 // *********************************************************************************************
-bool CFastXReader::Open(const string &_file_name)
+// Opens the file, optionally limiting reading to the [offset_begin, offset_end) range (uncompressed or indexed gzipped files only)
+bool CFastXReader::Open(const string &_file_name, uint64_t offset_begin, uint64_t offset_end)
 {
-	if (in || gz_in)
-		close();
+	close();
 
-	if (is_gzipped_name(_file_name))
+	if (bam_view != bam_view_t::none)
 	{
-		gz_in = gzopen(_file_name.c_str(), "rb");
+		auto bam_in = make_unique<CBamReader>(no_gz_threads, gz_backend, io_mode, direct_io, no_io_buffers);
+		bam_in->SetView(bam_view, bam_cbc_len, bam_umi_len);
 
-		if (!gz_in)
+		if (!bam_in->Open(_file_name))
 			return false;
 
-		gzbuffer(gz_in, ZLIB_BUFFER_SIZE);
-		is_gzipped = true;
+		decoder = move(bam_in);
 	}
-	else
+	else if (is_gzipped_name(_file_name))
 	{
-		in = fopen(_file_name.c_str(), "rb");
+		auto gz_in = make_unique<CParallelGzReader>(no_gz_threads, gz_backend, io_mode, direct_io, no_io_buffers);
+
+		if (offset_begin != 0 || offset_end != ~0ull)
+		{
+			auto index = CGzIndexStore::Get(_file_name);
+
+			if (!index || !gz_in->OpenRange(_file_name, *index, offset_begin, offset_end))
+				return false;
+		}
+		else
+		{
+			if (!gz_in->Open(_file_name))
+				return false;
+
+			if (CGzIndexStore::NeedsIndex(_file_name))
+			{
+				gz_index = make_unique<CGzIndex>();
+				gz_in->BuildIndex(gz_index.get());
+			}
+		}
+
+		decoder = move(gz_in);
+	}
+	else if (is_zstd_name(_file_name))
+	{
+		auto zstd_in = make_unique<CParallelZstdReader>(no_gz_threads, io_mode, direct_io, no_io_buffers);
+
+		if (!zstd_in->Open(_file_name))
+			return false;
 
+		decoder = move(zstd_in);
+	}
+	else if (use_mmap && !direct_io && open_mapped(_file_name))
+	{
+		map_pos = min(offset_begin, mapping->Size());
+		map_end = min(offset_end, mapping->Size());
+	}
+	else
+	{
 		if (!in)
+			in = make_unique<CAsyncFileReader>(io_mode, direct_io, no_io_buffers);
+
+		if (!in->Open(_file_name, offset_begin, offset_end))
 			return false;
 
-		setvbuf(in, nullptr, _IOFBF, BUFFER_SIZE);
-		is_gzipped = false;
+		stream = in.get();
 	}
 
+	if (decoder)
+		stream = decoder.get();
+
 	file_name = _file_name;
 
 	return true;
@@ -60,37 +198,155 @@ void CFastXReader::Close()
 }
 
 // *********************************************************************************************
-bool CFastXReader::ReadBlock(memory_chunk<char>& mc)
+bool CFastXReader::ReadBlock(memory_chunk<char>& mc, size_t max_size)
 {
-	if (!in && !gz_in)
+	if (!stream)
 		return false;
 
 	mc.resize(internal_buffer.size());
 	memcpy(mc.data(), internal_buffer.data(), internal_buffer.size());
 	internal_buffer.clear();
 
-	size_t to_read = mc.capacity() - mc.size();
-	size_t readed;
 	size_t filled = mc.size();
+	size_t limit = min(max_size, mc.capacity());
 
-	mc.resize(mc.capacity());
+	if (filled >= limit)
+		limit = mc.capacity();
 
-	if (is_gzipped)
-		readed = gzread(gz_in, mc.data() + filled, to_read);
-	else
-		readed = fread(mc.data() + filled, 1, to_read, in);
+	int64_t rec_end;
 
-	mc.resize(filled + readed);
+	// The block is extended up to the chunk capacity if there is no complete record within the limit
+	while (true)
+	{
+		mc.resize(limit);
+
+		size_t readed = stream->Read(mc.data() + filled, limit - filled);
+		if (stream->Error())
+		{
+			cerr << "Error: cannot read " + file_name + "\n";
+			return false;
+		}
+
+		filled += readed;
+		mc.resize(filled);
+
+		rec_end = find_last_record_end(mc);
+
+		if (rec_end >= 0 || filled != limit || limit == mc.capacity())
+			break;
+
+		limit = mc.capacity();
+	}
 
-	find_last_eols(mc);
+	if (rec_end < 0 && mc.size() != mc.capacity())
+	{
+		// The file ended exactly at the end of the previous block
+		if (mc.empty() && gz_index)
+			finish_gz_index();
 
-	if (eol_positions[rec_lines-1] < 0 && mc.size() != mc.capacity())
 		return false;		// No file end but impossible to find any complete read!
+	}
+
+	if (rec_end + 1 != (int64_t) mc.size())
+		internal_buffer.assign(mc.data() + rec_end + 1, mc.data() + mc.size());
 
-	if (eol_positions[rec_lines - 1] + 1 != (int) mc.size())
-		internal_buffer.assign(mc.data() + eol_positions[rec_lines - 1] + 1, mc.data() + mc.size());
+	mc.resize((size_t) (rec_end + 1));
 
-	mc.resize(eol_positions[rec_lines - 1] + 1);
+	if (gz_index)
+		update_gz_index(mc);
+
+	return true;
+}
+
+// *********************************************************************************************
+// Blocks start at record boundaries, so sync points are the 1st record starts at or after the requested spacing in the block
+// (the index is stored at the file end)
+void CFastXReader::update_gz_index(memory_chunk<char>& mc)
+{
+	const char* data = mc.data();
+	size_t pos = 0;
+	uint64_t read_id = gz_index_read_id;
+
+	while (true)
+	{
+		if (gz_index_out_pos + pos >= gz_index->NextSyncPointOutPos())
+			gz_index->AddSyncPoint(gz_index_out_pos + pos, read_id);
+
+		uint64_t next = gz_index->NextSyncPointOutPos();
+		if (next >= gz_index_out_pos + mc.size())
+			break;
+
+		// Skip EOLs up to the next record start at or after next
+		size_t target = (size_t) (next - gz_index_out_pos);
+		uint64_t no_eols = CEolIndex::Count(data + pos, target - pos);
+		uint64_t to_skip = rec_lines - no_eols % rec_lines;
+
+		if (to_skip == (uint64_t) rec_lines && data[target - 1] == '\n')
+			to_skip = 0;
+
+		size_t p = target;
+		for (uint64_t i = 0; i < to_skip && p < mc.size(); ++i)
+		{
+			auto q = (const char*) memchr(data + p, '\n', mc.size() - p);
+			p = q ? q - data + 1 : mc.size();
+		}
+
+		if (p >= mc.size())
+			break;
+
+		read_id += (no_eols + to_skip) / rec_lines;
+		pos = p;
+	}
+
+	gz_index_out_pos += mc.size();
+	gz_index_read_id += last_block_records;
+
+	finish_gz_index();
+}
+
+// *********************************************************************************************
+// The index is stored once the whole file has been delivered
+void CFastXReader::finish_gz_index()
+{
+	if (internal_buffer.empty() && stream->Eof() && !stream->Error())
+	{
+		gz_index->Finish(gz_index_out_pos, gz_index_read_id);
+		CGzIndexStore::Put(file_name, move(gz_index));
+	}
+}
+
+// *********************************************************************************************
+// Returns a view into the mapped file (no copying) containing complete records only
+bool CFastXReader::ReadMappedBlock(memory_chunk<char>& mc, shared_ptr<CMappedFile>& block_mapping, size_t max_size)
+{
+	if (!mapping || map_pos >= map_end)
+		return false;
+
+	uint64_t len = min<uint64_t>(max_size, map_end - map_pos);
+	int64_t rec_end;
+
+	// The view is extended if there is no complete record within max_size
+	while (true)
+	{
+		mc = memory_chunk<char>(mapping->Data() + map_pos, (size_t) len);
+		mc.resize((size_t) len);
+
+		rec_end = find_last_record_end(mc);
+
+		if (rec_end >= 0 || len == map_end - map_pos)
+			break;
+
+		len = min<uint64_t>(2 * len, map_end - map_pos);
+	}
+
+	if (rec_end < 0)
+		return false;		// Impossible to find any complete read!
+
+	mc.resize((size_t) (rec_end + 1));
+	map_pos += mc.size();
+
+	mapping->WillNeed(map_pos, max_size);
+	block_mapping = mapping;
 
 	return true;
 }
@@ -98,27 +354,255 @@ bool CFastXReader::ReadBlock(memory_chunk<char>& mc)
 // *********************************************************************************************
 bool CFastXReader::Eof()
 {
-	if (in)
-		return internal_buffer.empty() && feof(in);
+	if (mapping)
+		return map_pos >= map_end;
 
-	if (gz_in)
-		return internal_buffer.empty() && gzeof(gz_in);
+	if (!stream)
+		return false;
 
-	return false;
+	return internal_buffer.empty() && stream->Eof();
+}
+
+// *********************************************************************************************
+string CFastXReader::IoDescription() const
+{
+	if (file_name.empty())
+		return "closed";
+
+	if (mapping)
+		return "mmap";
+
+	return stream->Description();
+}
+
+// *********************************************************************************************
+// Returns the position of the EOL terminating the last complete record (-1 if there is none)
+// Only the no. of EOLs is necessary to know how many of them follow the last record, so they are located by a backward scan
+int64_t CFastXReader::find_last_record_end(memory_chunk<char>& mc)
+{
+	uint64_t no_eols = CEolIndex::Count(mc.data(), mc.size());
+
+	last_block_records = 0;
+
+	if (no_eols < (uint64_t) rec_lines)
+		return -1;
+
+	uint64_t to_skip = no_eols % rec_lines;
+	last_block_records = no_eols / rec_lines;
+	const char* data = mc.data();
+
+	for (int64_t i = (int64_t) mc.size() - 1; i >= 0; --i)
+		if (data[i] == '\n' && to_skip-- == 0)
+			return i;
+
+	return -1;
+}
+
+// *********************************************************************************************
+//
+// *********************************************************************************************
+
+// *********************************************************************************************
+// Looks for the 1st record starting at or after pos
+bool CFastXSplitter::find_record_start(FILE* f, uint64_t file_size, uint64_t& pos)
+{
+	vector<char> buf;
+	size_t buf_size = 1 << 16;
+	uint64_t start = pos ? pos - 1 : 0;			// 1 byte back to check whether pos is a line start
+
+	while (true)
+	{
+		buf.resize((size_t) min<uint64_t>(buf_size, file_size - start));
+
+		if (fseek_64(f, start) != 0 || fread(buf.data(), 1, buf.size(), f) != buf.size())
+			return false;
+
+		bool is_last_buf = start + buf.size() == file_size;
+
+		// Line starts in the buffer
+		vector<size_t> line_starts;
+		if (pos == 0)
+			line_starts.emplace_back(0);
+
+		for (size_t i = 0; i + 1 < buf.size(); ++i)
+			if (buf[i] == '\n')
+				line_starts.emplace_back(i + 1);
+
+		for (size_t i = 0; i < line_starts.size(); ++i)
+		{
+			if (buf[line_starts[i]] != first_symbol)
+				continue;
+
+			if (!is_fastq)
+			{
+				pos = start + line_starts[i];
+				return true;
+			}
+
+			// In FASTQ the quality line can also start from '@', so the line 2 lines later must start from '+'
+			if (i + 2 < line_starts.size())
+			{
+				if (buf[line_starts[i + 2]] == '+')
+				{
+					pos = start + line_starts[i];
+					return true;
+				}
+			}
+			else if(!is_last_buf)
+				break;
+		}
+
+		if (is_last_buf)
+		{
+			pos = file_size;
+			return true;
+		}
+
+		buf_size *= 2;
+	}
 }
 
 // *********************************************************************************************
-void CFastXReader::find_last_eols(memory_chunk<char>& mc)
+uint64_t CFastXSplitter::count_records(const string& file_name, uint64_t offset_begin, uint64_t offset_end)
 {
-	fill_n(eol_positions.begin(), rec_lines, -1);
+	FILE* f = fopen(file_name.c_str(), "rb");
+	if (!f)
+		return 0;
 
-	int eol_cnt = 0;
+	if (fseek_64(f, offset_begin) != 0)
+	{
+		fclose(f);
+		return 0;
+	}
+
+	vector<char> buf(BUFFER_SIZE);
+	uint64_t to_read = offset_end - offset_begin;
+	uint64_t no_eols = 0;
+
+	while (to_read)
+	{
+		size_t readed = fread(buf.data(), 1, (size_t) min<uint64_t>(buf.size(), to_read), f);
+		if (!readed)
+			break;
+
+		no_eols += CEolIndex::Count(buf.data(), readed);
+
+		to_read -= readed;
+	}
+
+	fclose(f);
+
+	return no_eols / rec_lines;
+}
+
+// *********************************************************************************************
+// Splits single-member gzipped file at the sync points of its index (offsets of parts are in the uncompressed data)
+bool CFastXSplitter::split_indexed(int file_id, const string& file_name, const CGzIndex& index, uint64_t no_parts, uint64_t min_part_size, vector<file_part_t>& parts)
+{
+	uint64_t out_size = index.OutSize();
+	auto& sync_points = index.SyncPoints();
+
+	no_parts = max<uint64_t>(1, min(no_parts, out_size / max<uint64_t>(min_part_size, 1)));
+
+	vector<gz_sync_point_t> boundaries;
+	boundaries.push_back(gz_sync_point_t{ 0, 0 });
+
+	for (uint64_t i = 1; i < no_parts; ++i)
+	{
+		uint64_t pos = out_size * i / no_parts;
+		auto p = lower_bound(sync_points.begin(), sync_points.end(), pos, [](const gz_sync_point_t& sp, uint64_t x) {return sp.out_pos < x; });
 
-	char* p = mc.data();
+		if (p != sync_points.end() && p->out_pos > boundaries.back().out_pos && p->out_pos < out_size)
+			boundaries.push_back(*p);
+	}
+
+	boundaries.push_back(gz_sync_point_t{ out_size, index.NoRecords() });
+
+	// The last part is read till the end of file (as in the sequential pass)
+	for (size_t i = 0; i + 1 < boundaries.size(); ++i)
+		parts.emplace_back(file_id, file_name, boundaries[i].out_pos, i + 2 == boundaries.size() ? ~0ull : boundaries[i + 1].out_pos,
+			boundaries[i].read_id, boundaries[i + 1].read_id - boundaries[i].read_id);
+
+	return true;
+}
+
+// *********************************************************************************************
+// Splits file into at most no_parts parts of size at least min_part_size (compressed files are split only if they have a gzip index)
+// Each part starts at the record boundary and knows the id of its 1st read
+bool CFastXSplitter::Split(int file_id, const string& file_name, uint64_t no_parts, uint64_t min_part_size, int no_threads, vector<file_part_t>& parts)
+{
+	std::error_code ec;
+	uint64_t file_size = filesystem::file_size(file_name, ec);
+
+	if (!ec && no_parts > 1 && is_gzipped_name(file_name))
+		if (auto index = CGzIndexStore::Get(file_name); index)
+			return split_indexed(file_id, file_name, *index, no_parts, min_part_size, parts);
+
+	if (ec || is_compressed_name(file_name))
+		no_parts = 1;
+	else
+		no_parts = max<uint64_t>(1, min(no_parts, file_size / max<uint64_t>(min_part_size, 1)));
+
+	if (no_parts == 1)
+	{
+		parts.emplace_back(file_id, file_name);
+		return true;
+	}
+
+	FILE* f = fopen(file_name.c_str(), "rb");
+	if (!f)
+		return false;
+
+	vector<uint64_t> boundaries;
+	boundaries.emplace_back(0);
+
+	for (uint64_t i = 1; i < no_parts; ++i)
+	{
+		uint64_t pos = max(file_size * i / no_parts, boundaries.back());
+
+		if (!find_record_start(f, file_size, pos))
+		{
+			fclose(f);
+			return false;
+		}
+
+		if (pos > boundaries.back() && pos < file_size)
+			boundaries.emplace_back(pos);
+	}
+
+	fclose(f);
+
+	boundaries.emplace_back(file_size);
+
+	// Count records in parts to know the ids of the 1st reads
+	vector<uint64_t> no_records(boundaries.size() - 1);
+	vector<thread> threads;
+	atomic<size_t> part_id{ 0 };
+
+	for (int i = 0; i < max(no_threads, 1); ++i)
+		threads.emplace_back([&] {
+			while (true)
+			{
+				size_t id = part_id.fetch_add(1);
+				if (id >= no_records.size())
+					break;
+
+				no_records[id] = count_records(file_name, boundaries[id], boundaries[id + 1]);
+			}
+		});
+
+	for (auto& t : threads)
+		t.join();
+
+	uint64_t first_read_id = 0;
+
+	for (size_t i = 0; i < no_records.size(); ++i)
+	{
+		parts.emplace_back(file_id, file_name, boundaries[i], boundaries[i + 1], first_read_id, no_records[i]);
+		first_read_id += no_records[i];
+	}
 
-	for (int i = 0; i < (int)mc.size(); ++i, ++p)
-		if (*p == '\n')
-			eol_positions[eol_cnt++ % rec_lines] = i;
+	return true;
 }
 
 // *********************************************************************************************
@@ -130,7 +614,36 @@ void CReadReader::Assign(memory_chunk<char>& _block)
 { 
 	block = _block.get_copy(); 
 	is_eob = false;
-	p_start = block.data();
+	line_id = 0;
+
+	CEolIndex::Find(block.data(), block.size(), eols);
+
+	if (block.size() && block.data()[block.size() - 1] != '\n')
+		eols.emplace_back((uint32_t) block.size());
+}
+
+// *********************************************************************************************
+// Returns the next non-empty line (without EOL characters), as empty lines were always skipped
+bool CReadReader::next_line(memory_chunk<char>::iterator& line, uint32_t& len)
+{
+	while (line_id < eols.size())
+	{
+		size_t start = line_start(line_id);
+		size_t end = eols[line_id++];
+
+		while (end > start && block.data()[end - 1] == '\r')
+			--end;
+
+		if (end > start)
+		{
+			line = block.data() + start;
+			len = (uint32_t) (end - start);
+
+			return true;
+		}
+	}
+
+	return false;
 }
 
 // *********************************************************************************************
@@ -139,92 +652,153 @@ bool CReadReader::GetRead(read_desc_t& read_desc)
 	if (is_eob)
 		return false;
 
-	if (p_start == block.end())
+	size_t rec_line_id = line_id;
+
+	if (!next_line(read_desc.header, read_desc.header_len))
 	{
 		is_eob = true;
 		return false;
 	}
 
-	if (*p_start != first_symbol)
+	if (*read_desc.header != first_symbol)
+	{
+		line_id = rec_line_id;
 		return false;
+	}
 
-	auto p = p_start;
-//	auto p_end = block.end();
+	if (!next_line(read_desc.bases, read_desc.bases_len))
+		return false;
 
-	read_desc.header = p;
+	if (is_fastq)
+	{
+		if (!next_line(read_desc.plus, read_desc.plus_len))
+			return false;
 
-	if (!find_eol(p))
-		return false;
+		if (!next_line(read_desc.quality, read_desc.quality_len))
+			return false;
+	}
 
-	skip_eols(p);
+	return true;
+}
 
-	read_desc.bases = p;
+// *********************************************************************************************
+// Header, bases and qualities are taken directly from the line index, so other lines are not tokenised
+// Records with empty lines, CRs or missing '+' are left to GetRead
+bool CReadReader::GetBases(read_desc_t& read_desc)
+{
+	if (is_eob || line_id + rec_lines > eols.size())
+		return GetRead(read_desc);
 
-	if (!find_eol(p))
-		return false;
+	const char* data = block.data();
+	size_t h = line_start(line_id);
+	size_t b = eols[line_id] + 1;
+	size_t b_end = eols[line_id + 1];
 
-	skip_eols(p);
+	bool is_plain = data[h] == first_symbol && data[eols[line_id] - 1] != '\r' && b_end > b && data[b_end - 1] != '\r';
 
-	if (is_fastq)
+	size_t q = 0, q_end = 0;
+
+	if (is_plain && is_fastq)
 	{
-		read_desc.plus = p;
-		if (!find_eol(p))
-			return false;
+		q = eols[line_id + 2] + 1;
+		q_end = eols[line_id + 3];
 
-		skip_eols(p);
+		is_plain = data[b_end + 1] == '+' && q_end > q && !(q_end == q + 1 && data[q] == '\r');
 
-		read_desc.quality = p;
+		while (q_end > q && data[q_end - 1] == '\r')
+			--q_end;
+	}
 
-		if (!find_eol(p))
-			return false;
+	if (!is_plain)
+		return GetRead(read_desc);
 
-		skip_eols(p);
-	}
+	read_desc.header = block.data() + h;
+	read_desc.header_len = (uint32_t) (eols[line_id] - h);
+	read_desc.bases = block.data() + b;
+	read_desc.bases_len = (uint32_t) (b_end - b);
+	read_desc.quality = block.data() + q;
+	read_desc.quality_len = (uint32_t) (q_end - q);
 
-	p_start = p;
+	line_id += rec_lines;
 
 	return true;
 }
 
 // *********************************************************************************************
-bool CReadReader::Eob()
+// Record starting at line id has the header symbol and no empty (or CR only) lines, so it is exactly rec_lines long
+bool CReadReader::is_plain_record(size_t id) const
 {
-	return is_eob;
+	const char* data = block.data();
+
+	if (data[line_start(id)] != first_symbol)
+		return false;
+
+	for (int i = 1; i < rec_lines; ++i)
+	{
+		size_t start = eols[id + i - 1] + 1;
+
+		if (start == eols[id + i] || data[start] == '\r')
+			return false;
+	}
+
+	return true;
 }
 
 // *********************************************************************************************
-bool CReadReader::ShrinkBlock()
+// Plain records are skipped by the line index only, other ones are parsed by GetRead
+uint64_t CReadReader::SkipReads(uint64_t n)
 {
-	copy(p_start, block.end(), block.begin());
-	block.resize(block.end() - p_start);
+	uint64_t skipped = 0;
+	read_desc_t read_desc;
 
-	return true;
+	while (skipped < n)
+	{
+		if (!is_eob && line_id + rec_lines <= eols.size() && is_plain_record(line_id))
+			line_id += rec_lines;
+		else if (!GetRead(read_desc))
+			break;
+
+		++skipped;
+	}
+
+	return skipped;
 }
 
 // *********************************************************************************************
-bool CReadReader::find_eol(memory_chunk<char>::iterator& iter)
+// Reads are counted in the same way as they are parsed by GetRead, so the count is exact also for irregular records
+uint64_t CReadReader::CountReads()
 {
-	auto p_end = block.end();
+	size_t prev_line_id = line_id;
+	bool prev_is_eob = is_eob;
 
-	if (iter == p_end)
-		return false;
+	uint64_t no_reads = SkipReads(~0ull);
 
-	for (; iter != p_end; ++iter)
-		if (*iter == '\n' || *iter == '\r')
-			break;
+	line_id = prev_line_id;
+	is_eob = prev_is_eob;
 
-	return true;
+	return no_reads;
 }
 
 // *********************************************************************************************
-// Skip EOLs and change them into '\0' for easier parsing
-void CReadReader::skip_eols(memory_chunk<char>::iterator& iter)
+bool CReadReader::Eob()
 {
-	while (iter != block.end() && *iter != 0)
-		if (*iter == '\n' || *iter == '\r')
-			*iter++ = 0;
-		else
-			break;
+	return is_eob;
+}
+
+// *********************************************************************************************
+bool CReadReader::ShrinkBlock()
+{
+	size_t start = line_start(line_id);
+
+	copy(block.begin() + start, block.end(), block.begin());
+	block.resize(block.size() - start);
+
+	eols.erase(eols.begin(), eols.begin() + line_id);
+	for (auto& x : eols)
+		x -= (uint32_t) start;
+	line_id = 0;
+
+	return true;
 }
 
 // EOF
@@ -5,96 +5,258 @@
 #include <zlib-ng/zlib.h>
 #include <vector>
 #include <array>
+#include <memory>
+#include <cinttypes>
 
 #include <refresh/memory_chunk/lib/memory_chunk.h>
+#include "parallel_gz_reader.h"
+#include "parallel_zstd_reader.h"
+#include "bam_reader.h"
+#include "eol_index.h"
 
 using namespace std;
 using namespace refresh;
 
+// *********************************************************************************************
+// Read-only memory mapping of the whole file
+class CMappedFile
+{
+	char* data = nullptr;
+	uint64_t size = 0;
+
+public:
+	CMappedFile() = default;
+	CMappedFile(const CMappedFile&) = delete;
+	CMappedFile& operator=(const CMappedFile&) = delete;
+	~CMappedFile();
+
+	bool Open(const string& file_name);
+
+	char* Data() const { return data; }
+	uint64_t Size() const { return size; }
+
+	void WillNeed(uint64_t offset, uint64_t length);
+};
+
+// *********************************************************************************************
+// Block of input data passed from reading to parsing threads
+// If mapping is set, mc is a view into the mapped file, otherwise it comes from the memory pool
+struct input_block_t
+{
+	int part_id = -1;
+	int reader_id = -1;				// owner of the memory chunk (if not mapped)
+	uint64_t block_no = 0;			// no. of the block within the part
+	memory_chunk<char> mc;
+	shared_ptr<CMappedFile> mapping;
+
+	input_block_t() = default;
+	input_block_t(int part_id, int reader_id, uint64_t block_no) : part_id(part_id), reader_id(reader_id), block_no(block_no) {}
+	input_block_t(input_block_t&&) = default;
+	input_block_t& operator=(input_block_t&&) = default;
+};
+
 // *********************************************************************************************
 class CFastXReader
 {
 protected:
-	const size_t BUFFER_SIZE = 64 << 20;
-	const size_t ZLIB_BUFFER_SIZE = 32 << 20;
-
-	FILE* in = nullptr;
-	gzFile gz_in = nullptr;
-	bool is_gzipped = false;
+	unique_ptr<CAsyncFileReader> in;			// kept between files, as it owns the read-ahead buffers
+	unique_ptr<CInputStream> decoder;			// gzip, zstd or BAM decoder
+	CInputStream* stream = nullptr;				// source of the current file (if not mapped)
 	bool is_fastq = true;
 	int rec_lines;
+	int no_gz_threads;
+	gz_backend_t gz_backend;
+	bool use_mmap;
+	io_mode_t io_mode;
+	bool direct_io;
+	int no_io_buffers;
+
+	bam_view_t bam_view = bam_view_t::none;
+	uint32_t bam_cbc_len = 0;
+	uint32_t bam_umi_len = 0;
+
+	shared_ptr<CMappedFile> mapping;
+	uint64_t map_pos = 0;
+	uint64_t map_end = 0;
+
+	uint64_t last_block_records = 0;
+
+	unique_ptr<CGzIndex> gz_index;				// index of a single-member gzip file built during sequential reading
+	uint64_t gz_index_out_pos = 0;				// uncompressed data and records delivered so far
+	uint64_t gz_index_read_id = 0;
 
 	string file_name;
 
-	array<int, 4> eol_positions;
 	vector<char> internal_buffer;
 
 	void close();
+	bool open_mapped(const string& _file_name);
 
 	bool is_gzipped_name(const string& fn)
 	{
 		return fn.size() > 3 && fn.substr(fn.size() - 3, 3) == ".gz";
 	}
 
-	void find_last_eols(memory_chunk<char>& mc);
+	bool is_zstd_name(const string& fn)
+	{
+		return fn.size() > 4 && fn.substr(fn.size() - 4, 4) == ".zst";
+	}
+
+	int64_t find_last_record_end(memory_chunk<char>& mc);
+	void update_gz_index(memory_chunk<char>& mc);
+	void finish_gz_index();
 
 public:
-	CFastXReader(bool is_fastq) : 
+	CFastXReader(bool is_fastq, int no_gz_threads = 1, gz_backend_t gz_backend = gz_backend_t::automatic, bool use_mmap = false,
+		io_mode_t io_mode = io_mode_t::automatic, bool direct_io = false, int no_io_buffers = 4) : 
 		is_fastq(is_fastq) ,
-		rec_lines(is_fastq ? 4 : 2)
+		rec_lines(is_fastq ? 4 : 2),
+		no_gz_threads(no_gz_threads),
+		gz_backend(gz_backend),
+		use_mmap(use_mmap),
+		io_mode(io_mode),
+		direct_io(direct_io),
+		no_io_buffers(no_io_buffers)
 	{}
 	~CFastXReader() {
 		close();
 	}
 
-	bool Open(const string& _file_name);
+	// Files opened after setting a view other than none are decoded as BAM
+	void SetBamView(bam_view_t view, uint32_t cbc_len, uint32_t umi_len)
+	{
+		bam_view = view;
+		bam_cbc_len = cbc_len;
+		bam_umi_len = umi_len;
+	}
+
+	// Offsets of gzipped files are in the uncompressed data (the file must have an index then)
+	bool Open(const string& _file_name, uint64_t offset_begin = 0, uint64_t offset_end = ~0ull);
 	void Close();
 
-	bool ReadBlock(memory_chunk<char>& mc);
+	bool ReadBlock(memory_chunk<char>& mc, size_t max_size = ~(size_t) 0);		// max_size is a fill target (the block can be extended to complete a record)
+	bool ReadMappedBlock(memory_chunk<char>& mc, shared_ptr<CMappedFile>& block_mapping, size_t max_size);
+	uint64_t LastBlockRecords() const { return last_block_records; }	// no. of complete records in the last block
+	bool IsMapped() const { return mapping != nullptr; }
+	string IoDescription() const;
 	bool Eof();
 };
 
 // *********************************************************************************************
+// Part of input file (range of complete records)
+struct file_part_t
+{
+	int file_id;
+	string file_name;
+	uint64_t offset_begin;
+	uint64_t offset_end;				// ~0ull means till the end of file
+	uint64_t first_read_id;				// id of the 1st read of the part (in the file numbering)
+	uint64_t first_valid_read_id;		// id of the 1st read of the part after relabelling (valid reads only)
+	uint64_t no_reads;
+
+	file_part_t(int file_id, const string& file_name, uint64_t offset_begin = 0, uint64_t offset_end = ~0ull, uint64_t first_read_id = 0, uint64_t no_reads = 0) :
+		file_id(file_id),
+		file_name(file_name),
+		offset_begin(offset_begin),
+		offset_end(offset_end),
+		first_read_id(first_read_id),
+		first_valid_read_id(0),
+		no_reads(no_reads)
+	{}
+};
+
+// *********************************************************************************************
+// Splits uncompressed FASTQ/FASTA file into parts starting at record boundaries
+class CFastXSplitter
+{
+	const size_t BUFFER_SIZE = 16 << 20;
+
+	bool is_fastq;
+	int rec_lines;
+	char first_symbol;
+
+	bool is_compressed_name(const string& fn)
+	{
+		return (fn.size() > 3 && fn.substr(fn.size() - 3, 3) == ".gz") || (fn.size() > 4 && (fn.substr(fn.size() - 4, 4) == ".zst" || fn.substr(fn.size() - 4, 4) == ".bam"));
+	}
+
+	bool is_gzipped_name(const string& fn)
+	{
+		return fn.size() > 3 && fn.substr(fn.size() - 3, 3) == ".gz";
+	}
+
+	bool find_record_start(FILE* f, uint64_t file_size, uint64_t& pos);
+	uint64_t count_records(const string& file_name, uint64_t offset_begin, uint64_t offset_end);
+	bool split_indexed(int file_id, const string& file_name, const CGzIndex& index, uint64_t no_parts, uint64_t min_part_size, vector<file_part_t>& parts);
+
+public:
+	CFastXSplitter(bool is_fastq) :
+		is_fastq(is_fastq),
+		rec_lines(is_fastq ? 4 : 2),
+		first_symbol(is_fastq ? '@' : '>')
+	{}
+
+	bool Split(int file_id, const string& file_name, uint64_t no_parts, uint64_t min_part_size, int no_threads, vector<file_part_t>& parts);
+};
+
+// *********************************************************************************************
+// Lines are not terminated by '\0' (blocks can be read-only views), so lengths must be used
 struct read_desc_t
 {
 	memory_chunk<char>::iterator header;
 	memory_chunk<char>::iterator bases;
 	memory_chunk<char>::iterator plus;
 	memory_chunk<char>::iterator quality;
+	uint32_t header_len;
+	uint32_t bases_len;
+	uint32_t plus_len;
+	uint32_t quality_len;
 
 	read_desc_t() :
 		header(nullptr),
 		bases(nullptr),
 		plus(nullptr),
-		quality(nullptr)
+		quality(nullptr),
+		header_len(0),
+		bases_len(0),
+		plus_len(0),
+		quality_len(0)
 	{}
 
 	read_desc_t(memory_chunk<char>::iterator _header, memory_chunk<char>::iterator _bases, memory_chunk<char>::iterator _plus, memory_chunk<char>::iterator _quality) :
 		header(_header),
 		bases(_bases),
 		plus(_plus),
-		quality(_quality)
+		quality(_quality),
+		header_len(0),
+		bases_len(0),
+		plus_len(0),
+		quality_len(0)
 	{}
 
 	read_desc_t(const read_desc_t&) = default;
 };
 
 // *********************************************************************************************
+// Line ends of the block are indexed once (in Assign), so GetRead only looks up line boundaries
 class CReadReader
 {
 	memory_chunk<char> block;
-	memory_chunk<char>::iterator p_start;
+	vector<uint32_t> eols;				// line ends (the last line can be unterminated, so its end is the block end)
+	size_t line_id;						// next line to read
 
 	bool is_eob;
 	bool is_fastq;
 	int rec_lines;
 	char first_symbol;
 
-	bool find_eol(memory_chunk<char>::iterator& iter);
-	void skip_eols(memory_chunk<char>::iterator& iter);
+	size_t line_start(size_t id) const { return id ? eols[id - 1] + 1 : 0; }
+	bool is_plain_record(size_t id) const;
+	bool next_line(memory_chunk<char>::iterator& line, uint32_t& len);
 
 public:
 	CReadReader(bool is_fastq) : 
+		line_id(0),
 		is_eob(false),
 		is_fastq(is_fastq),
 		rec_lines(is_fastq ? 4 : 2),
@@ -102,6 +264,11 @@ public:
 	{};
 	void Assign(memory_chunk<char>& _block);
 	bool GetRead(read_desc_t &read_desc);
+	bool GetBases(read_desc_t& read_desc);		// sets header, bases and quality only (not the '+' line)
+	uint64_t SkipReads(uint64_t n);				// returns the no. of skipped reads (less than n at the block end)
+	uint64_t CountReads();						// no. of reads from the current position to the block end (the position is kept)
+	uint64_t RemainingRecords() const { return (eols.size() - min(line_id, eols.size())) / rec_lines; }		// upper bound
+	const char* BlockEnd() const { return block.data() + block.size(); }
 	bool Eob();
 	bool ShrinkBlock();
 };
@@ -0,0 +1,321 @@
+#include <cstring>
+#include <chrono>
+#include <algorithm>
+#include "gz_backends.h"
+#include "params.h"
+
+using namespace std::chrono;
+
+// *********************************************************************************************
+CGzBackendZlib::CGzBackendZlib()
+{
+	memset(&strm, 0, sizeof(strm));
+}
+
+// *********************************************************************************************
+CGzBackendZlib::~CGzBackendZlib()
+{
+	if (initialized)
+		inflateEnd(&strm);
+}
+
+// *********************************************************************************************
+bool CGzBackendZlib::init()
+{
+	if (initialized)
+		return inflateReset(&strm) == Z_OK;
+
+	if (inflateInit2(&strm, 16 + MAX_WBITS) != Z_OK)
+		return false;
+
+	initialized = true;
+
+	return true;
+}
+
+// *********************************************************************************************
+bool CGzBackendZlib::BeginMember()
+{
+	return init();
+}
+
+// *********************************************************************************************
+gz_status_t CGzBackendZlib::Inflate(const uint8_t* in, size_t in_size, uint8_t* out, size_t out_size, size_t& in_used, size_t& out_used)
+{
+	strm.next_in = (Bytef*) in;
+	strm.avail_in = (uInt) in_size;
+	strm.next_out = (Bytef*) out;
+	strm.avail_out = (uInt) out_size;
+
+	int r = inflate(&strm, Z_NO_FLUSH);
+
+	in_used = in_size - strm.avail_in;
+	out_used = out_size - strm.avail_out;
+
+	if (r == Z_STREAM_END)
+		return gz_status_t::member_end;
+	if (r == Z_OK || r == Z_BUF_ERROR)
+		return gz_status_t::ok;
+
+	return gz_status_t::error;
+}
+
+// *********************************************************************************************
+gz_status_t CGzBackendZlib::DecompressMember(const uint8_t* in, size_t in_size, uint8_t* out, size_t out_size, size_t& in_used, size_t& out_used)
+{
+	if (!init())
+		return gz_status_t::error;
+
+	strm.next_in = (Bytef*) in;
+	strm.avail_in = (uInt) in_size;
+	strm.next_out = (Bytef*) out;
+	strm.avail_out = (uInt) out_size;
+
+	int r = inflate(&strm, Z_FINISH);
+
+	in_used = in_size - strm.avail_in;
+	out_used = out_size - strm.avail_out;
+
+	if (r == Z_STREAM_END)
+		return gz_status_t::ok;
+	if (r == Z_BUF_ERROR && strm.avail_out == 0)
+		return gz_status_t::insufficient_space;
+
+	return gz_status_t::error;
+}
+
+#ifdef REFRESH_USE_IGZIP
+// *********************************************************************************************
+//
+// *********************************************************************************************
+
+// *********************************************************************************************
+CGzBackendIgzip::CGzBackendIgzip()
+{
+	isal_inflate_init(&state);
+	state.crc_flag = ISAL_GZIP;
+}
+
+// *********************************************************************************************
+bool CGzBackendIgzip::BeginMember()
+{
+	isal_inflate_reset(&state);
+	state.crc_flag = ISAL_GZIP;
+
+	return true;
+}
+
+// *********************************************************************************************
+gz_status_t CGzBackendIgzip::Inflate(const uint8_t* in, size_t in_size, uint8_t* out, size_t out_size, size_t& in_used, size_t& out_used)
+{
+	state.next_in = (uint8_t*) in;
+	state.avail_in = (uint32_t) in_size;
+	state.next_out = out;
+	state.avail_out = (uint32_t) out_size;
+
+	int r = isal_inflate(&state);
+
+	in_used = in_size - state.avail_in;
+	out_used = out_size - state.avail_out;
+
+	if (r != ISAL_DECOMP_OK)
+		return gz_status_t::error;
+	if (state.block_state == ISAL_BLOCK_FINISH)
+		return gz_status_t::member_end;
+
+	return gz_status_t::ok;
+}
+
+// *********************************************************************************************
+gz_status_t CGzBackendIgzip::DecompressMember(const uint8_t* in, size_t in_size, uint8_t* out, size_t out_size, size_t& in_used, size_t& out_used)
+{
+	BeginMember();
+
+	auto r = Inflate(in, in_size, out, out_size, in_used, out_used);
+
+	if (r == gz_status_t::member_end)
+		return gz_status_t::ok;
+	if (r == gz_status_t::ok && out_used == out_size)
+		return gz_status_t::insufficient_space;
+
+	return gz_status_t::error;
+}
+#endif
+
+// *********************************************************************************************
+//
+// *********************************************************************************************
+
+// *********************************************************************************************
+CGzBackendLibdeflate::CGzBackendLibdeflate()
+{
+	decompressor = libdeflate_alloc_decompressor();
+}
+
+// *********************************************************************************************
+CGzBackendLibdeflate::~CGzBackendLibdeflate()
+{
+	libdeflate_free_decompressor(decompressor);
+}
+
+// *********************************************************************************************
+gz_status_t CGzBackendLibdeflate::DecompressMember(const uint8_t* in, size_t in_size, uint8_t* out, size_t out_size, size_t& in_used, size_t& out_used)
+{
+	in_used = out_used = 0;
+
+	auto r = libdeflate_gzip_decompress_ex(decompressor, in, in_size, out, out_size, &in_used, &out_used);
+
+	if (r == LIBDEFLATE_SUCCESS)
+		return gz_status_t::ok;
+	if (r == LIBDEFLATE_INSUFFICIENT_SPACE)
+		return gz_status_t::insufficient_space;
+
+	return gz_status_t::error;
+}
+
+// *********************************************************************************************
+//
+// *********************************************************************************************
+
+// *********************************************************************************************
+unique_ptr<CGzBackend> make_gz_backend(gz_backend_t type)
+{
+	switch (type)
+	{
+	case gz_backend_t::zlib:
+		return make_unique<CGzBackendZlib>();
+#ifdef REFRESH_USE_IGZIP
+	case gz_backend_t::igzip:
+		return make_unique<CGzBackendIgzip>();
+#endif
+	case gz_backend_t::libdeflate:
+		return make_unique<CGzBackendLibdeflate>();
+	default:
+		return nullptr;
+	}
+}
+
+// *********************************************************************************************
+vector<gz_backend_t> available_gz_backends()
+{
+#ifdef REFRESH_USE_IGZIP
+	return { gz_backend_t::zlib, gz_backend_t::igzip, gz_backend_t::libdeflate };
+#else
+	return { gz_backend_t::zlib, gz_backend_t::libdeflate };
+#endif
+}
+
+// *********************************************************************************************
+bool is_gz_backend_available(gz_backend_t type)
+{
+	auto backends = available_gz_backends();
+
+	return type == gz_backend_t::automatic || find(backends.begin(), backends.end(), type) != backends.end();
+}
+
+// *********************************************************************************************
+//
+// *********************************************************************************************
+mutex CGzBackendSelector::mtx;
+bool CGzBackendSelector::is_selected = false;
+gz_backend_t CGzBackendSelector::stream_backend = gz_backend_t::zlib;
+gz_backend_t CGzBackendSelector::member_backend = gz_backend_t::libdeflate;
+string CGzBackendSelector::report;
+
+// *********************************************************************************************
+// Each backend decompresses the beginning of the 1st member (streaming backends get at most SAMPLE_IN_SIZE bytes of input)
+// The output is limited to SAMPLE_OUT_SIZE bytes, so the benchmark takes a few tens of ms at most
+void CGzBackendSelector::Select(const uint8_t* in, size_t in_size)
+{
+	lock_guard<mutex> lck(mtx);
+
+	if (is_selected)
+		return;
+
+	vector<uint8_t> out(SAMPLE_OUT_SIZE);
+	double best_stream_speed = 0;
+	double best_member_speed = 0;
+
+	report = "Decompression backends benchmark:";
+
+	for (auto type : available_gz_backends())
+	{
+		auto backend = make_gz_backend(type);
+		size_t in_used, out_used;
+		gz_status_t status;
+
+		auto t_start = high_resolution_clock::now();
+
+		if (backend->CanStream())
+		{
+			if (!backend->BeginMember())
+				continue;
+			status = backend->Inflate(in, min(in_size, SAMPLE_IN_SIZE), out.data(), out.size(), in_used, out_used);
+		}
+		else
+		{
+			status = backend->DecompressMember(in, in_size, out.data(), out.size(), in_used, out_used);
+			if (status == gz_status_t::insufficient_space)
+				out_used = out.size();			// the whole buffer was filled before the member end
+		}
+
+		double time = duration<double>(high_resolution_clock::now() - t_start).count();
+
+		if (status == gz_status_t::error || out_used == 0)
+			continue;
+
+		double speed = (double) out_used / max(time, 1e-9);
+
+		report += " " + to_string(type) + ": " + to_string((int) (speed / 1e6)) + " MB/s";
+
+		if (backend->CanStream() && speed > best_stream_speed)
+		{
+			best_stream_speed = speed;
+			stream_backend = type;
+		}
+
+		if (speed > best_member_speed)
+		{
+			best_member_speed = speed;
+			member_backend = type;
+		}
+	}
+
+	report += "\nSelected backends: " + to_string(stream_backend) + " (streams), " + to_string(member_backend) + " (members)\n";
+
+	is_selected = true;
+}
+
+// *********************************************************************************************
+bool CGzBackendSelector::IsSelected()
+{
+	lock_guard<mutex> lck(mtx);
+
+	return is_selected;
+}
+
+// *********************************************************************************************
+gz_backend_t CGzBackendSelector::StreamBackend()
+{
+	lock_guard<mutex> lck(mtx);
+
+	return stream_backend;
+}
+
+// *********************************************************************************************
+gz_backend_t CGzBackendSelector::MemberBackend()
+{
+	lock_guard<mutex> lck(mtx);
+
+	return member_backend;
+}
+
+// *********************************************************************************************
+string CGzBackendSelector::Report()
+{
+	lock_guard<mutex> lck(mtx);
+
+	return report;
+}
+
+// EOF
@@ -0,0 +1,123 @@
+#pragma once
+
+#include <cinttypes>
+#include <string>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <zlib-ng/zlib.h>
+#include <libdeflate.h>
+
+#ifdef REFRESH_USE_IGZIP
+#include <igzip_lib.h>
+#endif
+
+#include "../common/defs.h"
+
+using namespace std;
+
+enum class gz_status_t { ok, member_end, insufficient_space, error };
+
+// *********************************************************************************************
+// Base class of gzip decompression backends
+class CGzBackend
+{
+public:
+	virtual ~CGzBackend() = default;
+
+	virtual gz_backend_t Type() const = 0;
+	virtual bool CanStream() const { return true; }
+
+	// Streaming decompression of a single member (Inflate can be called many times after BeginMember)
+	virtual bool BeginMember() = 0;
+	virtual gz_status_t Inflate(const uint8_t* in, size_t in_size, uint8_t* out, size_t out_size, size_t& in_used, size_t& out_used) = 0;
+
+	// Decompression of a complete member (the input can contain also the next members)
+	virtual gz_status_t DecompressMember(const uint8_t* in, size_t in_size, uint8_t* out, size_t out_size, size_t& in_used, size_t& out_used) = 0;
+};
+
+// *********************************************************************************************
+class CGzBackendZlib : public CGzBackend
+{
+	z_stream strm;
+	bool initialized = false;
+
+	bool init();
+
+public:
+	CGzBackendZlib();
+	~CGzBackendZlib() override;
+
+	gz_backend_t Type() const override { return gz_backend_t::zlib; }
+
+	bool BeginMember() override;
+	gz_status_t Inflate(const uint8_t* in, size_t in_size, uint8_t* out, size_t out_size, size_t& in_used, size_t& out_used) override;
+	gz_status_t DecompressMember(const uint8_t* in, size_t in_size, uint8_t* out, size_t out_size, size_t& in_used, size_t& out_used) override;
+};
+
+#ifdef REFRESH_USE_IGZIP
+// *********************************************************************************************
+class CGzBackendIgzip : public CGzBackend
+{
+	inflate_state state;
+
+public:
+	CGzBackendIgzip();
+
+	gz_backend_t Type() const override { return gz_backend_t::igzip; }
+
+	bool BeginMember() override;
+	gz_status_t Inflate(const uint8_t* in, size_t in_size, uint8_t* out, size_t out_size, size_t& in_used, size_t& out_used) override;
+	gz_status_t DecompressMember(const uint8_t* in, size_t in_size, uint8_t* out, size_t out_size, size_t& in_used, size_t& out_used) override;
+};
+#endif
+
+// *********************************************************************************************
+// libdeflate decompresses whole members only, so it cannot be used for streaming
+class CGzBackendLibdeflate : public CGzBackend
+{
+	libdeflate_decompressor* decompressor;
+
+public:
+	CGzBackendLibdeflate();
+	~CGzBackendLibdeflate() override;
+
+	gz_backend_t Type() const override { return gz_backend_t::libdeflate; }
+	bool CanStream() const override { return false; }
+
+	bool BeginMember() override { return false; }
+	gz_status_t Inflate(const uint8_t*, size_t, uint8_t*, size_t, size_t& in_used, size_t& out_used) override
+	{
+		in_used = out_used = 0;
+		return gz_status_t::error;
+	}
+	gz_status_t DecompressMember(const uint8_t* in, size_t in_size, uint8_t* out, size_t out_size, size_t& in_used, size_t& out_used) override;
+};
+
+// *********************************************************************************************
+unique_ptr<CGzBackend> make_gz_backend(gz_backend_t type);
+vector<gz_backend_t> available_gz_backends();
+bool is_gz_backend_available(gz_backend_t type);
+
+// *********************************************************************************************
+// Chooses the fastest backends for the host by a short benchmark on the first input data (once per run)
+class CGzBackendSelector
+{
+	static const size_t SAMPLE_IN_SIZE = 4 << 20;
+	static const size_t SAMPLE_OUT_SIZE = 8 << 20;
+
+	static mutex mtx;
+	static bool is_selected;
+	static gz_backend_t stream_backend;
+	static gz_backend_t member_backend;
+	static string report;
+
+public:
+	static void Select(const uint8_t* in, size_t in_size);
+	static bool IsSelected();
+	static gz_backend_t StreamBackend();
+	static gz_backend_t MemberBackend();
+	static string Report();
+};
+
+// EOF
@@ -0,0 +1,408 @@
+#include <iostream>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <algorithm>
+#include "gz_index.h"
+#include "spool.h"
+
+// *********************************************************************************************
+static bool write_u64(FILE* f, uint64_t x)
+{
+	return fwrite(&x, sizeof(x), 1, f) == 1;
+}
+
+// *********************************************************************************************
+static bool read_u64(FILE* f, uint64_t& x)
+{
+	return fread(&x, sizeof(x), 1, f) == 1;
+}
+
+// *********************************************************************************************
+// Hash of the input path, so files of the same name from different directories have different indexes in a shared directory
+static uint64_t path_hash(const string& path)
+{
+	uint64_t h = 0xcbf29ce484222325ull;		// FNV-1a
+
+	for (auto c : path)
+	{
+		h ^= (uint8_t) c;
+		h *= 0x100000001b3ull;
+	}
+
+	return h;
+}
+
+// *********************************************************************************************
+bool CGzIndex::file_fingerprint(const string& file_name, uint64_t& size, int64_t& time)
+{
+	std::error_code ec;
+
+	size = filesystem::file_size(file_name, ec);
+	if (ec)
+		return false;
+
+	auto t = filesystem::last_write_time(file_name, ec);
+	if (ec)
+		return false;
+
+	time = (int64_t) t.time_since_epoch().count();
+
+	return true;
+}
+
+// *********************************************************************************************
+void CGzIndex::AddCheckpoint(uint64_t in_pos, uint64_t out_pos, int bits, const uint8_t* window, size_t window_size)
+{
+	checkpoints.push_back(gz_checkpoint_t{ in_pos, out_pos, bits, vector<uint8_t>(window, window + window_size) });
+}
+
+// *********************************************************************************************
+void CGzIndex::AddSyncPoint(uint64_t out_pos, uint64_t read_id)
+{
+	sync_points.push_back(gz_sync_point_t{ out_pos, read_id });
+}
+
+// *********************************************************************************************
+// The last checkpoint at or before out_pos (the 1st one is at the beginning of the deflate data)
+const gz_checkpoint_t& CGzIndex::FindCheckpoint(uint64_t out_pos) const
+{
+	auto p = upper_bound(checkpoints.begin(), checkpoints.end(), out_pos, [](uint64_t x, const gz_checkpoint_t& c) {return x < c.out_pos; });
+
+	return p == checkpoints.begin() ? checkpoints.front() : *(p - 1);
+}
+
+// *********************************************************************************************
+// Windows are stored deflated, as they are highly compressible (FASTQ text)
+bool CGzIndex::Save(const string& index_name, const string& file_name) const
+{
+	uint64_t size;
+	int64_t time;
+
+	if (!IsValid() || !file_fingerprint(file_name, size, time))
+		return false;
+
+	string tmp_name = index_name + ".tmp";
+
+	FILE* f = fopen(tmp_name.c_str(), "wb");
+	if (!f)
+		return false;
+
+	bool ok = write_u64(f, MAGIC) && write_u64(f, size) && write_u64(f, (uint64_t) time) && write_u64(f, out_size) && write_u64(f, no_records) &&
+		write_u64(f, checkpoints.size()) && write_u64(f, sync_points.size());
+
+	vector<uint8_t> packed;
+
+	for (size_t i = 0; ok && i < checkpoints.size(); ++i)
+	{
+		auto& c = checkpoints[i];
+
+		uLongf packed_size = compressBound((uLong) c.window.size());
+		packed.resize(packed_size);
+
+		ok = compress2(packed.data(), &packed_size, c.window.data(), (uLong) c.window.size(), 1) == Z_OK &&
+			write_u64(f, c.in_pos) && write_u64(f, c.out_pos) && write_u64(f, (uint64_t) c.bits) &&
+			write_u64(f, c.window.size()) && write_u64(f, packed_size) &&
+			fwrite(packed.data(), 1, packed_size, f) == packed_size;
+	}
+
+	for (size_t i = 0; ok && i < sync_points.size(); ++i)
+		ok = write_u64(f, sync_points[i].out_pos) && write_u64(f, sync_points[i].read_id);
+
+	ok &= fclose(f) == 0;
+
+	std::error_code ec;
+
+	if (ok)
+		filesystem::rename(tmp_name, index_name, ec);
+
+	if (!ok || ec)
+	{
+		filesystem::remove(tmp_name, ec);
+		return false;
+	}
+
+	return true;
+}
+
+// *********************************************************************************************
+// Fails if the index does not exist, is damaged or was made for another version of the file
+bool CGzIndex::Load(const string& index_name, const string& file_name)
+{
+	uint64_t size;
+	int64_t time;
+
+	if (!file_fingerprint(file_name, size, time))
+		return false;
+
+	FILE* f = fopen(index_name.c_str(), "rb");
+	if (!f)
+		return false;
+
+	uint64_t magic = 0, idx_size = 0, idx_time = 0, no_checkpoints = 0, no_sync_points = 0;
+
+	bool ok = read_u64(f, magic) && read_u64(f, idx_size) && read_u64(f, idx_time) && read_u64(f, out_size) && read_u64(f, no_records) &&
+		read_u64(f, no_checkpoints) && read_u64(f, no_sync_points) &&
+		magic == MAGIC && idx_size == size && (int64_t) idx_time == time;
+
+	checkpoints.clear();
+	sync_points.clear();
+
+	vector<uint8_t> packed;
+
+	for (uint64_t i = 0; ok && i < no_checkpoints; ++i)
+	{
+		uint64_t in_pos, out_pos, bits, window_size, packed_size;
+
+		ok = read_u64(f, in_pos) && read_u64(f, out_pos) && read_u64(f, bits) && read_u64(f, window_size) && read_u64(f, packed_size) &&
+			bits < 8 && window_size <= (1u << MAX_WBITS) && packed_size <= compressBound((uLong) window_size);
+
+		if (!ok)
+			break;
+
+		packed.resize(packed_size);
+		ok = fread(packed.data(), 1, packed_size, f) == packed_size;
+
+		checkpoints.push_back(gz_checkpoint_t{ in_pos, out_pos, (int) bits, vector<uint8_t>(window_size) });
+
+		uLongf unpacked_size = (uLongf) window_size;
+
+		ok = ok && uncompress(checkpoints.back().window.data(), &unpacked_size, packed.data(), (uLong) packed_size) == Z_OK && unpacked_size == window_size;
+	}
+
+	for (uint64_t i = 0; ok && i < no_sync_points; ++i)
+	{
+		gz_sync_point_t sp;
+		ok = read_u64(f, sp.out_pos) && read_u64(f, sp.read_id);
+		sync_points.push_back(sp);
+	}
+
+	fclose(f);
+
+	is_valid = ok;
+
+	return IsValid();
+}
+
+// *********************************************************************************************
+//
+// *********************************************************************************************
+
+// *********************************************************************************************
+CGzIndexInflater::CGzIndexInflater(CGzIndex* index) :
+	index(index)
+{
+	memset(&strm, 0, sizeof(strm));
+}
+
+// *********************************************************************************************
+CGzIndexInflater::~CGzIndexInflater()
+{
+	if (initialized)
+		inflateEnd(&strm);
+}
+
+// *********************************************************************************************
+bool CGzIndexInflater::init(int window_bits)
+{
+	if (initialized)
+		return inflateReset2(&strm, window_bits) == Z_OK;
+
+	if (inflateInit2(&strm, window_bits) != Z_OK)
+		return false;
+
+	initialized = true;
+
+	return true;
+}
+
+// *********************************************************************************************
+bool CGzIndexInflater::BeginMember()
+{
+	in_base = out_base = 0;
+
+	return init(16 + MAX_WBITS);
+}
+
+// *********************************************************************************************
+// The input must start at checkpoint.in_pos, while the partially consumed byte preceding it is given separately
+bool CGzIndexInflater::BeginAt(const gz_checkpoint_t& checkpoint, uint8_t prev_byte)
+{
+	index = nullptr;
+	in_base = checkpoint.in_pos;
+	out_base = checkpoint.out_pos;
+
+	if (!init(-MAX_WBITS))
+		return false;
+
+	if (checkpoint.bits && inflatePrime(&strm, checkpoint.bits, prev_byte >> (8 - checkpoint.bits)) != Z_OK)
+		return false;
+
+	return checkpoint.window.empty() || inflateSetDictionary(&strm, checkpoint.window.data(), (uInt) checkpoint.window.size()) == Z_OK;
+}
+
+// *********************************************************************************************
+// When building the index, inflate stops at each deflate block boundary (Z_BLOCK), so checkpoints can be made there
+gz_status_t CGzIndexInflater::Inflate(const uint8_t* in, size_t in_size, uint8_t* out, size_t out_size, size_t& in_used, size_t& out_used)
+{
+	strm.next_in = (Bytef*) in;
+	strm.avail_in = (uInt) in_size;
+	strm.next_out = (Bytef*) out;
+	strm.avail_out = (uInt) out_size;
+
+	gz_status_t status = gz_status_t::ok;
+
+	while (true)
+	{
+		int r = inflate(&strm, index ? Z_BLOCK : Z_NO_FLUSH);
+
+		if (r == Z_STREAM_END)
+		{
+			status = gz_status_t::member_end;
+			break;
+		}
+
+		if (r != Z_OK && r != Z_BUF_ERROR)
+		{
+			status = gz_status_t::error;
+			break;
+		}
+
+		if (!index)
+			break;
+
+		uint64_t out_pos = out_base + (out_size - strm.avail_out);
+
+		// At the block boundary (bit 7) that is not the end of the last block (bit 6)
+		if ((strm.data_type & 128) && !(strm.data_type & 64) && out_pos >= index->NextCheckpointOutPos())
+		{
+			uint8_t window[1 << MAX_WBITS];
+			uInt window_size = sizeof(window);
+
+			if (inflateGetDictionary(&strm, window, &window_size) == Z_OK)
+				index->AddCheckpoint(in_base + (in_size - strm.avail_in), out_pos, strm.data_type & 7, window, window_size);
+		}
+
+		if (r == Z_BUF_ERROR || strm.avail_in == 0 || strm.avail_out == 0)
+			break;
+	}
+
+	in_used = in_size - strm.avail_in;
+	out_used = out_size - strm.avail_out;
+
+	in_base += in_used;
+	out_base += out_used;
+
+	return status;
+}
+
+// *********************************************************************************************
+gz_status_t CGzIndexInflater::DecompressMember(const uint8_t*, size_t, uint8_t*, size_t, size_t& in_used, size_t& out_used)
+{
+	in_used = out_used = 0;
+
+	return gz_status_t::error;
+}
+
+// *********************************************************************************************
+//
+// *********************************************************************************************
+
+mutex CGzIndexStore::mtx;
+bool CGzIndexStore::enabled = false;
+string CGzIndexStore::index_path;
+bool CGzIndexStore::verbose = false;
+map<string, shared_ptr<const CGzIndex>> CGzIndexStore::indexes;
+
+// *********************************************************************************************
+string CGzIndexStore::index_name(const string& file_name)
+{
+	if (index_path.empty())
+		return file_name + ".bkcidx";
+
+	std::error_code ec;
+	auto abs_path = filesystem::absolute(file_name, ec);
+	char hash[17];
+	snprintf(hash, sizeof(hash), "%016" PRIx64, path_hash(ec ? file_name : abs_path.string()));
+
+	return (filesystem::path(index_path) / (filesystem::path(file_name).filename().string() + "." + hash + ".bkcidx")).string();
+}
+
+// *********************************************************************************************
+void CGzIndexStore::Configure(bool _enabled, const string& _index_path, bool _verbose)
+{
+	lock_guard<mutex> lck(mtx);
+
+	enabled = _enabled;
+	index_path = _index_path;
+	verbose = _verbose;
+	indexes.clear();
+
+	std::error_code ec;
+	if (enabled && !index_path.empty())
+		filesystem::create_directories(index_path, ec);
+}
+
+// *********************************************************************************************
+bool CGzIndexStore::IsEnabled()
+{
+	lock_guard<mutex> lck(mtx);
+
+	return enabled;
+}
+
+// *********************************************************************************************
+// Missing indexes are also remembered, so the index file is looked for only once
+shared_ptr<const CGzIndex> CGzIndexStore::Get(const string& file_name)
+{
+	lock_guard<mutex> lck(mtx);
+
+	if (!enabled)
+		return nullptr;
+
+	auto p = indexes.find(file_name);
+	if (p != indexes.end())
+		return p->second;
+
+	auto index = make_shared<CGzIndex>();
+
+	if (index->Load(index_name(file_name), file_name))
+	{
+		if (verbose)
+			cerr << "Gzip index of " + file_name + " loaded (" + to_string(index->SyncPoints().size()) + " sync points)\n";
+	}
+	else
+		index.reset();
+
+	indexes[file_name] = index;
+
+	return index;
+}
+
+// *********************************************************************************************
+// Indexes are made for regular files only (streamed inputs cannot be read again anyway)
+bool CGzIndexStore::NeedsIndex(const string& file_name)
+{
+	std::error_code ec;
+
+	return IsEnabled() && !is_streamed_input(file_name) && filesystem::is_regular_file(file_name, ec) && !Get(file_name);
+}
+
+// *********************************************************************************************
+void CGzIndexStore::Put(const string& file_name, unique_ptr<CGzIndex> index)
+{
+	if (!index || !index->IsValid())
+		return;
+
+	lock_guard<mutex> lck(mtx);
+
+	string name = index_name(file_name);
+	bool saved = index->Save(name, file_name);
+
+	if (verbose)
+		cerr << (saved ? "Gzip index of " + file_name + " stored in " + name + "\n" : "Gzip index of " + file_name + " cannot be stored in " + name + "\n");
+
+	indexes[file_name] = move(index);
+}
+
+// EOF
@@ -0,0 +1,121 @@
+#pragma once
+
+#include <cinttypes>
+#include <string>
+#include <vector>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <zlib-ng/zlib.h>
+#include "gz_backends.h"
+
+using namespace std;
+
+// *********************************************************************************************
+// Access point of a single-member gzip stream (as in zran.c from zlib examples), i.e., the start of a deflate block
+struct gz_checkpoint_t
+{
+	uint64_t in_pos;				// offset (in the compressed file) of the 1st complete byte of the block
+	uint64_t out_pos;				// offset in the uncompressed data
+	int bits;						// no. of bits of the block in the byte preceding in_pos (0 if the block is byte-aligned)
+	vector<uint8_t> window;			// last (up to) 32 KB of uncompressed data before out_pos (dictionary of the block)
+};
+
+// *********************************************************************************************
+// Record boundary in the uncompressed data with the no. of records before it
+struct gz_sync_point_t
+{
+	uint64_t out_pos;
+	uint64_t read_id;
+};
+
+// *********************************************************************************************
+// Random-access index of a single-member gzip file
+// Checkpoints allow to start inflating in the middle of the file, while sync points allow to split the file into parts
+// of complete records with known ids of the 1st reads (so read numbering is the same as in a sequential pass)
+class CGzIndex
+{
+	static const uint64_t MAGIC = 0x3130495a47434b42ull;		// "BKCGZI01"
+
+	uint64_t file_size = 0;
+	int64_t file_time = 0;
+	uint64_t out_size = 0;
+	uint64_t no_records = 0;
+	bool is_valid = true;
+
+	vector<gz_checkpoint_t> checkpoints;
+	vector<gz_sync_point_t> sync_points;
+
+	static bool file_fingerprint(const string& file_name, uint64_t& size, int64_t& time);
+
+public:
+	static const uint64_t CHECKPOINT_SPACING = 16 << 20;		// in uncompressed data
+	static const uint64_t SYNC_POINT_SPACING = 8 << 20;
+
+	void AddCheckpoint(uint64_t in_pos, uint64_t out_pos, int bits, const uint8_t* window, size_t window_size);
+	void AddSyncPoint(uint64_t out_pos, uint64_t read_id);
+	void Invalidate() { is_valid = false; }		// e.g., the file is not a single-member gzip
+	void Finish(uint64_t _out_size, uint64_t _no_records) { out_size = _out_size; no_records = _no_records; }
+
+	bool IsValid() const { return is_valid && !checkpoints.empty(); }
+	uint64_t OutSize() const { return out_size; }
+	uint64_t NoRecords() const { return no_records; }
+	uint64_t NextCheckpointOutPos() const { return checkpoints.empty() ? 0 : checkpoints.back().out_pos + CHECKPOINT_SPACING; }
+	uint64_t NextSyncPointOutPos() const { return sync_points.empty() ? 0 : sync_points.back().out_pos + SYNC_POINT_SPACING; }
+
+	const gz_checkpoint_t& FindCheckpoint(uint64_t out_pos) const;
+	const vector<gz_sync_point_t>& SyncPoints() const { return sync_points; }
+
+	bool Save(const string& index_name, const string& file_name) const;
+	bool Load(const string& index_name, const string& file_name);
+};
+
+// *********************************************************************************************
+// zlib inflater that makes checkpoints of the index when inflating the file from the beginning
+// or starts inflating at a checkpoint (raw deflate data, so the gzip trailer is not verified then)
+class CGzIndexInflater : public CGzBackend
+{
+	z_stream strm;
+	bool initialized = false;
+	CGzIndex* index;					// index being built (nullptr when not building)
+
+	uint64_t in_base = 0;				// offsets of the stream start
+	uint64_t out_base = 0;
+
+	bool init(int window_bits);
+
+public:
+	CGzIndexInflater(CGzIndex* index = nullptr);
+	~CGzIndexInflater() override;
+
+	gz_backend_t Type() const override { return gz_backend_t::zlib; }
+
+	bool BeginMember() override;
+	bool BeginAt(const gz_checkpoint_t& checkpoint, uint8_t prev_byte);
+	gz_status_t Inflate(const uint8_t* in, size_t in_size, uint8_t* out, size_t out_size, size_t& in_used, size_t& out_used) override;
+	gz_status_t DecompressMember(const uint8_t* in, size_t in_size, uint8_t* out, size_t out_size, size_t& in_used, size_t& out_used) override;
+};
+
+// *********************************************************************************************
+// Indexes of gzipped inputs shared by all readers (loaded once per run)
+// Indexes are stored next to the input files or in the given directory and are rebuilt when the file changes
+class CGzIndexStore
+{
+	static mutex mtx;
+	static bool enabled;
+	static string index_path;
+	static bool verbose;
+	static map<string, shared_ptr<const CGzIndex>> indexes;
+
+	static string index_name(const string& file_name);
+
+public:
+	static void Configure(bool _enabled, const string& _index_path, bool _verbose);
+	static bool IsEnabled();
+
+	static shared_ptr<const CGzIndex> Get(const string& file_name);
+	static bool NeedsIndex(const string& file_name);
+	static void Put(const string& file_name, unique_ptr<CGzIndex> index);
+};
+
+// EOF
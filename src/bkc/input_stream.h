@@ -0,0 +1,23 @@
+#pragma once
+
+#include <cinttypes>
+#include <string>
+
+using namespace std;
+
+// *********************************************************************************************
+// Sequential source of (decompressed or decoded) input data
+class CInputStream
+{
+public:
+	virtual ~CInputStream() = default;
+
+	virtual size_t Read(char* dest, size_t size) = 0;
+	virtual bool Eof() = 0;
+	virtual bool Error() const = 0;
+
+	// Short description of the data source (for logs)
+	virtual string Description() const = 0;
+};
+
+// EOF
@@ -9,6 +9,8 @@
 #include <cstring>
 #include <unordered_set>
 #include <random>
+#include <tuple>
+#include <condition_variable>
 #include <filesystem>
 
 #include <refresh/hash_tables/lib/murmur_hash.h>
@@ -32,6 +34,15 @@ void CBarcodedCounter::join_threads(vector<thread>& threads)
 void CBarcodedCounter::SetParams(const CParams& params)
 {
 	no_threads = params.no_threads.get();
+	no_file_parts = params.no_file_parts.get();
+	no_gz_threads = params.no_gz_threads.get();
+	gz_backend = params.gz_backend;
+	use_mmap = params.use_mmap;
+	io_mode = params.io_mode;
+	direct_io = params.direct_io;
+	no_io_buffers = (int) params.no_io_buffers.get();
+	pipeline_tuner.SetMemoryBudget((size_t) params.io_memory.get() << 20);
+	CGzIndexStore::Configure(params.use_gz_index, params.gz_index_path, params.verbosity_level.get() >= 2);
 	cbc_len = params.cbc_len.get();
 	umi_len = params.umi_len.get();
 	soft_cbc_umi_len_limit = params.soft_cbc_umi_len_limit.get();
@@ -69,15 +80,17 @@ void CBarcodedCounter::SetParams(const CParams& params)
 
 	apply_cbc_correction = params.apply_cbc_correction;
 	cbc_filtering_thr = params.cbc_filtering_thr.get();
+	early_whitelist_sample = (uint64_t) params.early_whitelist_sample.get() * 1'000'000;
+	umi_dedup = params.umi_dedup;
 
 	input_format = params.input_format;
 	filtered_input_in_FASTA = input_format == input_format_t::fasta;
 	output_format = params.output_format;
 
-	predefined_cbc.clear();
+	// FASTA files have no qualities
+	quality_aware_cbc_correction = params.quality_aware_cbc_correction && apply_cbc_correction && input_format != input_format_t::fasta;
 
-	for (const auto& s : params.predefined_cbc)
-		predefined_cbc.insert(base_coding4.encode_bases_2b(s));
+	predefined_cbc = params.predefined_cbc && !params.predefined_cbc->Empty() ? params.predefined_cbc : nullptr;
 
 	if (params.export_cbc_logs)
 	{
@@ -85,6 +98,9 @@ void CBarcodedCounter::SetParams(const CParams& params)
 		cbc_log_file_name = params.cbc_log_file_name;
 	}
 
+	save_cbc_state_fn = params.save_cbc_state_fn;
+	load_cbc_state_fn = params.load_cbc_state_fn;
+
 	if (params.export_filtered_input != export_filtered_input_t::none)
 	{
 		export_filtered_input = params.export_filtered_input;
@@ -99,32 +115,258 @@ void CBarcodedCounter::SetParams(const CParams& params)
 
 	cbc_file_names = params.cbc_file_names;
 	read_file_names = params.read_file_names;
+
+	spool_path = params.spool_path;
+	if (spool_path.empty())
+		spool_path = ".";
+
+	max_ram = params.max_ram.get();
 }
 
 // *********************************************************************************************
-void CBarcodedCounter::set_CBC_file_names()
+CBarcodedCounter::~CBarcodedCounter()
 {
-	file_names = cbc_file_names;
+	wait_for_spools();
+	remove_spools();
+}
+
+// *********************************************************************************************
+// Splits input files into parts that can be read and parsed independently
+void CBarcodedCounter::prepare_file_parts(bool allow_split)
+{
+	file_parts.clear();
+
+	CFastXSplitter splitter(input_format != input_format_t::fasta);
+
+	uint64_t no_parts = 1;
+	uint64_t min_part_size = chunk_size;
+
+	if (input_format == input_format_t::bam)
+		allow_split = false;
+
+	if (allow_split)
+	{
+		if (no_file_parts)
+		{
+			no_parts = no_file_parts;
+			min_part_size = 1 << 20;
+		}
+		else
+			no_parts = (max(no_threads / 2, 1) + file_names.size() - 1) / file_names.size();
+	}
+
+	for (int i = 0; i < (int)file_names.size(); ++i)
+	{
+		// Spooled streams are read from the spools, but names of the original files are used for the output
+		const string& source_name = i < (int) file_spool_names.size() && !file_spool_names[i].empty() ? file_spool_names[i] : file_names[i];
+
+		if (!splitter.Split(i, source_name, no_parts, min_part_size, no_threads, file_parts))
+		{
+			std::cerr << "Error: File " + source_name + " cannot be split into parts\n";
+			exit(1);
+		}
+	}
+
+	if (verbosity_level >= 2 && file_parts.size() > file_names.size())
+		std::cerr << "No. of input file parts: " + to_string(file_parts.size()) + "\n";
+
+	part_queue = make_unique<parallel_queue<int>>(file_parts.size());
+
+	for (int i = 0; i < (int)file_parts.size(); ++i)
+		part_queue->push(move(i));
+
+	part_queue->mark_completed();
+}
+
+// *********************************************************************************************
+// Determines the ids (after relabelling) of the 1st reads of file parts
+void CBarcodedCounter::set_first_valid_read_ids()
+{
+	for (auto& part : file_parts)
+	{
+		if (part.first_read_id == 0)
+		{
+			part.first_valid_read_id = 0;
+			continue;
+		}
 
-	fn_queue = make_unique<parallel_queue<pair<int, string>>>(cbc_file_names.size());
+		auto& vr = valid_reads[part.file_id];
+		part.first_valid_read_id = vr.Rank(min<uint64_t>(part.first_read_id, vr.Size()));
+	}
+}
 
-	for(int i = 0; i < (int) cbc_file_names.size(); ++i)
-		fn_queue->push(make_pair(i, cbc_file_names[i]));
+// *********************************************************************************************
+void CBarcodedCounter::set_CBC_file_names(bool allow_split)
+{
+	file_names = cbc_file_names;
+	file_spool_names = spools_ready ? cbc_spool_names : vector<string>();
+	bam_view = input_format == input_format_t::bam ? bam_view_t::barcodes : bam_view_t::none;
 
-	fn_queue->mark_completed();
+	prepare_file_parts(allow_split);
 }
 
 // *********************************************************************************************
-void CBarcodedCounter::set_read_file_names()
+void CBarcodedCounter::set_read_file_names(bool allow_split)
 {
 	file_names = read_file_names;
+	file_spool_names = spools_ready ? read_spool_names : vector<string>();
+	bam_view = input_format == input_format_t::bam ? bam_view_t::reads : bam_view_t::none;
+
+	prepare_file_parts(allow_split);
+}
+
+// *********************************************************************************************
+string CBarcodedCounter::get_spool_file_name(const string& suffix, int id)
+{
+	std::filesystem::path out(spool_path);
+
+	out /= std::filesystem::path(out_file_name).filename();
+	out += ".spool_"s + suffix + "_" + to_string(id) + (input_format == input_format_t::fasta ? ".fasta" : ".fastq") + ".zst";
+
+	return out.string();
+}
+
+// *********************************************************************************************
+// Streamed inputs (pipes, FIFOs, stdin) can be read only once, so the ones necessary in the 2nd pass are spooled during the 1st pass:
+// - CBC files are teed by the reading threads (only if the filtered CBC reads are exported or CBC reads are corrected according to qualities)
+// - read files are drained by the spooling threads, concurrently with the 1st pass, as the producer can write both streams at once
+bool CBarcodedCounter::prepare_spools()
+{
+	bool export_cbc_reads = ((uint32_t) export_filtered_input) & (uint32_t) export_filtered_input_t::first;
+	bool export_reads = ((uint32_t) export_filtered_input) & (uint32_t) export_filtered_input_t::second;
+	bool reads_needed = counting_mode != counting_mode_t::filter || export_reads;
+	bool is_fastq = input_format != input_format_t::fasta;
+
+	cbc_spool_names.assign(cbc_file_names.size(), "");
+	read_spool_names.assign(read_file_names.size(), "");
+	cbc_spool_writers.clear();
+	cbc_spool_writers.resize(cbc_file_names.size());
+	read_spool_writers.clear();
+	read_spool_writers.resize(read_file_names.size());
+
+	for (int i = 0; i < (int) cbc_file_names.size(); ++i)
+	{
+		bool cbc_streamed = is_streamed_input(cbc_file_names[i]);
+		bool read_streamed = is_streamed_input(read_file_names[i]);
+
+		if ((cbc_streamed || read_streamed) && input_format == input_format_t::bam)
+		{
+			std::cerr << "Error: BAM input cannot be streamed: " + cbc_file_names[i] + "\n";
+			return false;
+		}
+
+		if (cbc_streamed && (export_cbc_reads || quality_aware_cbc_correction))
+		{
+			cbc_spool_names[i] = get_spool_file_name("R1", i);
+			cbc_spool_writers[i] = make_unique<CSpoolWriter>(is_fastq, false);
+
+			if (!cbc_spool_writers[i]->Open(cbc_spool_names[i]))
+			{
+				std::cerr << "Error: Cannot create spool file " + cbc_spool_names[i] + "\n";
+				return false;
+			}
+		}
+
+		if (read_streamed && reads_needed)
+		{
+			read_spool_names[i] = get_spool_file_name("R2", i);
+			read_spool_writers[i] = make_unique<CSpoolWriter>(is_fastq, !export_reads);
 
-	fn_queue = make_unique<parallel_queue<pair<int, string>>>(read_file_names.size());
+			if (!read_spool_writers[i]->Open(read_spool_names[i]))
+			{
+				std::cerr << "Error: Cannot create spool file " + read_spool_names[i] + "\n";
+				return false;
+			}
+
+			spooling_threads.emplace_back([&, i] {
+				spool_input(read_file_names[i], *read_spool_writers[i]);
+			});
+		}
+	}
+
+	return true;
+}
+
+// *********************************************************************************************
+void CBarcodedCounter::spool_input(const string& file_name, CSpoolWriter& writer)
+{
+	CFastXReader fqx(input_format != input_format_t::fasta, max<int>(no_gz_threads, 1), gz_backend, false, io_mode, false, no_io_buffers);
+	vector<char> buffer(chunk_size);
+	memory_chunk<char> mc(buffer.data(), buffer.size());
+
+	if (!fqx.Open(file_name))
+	{
+		std::cerr << "Error: File " + file_name + " cannot be opened\n";
+		exit(1);
+	}
+
+	while (!fqx.Eof())
+	{
+		if (!fqx.ReadBlock(mc))
+			break;
+
+		if (!writer.Write(mc))
+		{
+			std::cerr << "Error: Cannot write spool file " + writer.FileName() + "\n";
+			exit(1);
+		}
+	}
+
+	if (!writer.Close())
+	{
+		std::cerr << "Error: Cannot write spool file " + writer.FileName() + "\n";
+		exit(1);
+	}
+
+	if (verbosity_level >= 2)
+		std::cerr << "File " + file_name + " spooled into " + writer.FileName() + " (" + to_string(writer.RawSize()) + " -> " + to_string(writer.PackedSize()) + " bytes)\n";
+}
+
+// *********************************************************************************************
+void CBarcodedCounter::close_cbc_spools()
+{
+	for (auto& writer : cbc_spool_writers)
+		if (writer && !writer->Close())
+		{
+			std::cerr << "Error: Cannot write spool file " + writer->FileName() + "\n";
+			exit(1);
+		}
 
-	for (int i = 0; i < (int) read_file_names.size(); ++i)
-		fn_queue->push(make_pair(i, read_file_names[i]));
+	cbc_spool_writers.clear();
+}
+
+// *********************************************************************************************
+void CBarcodedCounter::wait_for_spools()
+{
+	if (spools_ready)
+		return;
+
+	join_threads(spooling_threads);
+	spooling_threads.clear();
+	read_spool_writers.clear();
+
+	spools_ready = true;
+}
+
+// *********************************************************************************************
+void CBarcodedCounter::remove_spools()
+{
+	std::error_code ec;
+
+	for (auto& names : { cbc_spool_names, read_spool_names })
+		for (auto& name : names)
+			if (!name.empty())
+				std::filesystem::remove(name, ec);
+}
+
+// *********************************************************************************************
+// No. of threads decompressing a single gzipped file (auto: threads not used for reading and parsing are shared by readers)
+int CBarcodedCounter::no_gz_threads_per_reader()
+{
+	if (no_gz_threads)
+		return (int) no_gz_threads;
 
-	fn_queue->mark_completed();
+	return max(1, 1 + (no_threads - 2 * no_reading_threads) / max(no_reading_threads, 1));
 }
 
 // *********************************************************************************************
@@ -137,48 +379,88 @@ void CBarcodedCounter::start_reading_threads()
 	{
 		reading_threads.push_back(thread([&, i] {
 			int thread_id = i;
-			pair<int, string> id_fn;
-			CFastXReader fqx(input_format == input_format_t::fastq);
-			memory_chunk<char> mc;
+			int part_id;
+			CFastXReader fqx(input_format != input_format_t::fasta, no_gz_threads_per_reader(), gz_backend, use_mmap, io_mode, direct_io, no_io_buffers);
+			fqx.SetBamView(bam_view, cbc_len, umi_len);
 
-			while (fn_queue->pop(id_fn))
+			CBlockSizer block_sizer(pipeline_plan.chunk_size);
+			CPhaseTimer timer;
+			uint64_t busy = 0, stall = 0, no_bytes = 0, no_records = 0, no_blocks = 0;
+
+			while (part_queue->pop(part_id))
 			{
+				auto& part = file_parts[part_id];
+				uint64_t block_no = 0;
+
 				if(verbosity_level >= 2)
-					std::cerr << "Reading thread " + to_string(thread_id) + " opens: " + id_fn.second + "\n";
+					std::cerr << "Reading thread " + to_string(thread_id) + " opens: " + part.file_name + (part.offset_end == ~0ull ? "" : " (part starting at byte " + to_string(part.offset_begin) + ")") + "\n";
 
-				if (fqx.Open(id_fn.second))
+				if (fqx.Open(part.file_name, part.offset_begin, part.offset_end))
 				{
 					if (verbosity_level >= 2)
-						std::cerr << "File " + id_fn.second + " opened\n";
+						std::cerr << "File " + part.file_name + " opened (" + fqx.IoDescription() + ")\n";
 				}
 				else
 				{
-					std::cerr << "Error: File " + id_fn.second + " cannot be opened\n";
+					std::cerr << "Error: File " + part.file_name + " cannot be opened\n";
 					exit(1);
 				}
 
+				timer.Lap();
+
 				while (!fqx.Eof())
 				{
-					memory_pools[thread_id]->Pop(mc);
+					input_block_t block(part_id, thread_id, block_no++);
 
-					if (!fqx.ReadBlock(mc))
+					if (fqx.IsMapped())
 					{
-						memory_pools[thread_id]->Push(mc);
-						break;
+						if (!fqx.ReadMappedBlock(block.mc, block.mapping, block_sizer.Target()))
+							break;
 					}
 					else
 					{
-//						cerr << "Reading thread " + to_string(thread_id) + " loaded block of size: " + to_string(mc.size()) + "\n";
+						memory_pool->Pop(block.mc);
+						stall += timer.Lap();
+
+						if (!fqx.ReadBlock(block.mc, block_sizer.Target()))
+						{
+							memory_pool->Push(block.mc);
+							break;
+						}
+					}
+
+					uint64_t read_time = timer.Lap();
+					block_sizer.Update(block.mc.size(), read_time);
+					busy += read_time;
+
+					no_bytes += block.mc.size();
+					no_records += fqx.LastBlockRecords();
+					++no_blocks;
+
+					if (!cbc_spool_writers.empty() && cbc_spool_writers[part.file_id] && !cbc_spool_writers[part.file_id]->Write(block.mc))
+					{
+						std::cerr << "Error: Cannot write spool file " + cbc_spool_writers[part.file_id]->FileName() + "\n";
+						exit(1);
 					}
 
-					block_queues[thread_id]->push(make_pair(id_fn.first, move(mc)));
+//					cerr << "Reading thread " + to_string(thread_id) + " loaded block of size: " + to_string(block.mc.size()) + "\n";
+
+					busy += timer.Lap();
+					block_scheduler->Push(thread_id, move(block));
+					stall += timer.Lap();
 				}
 			}
 
+			pipeline_stats.reader_busy += busy;
+			pipeline_stats.reader_stall += stall;
+			pipeline_stats.no_bytes += no_bytes;
+			pipeline_stats.no_records += no_records;
+			pipeline_stats.no_blocks += no_blocks;
+
 			if (verbosity_level >= 2)
-				std::cerr << "Reading thread " + to_string(thread_id) + " completed\n";
+				std::cerr << "Reading thread " + to_string(thread_id) + " completed (final block size: " + to_string(block_sizer.Target() >> 10) + " KB)\n";
 
-			block_queues[thread_id]->mark_completed();
+			block_scheduler->MarkCompleted(thread_id);
 		}));
 	}
 }
@@ -199,45 +481,54 @@ void CBarcodedCounter::start_counting_threads()
 		counting_threads.push_back(thread([&, i] {
 			int thread_id = i;
 
-			pair<int, memory_chunk<char>> id_mc;
-			CReadReader read_reader(input_format == input_format_t::fastq);
+			input_block_t block;
+			CReadReader read_reader(input_format != input_format_t::fasta);
 			read_desc_t read_desc;
 
-			auto& my_block_queue = block_queues[thread_id];
-			auto& my_memory_pool = memory_pools[thread_id];
-//			auto& my_cbc_dict = cbc_dict[thread_id];
-
-			unordered_map<cbc_t, vector<umi_readfid_t>, refresh::MurMur64Hash> my_cbc_dict;
-			my_cbc_dict.max_load_factor(0.8);
+			CCbcTupleBuckets my_cbc_tuples(cbc_tuples.Layout(), cbc_len);
+			uint64_t max_read_no = cbc_tuples.Layout().MaxReadNo();
 
 			BaseCoding4 bc4;
 
+			// CBC and UMI are encoded at once if they are shorter than 32 bases in total (so ~0ull is not a valid code)
+			bool use_base_encoder = cbc_len + umi_len < CBaseEncoder::MAX_LEN;
+			umi_t umi_mask = (1ull << (2 * umi_len)) - 1;
+
 			int total_no_reads = 0;
 
 			int file_id = -1;
-			int file_read_id = 0;
+			uint64_t file_read_id = 0;
+			uint64_t file_valid_read_id = 0;
 
-			while (my_block_queue->pop(id_mc))
+			vector<uint64_t> my_file_no_reads(file_names.size(), 0);
+
+			CPhaseTimer timer;
+			uint64_t busy = 0, starve = 0;
+
+			while (block_scheduler->Pop(thread_id, block))
 			{
-				if (id_mc.first != file_id)
-				{
-					file_id = id_mc.first;
-					file_read_id = 0;
-				}
+				starve += timer.Lap();
+
+				file_id = file_parts[block.part_id].file_id;
 
 //				cerr << "Counting thread " + to_string(thread_id) + " got block of size : " + to_string(id_mc.second.size()) + "\n";
 
-				read_reader.Assign(id_mc.second);
+				read_reader.Assign(block.mc);
+
+				// Blocks of a part can be processed by many threads, so the id of the 1st read of the block comes from the sequencer
+				uint64_t no_block_reads = read_reader.CountReads();
+				read_id_sequencer.Acquire(block.part_id, block.block_no, file_read_id, file_valid_read_id);
+				read_id_sequencer.Release(block.part_id, no_block_reads, 0);
 
 				int no_reads = 0;
 
-				while (read_reader.GetRead(read_desc))
+				while (read_reader.GetBases(read_desc))
 				{
-					auto read_len = strlen(read_desc.bases);
+					auto read_len = read_desc.bases_len;
 						
 					if (read_len < cbc_len + umi_len || read_len > cbc_len + umi_len + soft_cbc_umi_len_limit)
 					{
-						std::cerr << "Strange read: " + string(read_desc.header) + " " + string(read_desc.bases) + "\n";
+						std::cerr << "Strange read: " + string(read_desc.header, read_desc.header_len) + " " + string(read_desc.bases, read_desc.bases_len) + "\n";
 						if (!allow_strange_cbc_umi_reads)
 							exit(1);
 						++no_reads;
@@ -245,27 +536,69 @@ void CBarcodedCounter::start_counting_threads()
 						continue;
 					}
 
-					cbc_t cbc = bc4.encode_bases_2b(read_desc.bases, read_desc.bases + cbc_len);
-					umi_t umi = bc4.encode_bases_2b(read_desc.bases + cbc_len, read_desc.bases + cbc_len + umi_len);
+					cbc_t cbc;
+					umi_t umi;
 
-					if (cbc != ~0ull && umi != ~0ull)
-						my_cbc_dict[cbc].emplace_back(umi, encode_read_id(id_mc.first, file_read_id++));
+					if (use_base_encoder)
+					{
+						uint64_t code = CBaseEncoder::Encode(read_desc.bases, cbc_len + umi_len, read_reader.BlockEnd());
+						cbc = code == ~0ull ? ~0ull : code >> (2 * umi_len);
+						umi = code == ~0ull ? ~0ull : code & umi_mask;
+					}
 					else
+					{
+						cbc = bc4.encode_bases_2b(read_desc.bases, read_desc.bases + cbc_len);
+						umi = bc4.encode_bases_2b(read_desc.bases + cbc_len, read_desc.bases + cbc_len + umi_len);
+					}
+
+					if (file_read_id > max_read_no)
+					{
+						std::cerr << "Error: Too many reads in file " + file_names[file_id] + "\n";
+						exit(1);
+					}
+
+					if (cbc == ~0ull || umi == ~0ull)
 						file_read_id++;
+					else
+					{
+						// Reads of CBCs outside the early whitelist have no tuples, but the CBCs are necessary to find the trusted threshold
+						if (use_early_whitelist && !early_whitelist.count(cbc))
+						{
+							my_cbc_tuples.AddCbc(cbc);
+							file_read_id++;
+						}
+						else
+							my_cbc_tuples.Add(cbc, umi, file_id, file_read_id++);
+
+						if (cbc_tuples.ShouldSpill(my_cbc_tuples))
+							cbc_tuples.Spill(my_cbc_tuples);
+					}
 
 					++no_reads;
 				}
 
 				total_no_reads += no_reads;
 
-				file_no_reads[file_id] += no_reads;
+				my_file_no_reads[file_id] += no_reads;
 
 //				cerr << "Counting thread " + to_string(thread_id) + " found " + to_string(no_reads) + " reads in block\n";
 
-				my_memory_pool->Push(id_mc.second);
+				if (!block.mapping)
+					memory_pool->Push(block.mc);
+
+				busy += timer.Lap();
 			}
 
-			cbc_dict[thread_id] = move(my_cbc_dict);
+			pipeline_stats.parser_busy += busy;
+			pipeline_stats.parser_starve += starve;
+
+			cbc_tuples.Add(move(my_cbc_tuples));
+
+			{
+				lock_guard<mutex> lck(mtx_file_no_reads);
+				for (size_t j = 0; j < file_names.size(); ++j)
+					file_no_reads[j] += my_file_no_reads[j];
+			}
 
 			if (verbosity_level >= 2)
 				std::cerr << "Counting thread " + to_string(thread_id) + " found " + to_string(total_no_reads) + " reads in total and completed\n";
@@ -281,20 +614,64 @@ std::string CBarcodedCounter::get_dedup_file_name(const std::string& input_path,
 {
 	std::filesystem::path path(input_path);
 
-	//remove .gz if present
-	if (path.extension() == ".gz")
+	//remove .gz or .zst if present
+	if (path.extension() == ".gz" || path.extension() == ".zst")
 		path = path.stem();
-	//to remove ".fastq" or ".fasta"
+	//to remove ".fastq", ".fasta" or ".bam"
 	path = path.stem();
 
 	std::filesystem::path out(filtered_input_path);
 
 	out /= path.filename();
+
+	//both reads come from the same BAM file
+	if (input_format == input_format_t::bam)
+		out += bam_view == bam_view_t::barcodes ? "_R1" : "_R2";
 	out += ".dedup"s + (filtered_input_in_FASTA ? ".fasta" : ".fastq") + ".gz";
 
 	return out.string();
 }
 
+// *********************************************************************************************
+void CBarcodedCounter::export_read(gzFile filtered_file, const read_desc_t& read_desc)
+{
+	gzwrite(filtered_file, read_desc.header, read_desc.header_len);
+	gzputc(filtered_file, '\n');
+	gzwrite(filtered_file, read_desc.bases, read_desc.bases_len);
+	gzputc(filtered_file, '\n');
+
+	if (!filtered_input_in_FASTA)
+	{
+		gzwrite(filtered_file, read_desc.plus, read_desc.plus_len);
+		gzputc(filtered_file, '\n');
+		gzwrite(filtered_file, read_desc.quality, read_desc.quality_len);
+		gzputc(filtered_file, '\n');
+	}
+}
+
+// *********************************************************************************************
+// Skips the run of filtered-out reads starting at read_id (up to the block end) without parsing them
+uint64_t CBarcodedCounter::skip_filtered_reads(CReadReader& read_reader, const CRankBitVector& file_valid_reads, uint64_t read_id)
+{
+	uint64_t max_run = min<uint64_t>(read_reader.RemainingRecords(), file_valid_reads.Size() - min<uint64_t>(read_id, file_valid_reads.Size()));
+
+	if (!max_run)
+		return 0;
+
+	uint64_t run = file_valid_reads.NextSet(read_id, read_id + max_run) - read_id;
+
+	return run ? read_reader.SkipReads(run) : 0;
+}
+
+// *********************************************************************************************
+uint64_t CBarcodedCounter::count_valid_reads(const CRankBitVector& file_valid_reads, uint64_t read_id, uint64_t no_reads)
+{
+	uint64_t from = min<uint64_t>(read_id, file_valid_reads.Size());
+	uint64_t to = min<uint64_t>(read_id + no_reads, file_valid_reads.Size());
+
+	return file_valid_reads.Rank(to) - file_valid_reads.Rank(from);
+}
+
 // *********************************************************************************************
 void CBarcodedCounter::start_reads_exporting_threads()
 {
@@ -311,31 +688,36 @@ void CBarcodedCounter::start_reads_exporting_threads()
 		reads_exporting_threads.push_back(thread([&, i] {
 			int thread_id = i;
 
-			pair<int, memory_chunk<char>> id_mc;
-			CReadReader read_reader(input_format == input_format_t::fastq);
+			input_block_t block;
+			CReadReader read_reader(input_format != input_format_t::fasta);
 			read_desc_t read_desc;
 
-			auto& my_block_queue = block_queues[thread_id];
-			auto& my_memory_pool = memory_pools[thread_id];
 
 			int total_no_reads = 0;
 
+			int part_id = -1;
 			int file_id = -1;
-			int file_read_id = 0;			// read id after relabelling
-			int file_read_id_raw = 0;		// read id before relabelling
+			uint64_t file_read_id = 0;			// read id after relabelling
+			uint64_t file_read_id_raw = 0;		// read id before relabelling
 
 			uint64_t my_total_read_len = 0;
 			uint64_t my_total_no_reads = 0;
 
 			gzFile filtered_file = nullptr;
 
-			while (my_block_queue->pop(id_mc))
+			CPhaseTimer timer;
+			uint64_t busy = 0, starve = 0;
+
+			while (block_scheduler->Pop(thread_id, block))
 			{
-				if (id_mc.first != file_id)
+				starve += timer.Lap();
+
+				if (block.part_id != part_id)
 				{
-					file_id = id_mc.first;
-					file_read_id = 0;
-					file_read_id_raw = 0;
+					part_id = block.part_id;
+					file_id = file_parts[part_id].file_id;
+					file_read_id = file_parts[part_id].first_valid_read_id;
+					file_read_id_raw = file_parts[part_id].first_read_id;
 
 					if (filtered_file)
 						gzclose(filtered_file);
@@ -350,36 +732,32 @@ void CBarcodedCounter::start_reads_exporting_threads()
 				}
 				//				cerr << "Counting thread " + to_string(thread_id) + " got block of size : " + to_string(id_mc.second.size()) + "\n";
 
-				read_reader.Assign(id_mc.second);
+				read_reader.Assign(block.mc);
 
 				int no_reads = 0;
+				auto& my_valid_reads = valid_reads[file_id];
 
-				while (read_reader.GetRead(read_desc))
+				while (true)
 				{
-					if (!valid_reads[file_id][file_read_id_raw])
+					uint64_t skipped = skip_filtered_reads(read_reader, my_valid_reads, file_read_id_raw);
+					file_read_id_raw += skipped;
+					no_reads += (int) skipped;
+
+					// Bases are enough if the reads are not exported
+					if (!(filtered_file ? read_reader.GetRead(read_desc) : read_reader.GetBases(read_desc)))
+						break;
+
+					if (!my_valid_reads[file_read_id_raw])
 					{
 						++file_read_id_raw;
 						++no_reads;
 						continue;
 					}
 
-					int read_len = strlen(read_desc.bases);
+					int read_len = (int) read_desc.bases_len;
 
 					if (filtered_file)
-					{
-						gzputs(filtered_file, read_desc.header);
-						gzputc(filtered_file, '\n');
-						gzputs(filtered_file, read_desc.bases);
-						gzputc(filtered_file, '\n');
-
-						if (!filtered_input_in_FASTA)
-						{
-							gzputs(filtered_file, read_desc.plus);
-							gzputc(filtered_file, '\n');
-							gzputs(filtered_file, read_desc.quality);
-							gzputc(filtered_file, '\n');
-						}
-					}
+						export_read(filtered_file, read_desc);
 
 					my_total_no_reads++;
 					my_total_read_len += read_len;
@@ -393,9 +771,15 @@ void CBarcodedCounter::start_reads_exporting_threads()
 
 //				cerr << "Reads loading thread " + to_string(thread_id) + " found " + to_string(no_reads) + " reads in block\n";
 
-				my_memory_pool->Push(id_mc.second);
+				if (!block.mapping)
+					memory_pool->Push(block.mc);
+
+				busy += timer.Lap();
 			}
 
+			pipeline_stats.parser_busy += busy;
+			pipeline_stats.parser_starve += starve;
+
 			if (filtered_file)	
 				gzclose(filtered_file);
 
@@ -422,8 +806,8 @@ void CBarcodedCounter::start_reads_loading_threads()
 	a_total_read_len = 0;
 	a_total_no_reads = 0;
 
-	mma.reserve(file_names.size());
-	for (int i = 0; i < (int) file_names.size(); ++i)
+	mma.reserve(no_reading_threads);
+	for (int i = 0; i < no_reading_threads; ++i)
 		mma.push_back(move(make_unique<memory_monotonic_safe>(16 << 20, 1)));
 
 	sample_reads.resize(file_names.size());
@@ -435,33 +819,37 @@ void CBarcodedCounter::start_reads_loading_threads()
 		reading_threads.push_back(thread([&, i] {
 			int thread_id = i;
 
-			pair<int, memory_chunk<char>> id_mc;
-			CReadReader read_reader(input_format == input_format_t::fastq);
+			input_block_t block;
+			CReadReader read_reader(input_format != input_format_t::fasta);
 			read_desc_t read_desc;
 
-			auto& my_block_queue = block_queues[thread_id];
-			auto& my_memory_pool = memory_pools[thread_id];
 			auto& my_mma = mma[thread_id];
 
 			int total_no_reads = 0;
 
+			int part_id = -1;
 			int file_id = -1;
-			int file_read_id = 0;			// read id after relabelling
-			int file_read_id_raw = 0;		// read id before relabelling
+			uint64_t file_read_id = 0;			// read id after relabelling
+			uint64_t file_read_id_raw = 0;		// read id before relabelling
 
 			uint64_t my_total_read_len = 0;
 			uint64_t my_total_no_reads = 0;
 
 			gzFile filtered_file = nullptr;
 
-			while (my_block_queue->pop(id_mc))
+			CPhaseTimer timer;
+			uint64_t busy = 0, starve = 0;
+
+			while (block_scheduler->Pop(thread_id, block))
 			{
-				if (id_mc.first != file_id)
+				starve += timer.Lap();
+
+				if (block.part_id != part_id)
 				{
-					file_id = id_mc.first;
-					file_read_id = 0;
-					file_read_id_raw = 0;
+					part_id = block.part_id;
+					file_id = file_parts[part_id].file_id;
 
+					// Export is made only for non-split files (and without work stealing), so a new part means a new file
 					if (((uint32_t) export_filtered_input) & (uint32_t) export_filtered_input_t::second)
 					{
 						if (filtered_file)
@@ -478,51 +866,55 @@ void CBarcodedCounter::start_reads_loading_threads()
 				}
 				//				cerr << "Counting thread " + to_string(thread_id) + " got block of size : " + to_string(id_mc.second.size()) + "\n";
 
-				read_reader.Assign(id_mc.second);
+				read_reader.Assign(block.mc);
 
 				int no_reads = 0;
+				auto& my_valid_reads = valid_reads[file_id];
 
-				while (read_reader.GetRead(read_desc))
+				// Blocks of a part can be processed by many threads, so the ids of the 1st read of the block come from the sequencer
+				uint64_t no_block_reads = read_reader.CountReads();
+				read_id_sequencer.Acquire(part_id, block.block_no, file_read_id_raw, file_read_id);
+				read_id_sequencer.Release(part_id, no_block_reads, count_valid_reads(my_valid_reads, file_read_id_raw, no_block_reads));
+
+				while (true)
 				{
-					if (!valid_reads[file_id][file_read_id_raw])
+					uint64_t skipped = skip_filtered_reads(read_reader, my_valid_reads, file_read_id_raw);
+					file_read_id_raw += skipped;
+					no_reads += (int) skipped;
+
+					// Bases are enough if the reads are not exported
+					if (!(filtered_file ? read_reader.GetRead(read_desc) : read_reader.GetBases(read_desc)))
+						break;
+
+					if (!my_valid_reads[file_read_id_raw])
 					{
 						++file_read_id_raw;
 						++no_reads;
 						continue;
 					}
 
-					int read_len = strlen(read_desc.bases);
+					int read_len = (int) read_desc.bases_len;
 
 					if (filtered_file)
-					{
-						gzputs(filtered_file, read_desc.header);
-						gzputc(filtered_file, '\n');
-						gzputs(filtered_file, read_desc.bases);
-						gzputc(filtered_file, '\n');
-
-						if (!filtered_input_in_FASTA)
-						{
-							gzputs(filtered_file, read_desc.plus);
-							gzputc(filtered_file, '\n');
-							gzputs(filtered_file, read_desc.quality);
-							gzputc(filtered_file, '\n');
-						}
-					}
+						export_read(filtered_file, read_desc);
 
 					my_total_no_reads++;
 					my_total_read_len += read_len;
 
 #ifdef USE_READ_COMPRESSION
-					size_t pred_len = (read_len + 1 + 2) / 3;
-					uint8_t *p = (uint8_t*)(my_mma->allocate(pred_len));
-					size_t enc_len = base_coding3.encode_bases(read_desc.bases, read_len, p);
+					// Other symbols are not packed, so a read ends at the 1st of them (as at the terminator of packed reads)
+					read_len = (int) base_coding3.packable_len(read_desc.bases, read_len);
+
+					size_t pred_len = (read_len + 2) / 3;
+					uint8_t *p = (uint8_t*)(my_mma->allocate(read_len_size(read_len) + pred_len));
+					size_t enc_len = base_coding3.encode_bases(read_desc.bases, read_len, store_read_len(p, read_len));
 
 					if (pred_len != enc_len)
 						std::cerr << to_string(read_len) + "   -   "  + to_string(pred_len) + " : " + to_string(enc_len) + "\n";
 
 #else
-					uint8_t* p = (uint8_t*)(my_mma->allocate(read_len + 1));
-					memcpy(p, read_desc.bases, read_len + 1);			// !!! Add compression of reads (at least 2 bases -> 1 byte) here
+					uint8_t* p = (uint8_t*)(my_mma->allocate(read_len_size(read_len) + read_len));
+					memcpy(store_read_len(p, read_len), read_desc.bases, read_len);
 #endif
 
 					sample_reads[file_id][file_read_id] = p;
@@ -536,9 +928,15 @@ void CBarcodedCounter::start_reads_loading_threads()
 
 //				cerr << "Reads loading thread " + to_string(thread_id) + " found " + to_string(no_reads) + " reads in block\n";
 
-				my_memory_pool->Push(id_mc.second);
+				if (!block.mapping)
+					memory_pool->Push(block.mc);
+
+				busy += timer.Lap();
 			}
 
+			pipeline_stats.parser_busy += busy;
+			pipeline_stats.parser_starve += starve;
+
 			if (filtered_file)	
 				gzclose(filtered_file);
 
@@ -557,26 +955,53 @@ void CBarcodedCounter::start_reads_loading_threads()
 // *********************************************************************************************
 void CBarcodedCounter::init_queues_and_pools()
 {
-	block_queues.clear();
+	pipeline_plan = pipeline_tuner.Plan(no_reading_threads);
+	pipeline_stats.Clear();
 
-	for(int i = 0; i < no_reading_threads; ++i)
-		block_queues.emplace_back(make_unique<parallel_queue<pair<int, memory_chunk<char>>>>(no_blocks_in_queue));
+	if (verbosity_level >= 2)
+		std::cerr << pipeline_tuner.Describe(pipeline_plan, no_reading_threads);
 
-	memory_pools.clear();
+	block_scheduler = make_unique<CBlockScheduler>(no_reading_threads, pipeline_plan.queue_depth, true);
+	read_id_sequencer.Reset(file_parts);
 
-	for (int i = 0; i < no_reading_threads; ++i)
-		memory_pools.emplace_back(make_unique<CMemoryPool<char>>(no_chunks_per_file, chunk_size));
+	memory_pool = make_unique<CMemoryPool<char>>(no_reading_threads * pipeline_plan.no_chunks, pipeline_plan.chunk_size);
+}
+
+// *********************************************************************************************
+// The pipeline is replanned with the statistics of the previous pass, so the pool is reallocated only if the plan changed
+// Work stealing is not allowed when reads are exported, as the blocks of a file must be written in order by a single thread
+void CBarcodedCounter::reinit_queues(bool allow_stealing)
+{
+	auto prev_plan = pipeline_plan;
 
-	cbc_dict.resize(no_reading_threads);
+	pipeline_plan = pipeline_tuner.Plan(no_reading_threads);
+	pipeline_stats.Clear();
+
+	if (verbosity_level >= 2)
+		std::cerr << pipeline_tuner.Describe(pipeline_plan, no_reading_threads);
+
+	block_scheduler = make_unique<CBlockScheduler>(no_reading_threads, pipeline_plan.queue_depth, allow_stealing);
+	read_id_sequencer.Reset(file_parts);
+
+	// No. of reading threads can be larger than in previous stages when input files are split into parts
+	size_t no_chunks = no_reading_threads * pipeline_plan.no_chunks;
+
+	// No pool yet if the 1st pass was skipped (see load_cbc_state)
+	if (!memory_pool)
+		memory_pool = make_unique<CMemoryPool<char>>(no_chunks, pipeline_plan.chunk_size);
+	else if (!(pipeline_plan == prev_plan) || memory_pool->Capacity() != no_chunks)
+		memory_pool->Resize(no_chunks, pipeline_plan.chunk_size);
 }
 
 // *********************************************************************************************
-void CBarcodedCounter::reinit_queues()
+void CBarcodedCounter::learn_pipeline()
 {
-	block_queues.clear();
+	pipeline_stats.no_stolen_blocks = block_scheduler->NoStolenBlocks();
+
+	if (verbosity_level >= 2)
+		std::cerr << pipeline_tuner.Report(pipeline_stats);
 
-	for(int i = 0; i < no_reading_threads; ++i)
-		block_queues.emplace_back(make_unique<parallel_queue<pair<int, memory_chunk<char>>>>(no_blocks_in_queue));
+	pipeline_tuner.Learn(pipeline_stats);
 }
 
 // *********************************************************************************************
@@ -606,149 +1031,248 @@ bool CBarcodedCounter::init_bkc_files()
 }
 
 // *********************************************************************************************
-void CBarcodedCounter::merge_cbc_dict()
+void CBarcodedCounter::gather_cbc_stats()
 {
-	vector<thread> threads;
+	cbc_stats.max_load_factor(0.8);
+	cbc_stats.reserve(cbc_tuples.NoGroups() + cbc_tuples.NoRestCbcs());
 
-	vector<cbc_t> cbcs;
-	atomic_int id{ 0 };
+	if (cbc_tuples.IsSpilled())
+	{
+		for (const auto& x : cbc_tuples.SpilledStats())
+			cbc_stats[x.first] = x.second;
 
-	for (int i = 1; i < (int) cbc_dict.size(); ++i)
-		for (auto& x : cbc_dict[i])
-			if (!cbc_dict[0].count(x.first))
-				cbc_dict[0][x.first] = {};
+		cbc_tuples.ReleaseSpilledStats();
+	}
+	else
+		for (size_t i = 0; i < cbc_tuples.NoBuckets(); ++i)
+			for (const auto& x : cbc_tuples.Groups(i))
+				cbc_stats[x.cbc] = x.size();
 
-	cbcs.reserve(cbc_dict[0].size());
+	// CBCs outside the early whitelist have no tuples, but the knee is found for the whole distribution of CBCs (see find_trusted_thr)
+	for (size_t i = 0; i < cbc_tuples.NoBuckets(); ++i)
+		for (const auto& x : cbc_tuples.RestCounts(i))
+			cbc_stats[x.first] += x.second;
 
-	for (auto& x : cbc_dict[0])
-		cbcs.emplace_back(x.first);
+	cbc_tuples.ReleaseRestCounts();
+}
 
-	threads.reserve(no_threads);
+// *********************************************************************************************
+// A non-trusted CBC is corrected to its only trusted neighbour at Hamming distance 1
+// CBCs with many trusted neighbours are dropped, unless the corrections are quality-aware (then they are resolved for each read)
+void CBarcodedCounter::find_CBC_corrections()
+{
+	CCbcCorrectionIndex index;
+	index.Build(cbc_vec, cbc_len, no_threads);
 
-	for (int t = 0; t < no_threads; ++t)
-		threads.emplace_back([&] {
-		int curr_id;
+	vector<cbc_t> corrections(cbc_for_corr_vec.size(), ~0ull);
+	vector<vector<pair<size_t, vector<cbc_t>>>> ambiguous(no_threads);
+
+	atomic<size_t> next_id{ 0 };
+	vector<thread> threads;
+	const size_t batch_size = 4096;
 
-		vector<vector<umi_readfid_t>*> ptrs(cbc_dict.size(), nullptr);
+	for (int i = 0; i < no_threads; ++i)
+		threads.emplace_back([&, i] {
+		vector<cbc_t> neighbours;
 
 		while (true)
 		{
-			curr_id = id.fetch_add(1);
-			if (curr_id >= (int)cbcs.size())
+			size_t first = next_id.fetch_add(batch_size);
+			if (first >= cbc_for_corr_vec.size())
 				break;
 
-			cbc_t curr_cbc = cbcs[curr_id];
-			size_t no_items = 0;
+			size_t last = min(first + batch_size, cbc_for_corr_vec.size());
 
-			for (int i = 0; i < (int) cbc_dict.size(); ++i)
+			for (size_t j = first; j < last; ++j)
 			{
-				auto p = cbc_dict[i].find(curr_cbc);
+				neighbours.clear();
+				index.FindNeighbours(cbc_for_corr_vec[j].second, neighbours);
 
-				if (p == cbc_dict[i].end())
-					ptrs[i] = nullptr;
-				else
-				{
-					ptrs[i] = &(p->second);
-					no_items += p->second.size();
-				}
+				if (neighbours.size() == 1)
+					corrections[j] = neighbours.front();
+				else if (neighbours.size() > 1 && quality_aware_cbc_correction)
+					ambiguous[i].emplace_back(j, neighbours);
 			}
+		}
+		});
+
+	join_threads(threads);
+
+	correction_map.reserve(corrections.size());
 
-			ptrs[0]->reserve(no_items);
+	for (size_t i = 0; i < corrections.size(); ++i)
+		if (corrections[i] != ~0ull)
+			correction_map[cbc_for_corr_vec[i].second] = corrections[i];
 
-			for (int i = 1; i < (int) cbc_dict.size(); ++i)
+	if (quality_aware_cbc_correction)
+	{
+		for (auto& th_ambiguous : ambiguous)
+			for (auto& x : th_ambiguous)
 			{
-				if (!ptrs[i])
-					continue;
+				auto& candidates = ambiguous_corrections[cbc_for_corr_vec[x.first].second];
 
-				ptrs[0]->insert(ptrs[0]->end(), ptrs[i]->begin(), ptrs[i]->end());
-				clear_vec(*ptrs[i]);
+				for (auto cbc : x.second)
+					candidates.emplace_back(correction_candidate_t{ cbc, 0, index.MismatchPos(cbc, cbc_for_corr_vec[x.first].second) });
 			}
+
+		// Counts of the candidates are necessary to choose among them
+		unordered_map<cbc_t, uint64_t, refresh::MurMur64Hash> candidate_counts;
+
+		for (const auto& x : ambiguous_corrections)
+			for (const auto& c : x.second)
+				candidate_counts[c.cbc] = 0;
+
+		for (const auto& x : cbc_vec)
+		{
+			auto p = candidate_counts.find(x.second);
+			if (p != candidate_counts.end())
+				p->second = x.first;
 		}
-			});
 
-	join_threads(threads);
+		for (auto& x : ambiguous_corrections)
+			for (auto& c : x.second)
+				c.count = candidate_counts[c.cbc];
+	}
+
+	if (verbosity_level >= 2)
+		std::cerr << "CBC correction index: " + to_string(index.Size() >> 10) + " KB, corrected CBCs: " + to_string(correction_map.size()) +
+			(quality_aware_cbc_correction ? ", CBCs with many candidates: " + to_string(ambiguous_corrections.size()) : ""s) + "\n";
 
-	for (int i = 1; i < (int) cbc_dict.size(); ++i)
-		cbc_dict[i].clear();
+	clear_vec(cbc_for_corr_vec);
 }
 
 // *********************************************************************************************
-void CBarcodedCounter::sort_cbc_dict()
+// Reads of CBCs with many trusted neighbours are corrected according to the base qualities, so the CBC files are read again
+// in the same way as in the 1st pass (file parts, gzip indexes, shared blocks) and read numbers come from the read id sequencer
+// Records are taken from the line index (GetBases), so only the ones of ambiguous CBCs need their qualities
+// The probability of a candidate is proportional to its count and the error probability of the mismatching base (as in STARsolo),
+// and a read is corrected if the best candidate has at least cbc_correction_min_posterior of the total probability
+void CBarcodedCounter::correct_ambiguous_CBC_reads()
 {
-	atomic_int id{ 0 };
-
-	vector<thread> threads;
+	read_corrections.clear();
+	read_corrections.resize(file_names.size());
 
-	vector<vector<umi_readfid_t>*> umis;
+	if (ambiguous_corrections.empty())
+		return;
 
-	umis.reserve(cbc_dict[0].size());
-	for (auto& x : cbc_dict[0])
-		umis.emplace_back(&(x.second));
+	// Streamed CBC files are spooled in the quality-aware mode (and the spools are complete after the 1st pass)
+	file_spool_names = cbc_spool_names;
+	prepare_file_parts(true);
 
-	threads.reserve(no_threads);
+	no_reading_threads = max(min(no_threads / 2, (int)file_parts.size()), 1);
+	reinit_queues(true);
 
-	for (int i = 0; i < no_threads; ++i)
-		threads.emplace_back([&] {
-		int curr_id = -1;
-		while (true)
-		{
-			curr_id = id.fetch_add(1);
-			if (curr_id >= (int)umis.size())
-				break;
+	atomic<uint64_t> no_corrected_reads{ 0 };
+	atomic<uint64_t> no_ambiguous_reads{ 0 };
+	mutex mtx_corrections;
+	vector<thread> correcting_threads;
 
-			stable_sort(umis[curr_id]->begin(), umis[curr_id]->end());
-		}
-			});
+	start_reading_threads();
 
-	join_threads(threads);
-}
+	for (int i = 0; i < no_reading_threads; ++i)
+		correcting_threads.emplace_back([&, i] {
+		int thread_id = i;
 
-// *********************************************************************************************
-void CBarcodedCounter::gather_cbc_stats()
-{
-	cbc_stats.max_load_factor(0.8);
-	cbc_stats.reserve(cbc_dict[0].size());
+		input_block_t block;
+		CReadReader read_reader(input_format != input_format_t::fasta);
+		read_desc_t read_desc;
+		BaseCoding4 bc4;
 
-	for (size_t i = 0; i < cbc_dict.size(); ++i)
-		for (const auto& x : cbc_dict[i])
-			cbc_stats[x.first] += x.second.size();
-}
+		vector<vector<pair<uint64_t, cbc_t>>> my_corrections(file_names.size());
+		vector<double> probs;
+		uint64_t no_reads = 0;
 
-// *********************************************************************************************
-void CBarcodedCounter::find_CBC_corrections()
-{
-	unordered_map<cbc_t, vector<cbc_t>> candidate_corrections;
+		CPhaseTimer timer;
+		uint64_t busy = 0, starve = 0;
 
-	for (auto x : cbc_vec)
-	{
-		for (uint32_t i = 0; i < cbc_len; ++i)
+		while (block_scheduler->Pop(thread_id, block))
 		{
-			auto xc = x.second;
-			uint32_t shift = 2 * i;
-			cbc_t mask = 3ull << shift;
+			starve += timer.Lap();
+
+			int file_id = file_parts[block.part_id].file_id;
+			auto& file_corrections = my_corrections[file_id];
+
+			read_reader.Assign(block.mc);
+
+			uint64_t read_no, valid_read_no;
+			read_id_sequencer.Acquire(block.part_id, block.block_no, read_no, valid_read_no);
+			read_id_sequencer.Release(block.part_id, read_reader.CountReads(), 0);
 
-			for (uint32_t j = 0; j < 4; ++j)
+			for (; read_reader.GetBases(read_desc); ++read_no)
 			{
-				xc = (xc & ~mask) + (((cbc_t)j) << shift);
-				candidate_corrections[xc].emplace_back(x.second);
+				if (read_desc.bases_len < cbc_len)
+					continue;
+
+				cbc_t cbc = cbc_len < CBaseEncoder::MAX_LEN ? CBaseEncoder::Encode(read_desc.bases, cbc_len, read_reader.BlockEnd()) :
+					bc4.encode_bases_2b(read_desc.bases, read_desc.bases + cbc_len);
+
+				auto p = ambiguous_corrections.find(cbc);
+				if (p == ambiguous_corrections.end() || read_desc.quality_len < cbc_len)
+					continue;
+
+				++no_reads;
+
+				probs.clear();
+				double total = 0;
+				size_t best = 0;
+
+				for (const auto& c : p->second)
+				{
+					int q = max(read_desc.quality[c.mismatch_pos] - 33, 0);
+					probs.emplace_back((double) c.count * pow(10.0, -q / 10.0));
+					total += probs.back();
+
+					if (probs.back() > probs[best])
+						best = probs.size() - 1;
+				}
+
+				if (total > 0 && probs[best] >= cbc_correction_min_posterior * total)
+					file_corrections.emplace_back(read_no, p->second[best].cbc);
 			}
+
+			if (!block.mapping)
+				memory_pool->Push(block.mc);
+
+			busy += timer.Lap();
 		}
-	}
 
-	for (auto x : cbc_for_corr_vec)
-	{
-		auto p = candidate_corrections.find(x.second);
+		pipeline_stats.parser_busy += busy;
+		pipeline_stats.parser_starve += starve;
 
-		if (p != candidate_corrections.end() && p->second.size() == 1)
-			correction_map[p->first] = p->second.front();
-	}
+		no_ambiguous_reads += no_reads;
 
-	clear_vec(cbc_for_corr_vec);
+		lock_guard<mutex> lck(mtx_corrections);
+		for (size_t j = 0; j < my_corrections.size(); ++j)
+		{
+			no_corrected_reads += my_corrections[j].size();
+			read_corrections[j].insert(read_corrections[j].end(), my_corrections[j].begin(), my_corrections[j].end());
+		}
+		});
+
+	join_threads(reading_threads);
+	join_threads(correcting_threads);
+	learn_pipeline();
+
+	// Blocks of a file are processed by many threads
+	for (auto& x : read_corrections)
+		std::sort(x.begin(), x.end());
+
+	ambiguous_corrections.clear();
+
+	if (verbosity_level >= 2)
+		std::cerr << "Reads of CBCs with many candidates: " + to_string(no_ambiguous_reads) + ", corrected: " + to_string(no_corrected_reads) + "\n";
 }
 
 // *********************************************************************************************
+// Tuples stay in the store, only the groups of trusted CBCs (after correction) are collected
 void CBarcodedCounter::remove_non_trusted_CBC()
 {
+	if (cbc_tuples.IsSpilled())
+	{
+		redirect_spilled_tuples();
+		return;
+	}
+
 	unordered_set<cbc_t> trusted_CBC;
 
 	trusted_CBC.max_load_factor(0.8);
@@ -758,11 +1282,15 @@ void CBarcodedCounter::remove_non_trusted_CBC()
 
 	global_cbc_umi_dict.max_load_factor(0.8);
 
-	for (size_t i = 0; i < cbc_dict.size(); ++i)
-	{
-		for (auto& x : cbc_dict[i])
+	// (trusted CBC, source group no., tuple) of reads corrected separately
+	vector<tuple<cbc_t, size_t, packed_tuple_t>> corrected_reads;
+	const auto& layout = cbc_tuples.Layout();
+	size_t group_no = 0;
+
+	for (size_t i = 0; i < cbc_tuples.NoBuckets(); ++i)
+		for (const auto& x : cbc_tuples.Groups(i))
 		{
-			cbc_t cbc = x.first;
+			cbc_t cbc = x.cbc;
 
 			if (apply_cbc_correction)
 			{
@@ -772,230 +1300,691 @@ void CBarcodedCounter::remove_non_trusted_CBC()
 			}
 
 			if (trusted_CBC.count(cbc))
+				global_cbc_umi_dict[cbc].emplace_back(x);
+			else if (!read_corrections.empty())
 			{
-				auto& r = global_cbc_umi_dict[cbc];
-				if (r.empty())
-					r.reserve(cbc_dict.size() - i);
-				r.emplace_back(move(x.second));
-			}
+				for (auto q = x.first; q != x.last; ++q)
+				{
+					const auto& rc = read_corrections[layout.FileId(*q)];
+					auto r = lower_bound(rc.begin(), rc.end(), make_pair(layout.ReadNo(*q), (cbc_t) 0));
+
+					if (r != rc.end() && r->first == layout.ReadNo(*q))
+						corrected_reads.emplace_back(r->second, group_no, *q);
+				}
 
-			clear_vec(x.second);
+				++group_no;
+			}
 		}
 
-		cbc_dict[i].clear();
-	}
+	read_corrections.clear();
+
+	if (corrected_reads.empty())
+		return;
 
-	clear_vec(cbc_dict);
+	// Tuples of a source group corrected to the same CBC are still sorted by UMI and read id, so they form a new group
+	stable_sort(corrected_reads.begin(), corrected_reads.end(), [](const auto& x, const auto& y) {
+		return get<0>(x) != get<0>(y) ? get<0>(x) < get<0>(y) : get<1>(x) < get<1>(y);
+		});
+
+	corrected_read_tuples.clear();
+	corrected_read_tuples.reserve(corrected_reads.size());
+
+	for (const auto& x : corrected_reads)
+		corrected_read_tuples.emplace_back(get<2>(x));
+
+	for (size_t i = 0; i < corrected_reads.size(); )
+	{
+		size_t j = i + 1;
+
+		while (j < corrected_reads.size() && get<0>(corrected_reads[j]) == get<0>(corrected_reads[i]) && get<1>(corrected_reads[j]) == get<1>(corrected_reads[i]))
+			++j;
+
+		global_cbc_umi_dict[get<0>(corrected_reads[i])].emplace_back(cbc_group_t{ get<0>(corrected_reads[i]), corrected_read_tuples.data() + i, corrected_read_tuples.data() + j });
+		i = j;
+	}
 }
 
 // *********************************************************************************************
+// Reads of a UMI (or of a network of UMIs) are represented by one of them chosen at random (see select_umi_reads)
 void CBarcodedCounter::remove_duplicated_UMI()
+{
+	uint64_t no_reads_before = 0;
+	uint64_t no_reads_after = 0;
+	uint64_t no_giant_cbcs = 0;
+
+	global_cbc_dict.max_load_factor(0.8);
+
+	if (cbc_tuples.IsSpilled())
+		dedup_spilled_tuples(no_reads_before, no_reads_after);
+	else
+		dedup_stored_tuples(no_reads_before, no_reads_after, no_giant_cbcs);
+
+	global_cbc_umi_dict.clear();
+	cbc_tuples.Clear();
+	clear_vec(corrected_read_tuples);
+
+	stable_sort(cbc_vec.begin(), cbc_vec.end(), greater<pair<uint64_t, cbc_t>>());
+
+	if (cbc_filtering_thr)
+	{
+		while (!cbc_vec.empty())
+		{
+			if (cbc_vec.back().first < cbc_filtering_thr)
+			{
+				no_reads_after -= cbc_vec.back().first;
+				cbc_vec.pop_back();
+			}
+			else
+				break;
+		}
+	}
+
+	if (verbosity_level >= 2)
+	{
+		std::cerr << "Total no. of reads before UMI cleaning: " + to_string(no_reads_before) + "\n";
+		std::cerr << "Total no. of reads after UMI cleaning: " + to_string(no_reads_after) + "\n";
+		if (no_giant_cbcs)
+			std::cerr << "No. of CBCs deduplicated by all threads: " + to_string(no_giant_cbcs) + "\n";
+	}
+}
+
+// *********************************************************************************************
+// CBCs larger than their share of work are processed first, each by all threads (see dedup_giant_CBC), the rest by a single thread each
+void CBarcodedCounter::dedup_stored_tuples(uint64_t& no_reads_before, uint64_t& no_reads_after, uint64_t& no_giant_cbcs)
 {
 	atomic_int id{ 0 };
 	atomic_uint64_t total_no_after_removal { 0 };
-	atomic<uint64_t> a_total_no_reads_before_UMI_cleaning{ 0 };
 
 	vector<thread> threads;
 
 	vector<cbc_t> v_cbc;
+	vector<uint64_t> v_size;
+	uint64_t total_size = 0;
 
 	global_cbc_dict.reserve(global_cbc_umi_dict.size());
 	v_cbc.reserve(global_cbc_umi_dict.size());
+	v_size.reserve(global_cbc_umi_dict.size());
 
 	cbc_vec.clear();
 
-	global_cbc_dict.max_load_factor(0.8);
-
 	for (auto& x : global_cbc_umi_dict)
 	{
+		uint64_t size = 0;
+		for (auto& g : x.second)
+			size += g.size();
+
 		v_cbc.emplace_back(x.first);
+		v_size.emplace_back(size);
+		total_size += size;
 		global_cbc_dict.emplace(x.first, vector<uint64_t>());
 		cbc_vec.emplace_back(0, x.first);
 	}
 
-	threads.reserve(no_threads);
+	vector<bool> is_giant(v_cbc.size(), false);
+
+	if (no_threads > 1)
+		for (size_t i = 0; i < v_cbc.size(); ++i)
+			if (v_size[i] >= giant_cbc_min_size && v_size[i] * no_threads > total_size)
+			{
+				is_giant[i] = true;
+				++no_giant_cbcs;
+
+				auto& gd_dest = global_cbc_dict[v_cbc[i]];
+				dedup_giant_CBC(v_cbc[i], global_cbc_umi_dict[v_cbc[i]], gd_dest);
+
+				total_no_after_removal += gd_dest.size();
+				cbc_vec[i].first = gd_dest.size();
+				clear_vec(global_cbc_umi_dict[v_cbc[i]]);
+			}
+
+	threads.reserve(no_threads);
+
+	for (int i_thread = 0; i_thread < no_threads; ++i_thread)
+		threads.emplace_back([&id, &v_cbc, &is_giant, this, &total_no_after_removal] {
+		int curr_id = -1;
+		
+		CTupleMerger merger(cbc_tuples.Layout());
+		CUmiClusterer clusterer(umi_len);
+		umi_runs_t runs;
+
+		while (true)
+		{
+			curr_id = id.fetch_add(1);
+			if (curr_id >= (int)v_cbc.size())
+				break;
+
+			if (is_giant[curr_id])
+				continue;
+
+			auto& gd_src = global_cbc_umi_dict[v_cbc[curr_id]];
+			auto& gd_dest = global_cbc_dict[v_cbc[curr_id]];
+
+			// Merge of the groups (already sorted by UMI and read id) of all CBCs corrected to the current one
+			runs.clear();
+			merge_umi_runs(merger, gd_src, 0, ~0ull, runs);
+
+			select_umi_reads(v_cbc[curr_id], runs, clusterer, gd_dest);
+
+			total_no_after_removal += gd_dest.size();
+
+			cbc_vec[curr_id].first = gd_dest.size();
+
+			clear_vec(gd_src);
+		}
+		});
+
+	join_threads(threads);
+
+	no_reads_before = total_size;
+	no_reads_after = total_no_after_removal;
+}
+
+// *********************************************************************************************
+// External-memory counterpart of remove_non_trusted_CBC
+// Tuples of corrected CBCs (and of reads corrected separately) are copied with the trusted CBC into new runs,
+// so after sorting of a bucket they are merged with the tuples of the trusted CBC (as in the in-memory mode)
+void CBarcodedCounter::redirect_spilled_tuples()
+{
+	if (!apply_cbc_correction)
+		return;
+
+	unordered_set<cbc_t> trusted_CBC;
+
+	trusted_CBC.max_load_factor(0.8);
+
+	for (auto x : cbc_vec)
+		trusted_CBC.insert(x.second);
+
+	const auto& layout = cbc_tuples.Layout();
+	size_t no_buckets = cbc_tuples.NoBuckets();
+	size_t no_runs = cbc_tuples.NoRuns();
+
+	atomic<size_t> bucket_id{ 0 };
+	atomic<uint64_t> no_redirected{ 0 };
+	vector<thread> threads;
+
+	threads.reserve(no_threads);
+
+	for (int i = 0; i < no_threads; ++i)
+		threads.emplace_back([&] {
+		CCbcTupleBuckets my_cbc_tuples(layout, cbc_len);
+		uint64_t my_no_redirected = 0;
+
+		while (true)
+		{
+			size_t my_id = bucket_id.fetch_add(1);
+			if (my_id >= no_buckets)
+				break;
+
+			cbc_tuples.ScanBucket(my_id, no_runs, [&](cbc_t cbc, const packed_tuple_t& x) {
+				if (trusted_CBC.count(cbc))
+					return;
+
+				cbc_t dest = ~0ull;
+
+				auto p = correction_map.find(cbc);
+				if (p != correction_map.end() && trusted_CBC.count(p->second))
+					dest = p->second;
+				else if (!read_corrections.empty())
+				{
+					const auto& rc = read_corrections[layout.FileId(x)];
+					auto r = lower_bound(rc.begin(), rc.end(), make_pair(layout.ReadNo(x), (cbc_t) 0));
+
+					if (r != rc.end() && r->first == layout.ReadNo(x))
+						dest = r->second;
+				}
+
+				if (dest == ~0ull)
+					return;
+
+				my_cbc_tuples.Add(dest, layout.Umi(x), layout.FileId(x), layout.ReadNo(x));
+				++my_no_redirected;
+
+				if (cbc_tuples.ShouldSpill(my_cbc_tuples))
+					cbc_tuples.Spill(my_cbc_tuples, false);
+				});
+		}
+
+		if (my_cbc_tuples.Size())
+			cbc_tuples.Spill(my_cbc_tuples, false);
+
+		no_redirected += my_no_redirected;
+		});
+
+	join_threads(threads);
+
+	read_corrections.clear();
+
+	if (verbosity_level >= 2)
+		std::cerr << "Tuples of corrected CBCs: " + to_string(no_redirected) + ", no. of runs: " + to_string(cbc_tuples.NoRuns()) + "\n";
+}
+
+// *********************************************************************************************
+// External-memory counterpart of dedup_stored_tuples
+// Buckets are loaded (tuples of trusted CBCs only), sorted and deduplicated by many threads,
+// but the total size of loaded buckets is kept within the memory limit (a bucket larger than the limit is loaded in slices,
+// i.e., ranges of CBCs or ranges of UMIs of a single large CBC)
+void CBarcodedCounter::dedup_spilled_tuples(uint64_t& no_reads_before, uint64_t& no_reads_after)
+{
+	unordered_set<cbc_t> trusted_CBC;
+
+	trusted_CBC.max_load_factor(0.8);
+	global_cbc_dict.reserve(cbc_vec.size());
+
+	for (auto x : cbc_vec)
+	{
+		trusted_CBC.insert(x.second);
+		global_cbc_dict.emplace(x.second, vector<uint64_t>());
+	}
+
+	cbc_vec.clear();
+
+	size_t no_buckets = cbc_tuples.NoBuckets();
+	uint64_t ram_limit = (uint64_t) max_ram << 30;
+	uint64_t max_slice_size = ram_limit / sizeof(packed_tuple_t);
+	uint64_t ram_used = 0;
+	mutex mtx_ram;
+	condition_variable cv_ram;
+
+	atomic<size_t> bucket_id{ 0 };
+	atomic<uint64_t> total_before{ 0 };
+	vector<thread> threads;
+
+	threads.reserve(no_threads);
+
+	for (int i = 0; i < no_threads; ++i)
+		threads.emplace_back([&] {
+		CTupleMerger merger(cbc_tuples.Layout());
+		CUmiClusterer clusterer(umi_len);
+		umi_runs_t runs;
+		vector<packed_tuple_t> bucket;
+		vector<cbc_group_t> bucket_groups;
+		vector<cbc_group_t> group(1);
+		vector<bucket_slice_t> slices;
+
+		auto is_trusted = [&](cbc_t cbc) {return trusted_CBC.count(cbc) != 0; };
+
+		while (true)
+		{
+			size_t my_id = bucket_id.fetch_add(1);
+			if (my_id >= no_buckets)
+				break;
+
+			// A bucket larger than the limit is loaded in slices
+			if (cbc_tuples.SpilledBucketSize(my_id) <= max_slice_size)
+				slices.assign(1, bucket_slice_t{ 0, ~0ull, 0, ~0ull, cbc_tuples.SpilledBucketSize(my_id) });
+			else
+				cbc_tuples.PlanSlices(my_id, is_trusted, max_slice_size, slices);
+
+			for (const auto& slice : slices)
+			{
+				uint64_t my_ram = min(slice.size * sizeof(packed_tuple_t), ram_limit);
+
+				{
+					unique_lock<mutex> lck(mtx_ram);
+					cv_ram.wait(lck, [&] {return ram_used == 0 || ram_used + my_ram <= ram_limit; });
+					ram_used += my_ram;
+				}
+
+				bucket.reserve(slice.size);
+				cbc_tuples.LoadSlice(my_id, slice, is_trusted, bucket, bucket_groups);
+				total_before += bucket.size();
+
+				// Parts of a CBC are merged in the order of UMIs, so the result is the same as for the whole CBC
+				if (slice.IsPartOfCbc())
+				{
+					if (slice.umi_from == 0)
+						runs.clear();
+					if (!bucket_groups.empty())
+						merge_umi_runs(merger, bucket_groups, slice.umi_from, slice.umi_to, runs);
+
+					if (slice.IsLastPartOfCbc())
+					{
+						select_umi_reads(slice.cbc_from, runs, clusterer, global_cbc_dict[slice.cbc_from]);
+						runs = umi_runs_t();
+					}
+				}
+				else
+					for (const auto& x : bucket_groups)
+					{
+						group[0] = x;
+
+						runs.clear();
+						merge_umi_runs(merger, group, 0, ~0ull, runs);
+
+						select_umi_reads(x.cbc, runs, clusterer, global_cbc_dict[x.cbc]);
+					}
+
+				clear_vec(bucket);
+				clear_vec(bucket_groups);
+
+				{
+					lock_guard<mutex> lck(mtx_ram);
+					ram_used -= my_ram;
+				}
+				cv_ram.notify_all();
+			}
+		}
+		});
+
+	join_threads(threads);
+
+	// Trusted CBCs outside the early whitelist have no tuples (as in the in-memory mode)
+	for (auto p = global_cbc_dict.begin(); p != global_cbc_dict.end(); )
+	{
+		if (p->second.empty())
+		{
+			p = global_cbc_dict.erase(p);
+			continue;
+		}
+
+		cbc_vec.emplace_back(p->second.size(), p->first);
+		no_reads_after += p->second.size();
+		++p;
+	}
+
+	no_reads_before = total_before;
+}
+
+// *********************************************************************************************
+// Appends the reads of the groups with UMIs in [umi_from, umi_to) in the order of (UMI, file id, read no.)
+void CBarcodedCounter::merge_umi_runs(CTupleMerger& merger, const vector<cbc_group_t>& groups, uint64_t umi_from, uint64_t umi_to, umi_runs_t& runs)
+{
+	const auto& layout = cbc_tuples.Layout();
+
+	merger.Reset(groups, umi_from, umi_to);
+
+	for (auto x = merger.Pop(); x; x = merger.Pop())
+	{
+		umi_t umi = layout.Umi(*x);
+
+		if (runs.umis.empty() || runs.umis.back() != umi)
+		{
+			runs.umis.emplace_back(umi);
+			runs.starts.emplace_back(runs.ids.size());
+			runs.sizes.emplace_back(1);
+		}
+		else
+			++runs.sizes.back();
+
+		runs.ids.emplace_back(encode_read_id(layout.FileId(*x), layout.ReadNo(*x)));
+	}
+}
+
+// *********************************************************************************************
+// A single read is retained for each UMI (exact) or each network of UMIs (directional, the read comes from its root UMI)
+// Random draws are made in the order of UMIs (or networks), so the result does not depend on the no. of threads
+void CBarcodedCounter::select_umi_reads(cbc_t cbc, const umi_runs_t& runs, CUmiClusterer& clusterer, vector<readfid_t>& dest)
+{
+	mt19937_64 mt(cbc);
+
+	auto pick = [&](size_t i) {
+		uint32_t size = runs.sizes[i];
+		dest.emplace_back(size == 1 ? runs.ids[runs.starts[i]] : runs.ids[runs.starts[i] + size - 1 - mt() % size]);
+	};
+
+	if (umi_dedup == umi_dedup_t::directional)
+	{
+		vector<uint32_t> roots;
+		clusterer.Cluster(runs.umis, runs.sizes, roots);
+
+		dest.reserve(roots.size());
+		for (auto i : roots)
+			pick(i);
+	}
+	else
+	{
+		dest.reserve(runs.umis.size());
+		for (size_t i = 0; i < runs.umis.size(); ++i)
+			pick(i);
+	}
+}
+
+// *********************************************************************************************
+// The CBC is split into ranges of UMIs (quantiles of its largest group) merged by many threads
+// The parts are concatenated in the order of UMIs, so the result is the same as for a single thread
+void CBarcodedCounter::dedup_giant_CBC(cbc_t cbc, const vector<cbc_group_t>& groups, vector<readfid_t>& dest)
+{
+	const auto& layout = cbc_tuples.Layout();
+
+	size_t largest = 0;
+	for (size_t i = 1; i < groups.size(); ++i)
+		if (groups[i].size() > groups[largest].size())
+			largest = i;
+
+	size_t no_parts = 4 * no_threads;
+	vector<uint64_t> bounds{ 0 };
+
+	for (size_t i = 1; i < no_parts; ++i)
+	{
+		uint64_t umi = layout.Umi(groups[largest].first[groups[largest].size() * i / no_parts]);
+		if (umi > bounds.back())
+			bounds.emplace_back(umi);
+	}
+
+	bounds.emplace_back(~0ull);
+	no_parts = bounds.size() - 1;
+
+	vector<umi_runs_t> parts(no_parts);
 
-	for (int i_thread = 0; i_thread < no_threads; ++i_thread)
-		threads.emplace_back([&id, &v_cbc, this, &a_total_no_reads_before_UMI_cleaning, &total_no_after_removal] {
-		int curr_id = -1;
-		
-		vector<vector<umi_readfid_t>::iterator> p_src;
+	atomic<size_t> part_id{ 0 };
+	vector<thread> threads;
+
+	for (int i = 0; i < no_threads; ++i)
+		threads.emplace_back([&] {
+		CTupleMerger merger(layout);
 
 		while (true)
 		{
-			curr_id = id.fetch_add(1);
-			if (curr_id >= (int)v_cbc.size())
+			size_t my_id = part_id.fetch_add(1);
+			if (my_id >= no_parts)
 				break;
 
-			mt19937_64 mt(v_cbc[curr_id]);
+			merge_umi_runs(merger, groups, bounds[my_id], bounds[my_id + 1], parts[my_id]);
+		}
+		});
 
-			p_src.clear();
+	join_threads(threads);
 
-			size_t cur_cbc_size = 0;
-			const umi_readfid_t umi_guard{ ~0ull, ~0ull };
+	umi_runs_t runs;
 
-			auto& gd_src = global_cbc_umi_dict[v_cbc[curr_id]];
-			auto& gd_dest = global_cbc_dict[v_cbc[curr_id]];
+	for (auto& part : parts)
+	{
+		for (auto& x : part.starts)
+			x += runs.ids.size();
 
-			for (auto& x : gd_src)
-			{
-				cur_cbc_size += x.size();
-				std::stable_sort(x.begin(), x.end());
+		runs.ids.insert(runs.ids.end(), part.ids.begin(), part.ids.end());
+		runs.umis.insert(runs.umis.end(), part.umis.begin(), part.umis.end());
+		runs.starts.insert(runs.starts.end(), part.starts.begin(), part.starts.end());
+		runs.sizes.insert(runs.sizes.end(), part.sizes.begin(), part.sizes.end());
 
-				// Add guard records
-				x.emplace_back(umi_guard);
+		part = umi_runs_t();
+	}
 
-				p_src.emplace_back(x.begin());
-			}
+	CUmiClusterer clusterer(umi_len);
+	select_umi_reads(cbc, runs, clusterer, dest);
+}
 
-			a_total_no_reads_before_UMI_cleaning += cur_cbc_size;
+// *********************************************************************************************
+// Valid reads are marked in rank bit vectors (by many threads at once), so the id of a valid read after relabelling
+// is just the no. of valid reads before it in its file (no relabelling arrays are necessary)
+void CBarcodedCounter::create_valid_reads_lists()
+{
+	valid_reads.clear();
+	valid_reads.resize(file_names.size());
 
-			size_t no_streams = gd_src.size();
+	file_no_reads_after_cleanup.assign(file_names.size(), 0);
 
-			auto min_umi = *p_src[0];
-			size_t min_umi_id = 0;
+	for (int i = 0; i < (int)file_names.size(); ++i)
+		valid_reads[i].Assign(file_no_reads[i]);
 
-			for (size_t i = 1; i < no_streams; ++i)
-			{
-				if (*p_src[i] < min_umi)
-				{
-					min_umi = *p_src[i];
-					min_umi_id = i;
-				}
-			}
+	vector<vector<uint64_t>*> v_reads;
+	v_reads.reserve(global_cbc_dict.size());
 
-			auto prev_umi = min_umi;
-			gd_dest.emplace_back(p_src[min_umi_id]->second);
-			++p_src[min_umi_id];
-			size_t no_same_umi = 1;
+	for (auto& x : global_cbc_dict)
+		v_reads.emplace_back(&x.second);
 
-			while (true)
-			{
-				// Find min UMI
-				min_umi = *p_src[0];
-				size_t min_umi_id = 0;
+	auto run_in_parallel = [&](size_t no_items, auto&& fun) {
+		atomic<size_t> next_id{ 0 };
+		vector<thread> threads;
 
-				for (size_t i = 1; i < no_streams; ++i)
-				{
-					if (*p_src[i] < min_umi)
-					{
-						min_umi = *p_src[i];
-						min_umi_id = i;
-					}
-				}
+		for (int i = 0; i < no_threads; ++i)
+			threads.emplace_back([&] {
+			for (size_t id = next_id.fetch_add(1); id < no_items; id = next_id.fetch_add(1))
+				fun(id);
+			});
 
-				if (min_umi.first != prev_umi.first)
-				{
-					if (no_same_umi > 1)
-					{
-						size_t id_to_preserve = mt() % no_same_umi;
-						gd_dest[gd_dest.size() - no_same_umi] = gd_dest[gd_dest.size() - id_to_preserve - 1];
-						gd_dest.resize(gd_dest.size() - no_same_umi + 1);
-					}
-					no_same_umi = 0;
-				}
+		join_threads(threads);
+	};
 
-				if (min_umi == umi_guard)
-					break;
+	// Mark valid reads
+	run_in_parallel(v_reads.size(), [&](size_t id) {
+		for (auto y : *v_reads[id])
+		{
+			auto [file_id, read_id] = decode_read_id(y);
+			valid_reads[file_id].Set(read_id);
+		}
+		});
 
-				prev_umi = min_umi;
-				gd_dest.emplace_back(p_src[min_umi_id]->second);
-				++p_src[min_umi_id];
-				++no_same_umi;
-			}
+	run_in_parallel(valid_reads.size(), [&](size_t id) {
+		valid_reads[id].BuildRank();
+		file_no_reads_after_cleanup[id] = valid_reads[id].NoSet();
+		});
 
-			total_no_after_removal += gd_dest.size();
+	// Change read ids
+	run_in_parallel(v_reads.size(), [&](size_t id) {
+		for (auto& y : *v_reads[id])
+		{
+			auto [file_id, read_id] = decode_read_id(y);
+			y = encode_read_id(file_id, valid_reads[file_id].Rank(read_id));
+		}
+		});
 
-			cbc_vec[curr_id].first = gd_dest.size();
+	uint64_t no_valid_reads = 0;
 
-			gd_dest.shrink_to_fit();
+	for (auto x : file_no_reads_after_cleanup)
+		no_valid_reads += x;
 
-			clear_vec(gd_src);
-		}
-		});
+	if (verbosity_level >= 2)
+		cout << "No. valid reads: " + to_string(no_valid_reads) + " of " + to_string(no_sample_reads) + " reads in sample\n";
+}
 
-	join_threads(threads);
+// *********************************************************************************************
+// CBCs and corrections are sorted, so the file does not depend on the order of hash tables
+bool CBarcodedCounter::save_cbc_state()
+{
+	vector<pair<cbc_t, const vector<readfid_t>*>> cbc_read_ids;
+	vector<CCbcState::correction_t> corrections;
 
-	global_cbc_umi_dict.clear();
+	cbc_read_ids.reserve(global_cbc_dict.size());
+	for (auto& x : global_cbc_dict)
+		cbc_read_ids.emplace_back(x.first, &x.second);
 
-	stable_sort(cbc_vec.begin(), cbc_vec.end(), greater<pair<uint64_t, cbc_t>>());
+	corrections.reserve(correction_map.size());
+	for (auto& x : correction_map)
+		corrections.emplace_back(CCbcState::correction_t{ x.first, x.second });
 
-	if (cbc_filtering_thr)
-	{
-		while (!cbc_vec.empty())
-		{
-			if (cbc_vec.back().first < cbc_filtering_thr)
-			{
-				total_no_after_removal -= cbc_vec.back().first;
-				cbc_vec.pop_back();
-			}
-			else
-				break;
-		}
-	}
+	std::sort(cbc_read_ids.begin(), cbc_read_ids.end());
+	std::sort(corrections.begin(), corrections.end(), [](const auto& x, const auto& y) {return x.from < y.from; });
 
-	if (verbosity_level >= 2)
-	{
-		std::cerr << "Total no. of reads before UMI cleaning: " + to_string(a_total_no_reads_before_UMI_cleaning) + "\n";
-		std::cerr << "Total no. of reads after UMI cleaning: " + to_string(total_no_after_removal) + "\n";
-	}
+	return CCbcState::Save(save_cbc_state_fn, cbc_len, umi_len, cbc_file_names, valid_reads, cbc_read_ids, corrections);
 }
 
 // *********************************************************************************************
-void CBarcodedCounter::create_valid_reads_lists()
+// Replaces the 1st pass, i.e., the CBC files are not read (unless the filtered CBC reads are exported)
+// Streamed read files are not spooled, as they are read only once
+bool CBarcodedCounter::load_cbc_state()
 {
-	uint64_t no_valid_reads = 0;
+	times.emplace_back("", high_resolution_clock::now());
 
-	valid_reads.clear();
-	valid_reads.resize(file_names.size());
+	if (verbosity_level >= 1)
+		std::cerr << "Loading CBC state\n";
 
-	vector<vector<uint32_t>> relabelling(file_names.size());
-	file_no_reads_after_cleanup.resize(file_names.size(), 0);
+	CCbcState state;
 
-	for (int i = 0; i < (int)file_names.size(); ++i)
+	if (!state.Load(load_cbc_state_fn))
+		return false;
+
+	if (state.CbcLen() != cbc_len)
 	{
-		relabelling[i].resize(file_no_reads[i], 0);
-		valid_reads[i].resize(file_no_reads[i], false);
+		std::cerr << "Error: CBCs in " + load_cbc_state_fn + " are of length " + to_string(state.CbcLen()) + ", but cbc_len is " + to_string(cbc_len) + "\n";
+		return false;
 	}
 
-	uint64_t file_id;
-	uint64_t read_id;
+	if (state.NoFiles() != cbc_file_names.size())
+	{
+		std::cerr << "Error: " + load_cbc_state_fn + " was saved for " + to_string(state.NoFiles()) + " input files, but there are " + to_string(cbc_file_names.size()) + "\n";
+		return false;
+	}
 
-	// Count and mark valid reads
-	for (auto& x : global_cbc_dict)
+	if (state.FileNames() != cbc_file_names)
+		std::cerr << "Warning: " + load_cbc_state_fn + " was saved for other CBC files\n";
+
+	valid_reads.clear();
+	valid_reads.resize(state.NoFiles());
+	file_no_reads.assign(state.NoFiles(), 0);
+	file_no_reads_after_cleanup.assign(state.NoFiles(), 0);
+	no_sample_reads = 0;
+
+	for (size_t i = 0; i < state.NoFiles(); ++i)
 	{
-		for (auto y : x.second)
+		valid_reads[i].Assign(state.File(i).no_reads, state.BitVectorWords(i));
+		valid_reads[i].BuildRank();
+
+		if (valid_reads[i].NoSet() != state.File(i).no_valid_reads)
 		{
-			tie(file_id, read_id) = decode_read_id(y);
-			valid_reads[file_id][read_id] = true;
-			file_no_reads_after_cleanup[file_id]++;
+			std::cerr << "Error: Corrupted CBC state file: " + load_cbc_state_fn + "\n";
+			return false;
 		}
 
-		no_valid_reads += x.second.size();
+		file_no_reads[i] = state.File(i).no_reads;
+		file_no_reads_after_cleanup[i] = state.File(i).no_valid_reads;
+		no_sample_reads += state.File(i).no_reads;
 	}
 
-	// Determine new read ids mapping
-	for (size_t file_id = 0; file_id < file_names.size(); ++file_id)
-	{
-		uint32_t cnt = 0;
-
-		for (size_t i = 0; i < file_no_reads[file_id]; ++i)
-			if (valid_reads[file_id][i])
-				relabelling[file_id][i] = cnt++;
-	}
+	global_cbc_dict.max_load_factor(0.8);
+	global_cbc_dict.reserve(state.NoCbcs());
 
-	// Change read ids
-	for (auto& x : global_cbc_dict)
+	for (size_t i = 0; i < state.NoCbcs(); ++i)
 	{
-		for (auto& y : x.second)
+		auto ids = state.CbcReadIds(i);
+		auto& dest = global_cbc_dict[state.Cbc(i).cbc];
+		dest.reserve(state.Cbc(i).no_read_ids);
+
+		// Read ids are used later to index valid reads of files, so they must be in range
+		for (uint64_t j = 0; j < state.Cbc(i).no_read_ids; ++j)
 		{
-			tie(file_id, read_id) = decode_read_id(y);
-			y = encode_read_id(file_id, relabelling[file_id][read_id]);
+			auto [file_id, read_id] = decode_read_id(ids[j]);
+
+			if (file_id >= state.NoFiles() || read_id >= state.File(file_id).no_valid_reads)
+			{
+				std::cerr << "Error: Corrupted CBC state file: " + load_cbc_state_fn + "\n";
+				global_cbc_dict.clear();
+				return false;
+			}
+
+			dest.push_back(ids[j]);
 		}
 	}
 
+	correction_map.reserve(state.NoCorrections());
+
+	for (size_t i = 0; i < state.NoCorrections(); ++i)
+		correction_map[state.Correction(i).from] = state.Correction(i).to;
+
 	if (verbosity_level >= 2)
-		cout << "No. valid reads: " + to_string(no_valid_reads) + " of " + to_string(no_sample_reads) + " reads in sample\n";
+	{
+		uint64_t no_valid_reads = 0;
+		for (auto x : file_no_reads_after_cleanup)
+			no_valid_reads += x;
+
+		std::cerr << "CBC state: " + to_string(state.NoCbcs()) + " CBCs, " + to_string(no_valid_reads) + " valid reads, " +
+			to_string(state.NoCorrections()) + " corrected CBCs" + (state.IsMapped() ? " (mapped)" : "") + "\n";
+	}
+
+	times.emplace_back("Loading CBC state", high_resolution_clock::now());
+
+	return true;
 }
 
 // *********************************************************************************************
@@ -1061,18 +2050,10 @@ int CBarcodedCounter::find_split(vector<pair<uint64_t, uint64_t>>& arr)
 }
 
 // *********************************************************************************************
-void CBarcodedCounter::find_trusted_thr()
+// Returns the no. of CBCs before the knee of the cumulative sums of their counts (sorted non-increasingly)
+int CBarcodedCounter::find_knee(const vector<pair<uint64_t, cbc_t>>& sorted_counts)
 {
-	cbc_vec.reserve(cbc_stats.size());
-
-	for (auto& x : cbc_stats)
-		cbc_vec.emplace_back(x.second, x.first);
-
-	cbc_stats.clear();
-
-	stable_sort(cbc_vec.begin(), cbc_vec.end(), greater<pair<uint64_t, cbc_t>>());
-
-	vector<pair<uint64_t, cbc_t>> cbc_sum(cbc_vec);
+	vector<pair<uint64_t, cbc_t>> cbc_sum(sorted_counts);
 
 	uint64_t tot = 0;
 
@@ -1085,21 +2066,38 @@ void CBarcodedCounter::find_trusted_thr()
 
 	int best_split = 0;
 
-	if (cbc_filtering_thr == 0)
+	const int no_iters = 100;
+	for (int i = 0; i < no_iters; ++i)
 	{
-		const int no_iters = 100;
-		for (int i = 0; i < no_iters; ++i)
-		{
-			int curr_split = find_split(cbc_sum);
-			if (curr_split == best_split)
-				break;
+		int curr_split = find_split(cbc_sum);
+		if (curr_split == best_split)
+			break;
 
-			best_split = curr_split;
+		best_split = curr_split;
 
-			if (best_split * 3 < (int)cbc_sum.size())
-				cbc_sum.resize(best_split * 3);
-		}
+		if (best_split * 3 < (int)cbc_sum.size())
+			cbc_sum.resize(best_split * 3);
 	}
+
+	return best_split;
+}
+
+// *********************************************************************************************
+void CBarcodedCounter::find_trusted_thr()
+{
+	cbc_vec.reserve(cbc_stats.size());
+
+	for (auto& x : cbc_stats)
+		cbc_vec.emplace_back(x.second, x.first);
+
+	cbc_stats.clear();
+
+	stable_sort(cbc_vec.begin(), cbc_vec.end(), greater<pair<uint64_t, cbc_t>>());
+
+	int best_split = 0;
+
+	if (cbc_filtering_thr == 0)
+		best_split = find_knee(cbc_vec);
 	else
 	{
 		best_split = -1;
@@ -1131,14 +2129,152 @@ void CBarcodedCounter::find_trusted_thr()
 	cbc_vec.resize(best_split);
 }
 
+// *********************************************************************************************
+// CBCs of the first reads of CBC files are counted in a count-min sketch and the knee is found as in find_trusted_thr
+// CBCs with at least 1/early_whitelist_margin of the knee count (and, if CBCs are corrected, their neighbours at Hamming
+// distance 1) are candidates, so the 1st pass stores tuples of these CBCs only (other CBCs are just counted)
+// Streamed inputs can be read only once, so there is no estimation for them
+void CBarcodedCounter::estimate_whitelist()
+{
+	early_whitelist.clear();
+	use_early_whitelist = false;
+
+	if (!early_whitelist_sample || file_names.empty())
+		return;
+
+	if (predefined_cbc || cbc_filtering_thr)
+	{
+		if (verbosity_level >= 1)
+			std::cerr << "Early whitelist estimation is used only with auto CBC filtering\n";
+		return;
+	}
+
+	for (const auto& name : file_names)
+		if (is_streamed_input(name))
+		{
+			if (verbosity_level >= 1)
+				std::cerr << "Early whitelist estimation is not used for streamed input: " + name + "\n";
+			return;
+		}
+
+	uint64_t file_quota = (early_whitelist_sample + file_names.size() - 1) / file_names.size();
+
+	CCountMinSketch sketch(early_whitelist_sample);
+	vector<unordered_set<cbc_t, refresh::MurMur64Hash>> keys(file_names.size());
+	atomic<uint64_t> no_sampled_reads{ 0 };
+	atomic_int file_id{ 0 };
+	vector<thread> threads;
+
+	for (int i = 0; i < min(no_threads, (int) file_names.size()); ++i)
+		threads.emplace_back([&] {
+		CFastXReader fqx(input_format != input_format_t::fasta, max<int>(no_gz_threads, 1), gz_backend, false, io_mode, false, no_io_buffers);
+		fqx.SetBamView(bam_view, cbc_len, umi_len);
+
+		CReadReader read_reader(input_format != input_format_t::fasta);
+		read_desc_t read_desc;
+		BaseCoding4 bc4;
+
+		vector<char> buffer(chunk_size);
+
+		while (true)
+		{
+			int curr_id = file_id.fetch_add(1);
+			if (curr_id >= (int) file_names.size())
+				break;
+
+			if (!fqx.Open(file_names[curr_id]))
+			{
+				std::cerr << "Error: File " + file_names[curr_id] + " cannot be opened\n";
+				exit(1);
+			}
+
+			auto& my_keys = keys[curr_id];
+			uint64_t no_reads = 0;
+
+			while (no_reads < file_quota && !fqx.Eof())
+			{
+				memory_chunk<char> mc(buffer.data(), buffer.size());
+
+				if (!fqx.ReadBlock(mc))
+					break;
+
+				read_reader.Assign(mc);
+
+				while (no_reads < file_quota && read_reader.GetBases(read_desc))
+				{
+					++no_reads;
+
+					if (read_desc.bases_len < cbc_len)
+						continue;
+
+					cbc_t cbc = cbc_len < CBaseEncoder::MAX_LEN ? CBaseEncoder::Encode(read_desc.bases, cbc_len, read_reader.BlockEnd()) :
+						bc4.encode_bases_2b(read_desc.bases, read_desc.bases + cbc_len);
+
+					// CBCs seen once are (almost always) noise, so they are not collected
+					if (cbc != ~0ull && sketch.Add(cbc) >= 2)
+						my_keys.insert(cbc);
+				}
+			}
+
+			no_sampled_reads += no_reads;
+		}
+		});
+
+	join_threads(threads);
+
+	for (size_t i = 1; i < keys.size(); ++i)
+	{
+		keys[0].insert(keys[i].begin(), keys[i].end());
+		keys[i].clear();
+	}
+
+	vector<pair<uint64_t, cbc_t>> counts;
+	counts.reserve(keys[0].size());
+
+	for (auto cbc : keys[0])
+		counts.emplace_back(sketch.Estimate(cbc), cbc);
+
+	keys.clear();
+
+	if (counts.empty())
+		return;
+
+	stable_sort(counts.begin(), counts.end(), greater<pair<uint64_t, cbc_t>>());
+
+	int knee = max(find_knee(counts), 1);
+	uint64_t min_count = max<uint64_t>(2, counts[knee - 1].first / early_whitelist_margin);
+
+	for (auto& x : counts)
+	{
+		if (x.first < min_count)
+			break;
+
+		early_whitelist.insert(x.second);
+
+		// Non-trusted CBCs can be corrected to trusted ones
+		if (apply_cbc_correction)
+			for (uint32_t i = 0; i < cbc_len; ++i)
+				for (cbc_t j = 0; j < 4; ++j)
+					early_whitelist.insert((x.second & ~(3ull << (2 * i))) + (j << (2 * i)));
+	}
+
+	use_early_whitelist = true;
+
+	if (verbosity_level >= 2)
+		std::cerr << "Early whitelist: " + to_string(early_whitelist.size()) + " candidate CBCs (knee after " + to_string(knee) + " CBCs with " +
+			to_string(counts[knee - 1].first) + " reads in the sample of " + to_string(no_sampled_reads) + " reads, sketch of " + to_string(sketch.Size() >> 20) + " MB)\n";
+}
+
 // *********************************************************************************************
 void CBarcodedCounter::find_predefined_cbc()
 {
-	cbc_vec.reserve(predefined_cbc.size());
+	cbc_vec.reserve(min<uint64_t>(predefined_cbc->Size(), cbc_stats.size()));
 
 	for (auto& x : cbc_stats)
-		if (predefined_cbc.count(x.first))
+		if (predefined_cbc->Contains(x.first))
 			cbc_vec.emplace_back(x.second, x.first);
+		else if (apply_cbc_correction)
+			cbc_for_corr_vec.emplace_back(x.second, x.first);
 
 	cbc_stats.clear();
 
@@ -1151,12 +2287,11 @@ void CBarcodedCounter::find_predefined_cbc()
 }
 
 // *********************************************************************************************
-void CBarcodedCounter::enumerate_kmer_leaders_from_read(uint8_t* bases, vector<leader_t>& kmer_leaders)
+void CBarcodedCounter::enumerate_kmer_leaders_from_read(const uint8_t* bases, int read_len, vector<leader_t>& kmer_leaders)
 {
 	CKmer leader(leader_len, kmer_mode_t::direct);
 	CKmer follower(follower_len, kmer_mode_t::direct);
 
-	int read_len = strlen((char*)bases);
 	int follower_start_pos = leader_len + gap_len;
 
 	if (leader_len + gap_len + follower_len > (uint32_t) read_len)
@@ -1203,12 +2338,11 @@ void CBarcodedCounter::enumerate_kmer_leaders_from_read(uint8_t* bases, vector<l
 }
 
 // *********************************************************************************************
-void CBarcodedCounter::enumerate_kmer_pairs_from_read(uint8_t* bases, vector<leader_follower_t>& kmer_pairs)
+void CBarcodedCounter::enumerate_kmer_pairs_from_read(const uint8_t* bases, int read_len, vector<leader_follower_t>& kmer_pairs)
 {
 	CKmer leader(leader_len, kmer_mode_t::direct);
 	CKmer follower(follower_len, kmer_mode_t::direct);
 
-	int read_len = (int) strlen((char*)bases);
 	int follower_start_pos = leader_len + gap_len;
 
 	if (leader_len + gap_len + follower_len > (uint32_t) read_len)
@@ -1255,13 +2389,11 @@ void CBarcodedCounter::enumerate_kmer_pairs_from_read(uint8_t* bases, vector<lea
 }
 
 // *********************************************************************************************
-void CBarcodedCounter::enumerate_kmers_from_read(uint8_t* bases, vector<kmer_t>& kmers)
+void CBarcodedCounter::enumerate_kmers_from_read(const uint8_t* bases, int read_len, vector<kmer_t>& kmers)
 {
 //	CKmer kmer(leader_len, kmer_mode_t::direct);			// !!! TODO - add support for canonical
 	CKmer kmer(leader_len, canonical_mode ? kmer_mode_t::canonical : kmer_mode_t::direct);
 
-	int read_len = (int) strlen((char*)bases);
-	
 	if (leader_len > (uint32_t) read_len)
 		return;
 
@@ -1298,6 +2430,7 @@ void CBarcodedCounter::enumerate_kmer_leaders_for_cbc(cbc_t cbc, vector<leader_t
 
 	uint64_t file_id;
 	uint64_t read_id;
+	uint32_t read_len;
 
 #ifdef USE_READ_COMPRESSION
 	vector<uint8_t> decompressed_read;
@@ -1308,10 +2441,12 @@ void CBarcodedCounter::enumerate_kmer_leaders_for_cbc(cbc_t cbc, vector<leader_t
 		tie(file_id, read_id) = decode_read_id(x);
 
 #ifdef USE_READ_COMPRESSION
-		base_coding3.decode_bases(sample_reads[file_id][read_id], decompressed_read);
-		enumerate_kmer_leaders_from_read(decompressed_read.data(), kmer_leaders);
+		auto packed_read = load_read_len(sample_reads[file_id][read_id], read_len);
+		base_coding3.decode_bases(packed_read, read_len, decompressed_read);
+		enumerate_kmer_leaders_from_read(decompressed_read.data(), (int) read_len, kmer_leaders);
 #else
-		enumerate_kmer_leaders_from_read(sample_reads[file_id][read_id], kmer_leaders);
+		auto bases = load_read_len(sample_reads[file_id][read_id], read_len);
+		enumerate_kmer_leaders_from_read(bases, (int) read_len, kmer_leaders);
 #endif
 	}
 }
@@ -1323,6 +2458,7 @@ void CBarcodedCounter::enumerate_kmer_pairs_for_cbc(cbc_t cbc, vector<leader_fol
 
 	uint64_t file_id;
 	uint64_t read_id;
+	uint32_t read_len;
 
 #ifdef USE_READ_COMPRESSION
 	vector<uint8_t> decompressed_read;
@@ -1333,11 +2469,13 @@ void CBarcodedCounter::enumerate_kmer_pairs_for_cbc(cbc_t cbc, vector<leader_fol
 		tie(file_id, read_id) = decode_read_id(x);
 
 #ifdef USE_READ_COMPRESSION
-		base_coding3.decode_bases(sample_reads[file_id][read_id], decompressed_read);
+		auto packed_read = load_read_len(sample_reads[file_id][read_id], read_len);
+		base_coding3.decode_bases(packed_read, read_len, decompressed_read);
 
-		enumerate_kmer_pairs_from_read(decompressed_read.data(), kmer_pairs);
+		enumerate_kmer_pairs_from_read(decompressed_read.data(), (int) read_len, kmer_pairs);
 #else
-		enumerate_kmer_pairs_from_read(sample_reads[file_id][read_id], kmer_pairs);
+		auto bases = load_read_len(sample_reads[file_id][read_id], read_len);
+		enumerate_kmer_pairs_from_read(bases, (int) read_len, kmer_pairs);
 #endif
 	}
 
@@ -1353,6 +2491,7 @@ void CBarcodedCounter::enumerate_kmers_for_cbc(cbc_t cbc, vector<kmer_t>& kmers)
 
 	uint64_t file_id;
 	uint64_t read_id;
+	uint32_t read_len;
 
 #ifdef USE_READ_COMPRESSION
 	vector<uint8_t> decompressed_read;
@@ -1363,11 +2502,13 @@ void CBarcodedCounter::enumerate_kmers_for_cbc(cbc_t cbc, vector<kmer_t>& kmers)
 		tie(file_id, read_id) = decode_read_id(x);
 
 #ifdef USE_READ_COMPRESSION
-		base_coding3.decode_bases(sample_reads[file_id][read_id], decompressed_read);
+		auto packed_read = load_read_len(sample_reads[file_id][read_id], read_len);
+		base_coding3.decode_bases(packed_read, read_len, decompressed_read);
 
-		enumerate_kmers_from_read(decompressed_read.data(), kmers);
+		enumerate_kmers_from_read(decompressed_read.data(), (int) read_len, kmers);
 #else
-		enumerate_kmers_from_read(sample_reads[file_id][read_id], kmers);
+		auto bases = load_read_len(sample_reads[file_id][read_id], read_len);
+		enumerate_kmers_from_read(bases, (int) read_len, kmers);
 #endif
 	}
 
@@ -1856,32 +2997,73 @@ string CBarcodedCounter::kmer_to_string(uint64_t kmer, int len)
 // *********************************************************************************************
 bool CBarcodedCounter::ProcessCBC()
 {
-	set_CBC_file_names();
+	if (!load_cbc_state_fn.empty())
+		return load_cbc_state();
+
+	if (!prepare_spools())
+		return false;
+
+	set_CBC_file_names(true);
 
 	times.emplace_back("", high_resolution_clock::now());
 
 	if (!no_threads || file_names.empty())
 		return false;
 
-	no_reading_threads = max(min(no_threads / 2, (int)file_names.size()), 1);
+	if (early_whitelist_sample)
+	{
+		if (verbosity_level >= 1)
+			std::cerr << "Estimating CBC whitelist\n";
+		estimate_whitelist();
+		times.emplace_back("Estimating CBC whitelist", high_resolution_clock::now());
+	}
+
+	no_reading_threads = max(min(no_threads / 2, (int)file_parts.size()), 1);
 
 	init_queues_and_pools();
 
+	if (!cbc_tuples.Reset(cbc_len, umi_len, (uint32_t) file_names.size()))
+	{
+		std::cerr << "Error: Too many input files\n";
+		return false;
+	}
+
+	// Half of the limit is left for the growth of vectors (and the structures of CBCs)
+	if (max_ram)
+	{
+		std::filesystem::path spill_prefix(spool_path);
+		spill_prefix /= std::filesystem::path(out_file_name).filename();
+
+		cbc_tuples.SetSpilling(spill_prefix.string(), ((size_t) max_ram << 30) / sizeof(packed_tuple_t) / 2 / no_reading_threads);
+	}
+
 	start_reading_threads();
 	start_counting_threads();
 
 	join_threads(reading_threads);
 	join_threads(counting_threads);
+	learn_pipeline();
+	close_cbc_spools();
+	unordered_set<cbc_t, refresh::MurMur64Hash>().swap(early_whitelist);
+
+	if (verbosity_level >= 2 && CGzBackendSelector::IsSelected())
+		std::cerr << CGzBackendSelector::Report();
 
 	times.emplace_back("Reading and counting", high_resolution_clock::now());
 
+	if (verbosity_level >= 1)
+		std::cerr << "Sorting CBC/UMI tuples\n";
+	cbc_tuples.Finalize(no_threads);
+	mi_collect(true);
+	times.emplace_back("Sorting CBC/UMI tuples", high_resolution_clock::now());
+
 	if (verbosity_level >= 1)
 		std::cerr << "Gathering CBC statistics\n";
 	gather_cbc_stats();
 	mi_collect(true);
 	times.emplace_back("Gathering CBC statistics", high_resolution_clock::now());
 
-	if (!predefined_cbc.empty())
+	if (predefined_cbc)
 	{
 		if (verbosity_level >= 1)
 			std::cerr << "Looking for predefined CBC in data\n";
@@ -1898,14 +3080,23 @@ bool CBarcodedCounter::ProcessCBC()
 		find_trusted_thr();		// !!! This can be parallelized
 		mi_collect(true);
 		times.emplace_back("Looking for trusted threshold", high_resolution_clock::now());
+	}
 
-		if (apply_cbc_correction)
+	if (apply_cbc_correction)
+	{
+		if (verbosity_level >= 1)
+			std::cerr << "CBCs correction\n";
+		find_CBC_corrections();
+		mi_collect(true);
+		times.emplace_back("CBCs correction", high_resolution_clock::now());
+
+		if (quality_aware_cbc_correction)
 		{
 			if (verbosity_level >= 1)
-				std::cerr << "CBCs correction\n";
-			find_CBC_corrections();
+				std::cerr << "Quality-aware correction of CBC reads\n";
+			correct_ambiguous_CBC_reads();
 			mi_collect(true);
-			times.emplace_back("CBCs correction", high_resolution_clock::now());
+			times.emplace_back("Quality-aware correction of CBC reads", high_resolution_clock::now());
 		}
 	}
 
@@ -1929,13 +3120,23 @@ bool CBarcodedCounter::ProcessCBC()
 	mi_collect(true);
 	times.emplace_back("Creating valid reads list", high_resolution_clock::now());
 
+	if (!save_cbc_state_fn.empty())
+	{
+		if (verbosity_level >= 1)
+			std::cerr << "Saving CBC state\n";
+		if (!save_cbc_state())
+			return false;
+		times.emplace_back("Saving CBC state", high_resolution_clock::now());
+	}
+
 	return true;
 }
 
 // *********************************************************************************************
 bool CBarcodedCounter::ProcessExportFilteredCBCReads()
 {
-	set_CBC_file_names();
+	wait_for_spools();
+	set_CBC_file_names(false);
 
 	if (!no_threads || file_names.empty())
 		return false;
@@ -1945,7 +3146,7 @@ bool CBarcodedCounter::ProcessExportFilteredCBCReads()
 	if (verbosity_level >= 1)
 		std::cerr << "Reads loading\n";
 
-	reinit_queues();
+	reinit_queues(false);
 
 	init_bkc_files();
 
@@ -1954,6 +3155,7 @@ bool CBarcodedCounter::ProcessExportFilteredCBCReads()
 
 	join_threads(reading_threads);
 	join_threads(reads_exporting_threads);
+	learn_pipeline();
 	mi_collect(true);
 
 	times.emplace_back("CBC reads filtering", high_resolution_clock::now());
@@ -1964,7 +3166,8 @@ bool CBarcodedCounter::ProcessExportFilteredCBCReads()
 // *********************************************************************************************
 bool CBarcodedCounter::ProcessExportFilteredReads()
 {
-	set_read_file_names();
+	wait_for_spools();
+	set_read_file_names(false);
 
 	if (!no_threads || file_names.empty())
 		return false;
@@ -1974,7 +3177,7 @@ bool CBarcodedCounter::ProcessExportFilteredReads()
 	if (verbosity_level >= 1)
 		std::cerr << "Reads loading\n";
 
-	reinit_queues();
+	reinit_queues(false);
 
 	init_bkc_files();
 
@@ -1983,6 +3186,7 @@ bool CBarcodedCounter::ProcessExportFilteredReads()
 
 	join_threads(reading_threads);
 	join_threads(reads_exporting_threads);
+	learn_pipeline();
 	mi_collect(true);
 
 	times.emplace_back("CBC reads filtering", high_resolution_clock::now());
@@ -1993,17 +3197,19 @@ bool CBarcodedCounter::ProcessExportFilteredReads()
 // *********************************************************************************************
 bool CBarcodedCounter::ProcessReads()
 {
-	set_read_file_names();
+	wait_for_spools();
+	set_read_file_names(!(((uint32_t)export_filtered_input) & (uint32_t)export_filtered_input_t::second));
+	set_first_valid_read_ids();
 
 	if (!no_threads || file_names.empty())
 		return false;
 
-	no_reading_threads = max(min(no_threads / 2, (int)file_names.size()), 1);
+	no_reading_threads = max(min(no_threads / 2, (int)file_parts.size()), 1);
 
 	if (verbosity_level >= 1)
 		std::cerr << "Reads loading\n";
 
-	reinit_queues();
+	reinit_queues(!(((uint32_t) export_filtered_input) & (uint32_t) export_filtered_input_t::second));
 
 	init_bkc_files();
 
@@ -2012,6 +3218,7 @@ bool CBarcodedCounter::ProcessReads()
 
 	join_threads(reading_threads);
 	join_threads(reads_loading_threads);
+	learn_pipeline();
 	mi_collect(true);
 
 	if (verbosity_level >= 2)
@@ -17,6 +17,18 @@
 #include <refresh/allocators/lib/memory_monotonic.h>
 
 #include "memory_pool.h"
+#include "fq_reader.h"
+#include "spool.h"
+#include "pipeline_tuner.h"
+#include "block_scheduler.h"
+#include "cbc_tuple_store.h"
+#include "count_min_sketch.h"
+#include "cbc_correction.h"
+#include "cbc_whitelist.h"
+#include "cbc_state.h"
+#include "umi_clusterer.h"
+#include "rank_bit_vector.h"
+#include "base_encoder.h"
 #include "../common/utils.h"
 #include "../common/bkc_file.h"
 #include "params.h"
@@ -119,9 +131,7 @@ struct kmer_count_t
 
 class CBarcodedCounter
 {
-	const size_t no_blocks_in_queue = 3;
-	const size_t no_chunks_per_file = 3;
-	const size_t chunk_size = 64 << 20;
+	const size_t chunk_size = 64 << 20;				// used for file splitting and spooling (reading pipeline is planned by pipeline_tuner)
 	const int gz_filtered_file_buffer_size = 16 << 20;
 //	const bool filtered_input_in_FASTA = false;
 	bool filtered_input_in_FASTA = false;
@@ -130,8 +140,20 @@ class CBarcodedCounter
 	vector<pair<string, time_point<high_resolution_clock>>> times;
 
 	vector<string> file_names;
+	vector<file_part_t> file_parts;
 	int no_threads = 1;
 	int no_reading_threads = 0;
+	uint32_t no_file_parts = 0;					// 0 - auto
+	uint32_t no_gz_threads = 0;					// 0 - auto
+	gz_backend_t gz_backend = gz_backend_t::automatic;
+	bool use_mmap = true;
+	io_mode_t io_mode = io_mode_t::automatic;
+	bool direct_io = false;
+	int no_io_buffers = 4;
+	CPipelineTuner pipeline_tuner;
+	pipeline_plan_t pipeline_plan;
+	pipeline_stats_t pipeline_stats;
+	bam_view_t bam_view = bam_view_t::none;
 
 	string out_file_name = "./results.bkc";
 
@@ -150,9 +172,12 @@ class CBarcodedCounter
 	uint32_t zstd_level = 6;
 	uint32_t verbosity_level = 0;
 	bool apply_cbc_correction = false;
+	bool quality_aware_cbc_correction = false;
 	uint32_t cbc_filtering_thr = 0;
 	bool export_cbc_logs = false;
 	string cbc_log_file_name;
+	string save_cbc_state_fn;
+	string load_cbc_state_fn;
 	export_filtered_input_t export_filtered_input = export_filtered_input_t::none;
 	string filtered_input_path;
 	input_format_t input_format;
@@ -161,6 +186,16 @@ class CBarcodedCounter
 	vector<string> cbc_file_names;
 	vector<string> read_file_names;
 
+	string spool_path;
+	uint32_t max_ram;									// GB, limit of tuples of the 1st pass (0 - no limit)
+	bool spools_ready = false;
+	vector<string> cbc_spool_names;						// spools of streamed inputs read in the 2nd pass (empty if the file is read directly)
+	vector<string> read_spool_names;
+	vector<string> file_spool_names;
+	vector<unique_ptr<CSpoolWriter>> cbc_spool_writers;		// tees of streamed CBC files (written by the reading threads)
+	vector<unique_ptr<CSpoolWriter>> read_spool_writers;	// spools of streamed read files (written by the spooling threads)
+	vector<thread> spooling_threads;
+
 	uint8_t sample_id_size_in_bytes;
 	uint8_t barcode_size_in_bytes;
 	uint8_t leader_size_in_bytes;
@@ -176,25 +211,63 @@ class CBarcodedCounter
 	vector<thread> reads_loading_threads;
 	vector<thread> reads_exporting_threads;
 
-	vector<unique_ptr<CMemoryPool<char>>> memory_pools;
-	vector<unique_ptr<parallel_queue<pair<int, memory_chunk<char>>>>> block_queues;
+	unique_ptr<CMemoryPool<char>> memory_pool;			// shared by all reading threads
+	unique_ptr<CBlockScheduler> block_scheduler;
+	CReadIdSequencer read_id_sequencer;
 
-	unique_ptr<parallel_queue<pair<int, string>>> fn_queue;
+	unique_ptr<parallel_queue<int>> part_queue;
+	mutex mtx_file_no_reads;
 
 	using umi_t = uint64_t;
 	using readfid_t = uint64_t;
-	using umi_readfid_t = pair<umi_t, readfid_t>;
 
-	vector<unordered_map<cbc_t, vector<umi_readfid_t>, refresh::MurMur64Hash>> cbc_dict;
+	CCbcTupleStore cbc_tuples;
+	const uint64_t giant_cbc_min_size = 1 << 16;		// CBCs with more reads (and more than 1/no_threads of all) are deduplicated by all threads
+	umi_dedup_t umi_dedup = umi_dedup_t::exact;
+
+	// Reads of a CBC in the order of UMIs and the runs of reads of the same UMI
+	struct umi_runs_t
+	{
+		vector<readfid_t> ids;
+		vector<umi_t> umis;
+		vector<uint64_t> starts;
+		vector<uint32_t> sizes;
+
+		void clear()
+		{
+			ids.clear();
+			umis.clear();
+			starts.clear();
+			sizes.clear();
+		}
+	};
 	vector<pair<uint64_t, cbc_t>> cbc_vec, cbc_for_corr_vec;
-	unordered_map<cbc_t, vector<vector<umi_readfid_t>>, refresh::MurMur64Hash> global_cbc_umi_dict;
+	unordered_map<cbc_t, vector<cbc_group_t>, refresh::MurMur64Hash> global_cbc_umi_dict;		// groups of tuples of each trusted CBC (after correction)
 	unordered_map<cbc_t, vector<readfid_t>, refresh::MurMur64Hash> global_cbc_dict;
 	unordered_map<cbc_t, cbc_t, refresh::MurMur64Hash> correction_map;
+
+	// Non-trusted CBCs with many trusted neighbours are corrected (only in the quality-aware mode) for each read separately
+	struct correction_candidate_t
+	{
+		cbc_t cbc;
+		uint64_t count;
+		uint32_t mismatch_pos;
+	};
+
+	const double cbc_correction_min_posterior = 0.975;
+	unordered_map<cbc_t, vector<correction_candidate_t>, refresh::MurMur64Hash> ambiguous_corrections;
+	vector<vector<pair<uint64_t, cbc_t>>> read_corrections;		// (read no., trusted CBC) for each CBC file (sorted by read no.)
+	vector<packed_tuple_t> corrected_read_tuples;				// tuples of reads corrected separately (groups point here)
 	unordered_map<cbc_t, uint64_t, refresh::MurMur64Hash> cbc_stats;
 
-	unordered_set<cbc_t> predefined_cbc;
+	shared_ptr<const CCbcWhitelist> predefined_cbc;			// nullptr if not used
 
-	vector<vector<bool>> valid_reads;
+	const uint64_t early_whitelist_margin = 4;				// candidates have at least 1/margin of the knee count in the sample
+	uint64_t early_whitelist_sample = 0;					// no. of reads (0 - no estimation)
+	bool use_early_whitelist = false;
+	unordered_set<cbc_t, refresh::MurMur64Hash> early_whitelist;
+
+	vector<CRankBitVector> valid_reads;				// read ids after relabelling are ranks of the valid reads
 	vector<unique_ptr<memory_monotonic_safe>> mma;
 	vector<vector<uint8_t*>> sample_reads;
 	vector<uint64_t> file_no_reads;
@@ -234,6 +307,38 @@ class CBarcodedCounter
 		return make_pair(x >> 32, x & 0xffffffffull);
 	}
 
+	// Sample reads are preceded by their lengths (varint), so the lengths are never recomputed
+	static uint8_t* store_read_len(uint8_t* p, uint32_t len)
+	{
+		for (; len >= 0x80; len >>= 7)
+			*p++ = (uint8_t) (len | 0x80);
+		*p++ = (uint8_t) len;
+
+		return p;
+	}
+
+	static const uint8_t* load_read_len(const uint8_t* p, uint32_t& len)
+	{
+		len = 0;
+		for (int shift = 0; ; shift += 7)
+		{
+			len += (uint32_t) (*p & 0x7f) << shift;
+			if (!(*p++ & 0x80))
+				break;
+		}
+
+		return p;
+	}
+
+	static size_t read_len_size(uint32_t len)
+	{
+		size_t r = 1;
+		for (; len >= 0x80; len >>= 7)
+			++r;
+
+		return r;
+	}
+
 	template <typename T> void clear_vec(T&v)
 	{
 		v.clear();
@@ -242,6 +347,9 @@ class CBarcodedCounter
 	}
 
 	std::string get_dedup_file_name(const std::string& input_path, const uint32_t id);
+	void export_read(gzFile filtered_file, const read_desc_t& read_desc);
+	uint64_t skip_filtered_reads(CReadReader& read_reader, const CRankBitVector& file_valid_reads, uint64_t read_id);
+	uint64_t count_valid_reads(const CRankBitVector& file_valid_reads, uint64_t read_id, uint64_t no_reads);
 
 	void join_threads(vector<thread>& threads);
 	void start_reading_threads();
@@ -250,36 +358,46 @@ class CBarcodedCounter
 	void start_reads_exporting_threads();
 
 	void init_queues_and_pools();
-	void reinit_queues();
+	void reinit_queues(bool allow_stealing);
+	void learn_pipeline();
 
 	bool init_bkc_files();
 
-	void merge_cbc_dict();
-	void sort_cbc_dict();
 	void gather_cbc_stats();
 
 	double calc_dist(vector<pair<uint64_t, uint64_t>>::iterator p, vector<pair<uint64_t, uint64_t>>::iterator q);
 	int find_split(vector<pair<uint64_t, uint64_t>>& arr);
+	int find_knee(const vector<pair<uint64_t, cbc_t>>& sorted_counts);
 	void find_trusted_thr();
+	void estimate_whitelist();
 	void find_predefined_cbc();
 
 	void find_CBC_corrections();
+	void correct_ambiguous_CBC_reads();
 	void remove_non_trusted_CBC();
 	void remove_duplicated_UMI();
+	void dedup_stored_tuples(uint64_t& no_reads_before, uint64_t& no_reads_after, uint64_t& no_giant_cbcs);
+	void redirect_spilled_tuples();
+	void dedup_spilled_tuples(uint64_t& no_reads_before, uint64_t& no_reads_after);
+	void merge_umi_runs(CTupleMerger& merger, const vector<cbc_group_t>& groups, uint64_t umi_from, uint64_t umi_to, umi_runs_t& runs);
+	void select_umi_reads(cbc_t cbc, const umi_runs_t& runs, CUmiClusterer& clusterer, vector<readfid_t>& dest);
+	void dedup_giant_CBC(cbc_t cbc, const vector<cbc_group_t>& groups, vector<readfid_t>& dest);
 
 	void create_valid_reads_lists();
 
 	void list_cbc_dict(const string& suffix);
+	bool save_cbc_state();
+	bool load_cbc_state();
 
 	string kmer_to_string(uint64_t kmer, int len);
 
-	void enumerate_kmer_leaders_from_read(uint8_t* bases, vector<leader_t>& kmer_leaders);
+	void enumerate_kmer_leaders_from_read(const uint8_t* bases, int read_len, vector<leader_t>& kmer_leaders);
 	void enumerate_kmer_leaders_for_cbc(cbc_t cbc, vector<leader_t>& kmer_leaders);
 	void count_leaders();
 	void determine_valid_leaders();
 
-	void enumerate_kmer_pairs_from_read(uint8_t* bases, vector<leader_follower_t>& kmer_pairs);
-	void enumerate_kmers_from_read(uint8_t* bases, vector<kmer_t>& kmers);
+	void enumerate_kmer_pairs_from_read(const uint8_t* bases, int read_len, vector<leader_follower_t>& kmer_pairs);
+	void enumerate_kmers_from_read(const uint8_t* bases, int read_len, vector<kmer_t>& kmers);
 
 	void enumerate_kmer_pairs_for_cbc(cbc_t cbc, vector<leader_follower_t>& kmer_pairs);
 	void enumerate_kmers_for_cbc(cbc_t cbc, vector<kmer_t>& kmers);
@@ -298,11 +416,23 @@ class CBarcodedCounter
 
 	void pack_records(vector<bkc_record_t>& records, vector<uint8_t>& packed_buffer);
 
-	void set_CBC_file_names();
-	void set_read_file_names();
+	void prepare_file_parts(bool allow_split);
+	void set_first_valid_read_ids();
+	int no_gz_threads_per_reader();
+
+	void set_CBC_file_names(bool allow_split);
+	void set_read_file_names(bool allow_split);
+
+	string get_spool_file_name(const string& suffix, int id);
+	bool prepare_spools();
+	void spool_input(const string& file_name, CSpoolWriter& writer);
+	void close_cbc_spools();
+	void wait_for_spools();
+	void remove_spools();
 
 public:
 	CBarcodedCounter() = default;
+	~CBarcodedCounter();
 
 	void SetParams(const CParams& params);
 
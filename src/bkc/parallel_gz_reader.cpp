@@ -0,0 +1,881 @@
+#include <iostream>
+#include <cstring>
+#include <thread>
+#include <atomic>
+#include <algorithm>
+#include "parallel_gz_reader.h"
+
+// *********************************************************************************************
+CParallelGzReader::CParallelGzReader(int no_threads, gz_backend_t backend_type, io_mode_t io_mode, bool direct_io, int no_io_buffers) :
+	no_threads(max(no_threads, 1)),
+	in(io_mode, direct_io, no_io_buffers),
+	backend_type(backend_type)
+{
+	tasks.resize(this->no_threads);
+	chunks.resize(this->no_threads);
+
+	for (int i = 0; i < this->no_threads; ++i)
+		chunk_decoders.emplace_back(make_unique<CDeflateChunkDecoder>());
+}
+
+// *********************************************************************************************
+CParallelGzReader::~CParallelGzReader()
+{
+	close();
+}
+
+// *********************************************************************************************
+void CParallelGzReader::close()
+{
+	if (is_open)
+	{
+		in.Close();
+		is_open = false;
+	}
+
+	in_pos = 0;
+	in_size = 0;
+	in_eof = false;
+	is_finished = false;
+	is_error = false;
+
+	out_buf.clear();
+	out_pos = 0;
+
+	in_member = false;
+	in_blocks = false;
+	in_bits = 0;
+	window.clear();
+	in_file_pos = 0;
+	mode = gz_mode_t::unknown;
+	compression_ratio = 4.0;
+
+	index_builder = nullptr;
+	range_skip = range_left = 0;
+}
+
+// *********************************************************************************************
+bool CParallelGzReader::Open(const string& file_name)
+{
+	close();
+
+	if (!in.Open(file_name))
+		return false;
+
+	is_open = true;
+
+	in_buf.resize(IN_BUFFER_SIZE_PER_THREAD * no_threads);
+
+	return true;
+}
+
+// *********************************************************************************************
+// Inflates [out_begin, out_end) range of the uncompressed data of a single-member file starting from the nearest checkpoint
+bool CParallelGzReader::OpenRange(const string& file_name, const CGzIndex& index, uint64_t out_begin, uint64_t out_end)
+{
+	close();
+
+	auto& checkpoint = index.FindCheckpoint(out_begin);
+
+	if (!in.Open(file_name, checkpoint.in_pos - (checkpoint.bits ? 1 : 0)))
+		return false;
+
+	is_open = true;
+
+	in_buf.resize(IN_BUFFER_SIZE_PER_THREAD);
+
+	if (!fill_input(false) || in_size < (checkpoint.bits ? 1u : 0u))
+	{
+		cerr << "Error: cannot read gzip file\n";
+		return false;
+	}
+
+	auto inflater = make_unique<CGzIndexInflater>();
+
+	if (!inflater->BeginAt(checkpoint, checkpoint.bits ? in_buf[in_pos++] : 0))
+	{
+		cerr << "Error: incorrect gzip index of " + file_name + "\n";
+		return false;
+	}
+
+	stream_backend = move(inflater);
+	mode = gz_mode_t::indexed;
+	in_member = true;
+
+	range_skip = out_begin - checkpoint.out_pos;
+	range_left = min(out_end, index.OutSize()) - out_begin;
+
+	if (!range_left)
+		is_finished = true;
+
+	return true;
+}
+
+// *********************************************************************************************
+void CParallelGzReader::Close()
+{
+	close();
+}
+
+// *********************************************************************************************
+size_t CParallelGzReader::Read(char* dest, size_t size)
+{
+	size_t copied = 0;
+
+	while (copied < size && !is_error)
+	{
+		if (out_pos == out_buf.size())
+		{
+			out_buf.clear();
+			out_pos = 0;
+
+			if (is_finished)
+				break;
+
+			if (!decode_step())
+				is_error = true;
+
+			continue;
+		}
+
+		size_t n = min(size - copied, out_buf.size() - out_pos);
+		memcpy(dest + copied, out_buf.data() + out_pos, n);
+		copied += n;
+		out_pos += n;
+	}
+
+	return copied;
+}
+
+// *********************************************************************************************
+bool CParallelGzReader::Eof()
+{
+	return is_error || (is_finished && out_pos == out_buf.size());
+}
+
+// *********************************************************************************************
+// Moves the unprocessed data to the buffer front (compact mode) or waits until the buffer is consumed and reads next data
+bool CParallelGzReader::fill_input(bool compact)
+{
+	if (in_eof)
+		return true;
+
+	if (compact)
+	{
+		if (in_pos)
+		{
+			memmove(in_buf.data(), in_buf.data() + in_pos, in_size - in_pos);
+			in_size -= in_pos;
+			in_file_pos += in_pos;
+			in_pos = 0;
+		}
+	}
+	else if (in_pos < in_size)
+		return true;
+	else
+	{
+		in_file_pos += in_size;
+		in_pos = in_size = 0;
+	}
+
+	size_t to_read = in_buf.size() - in_size;
+	size_t readed = in.Read((char*) in_buf.data() + in_size, to_read);
+	in_size += readed;
+
+	if (readed < to_read)
+	{
+		if (in.Error())
+			return false;
+		in_eof = true;
+	}
+
+	return true;
+}
+
+// *********************************************************************************************
+// Backends are created at the first member, as the automatic selection needs some input data
+void CParallelGzReader::prepare_backends()
+{
+	if (stream_backend)
+		return;
+
+	gz_backend_t stream_type = backend_type;
+	gz_backend_t member_type = backend_type;
+
+	// Members of multi-member files are also inflated by the member backends, so the stream backend is needed for the index only
+	// in single-member files inflated by a single thread (many threads make checkpoints at boundaries of parts of deflate blocks)
+	if (index_builder && no_threads == 1)
+		stream_backend = make_unique<CGzIndexInflater>(index_builder);
+
+	if (backend_type == gz_backend_t::automatic)
+	{
+		CGzBackendSelector::Select(in_buf.data() + in_pos, in_size - in_pos);
+		stream_type = CGzBackendSelector::StreamBackend();
+		member_type = CGzBackendSelector::MemberBackend();
+	}
+
+	if (!stream_backend)
+		stream_backend = make_gz_backend(stream_type);
+	if (!stream_backend || !stream_backend->CanStream())
+		stream_backend = make_gz_backend(gz_backend_t::zlib);
+
+	for (int i = 0; i < no_threads; ++i)
+	{
+		member_backends.emplace_back(make_gz_backend(member_type));
+		if (!member_backends.back())
+			member_backends.back() = make_gz_backend(gz_backend_t::zlib);
+	}
+}
+
+// *********************************************************************************************
+bool CParallelGzReader::is_gzip_header(size_t pos)
+{
+	if (pos + 10 > in_size)
+		return false;
+
+	const uint8_t* p = in_buf.data() + pos;
+
+	return p[0] == 0x1f && p[1] == 0x8b && p[2] == 8 && (p[3] & 0xe0) == 0 && (p[9] <= 13 || p[9] == 255);
+}
+
+// *********************************************************************************************
+bool CParallelGzReader::is_bgzf_header(size_t pos, size_t& member_size)
+{
+	if (pos + BGZF_HEADER_SIZE > in_size || !is_gzip_header(pos))
+		return false;
+
+	const uint8_t* p = in_buf.data() + pos;
+
+	// FEXTRA with 'BC' subfield holding the member size
+	if ((p[3] & 4) == 0 || (p[10] | (p[11] << 8)) < 6 || p[12] != 'B' || p[13] != 'C' || p[14] != 2 || p[15] != 0)
+		return false;
+
+	member_size = (size_t)(p[16] | (p[17] << 8)) + 1;
+
+	return true;
+}
+
+// *********************************************************************************************
+// Size of the member header with optional fields (extra field, file name, comment, header CRC)
+bool CParallelGzReader::gzip_header_size(size_t pos, size_t& header_size)
+{
+	if (!is_gzip_header(pos))
+		return false;
+
+	const uint8_t* p = in_buf.data() + pos;
+	size_t size = in_size - pos;
+	uint8_t flags = p[3];
+
+	header_size = 10;
+
+	if (flags & 4)
+	{
+		if (header_size + 2 > size)
+			return false;
+		header_size += 2 + (p[header_size] | (p[header_size + 1] << 8));
+	}
+
+	for (int flag : { 8, 16 })
+		if (flags & flag)
+		{
+			auto q = header_size < size ? (const uint8_t*) memchr(p + header_size, 0, size - header_size) : nullptr;
+			if (!q)
+				return false;
+			header_size = q - p + 1;
+		}
+
+	if (flags & 2)
+		header_size += 2;
+
+	return header_size <= size;
+}
+
+// *********************************************************************************************
+template<typename FUN> void CParallelGzReader::run_in_parallel(int no_tasks, FUN&& fun)
+{
+	vector<thread> threads;
+	threads.reserve(no_tasks);
+
+	for (int i = 1; i < no_tasks; ++i)
+		threads.emplace_back([&, i] { fun(i); });
+
+	if (no_tasks > 0)
+		fun(0);
+
+	for (auto& t : threads)
+		t.join();
+}
+
+// *********************************************************************************************
+// Many threads: the member is inflated by parts of deflate blocks, so only its header is read here
+bool CParallelGzReader::begin_stream()
+{
+	member_in_size = 0;
+	member_out_size = 0;
+
+	if (no_threads > 1)
+	{
+		size_t header_size;
+
+		if (!gzip_header_size(in_pos, header_size))
+		{
+			cerr << "Error: incorrect gzip file\n";
+			return false;
+		}
+
+		in_pos += header_size;
+		in_bits = 0;
+		member_in_size = header_size;
+		member_crc = (uint32_t) crc32(0, nullptr, 0);
+		window.clear();
+		in_member = true;
+		in_blocks = true;
+
+		return true;
+	}
+
+	if (!stream_backend->BeginMember())
+		return false;
+
+	in_member = true;
+
+	return true;
+}
+
+// *********************************************************************************************
+void CParallelGzReader::end_member()
+{
+	in_member = false;
+	in_blocks = false;
+
+	if (mode == gz_mode_t::unknown)
+	{
+		mode = gz_mode_t::multi_member;
+		if (member_in_size)
+			compression_ratio = (double) member_out_size / (double) member_in_size;
+	}
+}
+
+// *********************************************************************************************
+bool CParallelGzReader::decode_step()
+{
+	if (mode == gz_mode_t::indexed)
+		return decode_range();
+
+	if (in_member)
+		return in_blocks ? decode_blocks() : decode_stream();
+
+	if (!fill_input(true))
+	{
+		cerr << "Error: cannot read gzip file\n";
+		return false;
+	}
+
+	if (in_pos == in_size)
+	{
+		is_finished = true;
+		return true;
+	}
+
+	if (!is_gzip_header(in_pos))
+	{
+		if (mode == gz_mode_t::unknown)
+		{
+			cerr << "Error: incorrect gzip file\n";
+			return false;
+		}
+
+		// Trailing garbage after the last member is ignored (as in zlib)
+		in_pos = in_size;
+		is_finished = true;
+		return true;
+	}
+
+	prepare_backends();
+
+	size_t member_size;
+
+	if (mode == gz_mode_t::unknown && is_bgzf_header(in_pos, member_size))
+		mode = gz_mode_t::bgzf;
+
+	// Members of BGZF and multi-member files can be inflated in parallel without any index
+	if (index_builder && mode != gz_mode_t::unknown)
+		index_builder->Invalidate();
+
+	if (mode == gz_mode_t::bgzf)
+		return decode_bgzf();
+	if (mode == gz_mode_t::multi_member)
+		return decode_speculative();
+
+	// The 1st member of non-BGZF file is inflated as a stream to find whether the file is multi-member at all
+	return begin_stream() && decode_step();
+}
+
+// *********************************************************************************************
+// Inflates the current member sequentially (single-member files or members that do not fit in the buffer)
+bool CParallelGzReader::decode_stream()
+{
+	size_t out_begin = out_buf.size();
+	size_t produced = 0;
+
+	out_buf.resize(out_begin + STREAM_OUT_SIZE);
+
+	while (produced < STREAM_OUT_SIZE)
+	{
+		if (in_pos == in_size)
+		{
+			if (in_eof)
+			{
+				cerr << "Error: unexpected end of gzip file\n";
+				return false;
+			}
+
+			if (!fill_input(false))
+			{
+				cerr << "Error: cannot read gzip file\n";
+				return false;
+			}
+
+			continue;
+		}
+
+		size_t in_used, out_used;
+
+		auto r = stream_backend->Inflate(in_buf.data() + in_pos, in_size - in_pos,
+			(uint8_t*) out_buf.data() + out_begin + produced, STREAM_OUT_SIZE - produced, in_used, out_used);
+
+		in_pos += in_used;
+		produced += out_used;
+		member_in_size += in_used;
+		member_out_size += out_used;
+
+		if (r == gz_status_t::member_end)
+		{
+			end_member();
+			break;
+		}
+
+		if (r == gz_status_t::error)
+		{
+			cerr << "Error: corrupted gzip data\n";
+			return false;
+		}
+	}
+
+	out_buf.resize(out_begin + produced);
+
+	return true;
+}
+
+// *********************************************************************************************
+// Inflates the next portion of the member by parts of deflate blocks decoded concurrently
+// The 1st part starts at the known block boundary (in_pos, in_bits) with the known window, the next ones at guessed block starts;
+// a guess is accepted only when the preceding part stopped exactly at it, so the output is always correct
+bool CParallelGzReader::decode_blocks()
+{
+	if (!fill_input(true))
+	{
+		cerr << "Error: cannot read gzip file\n";
+		return false;
+	}
+
+	const size_t WINDOW_SIZE = CDeflateChunkDecoder::WINDOW_SIZE;
+
+	uint64_t begin_bit = (uint64_t) in_pos * 8 + in_bits;
+	size_t region = min(in_size - in_pos, no_threads * MAX_BLOCK_TASK_SIZE);
+	uint64_t region_end_bit = region < in_size - in_pos ? (uint64_t) (in_pos + region) * 8 : UINT64_MAX;
+	int no_tasks = (int) max<size_t>(1, min<size_t>(no_threads, region / MIN_BLOCK_TASK_SIZE));
+	vector<char> is_found(no_tasks, 1);
+
+	run_in_parallel(no_tasks - 1, [&](int i) {
+		int t = i + 1;
+		uint64_t from_bit = (uint64_t) (in_pos + region * t / no_tasks) * 8;
+		uint64_t to_bit = min<uint64_t>(from_bit + MAX_BLOCK_SEARCH * 8, (uint64_t) (in_pos + region * (t + 1) / no_tasks) * 8);
+
+		is_found[t] = chunk_decoders[t]->FindBlockStart(in_buf.data(), in_size, from_bit, to_bit, chunks[t].begin_bit);
+	});
+
+	chunks[0].begin_bit = begin_bit;
+	int no_chunks = 1;
+
+	for (int t = 1; t < no_tasks; ++t)
+		if (is_found[t])
+			swap(chunks[no_chunks++], chunks[t]);
+
+	run_in_parallel(no_chunks, [&](int t) {
+		auto& chunk = chunks[t];
+		uint64_t stop_bit = t + 1 < no_chunks ? chunks[t + 1].begin_bit : region_end_bit;
+		uint64_t in_bytes = (min<uint64_t>(stop_bit, (uint64_t) in_size * 8) - chunk.begin_bit) / 8;
+		size_t est_out_size = (size_t) ((double) in_bytes * compression_ratio * 1.25) + (1 << 16);
+
+		if (chunk.out.size() < est_out_size)
+			chunk.out.resize(est_out_size);
+
+		chunk_decoders[t]->Decode(in_buf.data(), in_size, t ? nullptr : &window, stop_bit, chunk);
+	});
+
+	int no_accepted = 0;
+
+	for (int t = 0; t < no_chunks; ++t)
+	{
+		if (t > 0 && (chunks[t - 1].stop != deflate_stop_t::boundary || chunks[t - 1].end_bit != chunks[t].begin_bit))
+			break;			// Wrong guess (or the previous part stopped early)
+
+		if (chunks[t].stop == deflate_stop_t::error)
+			break;
+
+		++no_accepted;
+	}
+
+	if (!no_accepted)
+	{
+		cerr << "Error: corrupted gzip data\n";
+		return false;
+	}
+
+	auto& last = chunks[no_accepted - 1];
+
+	if (last.stop == deflate_stop_t::input_end && last.end_bit == begin_bit)
+	{
+		cerr << (in_eof ? "Error: unexpected end of gzip file\n" : "Error: deflate block larger than the input buffer\n");
+		return false;
+	}
+
+	vector<size_t> out_offsets(no_accepted + 1, 0);
+
+	for (int t = 0; t < no_accepted; ++t)
+		out_offsets[t + 1] = out_offsets[t] + chunks[t].Size();
+
+	// Windows (32 KB preceding the parts) depend on the preceding parts, so they are found sequentially
+	vector<vector<uint8_t>> windows(no_accepted);
+
+	if (no_accepted > 1)
+	{
+		windows[0].assign(WINDOW_SIZE - window.size(), 0);
+		windows[0].insert(windows[0].end(), window.begin(), window.end());
+	}
+
+	for (int t = 1; t < no_accepted; ++t)
+	{
+		auto& prev = chunks[t - 1];
+		auto& prev_window = windows[t - 1];
+		size_t from = prev.Size() - min(prev.Size(), WINDOW_SIZE);
+
+		windows[t].assign(prev_window.end() - (WINDOW_SIZE - (prev.Size() - from)), prev_window.end());
+
+		for (size_t i = from; i < prev.Size(); ++i)
+			if (i < prev.marked_size)
+				windows[t].push_back(prev.marked[i] < CDeflateChunkDecoder::MARKER ? (uint8_t) prev.marked[i] : prev_window[prev.marked[i] - CDeflateChunkDecoder::MARKER]);
+			else
+				windows[t].push_back(prev.out[i - prev.marked_size]);
+	}
+
+	size_t out_begin = out_buf.size();
+	vector<uint32_t> crcs(no_accepted);
+
+	out_buf.resize(out_begin + out_offsets[no_accepted]);
+
+	run_in_parallel(no_accepted, [&](int t) {
+		auto& chunk = chunks[t];
+		auto dest = (uint8_t*) out_buf.data() + out_begin + out_offsets[t];
+
+		CDeflateChunkDecoder::Resolve(chunk.marked.data(), chunk.marked_size, windows[t].data(), dest);
+		memcpy(dest + chunk.marked_size, chunk.out.data(), chunk.out_size);
+		crcs[t] = (uint32_t) crc32(0, dest, (uInt) chunk.Size());
+	});
+
+	// Part boundaries are block boundaries with known windows, so they are checkpoints of the index
+	if (index_builder)
+		for (int t = 0; t < no_accepted; ++t)
+		{
+			uint64_t out_pos = member_out_size + out_offsets[t];
+			if (out_pos < index_builder->NextCheckpointOutPos())
+				continue;
+
+			uint64_t bit_pos = chunks[t].begin_bit;
+			const uint8_t* w = t ? windows[t].data() : window.data();
+			size_t w_size = t ? WINDOW_SIZE : window.size();
+
+			if (out_pos < w_size)
+			{
+				w += w_size - out_pos;
+				w_size = (size_t) out_pos;
+			}
+
+			index_builder->AddCheckpoint(in_file_pos + (bit_pos + 7) / 8, out_pos, (int) ((8 - bit_pos % 8) % 8), w, w_size);
+		}
+
+	for (int t = 0; t < no_accepted; ++t)
+		member_crc = (uint32_t) crc32_combine(member_crc, crcs[t], (z_off_t) chunks[t].Size());
+
+	size_t produced = out_offsets[no_accepted];
+
+	if (produced >= WINDOW_SIZE)
+		window.assign(out_buf.end() - WINDOW_SIZE, out_buf.end());
+	else
+	{
+		window.insert(window.end(), out_buf.end() - produced, out_buf.end());
+		if (window.size() > WINDOW_SIZE)
+			window.erase(window.begin(), window.end() - WINDOW_SIZE);
+	}
+
+	member_in_size += (size_t) (last.end_bit / 8) - in_pos;
+	member_out_size += produced;
+	in_pos = (size_t) (last.end_bit / 8);
+	in_bits = (int) (last.end_bit % 8);
+
+	if (member_in_size)
+		compression_ratio = (double) member_out_size / (double) member_in_size;
+
+	if (last.stop == deflate_stop_t::member_end)
+		return check_trailer();
+
+	return true;
+}
+
+// *********************************************************************************************
+// Verifies the CRC and the size of the member inflated by parts of deflate blocks (zlib verifies them when inflating sequentially)
+bool CParallelGzReader::check_trailer()
+{
+	if (in_size - in_pos < GZIP_TRAILER_SIZE && !fill_input(true))
+	{
+		cerr << "Error: cannot read gzip file\n";
+		return false;
+	}
+
+	if (in_size - in_pos < GZIP_TRAILER_SIZE)
+	{
+		cerr << "Error: unexpected end of gzip file\n";
+		return false;
+	}
+
+	const uint8_t* p = in_buf.data() + in_pos;
+	uint32_t crc = (uint32_t) p[0] | ((uint32_t) p[1] << 8) | ((uint32_t) p[2] << 16) | ((uint32_t) p[3] << 24);
+	uint32_t isize = (uint32_t) p[4] | ((uint32_t) p[5] << 8) | ((uint32_t) p[6] << 16) | ((uint32_t) p[7] << 24);
+
+	if (crc != member_crc || isize != (uint32_t) member_out_size)
+	{
+		cerr << "Error: corrupted gzip data\n";
+		return false;
+	}
+
+	in_pos += GZIP_TRAILER_SIZE;
+	member_in_size += GZIP_TRAILER_SIZE;
+	end_member();
+
+	return true;
+}
+
+// *********************************************************************************************
+// Inflates the next portion of the range (the stream is not verified at its end, as the gzip trailer is not read)
+bool CParallelGzReader::decode_range()
+{
+	if (!in_member || !range_left)
+	{
+		is_finished = true;
+		return true;
+	}
+
+	if (!decode_stream())
+		return false;
+
+	size_t skipped = (size_t) min<uint64_t>(range_skip, out_buf.size());
+	range_skip -= skipped;
+	out_pos = skipped;
+
+	if (out_buf.size() - out_pos > range_left)
+		out_buf.resize(out_pos + (size_t) range_left);
+
+	range_left -= out_buf.size() - out_pos;
+
+	if (!range_left || !in_member)
+		is_finished = true;
+
+	return true;
+}
+
+// *********************************************************************************************
+// Decompresses all complete BGZF members in the buffer (exact sizes are known from headers and trailers)
+bool CParallelGzReader::decode_bgzf()
+{
+	members.clear();
+
+	size_t pos = in_pos;
+	size_t out_size = 0;
+	size_t member_size;
+
+	while (is_bgzf_header(pos, member_size) && pos + member_size <= in_size)
+	{
+		if (member_size < BGZF_HEADER_SIZE + GZIP_TRAILER_SIZE)
+		{
+			cerr << "Error: incorrect BGZF member\n";
+			return false;
+		}
+
+		const uint8_t* p = in_buf.data() + pos + member_size - 4;
+		size_t isize = (size_t) p[0] | ((size_t) p[1] << 8) | ((size_t) p[2] << 16) | ((size_t) p[3] << 24);
+
+		members.push_back(member_t{ pos, member_size, out_size, isize });
+		out_size += isize;
+		pos += member_size;
+	}
+
+	if (members.empty())
+	{
+		if (is_bgzf_header(pos, member_size))
+		{
+			cerr << "Error: unexpected end of BGZF file\n";
+			return false;
+		}
+
+		// Regular gzip member after BGZF ones
+		mode = gz_mode_t::multi_member;
+		return decode_speculative();
+	}
+
+	size_t out_begin = out_buf.size();
+	out_buf.resize(out_begin + out_size);
+
+	// Contiguous ranges of members of similar compressed sizes
+	int no_tasks = (int) min<size_t>(no_threads, members.size());
+	size_t in_total = pos - in_pos;
+	vector<size_t> task_first(no_tasks + 1, members.size());
+
+	for (int t = 0; t < no_tasks; ++t)
+	{
+		size_t task_in_begin = in_pos + in_total * t / no_tasks;
+		task_first[t] = lower_bound(members.begin(), members.end(), task_in_begin, [](const member_t& m, size_t x) {return m.in_pos < x; }) - members.begin();
+	}
+
+	atomic<bool> failed{ false };
+
+	run_in_parallel(no_tasks, [&](int t) {
+		for (size_t i = task_first[t]; i < task_first[t + 1]; ++i)
+		{
+			auto& m = members[i];
+
+			size_t in_used, out_used;
+
+			if (member_backends[t]->DecompressMember(in_buf.data() + m.in_pos, m.in_size, (uint8_t*) out_buf.data() + out_begin + m.out_pos, m.out_size, in_used, out_used) != gz_status_t::ok
+				|| out_used != m.out_size)
+				failed = true;
+		}
+	});
+
+	if (failed)
+	{
+		cerr << "Error: corrupted gzip data\n";
+		return false;
+	}
+
+	in_pos = pos;
+
+	return true;
+}
+
+// *********************************************************************************************
+// Decompresses members starting from the known member boundary (in_pos) and from guessed member starts
+// The guess is accepted only when the preceding task stopped exactly at it, so the output is always correct
+bool CParallelGzReader::decode_speculative()
+{
+	size_t region = in_size - in_pos;
+	int no_tasks = (int) max<size_t>(1, min<size_t>(no_threads, region / MIN_TASK_SIZE));
+	int n = 1;
+
+	tasks[0].in_begin = in_pos;
+
+	for (int t = 1; t < no_tasks; ++t)
+	{
+		size_t pos = max(in_pos + region * t / no_tasks, tasks[n - 1].in_begin + 1);
+
+		while (pos < in_size)
+		{
+			auto p = (const uint8_t*) memchr(in_buf.data() + pos, 0x1f, in_size - pos);
+			if (!p)
+			{
+				pos = in_size;
+				break;
+			}
+
+			pos = p - in_buf.data();
+			if (is_gzip_header(pos))
+				break;
+			++pos;
+		}
+
+		if (pos < in_size)
+			tasks[n++].in_begin = pos;
+	}
+
+	no_tasks = n;
+
+	for (int t = 0; t < no_tasks; ++t)
+		tasks[t].in_limit = t + 1 < no_tasks ? tasks[t + 1].in_begin : in_size;
+
+	run_in_parallel(no_tasks, [&](int t) {
+		decode_task(t, tasks[t]);
+	});
+
+	if (tasks[0].in_end == tasks[0].in_begin)
+		return begin_stream() && decode_step();			// No complete member in the buffer
+
+	size_t in_total = 0;
+	size_t out_total = 0;
+
+	for (int t = 0; t < no_tasks; ++t)
+	{
+		if (t > 0 && tasks[t - 1].in_end != tasks[t].in_begin)
+			break;			// Wrong guess (or the previous task stopped early)
+
+		if (tasks[t].in_end == tasks[t].in_begin)
+			break;
+
+		out_buf.insert(out_buf.end(), tasks[t].out.begin(), tasks[t].out.begin() + tasks[t].out_size);
+
+		in_total += tasks[t].in_end - tasks[t].in_begin;
+		out_total += tasks[t].out_size;
+		in_pos = tasks[t].in_end;
+	}
+
+	compression_ratio = (double) out_total / (double) in_total;
+
+	return true;
+}
+
+// *********************************************************************************************
+// Decompresses complete members starting before task.in_limit
+void CParallelGzReader::decode_task(int thread_id, task_t& task)
+{
+	auto& backend = member_backends[thread_id];
+	size_t pos = task.in_begin;
+
+	size_t est_out_size = (size_t) ((double) (task.in_limit - task.in_begin) * compression_ratio * 1.25) + (1 << 16);
+	size_t max_out_size = (size_t) ((double) (in_size - task.in_begin) * max(compression_ratio * 4, 16.0)) + (1 << 20);
+
+	if (task.out.size() < est_out_size)
+		task.out.resize(est_out_size);
+
+	task.out_size = 0;
+
+	while (pos < task.in_limit)
+	{
+		size_t in_used, out_used;
+
+		auto r = backend->DecompressMember(in_buf.data() + pos, in_size - pos,
+			(uint8_t*) task.out.data() + task.out_size, task.out.size() - task.out_size, in_used, out_used);
+
+		if (r == gz_status_t::ok)
+		{
+			pos += in_used;
+			task.out_size += out_used;
+		}
+		else if (r == gz_status_t::insufficient_space && task.out.size() < max_out_size)
+			task.out.resize(task.out.size() * 2);
+		else
+			break;		// Member truncated at the buffer end or a wrong guess of the member start
+	}
+
+	task.in_end = pos;
+}
+
+// EOF
@@ -0,0 +1,130 @@
+#pragma once
+
+#include <cstdio>
+#include <cinttypes>
+#include <string>
+#include <vector>
+#include <memory>
+#include "gz_backends.h"
+#include "gz_index.h"
+#include "deflate_chunk_decoder.h"
+#include "async_reader.h"
+
+using namespace std;
+
+// *********************************************************************************************
+// Multi-threaded reader of gzipped files
+// - BGZF: member sizes are stored in headers, so members are decompressed concurrently
+// - multi-member gzip: member starts are guessed (gzip header signatures) and decompressed concurrently;
+//   the guesses are validated by checking that the preceding part ends exactly at the guessed position
+// - single-member gzip (and members larger than the buffer): the member is split into parts at guessed deflate block starts,
+//   which are decoded concurrently with markers in place of references to the preceding (unknown) data (CDeflateChunkDecoder);
+//   a guess is accepted only when the preceding part stopped exactly at it and the markers are resolved when the preceding part is known;
+//   a checkpoint index can be built then (from part boundaries), so later a range of the file can be inflated starting from the nearest checkpoint
+// Decompression is made by backends (zlib-ng, igzip, libdeflate) chosen by the user or by the benchmark
+// Compressed data are prefetched by CAsyncFileReader, so reading from disk overlaps with decompression
+class CParallelGzReader : public CInputStream
+{
+	enum class gz_mode_t { unknown, bgzf, multi_member, indexed };
+
+	const size_t IN_BUFFER_SIZE_PER_THREAD = 4 << 20;
+	const size_t MIN_TASK_SIZE = 256 << 10;
+	const size_t MIN_BLOCK_TASK_SIZE = 1 << 20;
+	const size_t MAX_BLOCK_TASK_SIZE = 2 << 20;
+	const size_t MAX_BLOCK_SEARCH = 1 << 20;
+	const size_t STREAM_OUT_SIZE = 8 << 20;
+	const size_t BGZF_HEADER_SIZE = 18;
+	const size_t GZIP_TRAILER_SIZE = 8;
+
+	struct task_t
+	{
+		size_t in_begin;				// position of the 1st member
+		size_t in_limit;				// no new member is started at or after this position
+		size_t in_end;					// position after the last decompressed member
+		vector<char> out;
+		size_t out_size;
+	};
+
+	struct member_t
+	{
+		size_t in_pos;
+		size_t in_size;
+		size_t out_pos;
+		size_t out_size;
+	};
+
+	int no_threads;
+
+	CAsyncFileReader in;
+	bool is_open = false;
+	vector<uint8_t> in_buf;
+	size_t in_pos = 0;
+	size_t in_size = 0;
+	bool in_eof = false;
+	bool is_finished = false;
+	bool is_error = false;
+
+	vector<char> out_buf;
+	size_t out_pos = 0;
+
+	gz_backend_t backend_type;
+	unique_ptr<CGzBackend> stream_backend;
+	vector<unique_ptr<CGzBackend>> member_backends;
+	bool in_member = false;				// inside a member inflated sequentially or by parts of deflate blocks
+	bool in_blocks = false;				// inside a member inflated by parts of deflate blocks
+	int in_bits = 0;					// no. of bits of in_buf[in_pos] already decoded (blocks are not byte-aligned)
+	size_t member_in_size = 0;
+	size_t member_out_size = 0;
+	uint32_t member_crc = 0;
+	vector<uint8_t> window;				// last 32 KB of the member inflated by parts of deflate blocks
+	uint64_t in_file_pos = 0;			// file offset of in_buf[0]
+
+	gz_mode_t mode = gz_mode_t::unknown;
+	double compression_ratio = 4.0;
+
+	vector<task_t> tasks;
+	vector<member_t> members;
+	vector<deflate_chunk_t> chunks;
+	vector<unique_ptr<CDeflateChunkDecoder>> chunk_decoders;
+
+	CGzIndex* index_builder = nullptr;	// index made during sequential inflating of a single-member file
+	uint64_t range_skip = 0;			// indexed mode: data to skip from the checkpoint to the range start
+	uint64_t range_left = 0;			// indexed mode: data left to the range end
+
+	void close();
+	bool fill_input(bool compact);
+	void prepare_backends();
+
+	bool is_gzip_header(size_t pos);
+	bool is_bgzf_header(size_t pos, size_t &member_size);
+	bool gzip_header_size(size_t pos, size_t& header_size);
+
+	bool begin_stream();
+	void end_member();
+	bool decode_step();
+	bool decode_stream();
+	bool decode_blocks();
+	bool check_trailer();
+	bool decode_bgzf();
+	bool decode_speculative();
+	bool decode_range();
+
+	void decode_task(int thread_id, task_t& task);
+	template<typename FUN> void run_in_parallel(int no_tasks, FUN&& fun);
+
+public:
+	CParallelGzReader(int no_threads, gz_backend_t backend_type = gz_backend_t::automatic, io_mode_t io_mode = io_mode_t::automatic, bool direct_io = false, int no_io_buffers = 4);
+	~CParallelGzReader();
+
+	bool Open(const string& file_name);
+	bool OpenRange(const string& file_name, const CGzIndex& index, uint64_t out_begin, uint64_t out_end);
+	void BuildIndex(CGzIndex* _index_builder) { index_builder = _index_builder; }		// must be called after Open
+	void Close();
+
+	size_t Read(char* dest, size_t size) override;
+	bool Eof() override;
+	bool Error() const override { return is_error; }
+	string Description() const override { return "gzip, " + in.Description(); }
+};
+
+// EOF
@@ -0,0 +1,321 @@
+#include <iostream>
+#include <cstring>
+#include <thread>
+#include <atomic>
+#include <algorithm>
+#include "parallel_zstd_reader.h"
+
+// *********************************************************************************************
+CParallelZstdReader::CParallelZstdReader(int no_threads, io_mode_t io_mode, bool direct_io, int no_io_buffers) :
+	no_threads(max(no_threads, 1)),
+	in(io_mode, direct_io, no_io_buffers)
+{
+	dstream = ZSTD_createDStream();
+}
+
+// *********************************************************************************************
+CParallelZstdReader::~CParallelZstdReader()
+{
+	close();
+
+	ZSTD_freeDStream(dstream);
+	for (auto dctx : dctxs)
+		ZSTD_freeDCtx(dctx);
+}
+
+// *********************************************************************************************
+void CParallelZstdReader::close()
+{
+	if (is_open)
+	{
+		in.Close();
+		is_open = false;
+	}
+
+	in_pos = 0;
+	in_size = 0;
+	in_eof = false;
+	is_finished = false;
+	is_error = false;
+
+	out_buf.clear();
+	out_pos = 0;
+
+	in_frame = false;
+}
+
+// *********************************************************************************************
+bool CParallelZstdReader::Open(const string& file_name)
+{
+	close();
+
+	if (!dstream || !in.Open(file_name))
+		return false;
+
+	is_open = true;
+	in_buf.resize(IN_BUFFER_SIZE_PER_THREAD * no_threads);
+
+	return true;
+}
+
+// *********************************************************************************************
+void CParallelZstdReader::Close()
+{
+	close();
+}
+
+// *********************************************************************************************
+size_t CParallelZstdReader::Read(char* dest, size_t size)
+{
+	size_t copied = 0;
+
+	while (copied < size && !is_error)
+	{
+		if (out_pos == out_buf.size())
+		{
+			out_buf.clear();
+			out_pos = 0;
+
+			if (is_finished)
+				break;
+
+			if (!decode_step())
+				is_error = true;
+
+			continue;
+		}
+
+		size_t n = min(size - copied, out_buf.size() - out_pos);
+		memcpy(dest + copied, out_buf.data() + out_pos, n);
+		copied += n;
+		out_pos += n;
+	}
+
+	return copied;
+}
+
+// *********************************************************************************************
+bool CParallelZstdReader::Eof()
+{
+	return is_error || (is_finished && out_pos == out_buf.size());
+}
+
+// *********************************************************************************************
+// Moves the unprocessed data to the buffer front (compact mode) or waits until the buffer is consumed and reads next data
+bool CParallelZstdReader::fill_input(bool compact)
+{
+	if (in_eof)
+		return true;
+
+	if (compact)
+	{
+		if (in_pos)
+		{
+			memmove(in_buf.data(), in_buf.data() + in_pos, in_size - in_pos);
+			in_size -= in_pos;
+			in_pos = 0;
+		}
+	}
+	else if (in_pos < in_size)
+		return true;
+	else
+		in_pos = in_size = 0;
+
+	size_t to_read = in_buf.size() - in_size;
+	size_t readed = in.Read((char*) in_buf.data() + in_size, to_read);
+	in_size += readed;
+
+	if (readed < to_read)
+	{
+		if (in.Error())
+			return false;
+		in_eof = true;
+	}
+
+	return true;
+}
+
+// *********************************************************************************************
+// Regular or skippable frame
+bool CParallelZstdReader::is_frame_start(size_t pos)
+{
+	if (pos + 4 > in_size)
+		return false;
+
+	const uint8_t* p = in_buf.data() + pos;
+	uint32_t magic = (uint32_t) p[0] | ((uint32_t) p[1] << 8) | ((uint32_t) p[2] << 16) | ((uint32_t) p[3] << 24);
+
+	return magic == ZSTD_MAGICNUMBER || (magic & 0xFFFFFFF0u) == ZSTD_MAGIC_SKIPPABLE_START;
+}
+
+// *********************************************************************************************
+template<typename FUN> void CParallelZstdReader::run_in_parallel(int no_tasks, FUN&& fun)
+{
+	vector<thread> threads;
+	threads.reserve(no_tasks);
+
+	for (int i = 1; i < no_tasks; ++i)
+		threads.emplace_back([&, i] { fun(i); });
+
+	if (no_tasks > 0)
+		fun(0);
+
+	for (auto& t : threads)
+		t.join();
+}
+
+// *********************************************************************************************
+bool CParallelZstdReader::decode_step()
+{
+	if (in_frame)
+		return decode_stream();
+
+	if (!fill_input(true))
+	{
+		cerr << "Error: cannot read zstd file\n";
+		return false;
+	}
+
+	if (in_pos == in_size)
+	{
+		is_finished = true;
+		return true;
+	}
+
+	if (!is_frame_start(in_pos))
+	{
+		cerr << "Error: incorrect zstd file\n";
+		return false;
+	}
+
+	frames.clear();
+
+	size_t pos = in_pos;
+	size_t out_size = 0;
+
+	while (pos < in_size)
+	{
+		size_t frame_size = ZSTD_findFrameCompressedSize(in_buf.data() + pos, in_size - pos);
+		if (ZSTD_isError(frame_size))
+			break;			// Frame truncated at the buffer end
+
+		unsigned long long content_size = ZSTD_getFrameContentSize(in_buf.data() + pos, frame_size);
+		if (content_size == ZSTD_CONTENTSIZE_UNKNOWN || content_size == ZSTD_CONTENTSIZE_ERROR)
+			break;
+		if (out_size + content_size > MAX_OUT_SIZE_PER_THREAD * no_threads)
+			break;
+
+		frames.push_back(frame_t{ pos, frame_size, out_size, (size_t) content_size });
+		out_size += (size_t) content_size;
+		pos += frame_size;
+	}
+
+	if (!frames.empty())
+		return decode_frames();
+
+	// No complete frame of known size in the buffer
+	ZSTD_DCtx_reset(dstream, ZSTD_reset_session_only);
+	in_frame = true;
+
+	return decode_stream();
+}
+
+// *********************************************************************************************
+// Decompresses the current frame sequentially
+bool CParallelZstdReader::decode_stream()
+{
+	size_t out_begin = out_buf.size();
+	out_buf.resize(out_begin + STREAM_OUT_SIZE);
+
+	ZSTD_outBuffer out{ out_buf.data() + out_begin, STREAM_OUT_SIZE, 0 };
+
+	while (out.pos < out.size)
+	{
+		if (in_pos == in_size)
+		{
+			if (in_eof)
+			{
+				cerr << "Error: unexpected end of zstd file\n";
+				return false;
+			}
+
+			if (!fill_input(false))
+			{
+				cerr << "Error: cannot read zstd file\n";
+				return false;
+			}
+
+			continue;
+		}
+
+		ZSTD_inBuffer inb{ in_buf.data() + in_pos, in_size - in_pos, 0 };
+
+		size_t r = ZSTD_decompressStream(dstream, &out, &inb);
+		in_pos += inb.pos;
+
+		if (ZSTD_isError(r))
+		{
+			cerr << "Error: corrupted zstd data (" << ZSTD_getErrorName(r) << ")\n";
+			return false;
+		}
+
+		if (r == 0)
+		{
+			in_frame = false;
+			break;
+		}
+	}
+
+	out_buf.resize(out_begin + out.pos);
+
+	return true;
+}
+
+// *********************************************************************************************
+// Decompresses the frames found in the buffer (contiguous ranges of frames of similar compressed sizes per thread)
+bool CParallelZstdReader::decode_frames()
+{
+	int no_tasks = (int) min<size_t>(no_threads, frames.size());
+
+	while ((int) dctxs.size() < no_tasks)
+		dctxs.emplace_back(ZSTD_createDCtx());
+
+	size_t in_end = frames.back().in_pos + frames.back().in_size;
+	size_t in_total = in_end - in_pos;
+	vector<size_t> task_first(no_tasks + 1, frames.size());
+
+	for (int t = 0; t < no_tasks; ++t)
+	{
+		size_t task_in_begin = in_pos + in_total * t / no_tasks;
+		task_first[t] = lower_bound(frames.begin(), frames.end(), task_in_begin, [](const frame_t& f, size_t x) {return f.in_pos < x; }) - frames.begin();
+	}
+
+	size_t out_begin = out_buf.size();
+	out_buf.resize(out_begin + frames.back().out_pos + frames.back().out_size);
+
+	atomic<bool> failed{ false };
+
+	run_in_parallel(no_tasks, [&](int t) {
+		for (size_t i = task_first[t]; i < task_first[t + 1]; ++i)
+		{
+			auto& f = frames[i];
+
+			size_t r = ZSTD_decompressDCtx(dctxs[t], out_buf.data() + out_begin + f.out_pos, f.out_size, in_buf.data() + f.in_pos, f.in_size);
+
+			if (ZSTD_isError(r) || r != f.out_size)
+				failed = true;
+		}
+	});
+
+	if (failed)
+	{
+		cerr << "Error: corrupted zstd data\n";
+		return false;
+	}
+
+	in_pos = in_end;
+
+	return true;
+}
+
+// EOF
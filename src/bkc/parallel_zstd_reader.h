@@ -0,0 +1,73 @@
+#pragma once
+
+#include <cinttypes>
+#include <string>
+#include <vector>
+#include <zstd.h>
+#include "async_reader.h"
+
+using namespace std;
+
+// *********************************************************************************************
+// Multi-threaded reader of zstd-compressed files
+// - complete frames in the buffer with sizes stored in headers (e.g., made by pzstd or by concatenation of files) are decompressed concurrently
+// - frames that do not fit in the buffer (or without the content size) are decompressed sequentially (streaming)
+class CParallelZstdReader : public CInputStream
+{
+	const size_t IN_BUFFER_SIZE_PER_THREAD = 4 << 20;
+	const size_t MAX_OUT_SIZE_PER_THREAD = 64 << 20;
+	const size_t STREAM_OUT_SIZE = 8 << 20;
+
+	struct frame_t
+	{
+		size_t in_pos;
+		size_t in_size;
+		size_t out_pos;
+		size_t out_size;
+	};
+
+	int no_threads;
+
+	CAsyncFileReader in;
+	bool is_open = false;
+	vector<uint8_t> in_buf;
+	size_t in_pos = 0;
+	size_t in_size = 0;
+	bool in_eof = false;
+	bool is_finished = false;
+	bool is_error = false;
+
+	vector<char> out_buf;
+	size_t out_pos = 0;
+
+	ZSTD_DStream* dstream = nullptr;
+	vector<ZSTD_DCtx*> dctxs;
+	bool in_frame = false;				// inside a frame decompressed sequentially
+
+	vector<frame_t> frames;
+
+	void close();
+	bool fill_input(bool compact);
+
+	bool is_frame_start(size_t pos);
+
+	bool decode_step();
+	bool decode_stream();
+	bool decode_frames();
+
+	template<typename FUN> void run_in_parallel(int no_tasks, FUN&& fun);
+
+public:
+	CParallelZstdReader(int no_threads, io_mode_t io_mode = io_mode_t::automatic, bool direct_io = false, int no_io_buffers = 4);
+	~CParallelZstdReader();
+
+	bool Open(const string& file_name);
+	void Close();
+
+	size_t Read(char* dest, size_t size) override;
+	bool Eof() override;
+	bool Error() const override { return is_error; }
+	string Description() const override { return "zstd, " + in.Description(); }
+};
+
+// EOF
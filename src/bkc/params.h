@@ -3,12 +3,15 @@
 #include <cstdint>
 #include <iostream>
 #include <vector>
+#include <memory>
 
 #include "../common/defs.h"
 #include <types/common_types.h>
 
 using namespace std;
 
+class CCbcWhitelist;
+
 // *********************************************************************************************
 inline output_format_t output_format_from_string(const std::string& str) {
 	if (str == "bkc" || str == "BKC")
@@ -62,6 +65,92 @@ inline std::string to_string(export_filtered_input_t export_filtered_input) {
 	}
 }
 
+// *********************************************************************************************
+inline gz_backend_t gz_backend_from_string(const std::string& str) {
+	if (str == "auto")
+		return gz_backend_t::automatic;
+	else if (str == "zlib")
+		return gz_backend_t::zlib;
+	else if (str == "igzip")
+		return gz_backend_t::igzip;
+	else if (str == "libdeflate")
+		return gz_backend_t::libdeflate;
+	else
+	{
+		return gz_backend_t::unknown;
+	}
+}
+
+// *********************************************************************************************
+inline std::string to_string(gz_backend_t gz_backend) {
+	switch (gz_backend) {
+	case gz_backend_t::automatic:
+		return "auto";
+	case gz_backend_t::zlib:
+		return "zlib";
+	case gz_backend_t::igzip:
+		return "igzip";
+	case gz_backend_t::libdeflate:
+		return "libdeflate";
+	default:
+		return "unknown";
+	}
+}
+
+// *********************************************************************************************
+inline io_mode_t io_mode_from_string(const std::string& str) {
+	if (str == "auto")
+		return io_mode_t::automatic;
+	else if (str == "uring")
+		return io_mode_t::uring;
+	else if (str == "threads")
+		return io_mode_t::threads;
+	else if (str == "sync")
+		return io_mode_t::sync;
+	else
+	{
+		return io_mode_t::unknown;
+	}
+}
+
+// *********************************************************************************************
+inline std::string to_string(io_mode_t io_mode) {
+	switch (io_mode) {
+	case io_mode_t::automatic:
+		return "auto";
+	case io_mode_t::uring:
+		return "uring";
+	case io_mode_t::threads:
+		return "threads";
+	case io_mode_t::sync:
+		return "sync";
+	default:
+		return "unknown";
+	}
+}
+
+// *********************************************************************************************
+inline umi_dedup_t umi_dedup_from_string(const std::string& str) {
+	if (str == "exact")
+		return umi_dedup_t::exact;
+	else if (str == "directional")
+		return umi_dedup_t::directional;
+	else
+		return umi_dedup_t::unknown;
+}
+
+// *********************************************************************************************
+inline std::string to_string(umi_dedup_t umi_dedup) {
+	switch (umi_dedup) {
+	case umi_dedup_t::exact:
+		return "exact";
+	case umi_dedup_t::directional:
+		return "directional";
+	default:
+		return "unknown";
+	}
+}
+
 // *********************************************************************************************
 inline string technology_str(technology_t technology)
 {
@@ -85,6 +174,17 @@ struct CParams
 	param_t<uint32_t> soft_cbc_umi_len_limit{ 0, 1'000'000'000, 0 };
 	param_t<uint32_t> no_splits{ 1, 256, 1 };
 	param_t<uint32_t> no_threads{ 0, 256, 8 };
+	param_t<uint32_t> no_file_parts{ 0, 256, 0 };				// auto
+	param_t<uint32_t> no_gz_threads{ 0, 256, 0 };				// auto
+	gz_backend_t gz_backend{ gz_backend_t::automatic };
+	bool use_mmap{ true };
+	io_mode_t io_mode{ io_mode_t::automatic };
+	param_t<uint32_t> no_io_buffers{ 1, 64, 4 };
+	param_t<uint32_t> io_memory{ 0, 1 << 20, 0 };				// MB, auto
+	param_t<uint32_t> max_ram{ 0, 1 << 20, 0 };				// GB, 0 - no limit
+	bool direct_io{ false };
+	bool use_gz_index{ true };
+	string gz_index_path{};
 	param_t<uint32_t> max_count{ 1, ~0u, 65535 };
 	param_t<uint32_t> zstd_level{ 0, 19, 6 };
 	bool canonical_mode{ false };
@@ -98,14 +198,21 @@ struct CParams
 	param_t<uint32_t> verbosity_level{ 0, 2, 0 };
 	param_t<uint32_t> rare_leader_thr{ 0, 255, 5 };
 	bool apply_cbc_correction{ false };
+	bool quality_aware_cbc_correction{ false };
+	umi_dedup_t umi_dedup{ umi_dedup_t::exact };
 	param_t<uint32_t> cbc_filtering_thr{ 0, ~0u, 0 };			// auto
+	param_t<uint32_t> early_whitelist_sample{ 0, 100'000, 0 };	// M reads, 0 - off
 	technology_t technology{ technology_t::ten_x };
-	vector<string> predefined_cbc;
+	shared_ptr<const CCbcWhitelist> predefined_cbc;
 	bool export_cbc_logs{ false };
 	string predefined_cbc_fn;
+	string converted_cbc_fn;						// binary whitelist to save (only conversion is made)
+	string save_cbc_state_fn;
+	string load_cbc_state_fn;						// results of the 1st pass of an earlier run (the 1st pass is skipped)
 	string cbc_log_file_name;
 	export_filtered_input_t export_filtered_input { export_filtered_input_t::none };
 	string filtered_input_path{};
+	string spool_path{};
 	bool allow_strange_cbc_umi_reads{ false };
 	input_format_t input_format{ input_format_t::fastq };
 	output_format_t output_format {output_format_t::bkc};
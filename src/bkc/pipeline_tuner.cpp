@@ -0,0 +1,164 @@
+#include <algorithm>
+#include <cstdio>
+#include "pipeline_tuner.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
+
+// *********************************************************************************************
+void pipeline_stats_t::Clear()
+{
+	no_bytes = 0;
+	no_records = 0;
+	no_blocks = 0;
+	reader_busy = 0;
+	reader_stall = 0;
+	parser_busy = 0;
+	parser_starve = 0;
+	no_stolen_blocks = 0;
+}
+
+// *********************************************************************************************
+//
+// *********************************************************************************************
+
+// *********************************************************************************************
+void CBlockSizer::Update(size_t block_size, uint64_t busy_us)
+{
+	if (!block_size)
+		return;
+
+	double t = max<double>(busy_us, 1) * 1e-6;
+	double current = (double) block_size / t;
+
+	throughput = throughput == 0 ? current : (1 - SMOOTHING) * throughput + SMOOTHING * current;
+
+	double size = throughput * TARGET_BLOCK_TIME;
+
+	target = (size_t) clamp<double>(size, (double) min(MIN_BLOCK_SIZE, chunk_size), (double) chunk_size);
+}
+
+// *********************************************************************************************
+//
+// *********************************************************************************************
+
+// *********************************************************************************************
+uint64_t CPipelineTuner::PhysicalMemory()
+{
+#ifdef _WIN32
+	MEMORYSTATUSEX status;
+	status.dwLength = sizeof(status);
+
+	if (!GlobalMemoryStatusEx(&status))
+		return 0;
+
+	return status.ullTotalPhys;
+#else
+	long pages = sysconf(_SC_PHYS_PAGES);
+	long page_size = sysconf(_SC_PAGESIZE);
+
+	if (pages <= 0 || page_size <= 0)
+		return 0;
+
+	return (uint64_t) pages * (uint64_t) page_size;
+#endif
+}
+
+// *********************************************************************************************
+// 1/16 of the physical memory, but no more than 8 max. chunks per reading thread
+size_t CPipelineTuner::auto_memory_budget(int no_reading_threads) const
+{
+	size_t upper = (size_t) no_reading_threads * 8 * MAX_CHUNK_SIZE;
+	uint64_t phys = PhysicalMemory();
+
+	if (!phys)
+		return (size_t) no_reading_threads * (DEFAULT_QUEUE_DEPTH + 2) * MAX_CHUNK_SIZE;
+
+	return (size_t) min<uint64_t>(phys / 16, upper);
+}
+
+// *********************************************************************************************
+pipeline_plan_t CPipelineTuner::Plan(int no_reading_threads) const
+{
+	no_reading_threads = max(no_reading_threads, 1);
+
+	size_t budget = memory_budget ? memory_budget : auto_memory_budget(no_reading_threads);
+	size_t per_reader = budget / no_reading_threads;
+	size_t min_chunk_size = max(MIN_CHUNK_SIZE, (size_t) (NO_RECORDS_PER_CHUNK * avg_record_size));
+
+	pipeline_plan_t plan;
+
+	// A reader fills one chunk and a parser processes one, while the remaining ones wait in the queue
+	plan.queue_depth = queue_depth;
+	while (plan.queue_depth > MIN_QUEUE_DEPTH && per_reader / (plan.queue_depth + 2) < min_chunk_size)
+		--plan.queue_depth;
+
+	plan.no_chunks = plan.queue_depth + 2;
+	plan.chunk_size = clamp(per_reader / plan.no_chunks, min_chunk_size, MAX_CHUNK_SIZE);
+	plan.chunk_size = max<size_t>(plan.chunk_size >> 20, 1) << 20;
+
+	return plan;
+}
+
+// *********************************************************************************************
+void CPipelineTuner::Learn(const pipeline_stats_t& stats)
+{
+	if (stats.no_records)
+		avg_record_size = (double) stats.no_bytes / (double) stats.no_records;
+
+	uint64_t reader_total = stats.reader_busy + stats.reader_stall;
+	uint64_t parser_total = stats.parser_busy + stats.parser_starve;
+
+	if (!reader_total || !parser_total || stats.no_blocks < 4 * queue_depth)
+	{
+		last_decision = "kept, too few blocks";
+		return;
+	}
+
+	double stall = (double) stats.reader_stall / (double) reader_total;
+	double starve = (double) stats.parser_starve / (double) parser_total;
+
+	size_t prev_depth = queue_depth;
+
+	if (stall > 0.1 && starve > 0.1)
+	{
+		queue_depth = min(queue_depth * 2, MAX_QUEUE_DEPTH);
+		last_decision = "readers and parsers wait for each other";
+	}
+	else if (stall > 0.5 || starve > 0.5)
+	{
+		queue_depth = max(queue_depth - 1, MIN_QUEUE_DEPTH);
+		last_decision = stall > 0.5 ? "parsers are the bottleneck" : "readers are the bottleneck";
+	}
+	else
+		last_decision = "balanced";
+
+	last_decision = (queue_depth > prev_depth ? "increased, " : queue_depth < prev_depth ? "decreased, " : "kept, ") + last_decision;
+}
+
+// *********************************************************************************************
+string CPipelineTuner::Describe(const pipeline_plan_t& plan, int no_reading_threads) const
+{
+	return "Reading pipeline: " + to_string(no_reading_threads) + " reader(s) x " + to_string(plan.no_chunks) + " chunks of " + to_string(plan.chunk_size >> 20) +
+		" MB, queue depth " + to_string(plan.queue_depth) + " (" + last_decision + "), memory budget " +
+		to_string((memory_budget ? memory_budget : auto_memory_budget(no_reading_threads)) >> 20) + " MB" + (memory_budget ? "" : " (auto)") + "\n";
+}
+
+// *********************************************************************************************
+string CPipelineTuner::Report(const pipeline_stats_t& stats) const
+{
+	auto pct = [](uint64_t part, uint64_t total) {
+		char buf[16];
+		snprintf(buf, sizeof(buf), "%.1f%%", total ? 100.0 * (double) part / (double) total : 0.0);
+		return string(buf);
+	};
+
+	return "Reading pipeline stats: " + to_string(stats.no_blocks) + " blocks (" + to_string(stats.no_stolen_blocks) + " stolen) of " + to_string(stats.no_blocks ? (stats.no_bytes / stats.no_blocks) >> 10 : 0) + " KB on average, " +
+		to_string(stats.no_records ? stats.no_bytes / stats.no_records : 0) + " bytes per record, readers stalled " + pct(stats.reader_stall, stats.reader_busy + stats.reader_stall) +
+		", parsers starved " + pct(stats.parser_starve, stats.parser_busy + stats.parser_starve) + "\n";
+}
+
+// EOF
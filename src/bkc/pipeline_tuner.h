@@ -0,0 +1,119 @@
+#pragma once
+
+#include <cinttypes>
+#include <string>
+#include <atomic>
+#include <chrono>
+
+using namespace std;
+using namespace std::chrono;
+
+// *********************************************************************************************
+// Sizes of the reading pipeline of a single pass (per reading thread)
+struct pipeline_plan_t
+{
+	size_t chunk_size = 0;				// size of memory pool chunks, i.e., max. block size
+	size_t no_chunks = 0;				// no. of chunks in the pool of a reading thread
+	size_t queue_depth = 0;				// capacity of the block queue between a reader and a parser
+
+	bool operator==(const pipeline_plan_t&) const = default;
+};
+
+// *********************************************************************************************
+// Statistics of a pass gathered by the reading and parsing threads (times in microseconds)
+struct pipeline_stats_t
+{
+	atomic<uint64_t> no_bytes{ 0 };
+	atomic<uint64_t> no_records{ 0 };
+	atomic<uint64_t> no_blocks{ 0 };
+	atomic<uint64_t> reader_busy{ 0 };		// reading and decompression
+	atomic<uint64_t> reader_stall{ 0 };		// waiting for a free chunk or for a place in the queue
+	atomic<uint64_t> parser_busy{ 0 };
+	atomic<uint64_t> parser_starve{ 0 };	// waiting for a block
+	atomic<uint64_t> no_stolen_blocks{ 0 };	// taken by parsers from lanes of other readers
+
+	void Clear();
+};
+
+// *********************************************************************************************
+// Measures alternating phases of a thread, e.g., waiting for a block and processing it
+class CPhaseTimer
+{
+	time_point<high_resolution_clock> t = high_resolution_clock::now();
+
+public:
+	// Returns the time (in microseconds) since the previous call
+	uint64_t Lap()
+	{
+		auto t1 = high_resolution_clock::now();
+		auto r = duration_cast<microseconds>(t1 - t).count();
+		t = t1;
+
+		return (uint64_t) r;
+	}
+};
+
+// *********************************************************************************************
+// Block size of a single reading thread adjusted at run time
+// Blocks are filled with the amount of data the reader produces in about TARGET_BLOCK_TIME, so slow sources
+// (e.g., single-member gzip files) hand blocks over to the parser more often, while fast ones use whole chunks
+class CBlockSizer
+{
+	const double TARGET_BLOCK_TIME = 0.1;		// seconds
+	const size_t MIN_BLOCK_SIZE = 1 << 20;
+	const double SMOOTHING = 0.25;
+
+	size_t chunk_size;
+	size_t target;
+	double throughput = 0;						// bytes per second (exponential moving average)
+
+public:
+	CBlockSizer(size_t chunk_size) :
+		chunk_size(chunk_size),
+		target(chunk_size)
+	{}
+
+	void Update(size_t block_size, uint64_t busy_us);
+	size_t Target() const { return target; }
+};
+
+// *********************************************************************************************
+// Plans the reading pipeline of each pass from the memory budget and the statistics of the previous pass
+// - chunks are as large as possible (up to MAX_CHUNK_SIZE) within the budget, but not smaller than MIN_CHUNK_SIZE
+//   (the queues are made shorter first if the budget is small)
+// - queues are made deeper when both readers and parsers waited for each other (jitter of decompression or I/O)
+//   and shallower when one side was the bottleneck all the time (deep queues do not help then)
+class CPipelineTuner
+{
+	const size_t MIN_CHUNK_SIZE = 4 << 20;
+	const size_t MAX_CHUNK_SIZE = 64 << 20;
+	const size_t MIN_QUEUE_DEPTH = 1;
+	const size_t MAX_QUEUE_DEPTH = 8;
+	const size_t DEFAULT_QUEUE_DEPTH = 1;
+	const size_t NO_RECORDS_PER_CHUNK = 1024;	// min. no. of records of the average size in a chunk
+
+	size_t memory_budget;						// 0 - auto
+	size_t queue_depth;
+	double avg_record_size = 0;
+	string last_decision = "initial";
+
+	size_t auto_memory_budget(int no_reading_threads) const;
+
+public:
+	CPipelineTuner(size_t memory_budget = 0) :
+		memory_budget(memory_budget),
+		queue_depth(DEFAULT_QUEUE_DEPTH)
+	{}
+
+	void SetMemoryBudget(size_t _memory_budget) { memory_budget = _memory_budget; }
+
+	pipeline_plan_t Plan(int no_reading_threads) const;
+	void Learn(const pipeline_stats_t& stats);
+
+	string Describe(const pipeline_plan_t& plan, int no_reading_threads) const;
+	string Report(const pipeline_stats_t& stats) const;
+
+	static uint64_t PhysicalMemory();
+};
+
+// EOF
@@ -0,0 +1,47 @@
+#include "rank_bit_vector.h"
+
+// *********************************************************************************************
+void CRankBitVector::Assign(uint64_t _size)
+{
+	size = _size;
+	words.assign(size / 64 + 1, 0);
+	block_ranks.clear();
+}
+
+// *********************************************************************************************
+void CRankBitVector::Assign(uint64_t _size, const uint64_t* _words)
+{
+	size = _size;
+	words.assign(_words, _words + size / 64 + 1);
+	block_ranks.clear();
+}
+
+// *********************************************************************************************
+void CRankBitVector::Clear()
+{
+	size = 0;
+	vector<uint64_t>().swap(words);
+	vector<uint64_t>().swap(block_ranks);
+}
+
+// *********************************************************************************************
+// The last item is the total no. of set bits
+void CRankBitVector::BuildRank()
+{
+	uint64_t no_blocks = (words.size() + WORDS_PER_BLOCK - 1) / WORDS_PER_BLOCK;
+	uint64_t r = 0;
+
+	block_ranks.resize(no_blocks + 1);
+
+	for (uint64_t i = 0; i < no_blocks; ++i)
+	{
+		block_ranks[i] = r;
+
+		for (uint64_t j = i * WORDS_PER_BLOCK; j < min<uint64_t>((i + 1) * WORDS_PER_BLOCK, words.size()); ++j)
+			r += popcount(words[j]);
+	}
+
+	block_ranks[no_blocks] = r;
+}
+
+// EOF
@@ -0,0 +1,73 @@
+#pragma once
+
+#include <cinttypes>
+#include <vector>
+#include <atomic>
+#include <bit>
+
+using namespace std;
+
+// *********************************************************************************************
+// Bit vector with rank queries (no. of set bits before a position) in constant time
+// Counts of set bits before each block of 8 words are kept, so the index takes 1/8 bit per bit
+// Bits can be set by many threads at once (before BuildRank)
+class CRankBitVector
+{
+	static const uint64_t WORDS_PER_BLOCK = 8;
+
+	uint64_t size = 0;
+	vector<uint64_t> words;
+	vector<uint64_t> block_ranks;
+
+public:
+	void Assign(uint64_t _size);
+	void Assign(uint64_t _size, const uint64_t* _words);		// copies size / 64 + 1 words
+	void Clear();
+	void BuildRank();
+
+	void Set(uint64_t i)
+	{
+		atomic_ref<uint64_t>(words[i >> 6]).fetch_or(1ull << (i & 63), memory_order_relaxed);
+	}
+
+	bool operator[](uint64_t i) const { return (words[i >> 6] >> (i & 63)) & 1; }
+
+	// No. of set bits in [0, i)
+	uint64_t Rank(uint64_t i) const
+	{
+		uint64_t word_id = i >> 6;
+		uint64_t r = block_ranks[word_id / WORDS_PER_BLOCK];
+
+		for (uint64_t j = word_id / WORDS_PER_BLOCK * WORDS_PER_BLOCK; j < word_id; ++j)
+			r += popcount(words[j]);
+
+		if (i & 63)
+			r += popcount(words[word_id] & ((1ull << (i & 63)) - 1));
+
+		return r;
+	}
+
+	// Position of the 1st set bit in [i, limit) or limit if there is no such bit
+	uint64_t NextSet(uint64_t i, uint64_t limit) const
+	{
+		limit = min(limit, size);
+
+		while (i < limit)
+		{
+			uint64_t w = words[i >> 6] >> (i & 63);
+
+			if (w)
+				return min(i + countr_zero(w), limit);
+
+			i = (i | 63) + 1;
+		}
+
+		return limit;
+	}
+
+	uint64_t Size() const { return size; }
+	const uint64_t* Words() const { return words.data(); }
+	uint64_t NoSet() const { return block_ranks.empty() ? 0 : block_ranks.back(); }
+};
+
+// EOF
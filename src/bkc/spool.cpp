@@ -0,0 +1,133 @@
+#include <iostream>
+#include <filesystem>
+#include "spool.h"
+
+// *********************************************************************************************
+bool is_streamed_input(const string& file_name)
+{
+	std::error_code ec;
+	auto type = filesystem::status(file_name, ec).type();
+
+	return !ec && (type == filesystem::file_type::fifo || type == filesystem::file_type::character);
+}
+
+// *********************************************************************************************
+//
+// *********************************************************************************************
+
+// *********************************************************************************************
+CSpoolWriter::CSpoolWriter(bool is_fastq, bool compact, int zstd_level) :
+	is_fastq(is_fastq),
+	compact(compact),
+	zstd_level(zstd_level)
+{}
+
+// *********************************************************************************************
+CSpoolWriter::~CSpoolWriter()
+{
+	Close();
+}
+
+// *********************************************************************************************
+bool CSpoolWriter::Open(const string& _file_name)
+{
+	Close();
+
+	out = fopen(_file_name.c_str(), "wb");
+	if (!out)
+		return false;
+
+	cctx = ZSTD_createCCtx();
+	ZSTD_CCtx_setParameter(cctx, ZSTD_c_compressionLevel, zstd_level);
+
+	out_buf.resize(OUT_BUFFER_SIZE);
+	file_name = _file_name;
+	raw_size = packed_size = 0;
+
+	return true;
+}
+
+// *********************************************************************************************
+bool CSpoolWriter::compress(const char* data, size_t size, ZSTD_EndDirective mode)
+{
+	ZSTD_inBuffer input = { data, size, 0 };
+
+	while (true)
+	{
+		ZSTD_outBuffer output = { out_buf.data(), out_buf.size(), 0 };
+
+		size_t r = ZSTD_compressStream2(cctx, &output, &input, mode);
+		if (ZSTD_isError(r))
+			return false;
+
+		if (output.pos && fwrite(out_buf.data(), 1, output.pos, out) != output.pos)
+			return false;
+
+		packed_size += output.pos;
+
+		if (mode == ZSTD_e_end ? r == 0 : input.pos == input.size)
+			return true;
+	}
+}
+
+// *********************************************************************************************
+// Records are parsed in the same way as in the 2nd pass, so the read numbering is preserved
+void CSpoolWriter::make_compact(memory_chunk<char>& mc)
+{
+	CReadReader read_reader(is_fastq);
+	read_desc_t read_desc;
+
+	read_reader.Assign(mc);
+	compact_buf.clear();
+
+	while (read_reader.GetRead(read_desc))
+	{
+		compact_buf.push_back(is_fastq ? '@' : '>');
+		compact_buf.push_back('\n');
+		compact_buf.insert(compact_buf.end(), read_desc.bases, read_desc.bases + read_desc.bases_len);
+		compact_buf.push_back('\n');
+
+		if (is_fastq)
+		{
+			compact_buf.push_back('+');
+			compact_buf.push_back('\n');
+			compact_buf.push_back('I');
+			compact_buf.push_back('\n');
+		}
+	}
+}
+
+// *********************************************************************************************
+bool CSpoolWriter::Write(memory_chunk<char>& mc)
+{
+	if (!out)
+		return false;
+
+	raw_size += mc.size();
+
+	if (!compact)
+		return compress(mc.data(), mc.size(), ZSTD_e_continue);
+
+	make_compact(mc);
+
+	return compress(compact_buf.data(), compact_buf.size(), ZSTD_e_continue);
+}
+
+// *********************************************************************************************
+bool CSpoolWriter::Close()
+{
+	if (!out)
+		return true;
+
+	bool ok = compress(nullptr, 0, ZSTD_e_end);
+
+	ok &= fclose(out) == 0;
+	out = nullptr;
+
+	ZSTD_freeCCtx(cctx);
+	cctx = nullptr;
+
+	return ok;
+}
+
+// EOF
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <cstdio>
+#include <cinttypes>
+#include <string>
+#include <vector>
+#include <zstd.h>
+#include "fq_reader.h"
+
+using namespace std;
+
+// *********************************************************************************************
+// Pipes, FIFOs and character devices (e.g., /dev/stdin) can be read only once
+bool is_streamed_input(const string& file_name);
+
+// *********************************************************************************************
+// Writer of a spool of a streamed input, i.e., a zstd-compressed FASTQ/FASTA file read in the 2nd pass instead of the source
+// In the compact mode only bases are kept (headers are reduced to the record marker and qualities to a single symbol),
+// which is enough when the reads are not exported
+class CSpoolWriter
+{
+	const size_t OUT_BUFFER_SIZE = 4 << 20;
+
+	bool is_fastq;
+	bool compact;
+	int zstd_level;
+
+	FILE* out = nullptr;
+	ZSTD_CCtx* cctx = nullptr;
+	vector<char> out_buf;
+	vector<char> compact_buf;
+	string file_name;
+
+	uint64_t raw_size = 0;
+	uint64_t packed_size = 0;
+
+	bool compress(const char* data, size_t size, ZSTD_EndDirective mode);
+	void make_compact(memory_chunk<char>& mc);
+
+public:
+	CSpoolWriter(bool is_fastq, bool compact, int zstd_level = 1);
+	CSpoolWriter(const CSpoolWriter&) = delete;
+	CSpoolWriter& operator=(const CSpoolWriter&) = delete;
+	~CSpoolWriter();
+
+	bool Open(const string& _file_name);
+	bool Write(memory_chunk<char>& mc);			// mc must contain complete records
+	bool Close();
+
+	const string& FileName() const { return file_name; }
+	uint64_t RawSize() const { return raw_size; }
+	uint64_t PackedSize() const { return packed_size; }
+};
+
+// EOF
@@ -0,0 +1,89 @@
+#include <algorithm>
+#include "umi_clusterer.h"
+
+// *********************************************************************************************
+CUmiClusterer::CUmiClusterer(uint32_t umi_len) :
+	umi_len(umi_len),
+	use_presence(umi_len <= MAX_BIT_VECTOR_UMI_LEN)
+{}
+
+// *********************************************************************************************
+void CUmiClusterer::find_edges(const vector<uint64_t>& umis, const vector<uint32_t>& counts)
+{
+	edge_starts.clear();
+	edges.clear();
+
+	if (use_presence)
+	{
+		if (presence.empty())
+			presence.assign(max<uint64_t>((1ull << (2 * umi_len)) / 64, 1), 0);
+
+		for (auto umi : umis)
+			presence[umi >> 6] |= 1ull << (umi & 63);
+	}
+
+	for (size_t i = 0; i < umis.size(); ++i)
+	{
+		edge_starts.emplace_back((uint32_t) edges.size());
+
+		for (uint32_t pos = 0; pos < 2 * umi_len; pos += 2)
+			for (uint64_t delta = 1; delta < 4; ++delta)
+			{
+				uint64_t neighbour = umis[i] ^ (delta << pos);
+
+				if (!is_present(neighbour))
+					continue;
+
+				auto p = lower_bound(umis.begin(), umis.end(), neighbour);
+
+				if (p != umis.end() && *p == neighbour && counts[i] + 1 >= 2 * counts[p - umis.begin()])
+					edges.emplace_back((uint32_t) (p - umis.begin()));
+			}
+	}
+
+	edge_starts.emplace_back((uint32_t) edges.size());
+
+	// Only the bits of the UMIs are cleared, so the cost does not depend on the size of the bit vector
+	if (use_presence)
+		for (auto umi : umis)
+			presence[umi >> 6] = 0;
+}
+
+// *********************************************************************************************
+// Ties of counts are broken by the UMIs, so the result is deterministic
+void CUmiClusterer::Cluster(const vector<uint64_t>& umis, const vector<uint32_t>& counts, vector<uint32_t>& roots)
+{
+	roots.clear();
+
+	find_edges(umis, counts);
+
+	order.resize(umis.size());
+	for (uint32_t i = 0; i < (uint32_t) umis.size(); ++i)
+		order[i] = i;
+
+	stable_sort(order.begin(), order.end(), [&](uint32_t x, uint32_t y) {return counts[x] > counts[y]; });
+
+	assigned.assign(umis.size(), false);
+
+	for (auto root : order)
+	{
+		if (assigned[root])
+			continue;
+
+		roots.emplace_back(root);
+		assigned[root] = true;
+
+		queue.clear();
+		queue.emplace_back(root);
+
+		for (size_t i = 0; i < queue.size(); ++i)
+			for (uint32_t j = edge_starts[queue[i]]; j < edge_starts[queue[i] + 1]; ++j)
+				if (!assigned[edges[j]])
+				{
+					assigned[edges[j]] = true;
+					queue.emplace_back(edges[j]);
+				}
+	}
+}
+
+// EOF
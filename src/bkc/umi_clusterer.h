@@ -0,0 +1,40 @@
+#pragma once
+
+#include <cinttypes>
+#include <vector>
+
+using namespace std;
+
+// *********************************************************************************************
+// Directional clustering of the UMIs of a CBC (as in UMI-tools)
+// There is an edge from UMI a to UMI b if they differ in a single base and count(a) >= 2 * count(b) - 1.
+// Networks are grown (BFS along the edges) from the most frequent UMIs not assigned yet, and each network is a single molecule.
+// 1-mismatch neighbours are enumerated by XOR-ing the 2-bit codes with 3 masks per position. For short UMIs the probes
+// are filtered with a bit vector of present UMIs, so only the hits are searched for in the sorted UMIs.
+class CUmiClusterer
+{
+	static const uint32_t MAX_BIT_VECTOR_UMI_LEN = 12;		// 2 MB per thread
+
+	uint32_t umi_len;
+	bool use_presence;
+	vector<uint64_t> presence;						// allocated at the 1st use
+
+	// Out-edges of UMIs (CSR)
+	vector<uint32_t> edge_starts;
+	vector<uint32_t> edges;
+
+	vector<uint32_t> order;
+	vector<bool> assigned;
+	vector<uint32_t> queue;
+
+	bool is_present(uint64_t umi) const { return !use_presence || ((presence[umi >> 6] >> (umi & 63)) & 1); }
+	void find_edges(const vector<uint64_t>& umis, const vector<uint32_t>& counts);
+
+public:
+	CUmiClusterer(uint32_t umi_len);
+
+	// UMIs must be sorted and unique, roots of the networks are given in the order of their discovery
+	void Cluster(const vector<uint64_t>& umis, const vector<uint32_t>& counts, vector<uint32_t>& roots);
+};
+
+// EOF